@@ -63,6 +63,7 @@ static int list_peers      (int, char **);
 static int connect_peer    (int, char **);
 static int disconnect_peer (int, char **);
 static int invoke_echo     (int, char **);
+static int get_metrics     (int, char **);
 
 static struct cmd cmdtab[] =  {
     { "add-relay",      add_relay },
@@ -77,6 +78,7 @@ static struct cmd cmdtab[] =  {
     { "connect-peer",      connect_peer    },
     { "disconnect-peer",   disconnect_peer },
     { "invoke-echo",    invoke_echo },
+    { "metrics",        get_metrics },
     { 0 },
 };
 
@@ -123,6 +125,7 @@ void usage()
 "  send-cmd          Send command to ccnet daemon\n"
 "  connect-peer      Connect to a peer\n"
 "  disconnect-peer   Disconnect to a peer\n"
+"  metrics           Print daemon metrics in Prometheus text format\n"
     ,stderr);
 }
 
@@ -460,3 +463,36 @@ invoke_echo (int argc, char **argv)
 
     return 0;
 }
+
+/*
+ * metrics [FILE]
+ *
+ * FILE is replaced atomically, so the node_exporter textfile
+ * collector never reads a partial file.
+ */
+static int
+get_metrics (int argc, char **argv)
+{
+    GError *error = NULL;
+    SearpcClient *rpc;
+    char *metrics;
+    int ret = 0;
+
+    rpc = ccnet_create_rpc_client (client, NULL, "ccnet-rpcserver");
+    metrics = searpc_client_call__string (rpc, "get_metrics", &error, 0);
+    ccnet_rpc_client_free (rpc);
+    if (error) {
+        fprintf (stderr, "Error: %s\n", error->message);
+        return -1;
+    }
+
+    if (argc < 1)
+        fputs (metrics, stdout);
+    else if (!g_file_set_contents (argv[0], metrics, -1, &error)) {
+        fprintf (stderr, "Error: %s\n", error->message);
+        ret = -1;
+    }
+
+    g_free (metrics);
+    return ret;
+}
@@ -61,6 +61,37 @@ void
 ccnet_client_pool_return_client (struct CcnetClientPool *cpool,
                                  CcnetClient *client);
 
+/* multiplexed client */
+
+struct CcnetMuxClient;
+typedef struct CcnetMuxClient CcnetMuxClient;
+
+/* The connection to the daemon is made on the first call, and made
+ * again by later calls if it is lost. */
+CcnetMuxClient *
+ccnet_mux_client_new (const char *conf_dir);
+
+void
+ccnet_mux_client_free (CcnetMuxClient *mux);
+
+/* Set the default call timeout. */
+void
+ccnet_mux_client_set_timeout (CcnetMuxClient *mux, int timeout_msec);
+
+/*
+ * Call @service with @fcall_str. Can be called from many threads at
+ * the same time. @timeout_msec <= 0 means the default timeout.
+ * Returns the result of the call, or NULL on error or timeout.
+ */
+char *
+ccnet_mux_client_call (CcnetMuxClient *mux,
+                       const char *peer_id,
+                       const char *service,
+                       const char *fcall_str,
+                       size_t fcall_len,
+                       int timeout_msec,
+                       size_t *ret_len);
+
 /* rpc wrapper */
 
 /* Create rpc client using a single client for transport. */
@@ -74,6 +105,13 @@ ccnet_create_pooled_rpc_client (struct CcnetClientPool *cpool,
                                 const char *peer_id,
                                 const char *service);
 
+/* Create rpc client using a multiplexed client for transport.
+ * The rpc client can be shared by threads. */
+SearpcClient *
+ccnet_create_mux_rpc_client (CcnetMuxClient *mux,
+                             const char *peer_id,
+                             const char *service);
+
 SearpcClient *
 ccnet_create_async_rpc_client (CcnetClient *cclient, const char *peer_id,
                                const char *service_name);
@@ -4,11 +4,13 @@
 #include <ccnet.h>
 
 typedef struct {
-    /* either session or pool will be set. */
+    /* one of session, pool or mux will be set. */
     CcnetClient *session;
     CcnetClientPool *pool;
+    CcnetMuxClient *mux;
     char  *peer_id;       /* NULL if local */
     char  *service;
+    int    timeout;       /* msec, only used by mux; 0 for the default */
 } CcnetrpcTransportParam;        /* this structure will be parsed to
                                   * ccnet_transport_send ()
                                   */
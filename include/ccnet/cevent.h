@@ -2,6 +2,11 @@
 
 /* 
  * CEvent is used for send message from a work thread to main thread.
+ *
+ * Worker threads push events onto a lock-free stack. Only the push that
+ * finds the stack empty writes a byte to the pipe, and the main thread
+ * takes all pending events on each wakeup and runs them in the order
+ * they were added.
  */
 #ifndef CEVENT_H
 #define CEVENT_H
@@ -36,7 +41,12 @@ struct CEventManager {
     GHashTable   *handler_table;
     uint32_t      next_id;
     
+    /* No longer used, kept so that the layout stays the same for code
+     * built against older headers. */
     pthread_mutex_t  mutex;
+
+    /* pending events, newest first */
+    volatile gpointer  queue;
 };
 
 CEventManager* cevent_manager_new ();
@@ -0,0 +1,184 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_MESSAGE_WIRE_H
+#define CCNET_MESSAGE_WIRE_H
+
+/*
+ * Binary encoding of a message, used between the daemon and clients
+ * which negotiated it when starting "mq-server".
+ *
+ * The header has fixed offsets, integers are in network byte order:
+ *
+ *    0  uint8   version
+ *    1  uint8   flags
+ *    2  uint16  app length
+ *    4  uint32  ctime
+ *    8  uint32  rtime
+ *   12  uint32  body length
+ *   16  char    from[40]
+ *   56  char    to[40]     (NUL padded for 36 bytes group ids)
+ *   96  char    id[36]
+ *
+ * followed by the app and the body, each terminated by a '\0' that is
+ * not counted in its length. The terminators let a parser hand out
+ * pointers into the packet buffer instead of copying.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#define CCNET_MSG_WIRE_VERSION      1
+
+#define CCNET_MSG_WIRE_OFF_VERSION  0
+#define CCNET_MSG_WIRE_OFF_FLAGS    1
+#define CCNET_MSG_WIRE_OFF_APP_LEN  2
+#define CCNET_MSG_WIRE_OFF_CTIME    4
+#define CCNET_MSG_WIRE_OFF_RTIME    8
+#define CCNET_MSG_WIRE_OFF_BODY_LEN 12
+#define CCNET_MSG_WIRE_OFF_FROM     16
+#define CCNET_MSG_WIRE_OFF_TO       56
+#define CCNET_MSG_WIRE_OFF_ID       96
+#define CCNET_MSG_WIRE_HEADER_LEN   132
+
+#define CCNET_MSG_WIRE_PEER_ID_LEN  40
+#define CCNET_MSG_WIRE_MSG_ID_LEN   36
+
+/* Request option and response status used to negotiate the encoding. */
+#define CCNET_MSG_WIRE_OPTION       "--binary"
+#define CCNET_MSG_WIRE_SS_OK        "binary"
+
+/* Update/response code of a binary encoded message. */
+#define SC_BIN_MSG                  "302"
+
+/*
+ * A parsed message. All pointers point into the buffer passed to
+ * ccnet_message_wire_parse(). @from, @to and @id are not NUL terminated.
+ */
+typedef struct CcnetMessageWire {
+    int         flags;
+    guint32     ctime;
+    guint32     rtime;
+    const char *from;
+    const char *to;
+    const char *id;
+    const char *app;
+    guint16     app_len;
+    const char *body;
+    guint32     body_len;
+} CcnetMessageWire;
+
+static inline guint16
+ccnet_msg_wire_get16 (const char *p)
+{
+    guint16 v;
+    memcpy (&v, p, sizeof(v));
+    return g_ntohs (v);
+}
+
+static inline guint32
+ccnet_msg_wire_get32 (const char *p)
+{
+    guint32 v;
+    memcpy (&v, p, sizeof(v));
+    return g_ntohl (v);
+}
+
+static inline void
+ccnet_msg_wire_put16 (char *p, guint16 v)
+{
+    v = g_htons (v);
+    memcpy (p, &v, sizeof(v));
+}
+
+static inline void
+ccnet_msg_wire_put32 (char *p, guint32 v)
+{
+    v = g_htonl (v);
+    memcpy (p, &v, sizeof(v));
+}
+
+/*
+ * Append the encoding of a message to @buf.
+ * Returns 0 on success, -1 if @app or @body is too long for the length
+ * fields, in which case @buf is left unchanged.
+ */
+static inline int
+ccnet_message_wire_encode (GString *buf,
+                           int flags,
+                           const char *from,
+                           const char *to,
+                           const char *id,
+                           guint32 ctime,
+                           guint32 rtime,
+                           const char *app,
+                           const char *body)
+{
+    size_t app_len = strlen (app);
+    size_t body_len = body ? strlen (body) : 0;
+    gsize start = buf->len;
+    char *h;
+
+    if (app_len > G_MAXUINT16 || (guint64)body_len > G_MAXUINT32)
+        return -1;
+
+    g_string_set_size (buf, start + CCNET_MSG_WIRE_HEADER_LEN);
+    h = buf->str + start;
+    memset (h, 0, CCNET_MSG_WIRE_HEADER_LEN);
+
+    h[CCNET_MSG_WIRE_OFF_VERSION] = CCNET_MSG_WIRE_VERSION;
+    h[CCNET_MSG_WIRE_OFF_FLAGS] = (char)flags;
+    ccnet_msg_wire_put16 (h + CCNET_MSG_WIRE_OFF_APP_LEN, (guint16)app_len);
+    ccnet_msg_wire_put32 (h + CCNET_MSG_WIRE_OFF_CTIME, ctime);
+    ccnet_msg_wire_put32 (h + CCNET_MSG_WIRE_OFF_RTIME, rtime);
+    ccnet_msg_wire_put32 (h + CCNET_MSG_WIRE_OFF_BODY_LEN, (guint32)body_len);
+    strncpy (h + CCNET_MSG_WIRE_OFF_FROM, from, CCNET_MSG_WIRE_PEER_ID_LEN);
+    strncpy (h + CCNET_MSG_WIRE_OFF_TO, to, CCNET_MSG_WIRE_PEER_ID_LEN);
+    strncpy (h + CCNET_MSG_WIRE_OFF_ID, id, CCNET_MSG_WIRE_MSG_ID_LEN);
+
+    g_string_append_len (buf, app, app_len + 1);
+    if (body)
+        g_string_append_len (buf, body, body_len + 1);
+    else
+        g_string_append_c (buf, '\0');
+
+    return 0;
+}
+
+/*
+ * Parse an encoded message in @buf without copying.
+ * Returns 0 on success, -1 if @buf is malformed.
+ */
+static inline int
+ccnet_message_wire_parse (const char *buf, int len, CcnetMessageWire *msg)
+{
+    guint32 app_len, body_len;
+
+    if (len < CCNET_MSG_WIRE_HEADER_LEN ||
+        buf[CCNET_MSG_WIRE_OFF_VERSION] != CCNET_MSG_WIRE_VERSION)
+        return -1;
+
+    app_len = ccnet_msg_wire_get16 (buf + CCNET_MSG_WIRE_OFF_APP_LEN);
+    body_len = ccnet_msg_wire_get32 (buf + CCNET_MSG_WIRE_OFF_BODY_LEN);
+    if ((guint64)CCNET_MSG_WIRE_HEADER_LEN + app_len + 1 + body_len + 1
+        > (guint64)len)
+        return -1;
+
+    msg->flags = (unsigned char)buf[CCNET_MSG_WIRE_OFF_FLAGS];
+    msg->ctime = ccnet_msg_wire_get32 (buf + CCNET_MSG_WIRE_OFF_CTIME);
+    msg->rtime = ccnet_msg_wire_get32 (buf + CCNET_MSG_WIRE_OFF_RTIME);
+    msg->from = buf + CCNET_MSG_WIRE_OFF_FROM;
+    msg->to = buf + CCNET_MSG_WIRE_OFF_TO;
+    msg->id = buf + CCNET_MSG_WIRE_OFF_ID;
+
+    msg->app = buf + CCNET_MSG_WIRE_HEADER_LEN;
+    msg->app_len = (guint16)app_len;
+    msg->body = msg->app + app_len + 1;
+    msg->body_len = body_len;
+
+    if (msg->app[app_len] != '\0' || msg->body[body_len] != '\0')
+        return -1;
+
+    return 0;
+}
+
+#endif
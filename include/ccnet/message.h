@@ -39,6 +39,9 @@ struct _CcnetMessage
 
     char    *app;               /* application */
     char    *body;
+
+    /* Set by ccnet_message_from_binary(): app, id and body in one block. */
+    char    *wire_buf;
 };
 
 struct _CcnetMessageClass
@@ -68,6 +71,14 @@ void ccnet_message_free (CcnetMessage *msg);
 void ccnet_message_to_string_buf (CcnetMessage *msg, GString *buf);
 CcnetMessage *ccnet_message_from_string (char *buf, int len);
 
+/*
+ * Binary encoding, see <ccnet/message-wire.h>. @buf is not modified.
+ * ccnet_message_to_binary_buf() returns -1 if the app name is longer
+ * than 65535 bytes; send such a message with the string encoding.
+ */
+int ccnet_message_to_binary_buf (CcnetMessage *msg, GString *buf);
+CcnetMessage *ccnet_message_from_binary (const char *buf, int len);
+
 gboolean ccnet_message_is_to_group(CcnetMessage *msg);
 
 /* to avoid string allocation */
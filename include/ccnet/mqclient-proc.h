@@ -25,6 +25,9 @@ struct _CcnetMqclientProc {
     
     MessageGotCB  message_got_cb;
     void         *cb_data;
+
+    /* TRUE if the server accepted binary encoded messages. */
+    gboolean      binary;
 };
 
 struct _CcnetMqclientProcClass {
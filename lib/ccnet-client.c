@@ -406,9 +406,19 @@ ccnet_client_get_processor (CcnetClient *client, int id)
 int
 ccnet_client_read_input (CcnetClient *client)
 {
-    if (!client->io)
+    CcnetPacketIO *io = client->io;
+    int ret;
+
+    if (!io)
         return -1;
-    return ccnet_packet_io_read(client->io);
+
+    /* Packets sent by processors while handling this input are written
+     * out together with one syscall. */
+    ccnet_packet_io_cork (io);
+    ret = ccnet_packet_io_read (io);
+    if (client->io == io)
+        ccnet_packet_io_uncork (io);
+    return ret;
 }
 
 static void create_processor (CcnetClient *client, int req_id,
@@ -643,6 +653,33 @@ ccnet_client_send_request (CcnetClient *client, int req_id, const char *req)
     g_debug ("Send a request: id %d, cmd %s\n", req_id, req);
 }
 
+/* Content is passed to writev() as is, only the code line is built here. */
+static void
+send_code_packet (CcnetClient *client, int type, int req_id,
+                  const char *code, const char *reason,
+                  const char *content, int clen)
+{
+    struct iovec iov[5];
+    int n = 0;
+
+    iov[n].iov_base = (void *)code;
+    iov[n++].iov_len = 3;
+    if (reason) {
+        iov[n].iov_base = " ";
+        iov[n++].iov_len = 1;
+        iov[n].iov_base = (void *)reason;
+        iov[n++].iov_len = strlen(reason);
+    }
+    iov[n].iov_base = "\n";
+    iov[n++].iov_len = 1;
+    if (content) {
+        iov[n].iov_base = (void *)content;
+        iov[n++].iov_len = clen;
+    }
+
+    ccnet_packet_sendv (client->io, type, req_id, iov, n);
+}
+
 /**
  * ccnet_client_send_update:
  * @client:
@@ -660,18 +697,8 @@ ccnet_client_send_update (CcnetClient *client, int req_id,
     g_assert (req_id > 0);
     g_assert (clen < CCNET_PACKET_MAX_PAYLOAD_LEN);
 
-    ccnet_packet_prepare (client->io, CCNET_MSG_UPDATE, req_id);
-    /* code line */
-    ccnet_packet_add (client->io, code, 3);
-    if (reason) {
-        ccnet_packet_add (client->io, " ", 1);
-        ccnet_packet_write_string (client->io, reason);
-    }
-    ccnet_packet_add (client->io, "\n", 1);
-    if (content)
-        ccnet_packet_add (client->io, content, clen);
-
-    ccnet_packet_finish_send (client->io);
+    send_code_packet (client, CCNET_MSG_UPDATE, req_id,
+                      code, reason, content, clen);
 
     /* g_debug ("[client] Send an update: id %d: %s %s len=%d\n", */
     /*          req_id, code, reason, clen); */
@@ -685,18 +712,8 @@ ccnet_client_send_response (CcnetClient *client, int req_id,
 {
     g_assert (clen < CCNET_PACKET_MAX_PAYLOAD_LEN);
 
-    ccnet_packet_prepare (client->io, CCNET_MSG_RESPONSE, req_id);
-    /* code line */
-    ccnet_packet_add (client->io, code, 3);
-    if (reason) {
-        ccnet_packet_add (client->io, " ", 1);
-        ccnet_packet_write_string (client->io, reason);
-    }
-    ccnet_packet_add (client->io, "\n", 1);
-    if (content)
-        ccnet_packet_add (client->io, content, clen);
-
-    ccnet_packet_finish_send (client->io);
+    send_code_packet (client, CCNET_MSG_RESPONSE, req_id,
+                      code, reason, content, clen);
 
     /* g_debug ("[client] Send an response: id %d: %s %s len=%d\n", */
     /*          req_id, code, reason, clen); */
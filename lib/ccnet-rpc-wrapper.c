@@ -49,6 +49,26 @@ ccnet_create_pooled_rpc_client (struct CcnetClientPool *cpool,
     return rpc_client;
 }
 
+SearpcClient *
+ccnet_create_mux_rpc_client (CcnetMuxClient *mux,
+                             const char *peer_id,
+                             const char *service)
+{
+    SearpcClient *rpc_client;
+    CcnetrpcTransportParam *priv;
+
+    priv = g_new0(CcnetrpcTransportParam, 1);
+    priv->mux = mux;
+    priv->peer_id = g_strdup(peer_id);
+    priv->service = g_strdup(service);
+
+    rpc_client = searpc_client_new ();
+    rpc_client->send = ccnetrpc_transport_send;
+    rpc_client->arg = priv;
+
+    return rpc_client;
+}
+
 SearpcClient *
 ccnet_create_async_rpc_client (CcnetClient *cclient, const char *peer_id,
                                const char *service_name)
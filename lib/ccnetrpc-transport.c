@@ -110,7 +110,12 @@ ccnetrpc_transport_send (void *arg, const gchar *fcall_str,
 
     priv = (CcnetrpcTransportParam *)arg;
 
-    if (priv->session != NULL) {
+    if (priv->mux != NULL) {
+        /* Calls from many threads share one connection. */
+        return ccnet_mux_client_call (priv->mux, priv->peer_id, priv->service,
+                                      fcall_str, fcall_len, priv->timeout,
+                                      ret_len);
+    } else if (priv->session != NULL) {
         /* Use single ccnet client as transport. */
         return invoke_service (priv->session, priv->peer_id, priv->service,
                                fcall_str, fcall_len, ret_len);
@@ -3,13 +3,16 @@
 #include "include.h"
 #include "cevent.h"
 
-#define CEVENT_SIZE  (sizeof(CEvent))
-
 typedef struct Handler {
     cevent_handler handler;
     void *handler_data;
 } Handler;
 
+typedef struct CEventNode {
+    CEvent              event;
+    struct CEventNode  *next;
+} CEventNode;
+
 CEventManager* cevent_manager_new ()
 {
     CEventManager *manager;
@@ -22,18 +25,9 @@ CEventManager* cevent_manager_new ()
     return manager;
 }
 
-void pipe_callback (int fd, short event, void *vmgr)
+static void
+dispatch (CEventManager *manager, CEvent *cevent)
 {
-    CEventManager *manager = (CEventManager *) vmgr;
-    CEvent *cevent;
-    char buf[CEVENT_SIZE];
-    
-    if (ccnet_util_pipereadn(fd, buf, CEVENT_SIZE) != CEVENT_SIZE) {
-        g_warning ("read pipe error\n");
-        return;
-    }
-
-    cevent = (CEvent *)buf;
     Handler *h = g_hash_table_lookup (manager->handler_table,
                                       (gconstpointer)(long)cevent->id);
     if (h == NULL) {
@@ -44,6 +38,37 @@ void pipe_callback (int fd, short event, void *vmgr)
     h->handler(cevent, h->handler_data);
 }
 
+void pipe_callback (int fd, short event, void *vmgr)
+{
+    CEventManager *manager = (CEventManager *) vmgr;
+    CEventNode *node, *next, *list = NULL;
+    gpointer head;
+    char c;
+
+    /* Read the doorbell before taking the queue: an event added after
+     * that finds the queue empty and rings again. */
+    if (ccnet_util_pipereadn(fd, &c, 1) != 1)
+        g_warning ("read pipe error\n");
+
+    do {
+        head = g_atomic_pointer_get (&manager->queue);
+    } while (!g_atomic_pointer_compare_and_exchange (&manager->queue,
+                                                     head, NULL));
+
+    /* The queue is newest first, reverse it. */
+    for (node = head; node; node = next) {
+        next = node->next;
+        node->next = list;
+        list = node;
+    }
+
+    for (node = list; node; node = next) {
+        next = node->next;
+        dispatch (manager, &node->event);
+        g_free (node);
+    }
+}
+
 int cevent_manager_start (CEventManager *manager)
 {
     if (ccnet_util_pipe(manager->pipefd) < 0) {
@@ -90,16 +115,23 @@ void
 cevent_manager_add_event (CEventManager *manager, uint32_t id,
                           void *data)
 {
-    pthread_mutex_lock (&manager->mutex);
+    CEventNode *node = g_new (CEventNode, 1);
+    gpointer head;
 
-    struct CEvent cevent;
-    char *buf = (char *) &cevent;
+    node->event.id = id;
+    node->event.data = data;
 
-    cevent.id = id;
-    cevent.data = data;
-    if (ccnet_util_pipewriten(manager->pipefd[1], buf, CEVENT_SIZE) != CEVENT_SIZE) {
-        g_warning ("add event error\n");
+    do {
+        head = g_atomic_pointer_get (&manager->queue);
+        node->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&manager->queue,
+                                                     head, node));
+
+    /* Only the first event since the last drain wakes up the main
+     * thread, the others are picked up in the same run. */
+    if (head == NULL) {
+        char c = 0;
+        if (ccnet_util_pipewriten(manager->pipefd[1], &c, 1) != 1)
+            g_warning ("add event error\n");
     }
-
-    pthread_mutex_unlock (&manager->mutex);
 }
@@ -4,6 +4,13 @@
 
 #include "db.h"
 
+#define SQLITE_BUSY_TIMEOUT_MSEC 5000
+
+/*
+ * In WAL mode readers don't block on writers. With synchronous=normal
+ * commits don't wait for fsync; a power loss may lose the last
+ * commits but doesn't corrupt the db.
+ */
 int
 sqlite_open_db (const char *db_path, sqlite3 **db)
 {
@@ -21,6 +28,10 @@ sqlite_open_db (const char *db_path, sqlite3 **db)
         return -1;
     }
 
+    sqlite3_busy_timeout (*db, SQLITE_BUSY_TIMEOUT_MSEC);
+    sqlite_query_exec (*db, "PRAGMA journal_mode=WAL;");
+    sqlite_query_exec (*db, "PRAGMA synchronous=NORMAL;");
+
     return 0;
 }
 
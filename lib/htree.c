@@ -8,12 +8,12 @@
 #include "htree.h"
 
 #define MAX_HEIGHT 7
-#define INDEX(hashid,depth)  (depth%2 ? (hashid[depth/2] && 0x0f):(hashid[depth/2] >> 4))
+#define INDEX(hashid,depth)  (depth%2 ? (hashid[depth/2] & 0x0f):(hashid[depth/2] >> 4))
 #define IS_NODE(n) (n->is_node)
 
 static const int g_index[] = {0, 1, 17, 273, 4369, 69905, 1118481, 17895697, 286331153};
 
-static inline void hashxor(char *hashid, char *id, int len)
+static inline void hashxor(unsigned char *hashid, unsigned char *id, int len)
 {
     int i = 0;
     for (i = 0; i < len; ++i) {
@@ -46,6 +46,7 @@ static inline HTItem *create_item (unsigned char *hashid, void *data)
     it->hashid = hashid;
     it->data = data;
     it->next = NULL;
+    return it;
 }
 
 static inline void delete_item (HTree *tree, HTItem *it)
@@ -182,7 +183,8 @@ HTree* ht_new (int size, int hashlen)
     for (j = g_index[height-1]; j < g_index[height]; ++j) {
         (ht->nodes[j]).is_node = 0;
     }
-    
+
+    return ht;
 }
 
 int ht_add (HTree *tree, unsigned char *hashid, void *data)
@@ -254,7 +256,7 @@ HTNode *ht_get_parent (HTree *tree, HTNode *node)
 
 HTNode *ht_get_brother (HTree *tree, HTNode *node)
 {
-    if (get_pos(tree, node) & 0xff < 15)
+    if ((get_pos(tree, node) & 0x0f) < 15)
         return node + 1;
     return NULL;
 }
@@ -282,11 +284,11 @@ void ht_remove_node (HTree *tree, HTNode *node)
     HTData *data = ht_get_data (tree, node);
     if (data == NULL)
         return;
-    char *hash = data->hashid;
+    unsigned char *hash = data->hashid;
     HTNode *parent = ht_get_parent (tree, node);
 
     while (parent) {
-        char *phash = ht_get_node_hash (tree, parent);
+        unsigned char *phash = ht_get_node_hash (tree, parent);
         hashxor (phash, hash, tree->hashid_len);
         parent = ht_get_parent (tree, parent);
     }
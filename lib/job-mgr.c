@@ -18,6 +18,7 @@
     #define ccnet_pipe      ccnet_util_pipe
 #else
     #include "utils.h"
+    #include "metrics.h"
 #endif
 
 #include "job-mgr.h"
@@ -34,8 +35,30 @@ struct _CcnetJob {
 
     /* the done callback should only access this field */
     void           *result;
+
+#ifndef CCNET_LIB
+    gint64          queued;     /* usec */
+#endif
 };
 
+#ifndef CCNET_LIB
+static CcnetGauge *jobs_queued;
+static CcnetGauge *jobs_running;
+static CcnetHistogram *job_wait_time;
+static CcnetHistogram *job_run_time;
+
+static void
+init_job_metrics ()
+{
+    if (jobs_queued)
+        return;
+    jobs_queued = ccnet_metrics_gauge ("ccnet_jobs_queued");
+    jobs_running = ccnet_metrics_gauge ("ccnet_jobs_running");
+    job_wait_time = ccnet_metrics_histogram ("ccnet_job_wait_usec");
+    job_run_time = ccnet_metrics_histogram ("ccnet_job_run_usec");
+}
+#endif
+
 
 void
 ccnet_job_manager_remove_job (CcnetJobManager *mgr, int job_id);
@@ -44,9 +67,20 @@ static void
 job_thread_wrapper (void *vdata, void *unused)
 {
     CcnetJob *job = vdata;
+#ifndef CCNET_LIB
+    gint64 start = get_current_time ();
+
+    ccnet_gauge_add (jobs_queued, -1);
+    ccnet_gauge_add (jobs_running, 1);
+    ccnet_histogram_record (job_wait_time, start - job->queued);
+#endif
 
-    
     job->result = job->thread_func (job->data);
+
+#ifndef CCNET_LIB
+    ccnet_histogram_record (job_run_time, get_current_time () - start);
+    ccnet_gauge_add (jobs_running, -1);
+#endif
     if (pipewriten (job->pipefd[1], "a", 1) != 1) {
         g_warning ("[Job Manager] write to pipe error: %s\n", strerror(errno));
     }
@@ -107,6 +141,10 @@ ccnet_job_manager_new (int max_threads)
 {
     CcnetJobManager *mgr;
 
+#ifndef CCNET_LIB
+    init_job_metrics ();
+#endif
+
     mgr = g_new0 (CcnetJobManager, 1);
     mgr->jobs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
                                        NULL, (GDestroyNotify)ccnet_job_free);
@@ -140,7 +178,11 @@ ccnet_job_manager_schedule_job (CcnetJobManager *mgr,
     job->thread_func = func;
     job->done_func = done_func;
     job->data = data;
-    
+#ifndef CCNET_LIB
+    job->queued = get_current_time ();
+    ccnet_gauge_add (jobs_queued, 1);
+#endif
+
     g_hash_table_insert (mgr->jobs, (gpointer)(long)job->id, job);
 
     job_thread_create (job);
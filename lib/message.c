@@ -3,6 +3,7 @@
 #include "include.h"
 
 #include "message.h"
+#include <ccnet/message-wire.h>
 
 enum {
     P_ID = 1,
@@ -71,6 +72,14 @@ get_property (GObject *object, guint property_id,
 static void finalize (GObject *object)
 {
     CcnetMessage *message = (CcnetMessage *)object;
+
+    if (message->wire_buf) {
+        /* app, id and the original body live in wire_buf. */
+        if (message->body != message->wire_buf)
+            g_free (message->body);
+        g_free (message->wire_buf);
+        return;
+    }
     g_free (message->app);
     g_free (message->id);
     g_free (message->body);
@@ -250,6 +259,53 @@ error:
     return NULL;
 }
 
+int
+ccnet_message_to_binary_buf (CcnetMessage *msg, GString *buf)
+{
+    g_string_truncate (buf, 0);
+    return ccnet_message_wire_encode (buf, msg->flags, msg->from, msg->to,
+                                      msg->id, msg->ctime, msg->rtime,
+                                      msg->app, msg->body);
+}
+
+CcnetMessage *
+ccnet_message_from_binary (const char *buf, int len)
+{
+    CcnetMessageWire wire;
+    CcnetMessage *message;
+    char *p;
+
+    if (ccnet_message_wire_parse (buf, len, &wire) < 0)
+        return NULL;
+
+    message = g_object_new (CCNET_TYPE_MESSAGE, NULL);
+
+    message->flags = wire.flags;
+    memcpy (message->from, wire.from, 40);
+    message->from[40] = '\0';
+    memcpy (message->to, wire.to, 40);
+    message->to[40] = '\0';
+    message->ctime = (wire.ctime ? wire.ctime : time(NULL));
+    message->rtime = wire.rtime;
+
+    /* The packet buffer is reused once the processor returns, so copy
+     * the body, app and id into a single block "body\0app\0id\0"
+     * instead of allocating each of them. */
+    p = message->wire_buf = g_malloc (wire.body_len + 1 + wire.app_len + 1 +
+                                      CCNET_MSG_WIRE_MSG_ID_LEN + 1);
+    message->body = p;
+    memcpy (p, wire.body, wire.body_len + 1);
+    p += wire.body_len + 1;
+    message->app = p;
+    memcpy (p, wire.app, wire.app_len + 1);
+    p += wire.app_len + 1;
+    message->id = p;
+    memcpy (p, wire.id, CCNET_MSG_WIRE_MSG_ID_LEN);
+    p[CCNET_MSG_WIRE_MSG_ID_LEN] = '\0';
+
+    return message;
+}
+
 gboolean
 ccnet_message_is_to_group(CcnetMessage *msg)
 {
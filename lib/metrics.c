@@ -0,0 +1,464 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+#define N_SHARDS 8
+
+/*
+ * Histograms are log-linear like HdrHistogram: values below 4 get a
+ * bucket each, every power of two above is split into 4 buckets. That
+ * keeps quantiles within 25% of the true value over the whole range
+ * at a fixed cost of 140 buckets. Values of 2^36 usec (19 hours) and
+ * more go to the last bucket.
+ */
+#define SUB_BITS   2
+#define SUB_COUNT  (1 << SUB_BITS)
+#define MAX_EXP    36
+#define N_BUCKETS  (SUB_COUNT + (MAX_EXP - SUB_BITS) * SUB_COUNT)
+
+/* Exported bucket bounds are powers of 4, which fall on internal
+ * bucket boundaries: 4, 16, ... 4^13 (67s) usec. */
+#define N_EXPORTED_BOUNDS 13
+
+/* Shards may still be shared by threads, so updates are atomic. */
+#define atomic_add64(p, n)  __sync_fetch_and_add ((p), (n))
+#define atomic_read64(p)    __sync_fetch_and_add ((p), 0)
+
+enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
+
+static const char *type_names[] = { "counter", "gauge", "histogram" };
+
+/* One cache line per shard. */
+typedef union {
+    guint64 value;
+    char    pad[64];
+} CounterShard;
+
+struct CcnetCounter {
+    CounterShard shards[N_SHARDS];
+};
+
+/* Signed deltas wrap around in the unsigned sum. */
+struct CcnetGauge {
+    CounterShard shards[N_SHARDS];
+};
+
+typedef struct HistogramShard {
+    guint64 count;
+    guint64 sum;
+    guint64 buckets[N_BUCKETS];
+} HistogramShard;
+
+struct CcnetHistogram {
+    HistogramShard shards[N_SHARDS];
+};
+
+typedef struct Metric {
+    int         type;
+    char       *series;
+    gpointer    impl;
+} Metric;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *registry;
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static volatile gint next_shard;
+
+static void
+init_shard_key (void)
+{
+    pthread_key_create (&shard_key, NULL);
+}
+
+/* Threads are given shards round robin on their first update. */
+static int
+get_shard (void)
+{
+    gpointer p;
+    int shard;
+
+    pthread_once (&shard_once, init_shard_key);
+    p = pthread_getspecific (shard_key);
+    if (p)
+        return GPOINTER_TO_INT(p) - 1;
+
+    /* Two threads may read the same value and share a shard, which
+     * is fine as updates are atomic anyway. */
+    g_atomic_int_add (&next_shard, 1);
+    shard = g_atomic_int_get (&next_shard) % N_SHARDS;
+    pthread_setspecific (shard_key, GINT_TO_POINTER(shard + 1));
+    return shard;
+}
+
+static gpointer
+get_metric (const char *series, int type)
+{
+    Metric *metric;
+    gpointer impl = NULL;
+
+    pthread_mutex_lock (&registry_lock);
+
+    if (!registry)
+        registry = g_hash_table_new (g_str_hash, g_str_equal);
+
+    metric = g_hash_table_lookup (registry, series);
+    if (metric) {
+        if (metric->type == type)
+            impl = metric->impl;
+        else
+            g_warning ("Metric %s registered with another type.\n", series);
+        pthread_mutex_unlock (&registry_lock);
+        return impl;
+    }
+
+    switch (type) {
+    case METRIC_COUNTER:
+        impl = g_new0 (CcnetCounter, 1);
+        break;
+    case METRIC_GAUGE:
+        impl = g_new0 (CcnetGauge, 1);
+        break;
+    case METRIC_HISTOGRAM:
+        impl = g_new0 (CcnetHistogram, 1);
+        break;
+    }
+
+    metric = g_new0 (Metric, 1);
+    metric->type = type;
+    metric->series = g_strdup (series);
+    metric->impl = impl;
+    g_hash_table_insert (registry, metric->series, metric);
+
+    pthread_mutex_unlock (&registry_lock);
+
+    return impl;
+}
+
+CcnetCounter *
+ccnet_metrics_counter (const char *series)
+{
+    return get_metric (series, METRIC_COUNTER);
+}
+
+CcnetGauge *
+ccnet_metrics_gauge (const char *series)
+{
+    return get_metric (series, METRIC_GAUGE);
+}
+
+CcnetHistogram *
+ccnet_metrics_histogram (const char *series)
+{
+    return get_metric (series, METRIC_HISTOGRAM);
+}
+
+void
+ccnet_counter_add (CcnetCounter *counter, guint64 n)
+{
+    if (counter)
+        atomic_add64 (&counter->shards[get_shard()].value, n);
+}
+
+void
+ccnet_gauge_add (CcnetGauge *gauge, gint64 delta)
+{
+    if (gauge)
+        atomic_add64 (&gauge->shards[get_shard()].value, (guint64)delta);
+}
+
+static guint64
+sum_shards (CounterShard *shards)
+{
+    guint64 sum = 0;
+    int i;
+
+    for (i = 0; i < N_SHARDS; ++i)
+        sum += atomic_read64 (&shards[i].value);
+    return sum;
+}
+
+static int
+bucket_index (gint64 usec)
+{
+    guint64 v = usec < 0 ? 0 : (guint64)usec;
+    int exp = 0;
+
+    if (v < SUB_COUNT)
+        return (int)v;
+
+    while ((v >> exp) > 1)
+        ++exp;
+    if (exp >= MAX_EXP)
+        return N_BUCKETS - 1;
+
+    return SUB_COUNT + (exp - SUB_BITS) * SUB_COUNT
+        + (int)((v >> (exp - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* Exclusive upper bound of bucket @index. */
+static guint64
+bucket_upper (int index)
+{
+    int k, exp;
+    guint64 lower;
+
+    if (index < SUB_COUNT)
+        return index + 1;
+
+    k = index - SUB_COUNT;
+    exp = SUB_BITS + k / SUB_COUNT;
+    lower = (guint64)(SUB_COUNT + k % SUB_COUNT) << (exp - SUB_BITS);
+    return lower + ((guint64)1 << (exp - SUB_BITS));
+}
+
+void
+ccnet_histogram_record (CcnetHistogram *histogram, gint64 usec)
+{
+    HistogramShard *shard;
+
+    if (!histogram)
+        return;
+
+    shard = &histogram->shards[get_shard()];
+    atomic_add64 (&shard->buckets[bucket_index(usec)], 1);
+    atomic_add64 (&shard->sum, (guint64)(usec < 0 ? 0 : usec));
+    atomic_add64 (&shard->count, 1);
+}
+
+/* Merge all shards into @out. */
+static void
+merge_histogram (CcnetHistogram *histogram, HistogramShard *out)
+{
+    HistogramShard *shard;
+    int i, j;
+
+    memset (out, 0, sizeof(*out));
+    for (i = 0; i < N_SHARDS; ++i) {
+        shard = &histogram->shards[i];
+        out->count += atomic_read64 (&shard->count);
+        out->sum += atomic_read64 (&shard->sum);
+        for (j = 0; j < N_BUCKETS; ++j)
+            out->buckets[j] += atomic_read64 (&shard->buckets[j]);
+    }
+}
+
+gint64
+ccnet_histogram_quantile (CcnetHistogram *histogram, double q)
+{
+    HistogramShard merged;
+    guint64 total = 0, rank;
+    int i;
+
+    merge_histogram (histogram, &merged);
+    for (i = 0; i < N_BUCKETS; ++i)
+        total += merged.buckets[i];
+    if (total == 0)
+        return 0;
+
+    rank = (guint64)(q * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    for (i = 0; i < N_BUCKETS; ++i) {
+        if (merged.buckets[i] > rank)
+            return bucket_upper (i) - 1;
+        rank -= merged.buckets[i];
+    }
+    return bucket_upper (N_BUCKETS - 1) - 1;
+}
+
+#define MAX_FUNC_NAME 64
+
+/* function name -> CcnetHistogram. Filled before rpcs are served and
+ * only read afterwards, so lookups take no lock. */
+static GHashTable *rpc_histograms;
+static CcnetHistogram *unknown_rpc;
+
+void
+ccnet_metrics_register_rpc (const char *func)
+{
+    char series[MAX_FUNC_NAME + 64];
+
+    if (!rpc_histograms) {
+        rpc_histograms = g_hash_table_new (g_str_hash, g_str_equal);
+        unknown_rpc = ccnet_metrics_histogram (
+            "ccnet_rpc_duration_usec{func=\"unknown\"}");
+    }
+
+    if (strlen (func) > MAX_FUNC_NAME ||
+        g_hash_table_lookup (rpc_histograms, func))
+        return;
+
+    snprintf (series, sizeof(series),
+              "ccnet_rpc_duration_usec{func=\"%s\"}", func);
+    g_hash_table_insert (rpc_histograms, g_strdup (func),
+                         ccnet_metrics_histogram (series));
+}
+
+void
+ccnet_metrics_record_rpc (const char *fcall, gsize fcall_len, gint64 usec)
+{
+    char name[MAX_FUNC_NAME + 1];
+    const char *p, *end = fcall + fcall_len, *start;
+    CcnetHistogram *histogram = NULL;
+    int len;
+
+    if (!rpc_histograms)
+        return;
+
+    /* ["func_name", ...] */
+    p = memchr (fcall, '"', fcall_len);
+    if (p) {
+        start = ++p;
+        while (p < end && *p != '"' && p - start <= MAX_FUNC_NAME)
+            ++p;
+        len = p - start;
+        if (p < end && *p == '"' && len <= MAX_FUNC_NAME) {
+            memcpy (name, start, len);
+            name[len] = '\0';
+            histogram = g_hash_table_lookup (rpc_histograms, name);
+        }
+    }
+
+    /* Names sent by clients are not trusted to create series. */
+    ccnet_histogram_record (histogram ? histogram : unknown_rpc, usec);
+}
+
+/* @series is "family{labels}" or "family". Point @labels at the part
+ * inside the braces, or "" if none. */
+static char *
+split_series (const char *series, const char **labels, int *labels_len)
+{
+    const char *brace = strchr (series, '{');
+
+    if (!brace) {
+        *labels = "";
+        *labels_len = 0;
+        return g_strdup (series);
+    }
+
+    *labels = brace + 1;
+    *labels_len = strlen (brace + 1);
+    if (*labels_len > 0 && brace[*labels_len] == '}')
+        (*labels_len)--;
+    return g_strndup (series, brace - series);
+}
+
+static void
+format_histogram (GString *buf, const char *family,
+                  const char *labels, int labels_len,
+                  CcnetHistogram *histogram)
+{
+    HistogramShard merged;
+    const char *sep = labels_len ? "," : "";
+    guint64 bound = 4, cum = 0;
+    int i, b = 0;
+
+    merge_histogram (histogram, &merged);
+
+    for (i = 0; i < N_EXPORTED_BOUNDS; ++i, bound *= 4) {
+        while (b < N_BUCKETS && bucket_upper (b) <= bound)
+            cum += merged.buckets[b++];
+        g_string_append_printf (buf, "%s_bucket{%.*s%sle=\"%"G_GUINT64_FORMAT"\"}"
+                                " %"G_GUINT64_FORMAT"\n",
+                                family, labels_len, labels, sep,
+                                bound - 1, cum);
+    }
+    g_string_append_printf (buf, "%s_bucket{%.*s%sle=\"+Inf\"} %"G_GUINT64_FORMAT"\n",
+                            family, labels_len, labels, sep, merged.count);
+    if (labels_len) {
+        g_string_append_printf (buf, "%s_sum{%.*s} %"G_GUINT64_FORMAT"\n",
+                                family, labels_len, labels, merged.sum);
+        g_string_append_printf (buf, "%s_count{%.*s} %"G_GUINT64_FORMAT"\n",
+                                family, labels_len, labels, merged.count);
+    } else {
+        g_string_append_printf (buf, "%s_sum %"G_GUINT64_FORMAT"\n",
+                                family, merged.sum);
+        g_string_append_printf (buf, "%s_count %"G_GUINT64_FORMAT"\n",
+                                family, merged.count);
+    }
+}
+
+/* Order by family first, so that "a{...}" doesn't get split by "a_b". */
+static gint
+cmp_metric (gconstpointer a, gconstpointer b)
+{
+    const char *x = (*(Metric **)a)->series;
+    const char *y = (*(Metric **)b)->series;
+    size_t lx = strcspn (x, "{"), ly = strcspn (y, "{");
+    int cmp;
+
+    cmp = strncmp (x, y, MIN(lx, ly));
+    if (cmp != 0)
+        return cmp;
+    if (lx != ly)
+        return lx < ly ? -1 : 1;
+    return strcmp (x + lx, y + ly);
+}
+
+void
+ccnet_metrics_format (GString *buf)
+{
+    GPtrArray *metrics = g_ptr_array_new ();
+    GHashTableIter iter;
+    gpointer key, value;
+    Metric *metric;
+    char *family, *last_family = NULL;
+    const char *labels;
+    int labels_len;
+    guint i;
+
+    /* Metrics are never freed, so they can be read without the lock. */
+    pthread_mutex_lock (&registry_lock);
+    if (registry) {
+        g_hash_table_iter_init (&iter, registry);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+            g_ptr_array_add (metrics, value);
+    }
+    pthread_mutex_unlock (&registry_lock);
+
+    /* Series of one family must be listed together. */
+    g_ptr_array_sort (metrics, cmp_metric);
+
+    for (i = 0; i < metrics->len; ++i) {
+        metric = g_ptr_array_index (metrics, i);
+        family = split_series (metric->series, &labels, &labels_len);
+
+        if (g_strcmp0 (family, last_family) != 0)
+            g_string_append_printf (buf, "# TYPE %s %s\n",
+                                    family, type_names[metric->type]);
+
+        switch (metric->type) {
+        case METRIC_COUNTER:
+            g_string_append_printf (buf, "%s %"G_GUINT64_FORMAT"\n",
+                                    metric->series,
+                                    sum_shards (((CcnetCounter *)metric->impl)->shards));
+            break;
+        case METRIC_GAUGE:
+            g_string_append_printf (buf, "%s %"G_GINT64_FORMAT"\n",
+                                    metric->series,
+                                    (gint64)sum_shards (((CcnetGauge *)metric->impl)->shards));
+            break;
+        case METRIC_HISTOGRAM:
+            format_histogram (buf, family, labels, labels_len, metric->impl);
+            break;
+        }
+
+        g_free (last_family);
+        last_family = family;
+    }
+
+    g_free (last_family);
+    g_ptr_array_free (metrics, TRUE);
+}
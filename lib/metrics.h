@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+#ifndef CCNET_METRICS_H
+#define CCNET_METRICS_H
+
+#include <glib.h>
+
+/*
+ * Process wide registry of counters, gauges and latency histograms.
+ *
+ * A metric is identified by its Prometheus series name, labels
+ * included, e.g. "ccnet_packets_in_total{type=\"request\"}". Getting a
+ * metric creates it on first use; the returned pointer stays valid for
+ * the life of the process, so hot paths should look it up once.
+ *
+ * Updates go to one of several shards picked per thread and are
+ * merged only when formatting, so threads don't bounce a cache line
+ * on every update. All functions are thread safe.
+ */
+
+typedef struct CcnetCounter CcnetCounter;
+typedef struct CcnetGauge CcnetGauge;
+typedef struct CcnetHistogram CcnetHistogram;
+
+CcnetCounter *
+ccnet_metrics_counter (const char *series);
+
+CcnetGauge *
+ccnet_metrics_gauge (const char *series);
+
+/* Values are in microseconds. */
+CcnetHistogram *
+ccnet_metrics_histogram (const char *series);
+
+void
+ccnet_counter_add (CcnetCounter *counter, guint64 n);
+
+#define ccnet_counter_inc(c) ccnet_counter_add ((c), 1)
+
+void
+ccnet_gauge_add (CcnetGauge *gauge, gint64 delta);
+
+void
+ccnet_histogram_record (CcnetHistogram *histogram, gint64 usec);
+
+/* Value at quantile @q (0 - 1), rounded up to its bucket bound, so
+ * at most 25% over. */
+gint64
+ccnet_histogram_quantile (CcnetHistogram *histogram, double q);
+
+/* Create the duration histogram of rpc function @func. Register all
+ * functions before the first rpc is recorded; not thread safe. */
+void
+ccnet_metrics_register_rpc (const char *func);
+
+/* Record the duration of searpc call @fcall, a JSON array starting
+ * with the function name, as ccnet_rpc_duration_usec{func="..."}.
+ * Calls of unregistered functions are recorded as func="unknown". */
+void
+ccnet_metrics_record_rpc (const char *fcall, gsize fcall_len, gint64 usec);
+
+/* Append all metrics to @buf in Prometheus text format. */
+void
+ccnet_metrics_format (GString *buf);
+
+#endif
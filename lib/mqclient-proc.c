@@ -6,6 +6,7 @@
 
 #include "ccnet-client.h"
 #include "mqclient-proc.h"
+#include <ccnet/message-wire.h>
 
 #define SC_MSG "300"
 #define SC_UNSUBSCRIBE "301"
@@ -62,7 +63,9 @@ mq_client_start (CcnetProcessor *processor, int argc, char **argv)
     GString *buf;
     int i;
 
-    buf = g_string_new ("mq-server");
+    /* Servers not knowing the option just subscribe to a bogus app,
+     * and keep sending text messages. */
+    buf = g_string_new ("mq-server " CCNET_MSG_WIRE_OPTION);
     for (i = 0; i < argc; ++i) {
         g_string_append (buf, " ");
         g_string_append (buf, argv[i]);
@@ -91,6 +94,8 @@ static void handle_response (CcnetProcessor *processor,
             return;
         }
 
+        if (code_msg && strcmp (code_msg, CCNET_MSG_WIRE_SS_OK) == 0)
+            proc->binary = TRUE;
         processor->state = READY;
         break;
     case READY:
@@ -100,8 +105,15 @@ static void handle_response (CcnetProcessor *processor,
         }
 
         /* message notification. */
-        if (code[0] == '3' && code[2] == '0') {
-            msg = ccnet_message_from_string (content, clen);
+        if (code[0] == '3' && (code[2] == '0' || code[2] == '2')) {
+            if (code[2] == '0')
+                msg = ccnet_message_from_string (content, clen);
+            else
+                msg = ccnet_message_from_binary (content, clen);
+            if (!msg) {
+                g_warning ("receive bad message\n");
+                return;
+            }
             if (proc->message_got_cb)
                 proc->message_got_cb (msg, proc->cb_data);
             g_signal_emit (proc, signals[RECV_MSG_SIG], 0, msg);
@@ -130,9 +142,14 @@ void ccnet_mqclient_proc_put_message (CcnetMqclientProc *proc,
 
     msg_buf = g_string_new (NULL);
 
-    ccnet_message_to_string_buf (message, msg_buf);
-    ccnet_client_send_update (processor->session, UPDATE_ID(processor->id),
-                              SC_MSG, NULL, msg_buf->str, msg_buf->len+1);
+    if (proc->binary && ccnet_message_to_binary_buf (message, msg_buf) == 0) {
+        ccnet_client_send_update (processor->session, UPDATE_ID(processor->id),
+                                  SC_BIN_MSG, NULL, msg_buf->str, msg_buf->len);
+    } else {
+        ccnet_message_to_string_buf (message, msg_buf);
+        ccnet_client_send_update (processor->session, UPDATE_ID(processor->id),
+                                  SC_MSG, NULL, msg_buf->str, msg_buf->len+1);
+    }
     g_string_free (msg_buf, TRUE);
 }
 
@@ -0,0 +1,517 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * A multiplexed client lets many threads call rpc services over a single
+ * daemon connection. Every in-flight call uses its own request id, so it
+ * talks to its own processor in the daemon. A reader thread dispatches
+ * the responses to the waiting callers by request id.
+ *
+ * Started processors are kept per service after a call returns, and
+ * reused by later calls, like the rpc pool of a sync CcnetClient.
+ */
+
+#include "include.h"
+
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef WIN32
+    #include <winsock2.h>
+#else
+    #include <sys/socket.h>
+#endif
+
+#include <ccnet.h>
+#include <ccnet/ccnetrpc-transport.h>
+
+#include "packet-io.h"
+#include "rpc-common.h"
+
+#define DEFAULT_CALL_TIMEOUT_MSEC (30 * 1000)
+
+typedef struct MuxCall {
+    uint32_t        req_id;
+    guint           conn_gen;
+    pthread_cond_t  cond;
+
+    /* The last response, a copy of the packet body. */
+    char           *rsp;
+    int             rsp_len;
+} MuxCall;
+
+struct CcnetMuxClient {
+    char           *conf_dir;
+    int             timeout;    /* default call timeout in msec */
+
+    /* Serializes reconnection. */
+    pthread_mutex_t conn_lock;
+
+    /* Serializes writes on the connection. */
+    pthread_mutex_t send_lock;
+
+    /* Protects the fields below. */
+    pthread_mutex_t lock;
+    CcnetClient    *client;
+    pthread_t       reader;
+    gboolean        broken;
+    guint           conn_gen;   /* bumped on every new connection */
+    uint32_t        req_id;
+    GHashTable     *calls;      /* req_id -> MuxCall */
+    GHashTable     *idle;       /* "<peer_id> <service>" -> GQueue of req_id */
+};
+
+static void
+free_req_queue (gpointer queue)
+{
+    g_queue_free ((GQueue *)queue);
+}
+
+CcnetMuxClient *
+ccnet_mux_client_new (const char *conf_dir)
+{
+    CcnetMuxClient *mux = g_new0 (CcnetMuxClient, 1);
+
+    mux->conf_dir = g_strdup (conf_dir);
+    mux->timeout = DEFAULT_CALL_TIMEOUT_MSEC;
+    mux->req_id = CCNET_USER_ID_START;
+    pthread_mutex_init (&mux->conn_lock, NULL);
+    pthread_mutex_init (&mux->send_lock, NULL);
+    pthread_mutex_init (&mux->lock, NULL);
+    mux->calls = g_hash_table_new (g_direct_hash, g_direct_equal);
+    mux->idle = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                       g_free, free_req_queue);
+
+    return mux;
+}
+
+void
+ccnet_mux_client_set_timeout (CcnetMuxClient *mux, int timeout_msec)
+{
+    mux->timeout = timeout_msec > 0 ? timeout_msec : DEFAULT_CALL_TIMEOUT_MSEC;
+}
+
+static void
+shutdown_connection (CcnetClient *client)
+{
+#ifdef WIN32
+    shutdown (client->connfd, SD_BOTH);
+#else
+    shutdown (client->connfd, SHUT_RDWR);
+#endif
+}
+
+static void
+wake_up_calls (CcnetMuxClient *mux)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, mux->calls);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        MuxCall *call = value;
+        pthread_cond_signal (&call->cond);
+    }
+}
+
+static int
+send_update (CcnetMuxClient *mux, guint conn_gen, uint32_t req_id,
+             const char *code, const char *code_msg,
+             const char *content, int clen)
+{
+    int ret = 0;
+
+    pthread_mutex_lock (&mux->send_lock);
+    /* send_lock is held while the connection is replaced, so reading
+     * these without the main lock is safe. */
+    if (mux->client && mux->conn_gen == conn_gen && !mux->broken)
+        ccnet_client_send_update (mux->client, req_id,
+                                  code, code_msg, content, clen);
+    else
+        ret = -1;
+    pthread_mutex_unlock (&mux->send_lock);
+
+    return ret;
+}
+
+static int
+send_request (CcnetMuxClient *mux, guint conn_gen, uint32_t req_id,
+              const char *req)
+{
+    int ret = 0;
+
+    pthread_mutex_lock (&mux->send_lock);
+    if (mux->client && mux->conn_gen == conn_gen && !mux->broken)
+        ccnet_client_send_request (mux->client, req_id, req);
+    else
+        ret = -1;
+    pthread_mutex_unlock (&mux->send_lock);
+
+    return ret;
+}
+
+typedef struct ReaderArg {
+    CcnetMuxClient *mux;
+    CcnetClient    *client;
+    guint           conn_gen;
+} ReaderArg;
+
+static void *
+reader_thread (void *vdata)
+{
+    ReaderArg *arg = vdata;
+    CcnetMuxClient *mux = arg->mux;
+    ccnet_packet *packet;
+    MuxCall *call;
+
+    while ((packet = ccnet_packet_io_read_packet (arg->client->io)) != NULL) {
+        if (packet->header.type != CCNET_MSG_RESPONSE ||
+            packet->header.length < 4)
+            continue;
+
+        if (memcmp (packet->data, SC_PROC_KEEPALIVE, 3) == 0) {
+            send_update (mux, arg->conn_gen, packet->header.id,
+                         SC_PROC_ALIVE, SS_PROC_ALIVE, NULL, 0);
+            continue;
+        }
+
+        pthread_mutex_lock (&mux->lock);
+        call = g_hash_table_lookup (mux->calls,
+                                    GUINT_TO_POINTER(packet->header.id));
+        /* Responses to calls that timed out are dropped. */
+        if (call && call->conn_gen == arg->conn_gen && !call->rsp) {
+            call->rsp = g_memdup (packet->data, packet->header.length);
+            call->rsp_len = packet->header.length;
+            pthread_cond_signal (&call->cond);
+        }
+        pthread_mutex_unlock (&mux->lock);
+    }
+
+    pthread_mutex_lock (&mux->lock);
+    if (mux->conn_gen == arg->conn_gen) {
+        mux->broken = TRUE;
+        wake_up_calls (mux);
+    }
+    pthread_mutex_unlock (&mux->lock);
+
+    g_free (arg);
+    return NULL;
+}
+
+/* Must be called with conn_lock held. */
+static void
+close_connection (CcnetMuxClient *mux)
+{
+    CcnetClient *client;
+
+    if (!mux->client)
+        return;
+
+    shutdown_connection (mux->client);
+    pthread_join (mux->reader, NULL);
+
+    pthread_mutex_lock (&mux->send_lock);
+    pthread_mutex_lock (&mux->lock);
+    client = mux->client;
+    mux->client = NULL;
+    mux->broken = TRUE;
+    mux->conn_gen++;
+    g_hash_table_remove_all (mux->idle);
+    wake_up_calls (mux);
+    pthread_mutex_unlock (&mux->lock);
+    pthread_mutex_unlock (&mux->send_lock);
+
+    g_object_unref (client);
+}
+
+/* Must be called with conn_lock held. */
+static int
+open_connection (CcnetMuxClient *mux)
+{
+    CcnetClient *client;
+    ReaderArg *arg;
+    int ret = 0;
+
+    client = ccnet_client_new ();
+    if (ccnet_client_load_confdir (client, mux->conf_dir) < 0) {
+        g_warning ("[mux client] Failed to load conf dir.\n");
+        g_object_unref (client);
+        return -1;
+    }
+    if (ccnet_client_connect_daemon (client, CCNET_CLIENT_SYNC) < 0) {
+        g_warning ("[mux client] Failed to connect.\n");
+        g_object_unref (client);
+        return -1;
+    }
+
+    arg = g_new0 (ReaderArg, 1);
+    arg->mux = mux;
+    arg->client = client;
+
+    pthread_mutex_lock (&mux->send_lock);
+    pthread_mutex_lock (&mux->lock);
+    arg->conn_gen = ++mux->conn_gen;
+    if (pthread_create (&mux->reader, NULL, reader_thread, arg) != 0) {
+        g_warning ("[mux client] Failed to create reader thread.\n");
+        g_free (arg);
+        ret = -1;
+    } else {
+        mux->client = client;
+        mux->broken = FALSE;
+    }
+    pthread_mutex_unlock (&mux->lock);
+    pthread_mutex_unlock (&mux->send_lock);
+
+    if (ret < 0)
+        g_object_unref (client);
+    return ret;
+}
+
+static int
+ensure_connected (CcnetMuxClient *mux)
+{
+    gboolean ok;
+    int ret = 0;
+
+    pthread_mutex_lock (&mux->conn_lock);
+
+    pthread_mutex_lock (&mux->lock);
+    ok = (mux->client != NULL && !mux->broken);
+    pthread_mutex_unlock (&mux->lock);
+
+    if (!ok) {
+        if (mux->client)
+            g_message ("[mux client] Ccnet disconnected. Connect again.\n");
+        close_connection (mux);
+        ret = open_connection (mux);
+    }
+
+    pthread_mutex_unlock (&mux->conn_lock);
+    return ret;
+}
+
+void
+ccnet_mux_client_free (CcnetMuxClient *mux)
+{
+    if (!mux)
+        return;
+
+    pthread_mutex_lock (&mux->conn_lock);
+    close_connection (mux);
+    pthread_mutex_unlock (&mux->conn_lock);
+
+    g_hash_table_destroy (mux->calls);
+    g_hash_table_destroy (mux->idle);
+    pthread_mutex_destroy (&mux->lock);
+    pthread_mutex_destroy (&mux->send_lock);
+    pthread_mutex_destroy (&mux->conn_lock);
+    g_free (mux->conf_dir);
+    g_free (mux);
+}
+
+/*
+ * Wait for the next response of @call. Returns the raw response, which
+ * the caller should free, or NULL on timeout or disconnection.
+ */
+static char *
+wait_response (CcnetMuxClient *mux, MuxCall *call,
+               const struct timespec *deadline, int *len)
+{
+    char *rsp;
+
+    pthread_mutex_lock (&mux->lock);
+    while (!call->rsp && call->conn_gen == mux->conn_gen && !mux->broken) {
+        if (pthread_cond_timedwait (&call->cond, &mux->lock,
+                                    deadline) == ETIMEDOUT)
+            break;
+    }
+    rsp = call->rsp;
+    *len = call->rsp_len;
+    call->rsp = NULL;
+    pthread_mutex_unlock (&mux->lock);
+
+    return rsp;
+}
+
+static int
+parse_response (char *data, int len, struct CcnetResponse *rsp)
+{
+    char *end = data + len;
+    char *ptr;
+
+    if (len < 4)
+        return -1;
+
+    rsp->code = data;
+    rsp->code_msg = NULL;
+    ptr = data + 3;
+    if (*ptr != '\n') {
+        if (*ptr != ' ')
+            return -1;
+        *ptr++ = '\0';
+        rsp->code_msg = ptr;
+        while (ptr != end && *ptr != '\n')
+            ++ptr;
+        if (ptr == end)
+            return -1;
+    }
+    *ptr++ = '\0';
+    rsp->content = ptr;
+    rsp->clen = end - ptr;
+
+    return 0;
+}
+
+static char *
+make_pool_key (const char *peer_id, const char *service)
+{
+    return g_strdup_printf ("%s %s", peer_id ? peer_id : "", service);
+}
+
+char *
+ccnet_mux_client_call (CcnetMuxClient *mux,
+                       const char *peer_id,
+                       const char *service,
+                       const char *fcall_str,
+                       size_t fcall_len,
+                       int timeout_msec,
+                       size_t *ret_len)
+{
+    MuxCall call;
+    GQueue *idle_reqs;
+    struct timeval now;
+    struct timespec deadline;
+    struct CcnetResponse rsp;
+    char *key, *data = NULL;
+    int len;
+    GString *buf = NULL;
+    gboolean started, done = FALSE;
+
+    *ret_len = 0;
+
+    if (ensure_connected (mux) < 0)
+        return NULL;
+
+    if (timeout_msec <= 0)
+        timeout_msec = mux->timeout;
+    gettimeofday (&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout_msec / 1000;
+    deadline.tv_nsec = (now.tv_usec + (timeout_msec % 1000) * 1000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    memset (&call, 0, sizeof(call));
+    pthread_cond_init (&call.cond, NULL);
+    key = make_pool_key (peer_id, service);
+
+    pthread_mutex_lock (&mux->lock);
+    call.conn_gen = mux->conn_gen;
+    idle_reqs = g_hash_table_lookup (mux->idle, key);
+    if (idle_reqs && !g_queue_is_empty (idle_reqs))
+        call.req_id = GPOINTER_TO_UINT (g_queue_pop_head (idle_reqs));
+    started = (call.req_id != 0);
+    if (!started)
+        call.req_id = ++mux->req_id;
+    g_hash_table_insert (mux->calls, GUINT_TO_POINTER(call.req_id), &call);
+    pthread_mutex_unlock (&mux->lock);
+
+    if (!started) {
+        /* start a new processor for this call */
+        char *req;
+
+        if (!peer_id)
+            req = g_strdup (service);
+        else
+            req = g_strdup_printf ("remote %s %s", peer_id, service);
+        if (send_request (mux, call.conn_gen, call.req_id, req) < 0) {
+            g_free (req);
+            goto out;
+        }
+        g_free (req);
+
+        data = wait_response (mux, &call, &deadline, &len);
+        if (!data)
+            goto out;
+        if (parse_response (data, len, &rsp) < 0 ||
+            memcmp (rsp.code, "200", 3) != 0) {
+            g_warning ("[mux client] failed to start rpc server: %.3s.\n",
+                       data);
+            goto out;
+        }
+        g_free (data);
+        data = NULL;
+    }
+
+    if (send_update (mux, call.conn_gen, call.req_id, SC_CLIENT_CALL,
+                     SS_CLIENT_CALL, fcall_str, fcall_len) < 0)
+        goto out;
+
+    while (1) {
+        data = wait_response (mux, &call, &deadline, &len);
+        if (!data)
+            goto out;
+        if (parse_response (data, len, &rsp) < 0) {
+            g_warning ("[mux client] Bad response format.\n");
+            goto out;
+        }
+
+        if (memcmp (rsp.code, SC_SERVER_RET, 3) == 0) {
+            if (!buf)
+                buf = g_string_sized_new (rsp.clen);
+            g_string_append_len (buf, rsp.content, rsp.clen);
+            done = TRUE;
+            break;
+        } else if (memcmp (rsp.code, SC_SERVER_MORE, 3) == 0) {
+            if (!buf)
+                buf = g_string_new (NULL);
+            g_string_append_len (buf, rsp.content, rsp.clen);
+        } else {
+            g_warning ("[mux client] Bad response: %s %s.\n",
+                       rsp.code, rsp.code_msg ? rsp.code_msg : "");
+            goto out;
+        }
+        g_free (data);
+        data = NULL;
+
+        if (send_update (mux, call.conn_gen, call.req_id, SC_CLIENT_MORE,
+                         SS_CLIENT_MORE, fcall_str, fcall_len) < 0)
+            goto out;
+    }
+
+out:
+    g_free (data);
+
+    pthread_mutex_lock (&mux->lock);
+    g_hash_table_remove (mux->calls, GUINT_TO_POINTER(call.req_id));
+    if (done && call.conn_gen == mux->conn_gen) {
+        /* keep the processor for later calls */
+        idle_reqs = g_hash_table_lookup (mux->idle, key);
+        if (!idle_reqs) {
+            idle_reqs = g_queue_new ();
+            g_hash_table_insert (mux->idle, key, idle_reqs);
+            key = NULL;
+        }
+        g_queue_push_head (idle_reqs, GUINT_TO_POINTER(call.req_id));
+    }
+    g_free (call.rsp);
+    pthread_mutex_unlock (&mux->lock);
+
+    if (!done) {
+        /* The processor may still be busy with this call, don't reuse it. */
+        send_update (mux, call.conn_gen, call.req_id,
+                     SC_PROC_DONE, SS_PROC_DONE, NULL, 0);
+    }
+
+    g_free (key);
+    pthread_cond_destroy (&call.cond);
+
+    if (!done) {
+        if (buf)
+            g_string_free (buf, TRUE);
+        return NULL;
+    }
+
+    *ret_len = buf->len;
+    return g_string_free (buf, FALSE);
+}
@@ -8,6 +8,7 @@
     #include <winsock2.h>
 #else
     #include <netinet/in.h>
+    #include <sys/uio.h>
 #endif
 
 #include <unistd.h>
@@ -55,6 +56,41 @@ writen(evutil_socket_t fd, const void *vptr, size_t n)
 	return(n);
 }
 
+#ifndef WIN32
+static ssize_t						/* Write all of "iov" to a descriptor. */
+writevn(evutil_socket_t fd, struct iovec *iov, int iovcnt)
+{
+	size_t		ntotal = 0;
+	ssize_t		nwritten;
+
+	while (iovcnt > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+		if ( (nwritten = writev(fd, iov, iovcnt)) <= 0) {
+			if (nwritten < 0 && errno == EINTR)
+				continue;			/* and call writev() again */
+			else
+				return(-1);			/* error */
+		}
+
+		ntotal += nwritten;
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+	return(ntotal);
+}
+#endif
+
 static ssize_t						/* Read "n" bytes from a descriptor. */
 readn(evutil_socket_t fd, struct buffer *buf, size_t n)
 {
@@ -82,7 +118,7 @@ ccnet_packet_io_new (evutil_socket_t fd)
 {
     CcnetPacketIO *io;
 
-    io = g_malloc (sizeof(CcnetPacketIO));
+    io = g_malloc0 (sizeof(CcnetPacketIO));
     io->fd = fd;
     io->buffer = buffer_new ();
     io->in_buf = buffer_new ();
@@ -103,7 +139,10 @@ void
 ccnet_packet_prepare (CcnetPacketIO *io, int type, int id)
 {
     ccnet_header header;
-    assert (io->buffer && BUFFER_LENGTH(io->buffer) == 0);
+    assert (io->buffer && (io->corked || BUFFER_LENGTH(io->buffer) == 0));
+
+    /* When corked, earlier packets are still queued in the buffer. */
+    io->packet_off = BUFFER_LENGTH(io->buffer);
 
     header.version = 1;
     header.type = type;
@@ -133,8 +172,8 @@ void
 ccnet_packet_finish (CcnetPacketIO *io)
 {
     ccnet_header *header;
-    header = (ccnet_header *) BUFFER_DATA(io->buffer);
-    header->length = htons (BUFFER_LENGTH(io->buffer)
+    header = (ccnet_header *) (BUFFER_DATA(io->buffer) + io->packet_off);
+    header->length = htons (BUFFER_LENGTH(io->buffer) - io->packet_off
                             - CCNET_PACKET_LENGTH_HEADER);
 }
 
@@ -142,10 +181,70 @@ ccnet_packet_finish (CcnetPacketIO *io)
 void
 ccnet_packet_send (CcnetPacketIO *io)
 {
+    if (io->corked)
+        return;
+
+    io->bytes_sent += io->buffer->off;
     writen (io->fd, BUFFER_DATA (io->buffer), io->buffer->off);
     buffer_drain (io->buffer, io->buffer->off); 
 }
 
+void
+ccnet_packet_sendv (CcnetPacketIO *io, int type, int id,
+                    const struct iovec *iov, int iovcnt)
+{
+    int i;
+
+#ifndef WIN32
+    if (!io->corked) {
+        ccnet_header header;
+        struct iovec vec[CCNET_PACKET_MAX_IOV + 1];
+        size_t len = 0;
+
+        g_return_if_fail (iovcnt <= CCNET_PACKET_MAX_IOV);
+
+        for (i = 0; i < iovcnt; ++i) {
+            vec[i+1] = iov[i];
+            len += iov[i].iov_len;
+        }
+
+        header.version = 1;
+        header.type = type;
+        header.length = htons (len);
+        header.id = htonl (id);
+        vec[0].iov_base = &header;
+        vec[0].iov_len = sizeof(header);
+
+        io->bytes_sent += sizeof(header) + len;
+        writevn (io->fd, vec, iovcnt + 1);
+        return;
+    }
+#endif
+
+    /* Corked or no writev(): stage a copy in the buffer. */
+    ccnet_packet_prepare (io, type, id);
+    for (i = 0; i < iovcnt; ++i) {
+        buffer_add (io->buffer, iov[i].iov_base, iov[i].iov_len);
+        io->bytes_copied += iov[i].iov_len;
+    }
+    ccnet_packet_finish_send (io);
+}
+
+void
+ccnet_packet_io_cork (CcnetPacketIO *io)
+{
+    io->corked++;
+}
+
+void
+ccnet_packet_io_uncork (CcnetPacketIO *io)
+{
+    g_return_if_fail (io->corked > 0);
+
+    if (--io->corked == 0 && BUFFER_LENGTH(io->buffer) > 0)
+        ccnet_packet_send (io);
+}
+
 
 void
 ccnet_packet_finish_send (CcnetPacketIO *io)
@@ -3,9 +3,22 @@
 #ifndef CCNET_CLI_IO_H
 #define CCNET_CLI_IO_H
 
+#include <glib.h>
 #include <packet.h>
 #include <evutil.h>
 
+#ifndef WIN32
+#include <sys/uio.h>
+#else
+struct iovec {
+    void   *iov_base;
+    size_t  iov_len;
+};
+#endif
+
+/* Max number of payload pieces accepted by ccnet_packet_sendv(). */
+#define CCNET_PACKET_MAX_IOV 8
+
 struct buffer;
 
 typedef struct CcnetPacketIO CcnetPacketIO;
@@ -19,6 +32,14 @@ struct CcnetPacketIO {
     
     struct buffer *in_buf;
 
+    /* While corked, sent packets are queued in @buffer and written
+     * together by the final ccnet_packet_io_uncork(). */
+    int            corked;
+    size_t         packet_off;  /* start of the packet being built */
+
+    guint64        bytes_sent;
+    guint64        bytes_copied; /* payload bytes staged through @buffer */
+
     got_packet_callback func;
     void                *user_data;
 };
@@ -34,6 +55,16 @@ void ccnet_packet_finish (CcnetPacketIO *io);
 void ccnet_packet_send (CcnetPacketIO *io);
 void ccnet_packet_finish_send (CcnetPacketIO *io);
 
+/*
+ * Send a packet whose payload is gathered from @iov with a single
+ * writev(), without copying it. The caller keeps ownership of @iov.
+ */
+void ccnet_packet_sendv (CcnetPacketIO *io, int type, int id,
+                         const struct iovec *iov, int iovcnt);
+
+void ccnet_packet_io_cork (CcnetPacketIO *io);
+void ccnet_packet_io_uncork (CcnetPacketIO *io);
+
 void ccnet_packet_io_set_callback (CcnetPacketIO *io,
                                    got_packet_callback func,
                                    void *user_data);
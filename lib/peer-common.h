@@ -174,9 +174,8 @@ set_property_common (GObject *object, guint property_id,
         break;
     case P_PUBKEY:
 #ifndef CCNET_LIB
-        if (peer->pubkey)
-            RSA_free(peer->pubkey);
-        peer->pubkey = public_key_from_string ((char *)g_value_get_string(v));
+        replace_pubkey (peer,
+                        public_key_from_string ((char *)g_value_get_string(v)));
 #endif
         break;
     case P_CAN_CONNECT:
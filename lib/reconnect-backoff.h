@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef RECONNECT_BACKOFF_H
+#define RECONNECT_BACKOFF_H
+
+#include <glib.h>
+
+/*
+ * Reconnect backoff of the connection manager, kept here so that
+ * ccnet-bench can simulate it. Each failed attempt waits a random time
+ * between RECONNECT_BASE_SECS and three times the previous wait, capped
+ * ("decorrelated jitter"). After a network blip this spreads clients
+ * out instead of having them all hit the relay every pulse in lockstep.
+ */
+#define RECONNECT_BASE_SECS          10
+#define RECONNECT_MAX_SECS           300
+#define MASTER_RECONNECT_MAX_SECS    60
+#define MASTER_FIRST_WINDOW_SECS     2
+
+/* Wait before the first attempt after a peer went down. Peers that
+ * dropped together shouldn't come back together. */
+static inline int
+reconnect_first_delay (gboolean master)
+{
+    return g_random_int_range (0, master ? MASTER_FIRST_WINDOW_SECS
+                                         : RECONNECT_BASE_SECS);
+}
+
+/* Wait after an attempt, given the previous wait, 0 for none. */
+static inline int
+reconnect_next_delay (int prev, gboolean master)
+{
+    int cap = master ? MASTER_RECONNECT_MAX_SECS : RECONNECT_MAX_SECS;
+    int upper = MAX (RECONNECT_BASE_SECS, prev * 3);
+
+    return MIN (cap, g_random_int_range (RECONNECT_BASE_SECS, upper + 1));
+}
+
+#endif
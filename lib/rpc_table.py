@@ -32,9 +32,12 @@ func_table = [
     [ "int64", ["int", "string"]],
     [ "string", [] ],
     [ "string", ["int"] ],
+    [ "string", ["int", "string", "int"] ],
+    [ "string", ["int", "string", "string"] ],
     [ "string", ["string"] ],
     [ "string", ["string", "int"] ],
     [ "string", ["string", "string"] ],
+    [ "string", ["string", "string", "int", "int"] ],
     [ "string", ["string", "string", "string"] ],
     [ "string", ["string", "string", "string", "string"] ],
     [ "string", ["string", "string", "string", "string", "int"] ],
@@ -6,6 +6,7 @@
 #include <openssl/err.h>
 
 #include <string.h>
+#include <pthread.h>
 #include <glib.h>
 
 #include "rsa.h"
@@ -159,3 +160,48 @@ generate_private_key(u_int bits)
 		g_error ("rsa_generate_private_key: key generation failed.");
 	return private;
 }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+static pthread_mutex_t *crypto_locks;
+
+static void
+crypto_locking_cb (int mode, int type, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock (&crypto_locks[type]);
+    else
+        pthread_mutex_unlock (&crypto_locks[type]);
+}
+
+static unsigned long
+crypto_thread_id_cb (void)
+{
+    return (unsigned long)pthread_self ();
+}
+
+void
+ccnet_crypto_init_threads (void)
+{
+    int i, n;
+
+    if (crypto_locks)
+        return;
+
+    n = CRYPTO_num_locks ();
+    crypto_locks = g_new0 (pthread_mutex_t, n);
+    for (i = 0; i < n; ++i)
+        pthread_mutex_init (&crypto_locks[i], NULL);
+
+    CRYPTO_set_id_callback (crypto_thread_id_cb);
+    CRYPTO_set_locking_callback (crypto_locking_cb);
+}
+
+#else
+
+void
+ccnet_crypto_init_threads (void)
+{
+}
+
+#endif
@@ -27,5 +27,10 @@ char *id_from_pubkey (RSA *pubkey);
 
 RSA* generate_private_key(u_int bits);
 
+/* Install OpenSSL locking callbacks so keys can be used from
+ * worker threads. Call once at startup, before starting any thread.
+ * No-op with OpenSSL 1.1 and later, which lock internally. */
+void ccnet_crypto_init_threads (void);
+
 
 #endif
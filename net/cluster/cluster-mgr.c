@@ -14,10 +14,17 @@
 #include "peer-mgr.h"
 #include "cluster-mgr.h"
 #include "connect-mgr.h"
+#include "peer-sync.h"
 
 #include "message.h"
+#include "peermgr-message.h"
+#include "proc-factory.h"
+#include "algorithms.h"
+#include "job-mgr.h"
 #include "utils.h"
 
+#include <openssl/sha.h>
+
 #define DEBUG_FLAG  CCNET_DEBUG_PEER
 #include "log.h"
 
@@ -25,10 +32,259 @@ extern CcnetSession  *session;
 extern CcnetSession  *inner_session;
 
 
+#define LOAD_REPORT_INTERVAL   5000     /* msec */
+#define LOAD_REPORT_EXPIRE     30       /* secs */
+
+/*
+ * Clients are mapped to members with a consistent hash ring keyed by
+ * client peer id, so a client that reconnects lands on the member that
+ * still has its session state. Each member owns RING_VNODES points.
+ * A member is skipped if it's down, its load report is older than
+ * LOAD_REPORT_EXPIRE, or its score is above RING_MAX_OVERLOAD times the
+ * average, in which case the client goes to the next member on the
+ * ring.
+ */
+#define RING_VNODES            100
+#define RING_MAX_OVERLOAD      1.25
+
+/* Score of a member whose load report has expired, above any real
+ * load. */
+#define STALE_MEMBER_SCORE     1e9
+
+/* Load of one member as last reported. Kept in priv->members, and in
+ * priv->cands while the member is connected. */
+typedef struct {
+    CcnetPeer  *peer;
+    int         index;          /* in cands, -1 if not a candidate */
+
+    int         n_peers;
+    int         n_procs;
+    int         n_jobs;
+    int         cpu;            /* load average * 100 */
+    time_t      report_time;
+
+    /* redirected to it since the last report */
+    int         n_redirected;
+} MemberLoad;
+
+typedef struct {
+    guint32     hash;
+    MemberLoad *load;
+} RingPoint;
+
 struct CcnetClusterManagerPriv {
-    int dummy;
+    GHashTable *members;        /* peer id -> MemberLoad */
+    GPtrArray  *cands;          /* connected members */
+    GArray     *ring;           /* of RingPoint, sorted by hash */
+    CcnetTimer *report_timer;
+
+    CcnetPeerSync *sync;
 };
 
+static guint32
+ring_hash (const char *key)
+{
+    unsigned char sha1[SHA_DIGEST_LENGTH];
+    guint32 h;
+
+    SHA1 ((const unsigned char *)key, strlen(key), sha1);
+    memcpy (&h, sha1, sizeof(h));
+    return h;
+}
+
+static gint
+cmp_ring_point (gconstpointer a, gconstpointer b)
+{
+    guint32 ha = ((const RingPoint *)a)->hash;
+    guint32 hb = ((const RingPoint *)b)->hash;
+
+    return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/* Only the member's own points are added or removed, so the other
+ * members keep their clients. */
+static void
+ring_add_member (CcnetClusterManager *manager, MemberLoad *load)
+{
+    RingPoint point;
+    char key[64];
+    int i;
+
+    point.load = load;
+    for (i = 0; i < RING_VNODES; ++i) {
+        snprintf (key, sizeof(key), "%s-%d", load->peer->id, i);
+        point.hash = ring_hash (key);
+        g_array_append_val (manager->priv->ring, point);
+    }
+    g_array_sort (manager->priv->ring, cmp_ring_point);
+}
+
+static void
+ring_remove_member (CcnetClusterManager *manager, MemberLoad *load)
+{
+    GArray *ring = manager->priv->ring;
+    guint i, n = 0;
+
+    for (i = 0; i < ring->len; ++i) {
+        RingPoint *point = &g_array_index (ring, RingPoint, i);
+        if (point->load != load)
+            g_array_index (ring, RingPoint, n++) = *point;
+    }
+    g_array_set_size (ring, n);
+}
+
+/* Index of the first point at or after @hash, wrapping around. */
+static guint
+ring_search (GArray *ring, guint32 hash)
+{
+    guint lo = 0, hi = ring->len;
+
+    while (lo < hi) {
+        guint mid = (lo + hi) / 2;
+        if (g_array_index (ring, RingPoint, mid).hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == ring->len ? 0 : lo;
+}
+
+
+static void
+add_candidate (CcnetClusterManager *manager, MemberLoad *load)
+{
+    if (load->index >= 0)
+        return;
+    load->index = manager->priv->cands->len;
+    g_ptr_array_add (manager->priv->cands, load);
+}
+
+static void
+remove_candidate (CcnetClusterManager *manager, MemberLoad *load)
+{
+    GPtrArray *cands = manager->priv->cands;
+    MemberLoad *last;
+
+    if (load->index < 0)
+        return;
+
+    /* move the last one into the hole */
+    last = g_ptr_array_index (cands, cands->len - 1);
+    g_ptr_array_remove_index_fast (cands, load->index);
+    if (last != load)
+        last->index = load->index;
+    load->index = -1;
+}
+
+static void
+on_member_down (CcnetPeer *peer, void *vmanager)
+{
+    CcnetClusterManager *manager = vmanager;
+    MemberLoad *load = g_hash_table_lookup (manager->priv->members, peer->id);
+
+    if (load)
+        remove_candidate (manager, load);
+}
+
+static void
+on_peer_auth_done (CcnetPeerManager *peer_mgr, CcnetPeer *peer,
+                   void *vmanager)
+{
+    CcnetClusterManager *manager = vmanager;
+    MemberLoad *load = g_hash_table_lookup (manager->priv->members, peer->id);
+
+    if (load)
+        add_candidate (manager, load);
+}
+
+static void
+track_member (CcnetClusterManager *manager, CcnetPeer *peer)
+{
+    MemberLoad *load;
+
+    if (g_hash_table_lookup (manager->priv->members, peer->id))
+        return;
+
+    load = g_new0 (MemberLoad, 1);
+    load->peer = peer;
+    load->index = -1;
+    g_hash_table_insert (manager->priv->members, peer->id, load);
+    ring_add_member (manager, load);
+
+    g_signal_connect (peer, "down", G_CALLBACK(on_member_down), manager);
+    if (peer->net_state == PEER_CONNECTED)
+        add_candidate (manager, load);
+}
+
+static void
+untrack_member (CcnetClusterManager *manager, CcnetPeer *peer)
+{
+    MemberLoad *load = g_hash_table_lookup (manager->priv->members, peer->id);
+
+    if (!load)
+        return;
+
+    remove_candidate (manager, load);
+    ring_remove_member (manager, load);
+    g_signal_handlers_disconnect_by_func (peer, on_member_down, manager);
+    g_hash_table_remove (manager->priv->members, peer->id);
+}
+
+static int
+count_connected_peers (CcnetSession *sess)
+{
+    GList *peers, *ptr;
+    int n = 0;
+
+    peers = ccnet_peer_manager_get_peer_list (sess->peer_mgr);
+    for (ptr = peers; ptr; ptr = ptr->next) {
+        CcnetPeer *peer = ptr->data;
+        if (peer->net_state == PEER_CONNECTED)
+            ++n;
+    }
+    g_list_free (peers);
+
+    return n;
+}
+
+static int
+report_load_pulse (void *vmanager)
+{
+    CcnetClusterManager *manager = vmanager;
+    GList *masters, *ptr;
+    char buf[256];
+    double loadavg = 0;
+
+#ifndef WIN32
+    if (getloadavg (&loadavg, 1) < 0)
+        loadavg = 0;
+#endif
+
+    snprintf (buf, sizeof(buf), "v%d\n%s\n%d %d %d %d\n",
+              CLUSTER_MSG_VERSION, LOAD_REPORT,
+              count_connected_peers (session),
+              session->proc_factory->procs_alive_cnt,
+              g_hash_table_size (session->job_mgr->jobs),
+              (int)(loadavg * 100));
+
+    masters = ccnet_peer_manager_get_peers_with_role (
+        inner_session->peer_mgr, "ClusterMaster");
+    for (ptr = masters; ptr; ptr = ptr->next) {
+        CcnetPeer *master = ptr->data;
+
+        if (master->net_state == PEER_CONNECTED) {
+            CcnetMessage *msg = ccnet_message_new (inner_session->base.id,
+                                                   master->id, CLUSTER_APP,
+                                                   buf, 0);
+            ccnet_send_message (inner_session, msg);
+            ccnet_message_unref (msg);
+        }
+        g_object_unref (master);
+    }
+    g_list_free (masters);
+
+    return TRUE;
+}
 
 CcnetClusterManager*
 ccnet_cluster_manager_new ()
@@ -38,6 +294,11 @@ ccnet_cluster_manager_new ()
     manager = g_new0 (CcnetClusterManager, 1);
 
     manager->priv = g_new0 (CcnetClusterManagerPriv, 1);
+    manager->priv->members = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                    NULL, g_free);
+    manager->priv->cands = g_ptr_array_new ();
+    manager->priv->ring = g_array_new (FALSE, FALSE, sizeof(RingPoint));
+    manager->priv->sync = ccnet_peer_sync_new (session, inner_session);
 
     return manager;
 }
@@ -70,6 +331,12 @@ ccnet_cluster_manager_start (CcnetClusterManager *manager)
         ccnet_cluster_manager_add_master (manager, peer);
     }
     g_list_free (peers);
+
+    g_signal_connect (inner_session->peer_mgr, "peer-auth-done",
+                      G_CALLBACK(on_peer_auth_done), manager);
+    manager->priv->report_timer = ccnet_timer_new (report_load_pulse, manager,
+                                                   LOAD_REPORT_INTERVAL);
+    ccnet_peer_sync_start (manager->priv->sync);
 }
 
 void
@@ -78,6 +345,7 @@ ccnet_cluster_manager_add_member (CcnetClusterManager *manager,
 {
     manager->members = g_list_prepend (manager->members, peer);
     g_object_ref (peer);
+    track_member (manager, peer);
 }
 
 void
@@ -86,6 +354,7 @@ ccnet_cluster_manager_remove_member (CcnetClusterManager *manager,
 {
     if (!g_list_find (manager->members, peer))
         return;
+    untrack_member (manager, peer);
     manager->members = g_list_remove (manager->members, peer);
     g_object_unref (peer);
 }
@@ -96,6 +365,7 @@ ccnet_cluster_manager_add_master (CcnetClusterManager *manager,
 {
     manager->members = g_list_prepend (manager->members, peer);
     g_object_ref (peer);
+    track_member (manager, peer);
     ccnet_conn_manager_add_to_conn_list (
         inner_session->connMgr, peer);
 }
@@ -106,6 +376,7 @@ ccnet_cluster_manager_remove_master (CcnetClusterManager *manager,
 {
     if (!g_list_find (manager->members, peer))
         return;
+    untrack_member (manager, peer);
     manager->members = g_list_remove (manager->members, peer);
     g_object_unref (peer);
 
@@ -113,37 +384,159 @@ ccnet_cluster_manager_remove_master (CcnetClusterManager *manager,
         inner_session->connMgr, peer);
 }
 
+/* A member that hasn't reported for a while may be hung or cut off
+ * from us; its last numbers say nothing about its load now. */
+static inline gboolean
+member_is_stale (MemberLoad *load, time_t now)
+{
+    return now - load->report_time > LOAD_REPORT_EXPIRE;
+}
+
+/*
+ * Lower is better. Stale members score above every fresh one, so they
+ * are only picked when no member has reported lately; among them the
+ * clients we already sent are spread evenly.
+ */
+static double
+member_score (MemberLoad *load, time_t now)
+{
+    if (member_is_stale (load, now))
+        return STALE_MEMBER_SCORE + load->n_redirected;
+
+    return (load->n_peers + load->n_redirected + load->n_jobs * 4 + 1)
+        * (100 + load->cpu) / 100.0;
+}
+
+/* Walk the ring from @peer's point to the first member that is up,
+ * has a fresh report and is not overloaded. Stale members are left out
+ * of the average as well. */
+static MemberLoad *
+ring_lookup (CcnetClusterManager *manager, CcnetPeer *peer, time_t now)
+{
+    GArray *ring = manager->priv->ring;
+    GPtrArray *cands = manager->priv->cands;
+    MemberLoad *load;
+    double total = 0, limit;
+    guint i, start, idx, n_fresh = 0;
+
+    for (i = 0; i < cands->len; ++i) {
+        load = g_ptr_array_index (cands, i);
+        if (member_is_stale (load, now))
+            continue;
+        total += member_score (load, now);
+        ++n_fresh;
+    }
+    if (n_fresh == 0)
+        return NULL;
+    limit = RING_MAX_OVERLOAD * (total + 1) / n_fresh;
+
+    start = ring_search (ring, ring_hash (peer->id));
+    for (i = 0; i < ring->len; ++i) {
+        idx = (start + i) % ring->len;
+        load = g_array_index (ring, RingPoint, idx).load;
+
+        if (load->index >= 0 && !member_is_stale (load, now)
+            && member_score (load, now) <= limit)
+            return load;
+    }
+
+    return NULL;
+}
+
 CcnetPeer*
 ccnet_cluster_manager_find_redirect_dest (CcnetClusterManager *manager,
                                           CcnetPeer *peer)
 {
-    GList *ptr;
-    GList *cands = NULL;
-    int n = 0;
-    CcnetPeer *res;
+    GPtrArray *cands = manager->priv->cands;
+    MemberLoad *a, *b, *best;
+    time_t now = time (NULL);
+    int i, j;
 
-    for (ptr = manager->members; ptr; ptr = ptr->next) {
-        CcnetPeer *p = ptr->data;
+    if (cands->len == 0)
+        return NULL;
 
-        if (p->net_state == PEER_CONNECTED) {
-            cands = g_list_prepend (cands, p);
-            n++;
-        }
-    }
+    best = ring_lookup (manager, peer, now);
+    if (best)
+        goto out;
 
-    if (n) {
-        int i = rand() % n;
-        res = g_list_nth_data(cands, i);
-        g_object_ref (res);
-        return res;
+    /* everyone is busy, fall back to power of two choices */
+    i = g_random_int_range (0, cands->len);
+    best = a = g_ptr_array_index (cands, i);
+    if (cands->len > 1) {
+        j = g_random_int_range (0, cands->len - 1);
+        if (j >= i)
+            ++j;
+        b = g_ptr_array_index (cands, j);
+
+        if (member_score (b, now) < member_score (a, now))
+            best = b;
     }
 
-    return NULL;
+out:
+    best->n_redirected++;
+    g_object_ref (best->peer);
+    return best->peer;
 }
 
 /* -------- cluster message handling -------- */
+
+static void
+handle_load_report (CcnetClusterManager *manager, CcnetMessage *msg,
+                    char *body)
+{
+    MemberLoad *load = g_hash_table_lookup (manager->priv->members, msg->from);
+    int n_peers, n_procs, n_jobs, cpu;
+
+    if (!load) {
+        ccnet_debug ("[Cluster] Load report from non-member %.8s\n", msg->from);
+        return;
+    }
+
+    if (sscanf (body, "%d %d %d %d", &n_peers, &n_procs, &n_jobs, &cpu) != 4) {
+        ccnet_message ("[Cluster] Bad load report from %.8s\n", msg->from);
+        return;
+    }
+
+    load->n_peers = n_peers;
+    load->n_procs = n_procs;
+    load->n_jobs = n_jobs;
+    load->cpu = cpu;
+    load->report_time = time (NULL);
+    load->n_redirected = 0;
+}
+
 void
-ccnet_cluster_manager_receive_message (CcnetPeerManager *manager,
+ccnet_cluster_manager_receive_message (CcnetClusterManager *manager,
                                        CcnetMessage *msg)
 {
+    guint16 version;
+    char *type;
+    char *body;
+
+    if (parse_peermgr_message (msg, &version, &type, &body) < 0) {
+        ccnet_message ("Invalid cluster message from %.8s\n", msg->from);
+        return;
+    }
+
+    if (version != CLUSTER_MSG_VERSION) {
+        ccnet_message ("Incompatible cluster message version %d from %.8s\n",
+                       version, msg->from);
+        return;
+    }
+
+    if (strcmp(type, LOAD_REPORT) == 0) {
+        handle_load_report (manager, msg, body);
+        return;
+    }
+
+    if (!g_hash_table_lookup (manager->priv->members, msg->from)) {
+        ccnet_debug ("[Cluster] Sync message from non-member %.8s\n",
+                     msg->from);
+        return;
+    }
+
+    if (strcmp(type, SYNC_HASHES) == 0)
+        ccnet_peer_sync_handle_hashes (manager->priv->sync, msg, body);
+    else if (strcmp(type, SYNC_ENTRIES) == 0)
+        ccnet_peer_sync_handle_entries (manager->priv->sync, msg, body);
 }
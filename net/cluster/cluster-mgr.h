@@ -6,7 +6,27 @@
 #include <glib.h>
 
 #include "peer.h"
+#include "message.h"
 
+/*
+  Cluster messages, sent over the inner session:
+
+        v<num>\n
+        <type>\n
+        [content]
+
+  load-report: "<peers> <procs> <jobs> <cpu>\n", sent by every node to
+  its cluster masters every few seconds. cpu is the 1 minute load
+  average times 100.
+
+  sync-hashes, sync-entries: anti-entropy sync of client peer roles and
+  addresses, see peer-sync.h.
+ */
+#define CLUSTER_APP          "cluster-manager"
+#define CLUSTER_MSG_VERSION  1
+#define LOAD_REPORT          "load-report"
+#define SYNC_HASHES          "sync-hashes"
+#define SYNC_ENTRIES         "sync-entries"
 
 typedef struct _CcnetClusterManager CcnetClusterManager;
 typedef struct CcnetClusterManagerPriv CcnetClusterManagerPriv;
@@ -38,9 +58,19 @@ void ccnet_cluster_manager_add_master (CcnetClusterManager *manager,
 void ccnet_cluster_manager_remove_master (CcnetClusterManager *manager,
                                           CcnetPeer *peer);
 
+/*
+ * Pick the member to redirect @peer to, or NULL to serve it here.
+ * A client sticks to the member its id hashes to on the consistent
+ * hash ring unless that member is down or overloaded; then the least
+ * loaded of two random members is used.
+ */
 CcnetPeer*
 ccnet_cluster_manager_find_redirect_dest (CcnetClusterManager *manager,
                                           CcnetPeer *peer);
 
+void
+ccnet_cluster_manager_receive_message (CcnetClusterManager *manager,
+                                       CcnetMessage *msg);
+
 
 #endif
@@ -0,0 +1,448 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <openssl/sha.h>
+
+#include "htree.h"
+#include "timer.h"
+#include "utils.h"
+
+#include "peer.h"
+#include "session.h"
+#include "peer-mgr.h"
+#include "message.h"
+#include "cluster-mgr.h"
+#include "peer-sync.h"
+
+#define DEBUG_FLAG  CCNET_DEBUG_PEER
+#include "log.h"
+
+#define SYNC_INTERVAL      30000    /* msec */
+
+/* ht_new() picks the lowest tree with more nodes than this: 5 levels and
+ * 65536 leaves, about 15 entries per leaf for a million peers. */
+#define SYNC_TREE_NODES    100000
+
+/* Split replies so that each message fits in one packet. */
+#define SYNC_MSG_MAX       32768
+
+#define ZERO_HASH_HEX      "0000000000000000000000000000000000000000"
+
+/*
+ * An entry is sent and hashed as one line:
+ *
+ *     <peer id> <mtime> <addr> <port> <roles>\n
+ *
+ * addr and roles are "-" if unset. mtime is in usec, 0 for the state
+ * the node loaded at startup.
+ */
+typedef struct {
+    char           peer_id[41];
+    gint64         mtime;
+    char          *addr;
+    int            port;
+    char          *roles;
+    unsigned char  hash[SHA_DIGEST_LENGTH];
+} SyncEntry;
+
+struct CcnetPeerSync {
+    CcnetSession   *session;        /* whose peers are synced */
+    CcnetSession   *inner_session;  /* to talk to the other nodes */
+
+    HTree          *tree;
+    GHashTable     *entries;        /* peer id -> SyncEntry */
+
+    CcnetTimer     *timer;
+};
+
+static void
+free_entry (SyncEntry *e)
+{
+    g_free (e->addr);
+    g_free (e->roles);
+    g_free (e);
+}
+
+static void
+format_entry (SyncEntry *e, GString *buf)
+{
+    g_string_append_printf (buf, "%s %"G_GINT64_FORMAT" %s %d %s\n",
+                            e->peer_id, e->mtime, e->addr, e->port, e->roles);
+}
+
+static void
+entry_compute_hash (SyncEntry *e)
+{
+    GString *buf = g_string_new (NULL);
+
+    format_entry (e, buf);
+    SHA1 ((unsigned char *)buf->str, buf->len, e->hash);
+    g_string_free (buf, TRUE);
+}
+
+static SyncEntry *
+entry_from_peer (CcnetPeer *peer, gint64 mtime)
+{
+    SyncEntry *e = g_new0 (SyncEntry, 1);
+    GString *roles = g_string_new (NULL);
+
+    ccnet_peer_get_roles_str (peer, roles);
+
+    memcpy (e->peer_id, peer->id, 40);
+    e->mtime = mtime;
+    e->addr = g_strdup (peer->public_addr ? peer->public_addr : "-");
+    e->port = peer->public_port;
+    e->roles = g_strdup (roles->len > 0 ? roles->str : "-");
+    entry_compute_hash (e);
+
+    g_string_free (roles, TRUE);
+    return e;
+}
+
+static SyncEntry *
+parse_entry (const char *line)
+{
+    char **tokens = g_strsplit (line, " ", -1);
+    SyncEntry *e = NULL;
+
+    if (g_strv_length (tokens) != 5 || strlen(tokens[0]) != 40 ||
+        *tokens[2] == '\0' || *tokens[4] == '\0')
+        goto out;
+
+    e = g_new0 (SyncEntry, 1);
+    memcpy (e->peer_id, tokens[0], 40);
+    e->mtime = g_ascii_strtoll (tokens[1], NULL, 10);
+    e->addr = g_strdup (tokens[2]);
+    e->port = atoi (tokens[3]);
+    e->roles = g_strdup (tokens[4]);
+    entry_compute_hash (e);
+
+out:
+    g_strfreev (tokens);
+    return e;
+}
+
+static gboolean
+same_state (SyncEntry *a, SyncEntry *b)
+{
+    return (a->port == b->port &&
+            strcmp (a->addr, b->addr) == 0 &&
+            strcmp (a->roles, b->roles) == 0);
+}
+
+/* Takes ownership of @e and replaces the entry of the same peer. */
+static void
+set_entry (CcnetPeerSync *sync, SyncEntry *e)
+{
+    SyncEntry *old = g_hash_table_lookup (sync->entries, e->peer_id);
+
+    if (old)
+        ht_remove (sync->tree, old->hash);
+    g_hash_table_replace (sync->entries, e->peer_id, e);
+    ht_add (sync->tree, e->hash, e);
+}
+
+static void
+apply_entry (CcnetPeerSync *sync, SyncEntry *e)
+{
+    CcnetPeer *peer;
+
+    peer = ccnet_peer_manager_get_peer (sync->session->peer_mgr, e->peer_id);
+    if (!peer)
+        return;
+
+    /* Set the fields directly, going through the peer manager would
+     * emit "peer-updated" again. */
+    ccnet_peer_set_roles (peer, strcmp(e->roles, "-") == 0 ? "" : e->roles);
+    g_free (peer->public_addr);
+    peer->public_addr = strcmp(e->addr, "-") == 0 ? NULL : g_strdup (e->addr);
+    peer->public_port = e->port;
+
+    g_object_unref (peer);
+}
+
+static void
+on_peer_added (CcnetPeerManager *peer_mgr, CcnetPeer *peer, void *vsync)
+{
+    CcnetPeerSync *sync = vsync;
+    SyncEntry *e = g_hash_table_lookup (sync->entries, peer->id);
+
+    /* We may have learnt about the peer from other nodes before it was
+     * added here. */
+    if (e)
+        apply_entry (sync, e);
+    else
+        set_entry (sync, entry_from_peer (peer, 0));
+}
+
+static void
+on_peer_updated (CcnetPeerManager *peer_mgr, CcnetPeer *peer, void *vsync)
+{
+    CcnetPeerSync *sync = vsync;
+    SyncEntry *old = g_hash_table_lookup (sync->entries, peer->id);
+    SyncEntry *e;
+    gint64 now = get_current_time ();
+
+    /* A remote entry can be stamped ahead of our clock, a local change
+     * must still win over it. */
+    if (old && old->mtime >= now)
+        now = old->mtime + 1;
+
+    e = entry_from_peer (peer, now);
+    if (old && same_state (old, e)) {
+        free_entry (e);
+        return;
+    }
+    set_entry (sync, e);
+}
+
+/* Keep the newer entry. Ties are broken by hash so both sides agree. */
+static void
+merge_entry (CcnetPeerSync *sync, SyncEntry *e)
+{
+    SyncEntry *old = g_hash_table_lookup (sync->entries, e->peer_id);
+
+    if (old && (old->mtime > e->mtime ||
+                (old->mtime == e->mtime &&
+                 memcmp (old->hash, e->hash, SHA_DIGEST_LENGTH) >= 0))) {
+        free_entry (e);
+        return;
+    }
+
+    ccnet_debug ("[Sync] Update peer %.8s: roles %s, addr %s:%d\n",
+                 e->peer_id, e->roles, e->addr, e->port);
+    set_entry (sync, e);
+    apply_entry (sync, e);
+}
+
+/* -------- messages -------- */
+
+static void
+send_sync_message (CcnetPeerSync *sync, const char *to, const char *type,
+                   GString *body)
+{
+    CcnetMessage *msg;
+    GString *buf;
+
+    if (body->len == 0)
+        return;
+
+    buf = g_string_new (NULL);
+    g_string_printf (buf, "v%d\n%s\n%s", CLUSTER_MSG_VERSION, type, body->str);
+
+    msg = ccnet_message_new (sync->inner_session->base.id, to,
+                             CLUSTER_APP, buf->str, 0);
+    ccnet_send_message (sync->inner_session, msg);
+    ccnet_message_unref (msg);
+
+    g_string_free (buf, TRUE);
+    g_string_truncate (body, 0);
+}
+
+/* Nodes that never had an entry have no hash yet. */
+static void
+node_hash_hex (HTree *tree, HTNode *node, char *hex)
+{
+    unsigned char *hash = ht_get_node_hash (tree, node);
+
+    if (hash)
+        rawdata_to_hex (hash, hex, SHA_DIGEST_LENGTH);
+    else
+        memcpy (hex, ZERO_HASH_HEX, 41);
+}
+
+static void
+append_node_hash (HTree *tree, HTNode *node, GString *buf)
+{
+    char hex[41];
+
+    node_hash_hex (tree, node, hex);
+    g_string_append_printf (buf, "%d %s\n", ht_get_node_seq (tree, node), hex);
+}
+
+static void
+append_leaf (HTree *tree, HTNode *leaf, gboolean want, GString *buf)
+{
+    HTData *data = ht_get_data (tree, leaf);
+    HTItem *it;
+
+    g_string_append_printf (buf, "leaf %d %d\n",
+                            ht_get_node_seq (tree, leaf), want);
+    if (!data)
+        return;
+    for (it = data->item_list; it; it = it->next)
+        format_entry (it->data, buf);
+}
+
+void
+ccnet_peer_sync_probe (CcnetPeerSync *sync, const char *peer_id)
+{
+    GString *body = g_string_new (NULL);
+
+    append_node_hash (sync->tree, ht_get_root (sync->tree), body);
+    send_sync_message (sync, peer_id, SYNC_HASHES, body);
+    g_string_free (body, TRUE);
+}
+
+/*
+ * sync-hashes: "<node seq> <hash>\n"...
+ *
+ * For every node whose hash differs from ours, answer with the hashes
+ * of its children, or with our entries in it if it's a leaf.
+ */
+void
+ccnet_peer_sync_handle_hashes (CcnetPeerSync *sync, CcnetMessage *msg,
+                               char *body)
+{
+    HTree *tree = sync->tree;
+    GString *hashes = g_string_new (NULL);
+    GString *entries = g_string_new (NULL);
+    char **lines, **ptr;
+    char hex[41], mine[41];
+    int seq, i;
+
+    lines = g_strsplit (body, "\n", -1);
+    for (ptr = lines; *ptr; ++ptr) {
+        HTNode *node;
+
+        if (**ptr == '\0')
+            continue;
+        if (sscanf (*ptr, "%d %40s", &seq, hex) != 2 ||
+            seq < 0 || seq >= tree->size) {
+            ccnet_message ("[Sync] Bad hash line from %.8s\n", msg->from);
+            break;
+        }
+
+        node = ht_get_node_by_seq (tree, seq);
+        node_hash_hex (tree, node, mine);
+        if (strcmp (hex, mine) == 0)
+            continue;
+
+        if (HTNODE_IS_LEAF (node)) {
+            append_leaf (tree, node, TRUE, entries);
+            if (entries->len > SYNC_MSG_MAX)
+                send_sync_message (sync, msg->from, SYNC_ENTRIES, entries);
+        } else {
+            for (i = 0; i < 16; ++i)
+                append_node_hash (tree, ht_get_child (tree, node, i), hashes);
+            if (hashes->len > SYNC_MSG_MAX)
+                send_sync_message (sync, msg->from, SYNC_HASHES, hashes);
+        }
+    }
+    g_strfreev (lines);
+
+    send_sync_message (sync, msg->from, SYNC_HASHES, hashes);
+    send_sync_message (sync, msg->from, SYNC_ENTRIES, entries);
+    g_string_free (hashes, TRUE);
+    g_string_free (entries, TRUE);
+}
+
+/*
+ * sync-entries: "leaf <node seq> <want>\n" followed by the sender's
+ * entries in that leaf. Merge them, and if the sender wants ours, send
+ * back the merged leaf.
+ */
+void
+ccnet_peer_sync_handle_entries (CcnetPeerSync *sync, CcnetMessage *msg,
+                                char *body)
+{
+    HTree *tree = sync->tree;
+    GString *reply = g_string_new (NULL);
+    HTNode *leaf = NULL;
+    int want = 0, seq;
+    char **lines, **ptr;
+    SyncEntry *e;
+
+    lines = g_strsplit (body, "\n", -1);
+    for (ptr = lines; *ptr; ++ptr) {
+        if (**ptr == '\0')
+            continue;
+
+        if (strncmp (*ptr, "leaf ", 5) == 0) {
+            if (leaf && want) {
+                append_leaf (tree, leaf, FALSE, reply);
+                if (reply->len > SYNC_MSG_MAX)
+                    send_sync_message (sync, msg->from, SYNC_ENTRIES, reply);
+            }
+
+            leaf = NULL;
+            if (sscanf (*ptr + 5, "%d %d", &seq, &want) != 2 ||
+                seq < 0 || seq >= tree->size ||
+                !HTNODE_IS_LEAF (ht_get_node_by_seq (tree, seq))) {
+                ccnet_message ("[Sync] Bad leaf line from %.8s\n", msg->from);
+                continue;
+            }
+            leaf = ht_get_node_by_seq (tree, seq);
+            continue;
+        }
+
+        if (!leaf)
+            continue;
+        if (!(e = parse_entry (*ptr))) {
+            ccnet_message ("[Sync] Bad entry from %.8s\n", msg->from);
+            continue;
+        }
+        merge_entry (sync, e);
+    }
+    g_strfreev (lines);
+
+    if (leaf && want)
+        append_leaf (tree, leaf, FALSE, reply);
+    send_sync_message (sync, msg->from, SYNC_ENTRIES, reply);
+    g_string_free (reply, TRUE);
+}
+
+/* -------- setup -------- */
+
+static int
+sync_pulse (void *vsync)
+{
+    CcnetPeerSync *sync = vsync;
+    GList *masters, *ptr;
+
+    masters = ccnet_peer_manager_get_peers_with_role (
+        sync->inner_session->peer_mgr, "ClusterMaster");
+    for (ptr = masters; ptr; ptr = ptr->next) {
+        CcnetPeer *master = ptr->data;
+
+        if (master->net_state == PEER_CONNECTED)
+            ccnet_peer_sync_probe (sync, master->id);
+        g_object_unref (master);
+    }
+    g_list_free (masters);
+
+    return TRUE;
+}
+
+CcnetPeerSync *
+ccnet_peer_sync_new (CcnetSession *session, CcnetSession *inner_session)
+{
+    CcnetPeerSync *sync = g_new0 (CcnetPeerSync, 1);
+
+    sync->session = session;
+    sync->inner_session = inner_session;
+    sync->tree = ht_new (SYNC_TREE_NODES, SHA_DIGEST_LENGTH);
+    /* keys point into the entries */
+    sync->entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify)free_entry);
+    return sync;
+}
+
+void
+ccnet_peer_sync_start (CcnetPeerSync *sync)
+{
+    GList *peers, *ptr;
+
+    peers = ccnet_peer_manager_get_peer_list (sync->session->peer_mgr);
+    for (ptr = peers; ptr; ptr = ptr->next)
+        set_entry (sync, entry_from_peer (ptr->data, 0));
+    g_list_free (peers);
+
+    g_signal_connect (sync->session->peer_mgr, "peer-added",
+                      G_CALLBACK(on_peer_added), sync);
+    g_signal_connect (sync->session->peer_mgr, "peer-updated",
+                      G_CALLBACK(on_peer_updated), sync);
+
+    sync->timer = ccnet_timer_new (sync_pulse, sync, SYNC_INTERVAL);
+}
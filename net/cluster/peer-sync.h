@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_PEER_SYNC_H
+#define CCNET_PEER_SYNC_H
+
+#include <glib.h>
+
+#include "session.h"
+#include "message.h"
+
+/*
+ * Anti-entropy sync of client peer roles and public addresses between
+ * cluster nodes.
+ *
+ * Every node keeps one entry per peer of the outer session, hashed into
+ * an HTree. A node periodically sends the root hash to its cluster
+ * masters. The receiver answers every hash that differs from its own
+ * with the hashes of that node's children, and the sender does the
+ * same in turn, so only differing subtrees are walked. When a leaf
+ * differs, its entries are exchanged and merged. Two nodes that differ
+ * in d entries converge in about tree height round trips and
+ * O(d * log n) data, instead of dumping all entries.
+ *
+ * The newer entry wins. Local changes are picked up from the
+ * "peer-updated" signal of the peer manager.
+ */
+
+typedef struct CcnetPeerSync CcnetPeerSync;
+
+CcnetPeerSync *
+ccnet_peer_sync_new (CcnetSession *session, CcnetSession *inner_session);
+
+void
+ccnet_peer_sync_start (CcnetPeerSync *sync);
+
+/* Start a sync round with @peer_id on the inner session. */
+void
+ccnet_peer_sync_probe (CcnetPeerSync *sync, const char *peer_id);
+
+void
+ccnet_peer_sync_handle_hashes (CcnetPeerSync *sync, CcnetMessage *msg,
+                               char *body);
+
+void
+ccnet_peer_sync_handle_entries (CcnetPeerSync *sync, CcnetMessage *msg,
+                                char *body);
+
+#endif
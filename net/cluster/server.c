@@ -12,6 +12,7 @@
 #include "peer.h"
 #include "peer-mgr.h"
 #include "rpc-service.h"
+#include "rsa.h"
 #include "log.h"
 #include "cluster-mgr.h"
 
@@ -211,6 +212,7 @@ main (int argc, char **argv)
         daemon (1, 0);
 #endif
     g_type_init ();
+    ccnet_crypto_init_threads ();
 
     /* log */
     if (!debug_str)
@@ -11,6 +11,7 @@
 
 #include "proc-factory.h"
 #include "processors/sendmsg-proc.h"
+#include "processors/sendmsg-stream-proc.h"
 
 #include "algorithms.h"
 
@@ -53,16 +54,32 @@ ccnet_send_msg_to_peer (CcnetSession *session, CcnetPeer *peer,
 
     g_assert (!peer->is_self);
 
-    if (peer->net_state == PEER_CONNECTED) {
-        processor = ccnet_proc_factory_create_master_processor 
-            (factory, "send-msg", peer);
-        g_assert (processor);
-
-        ccnet_sendmsg_proc_set_msg (CCNET_SENDMSG_PROC(processor), msg);
-        /* g_signal_connect (processor, "done", */
-        /*                   G_CALLBACK(msg_cb), msg); */
-        ccnet_processor_start (processor, 0, NULL);
+    if (peer->net_state != PEER_CONNECTED)
+        return;
+
+    if (!peer->is_local && !peer->no_msg_stream) {
+        if (!peer->msg_stream) {
+            processor = ccnet_proc_factory_create_master_processor
+                (factory, "send-msg-stream", peer);
+            g_assert (processor);
+            peer->msg_stream = processor;
+            ccnet_processor_start (processor, 0, NULL);
+        }
+        if (peer->msg_stream) {
+            ccnet_sendmsg_stream_proc_send (
+                CCNET_SENDMSG_STREAM_PROC(peer->msg_stream), msg);
+            return;
+        }
     }
+
+    processor = ccnet_proc_factory_create_master_processor 
+        (factory, "send-msg", peer);
+    g_assert (processor);
+
+    ccnet_sendmsg_proc_set_msg (CCNET_SENDMSG_PROC(processor), msg);
+    /* g_signal_connect (processor, "done", */
+    /*                   G_CALLBACK(msg_cb), msg); */
+    ccnet_processor_start (processor, 0, NULL);
 }
 
 void
@@ -2,25 +2,132 @@
 
 #include "common.h"
 
+#include <pthread.h>
+#include <sys/time.h>
+
 #include <zdb.h>
 #include "ccnet-db.h"
-
-#ifdef WIN32
-#include <windows.h>
-#define sleep(n) Sleep(1000 * (n))
-#endif
-
-#define MAX_GET_CONNECTION_RETRIES 3
+#include "metrics.h"
+
+#define DEFAULT_WAIT_TIMEOUT_MSEC 3000
+#define DEFAULT_SQLITE_BUSY_TIMEOUT_MSEC 5000
+#define DEFAULT_READ_AFTER_WRITE_MSEC 5000
+#define DEFAULT_MAX_REPLICA_LAG 5           /* seconds */
+#define DEFAULT_REPLICA_RETRY_INTERVAL 30   /* seconds */
+#define REPLICA_LAG_CHECK_INTERVAL 5        /* seconds */
+
+/* Upper bounds of the latency histogram buckets, in microseconds.
+ * The last bucket counts everything slower. */
+static const gint64 latency_bounds[CCNET_DB_LATENCY_BUCKETS - 1] = {
+    100, 1000, 10000, 100000, 1000000,
+};
 
 struct CcnetDB {
     int type;
     ConnectionPool_T pool;
+
+    /* Callers wait on @cond for a free slot when @in_use reaches
+     * @max_connections, instead of failing inside the zdb pool. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int max_connections;
+    int in_use;
+    int wait_timeout;           /* msec */
+
+    /* the thread running the event loop, which never waits */
+    pthread_t main_thread;
+
+    /* SQLite only. Statements of ccnet_db_query() from worker threads
+     * are queued for the writer thread, which runs all statements
+     * queued so far in one transaction. The writer has its own native
+     * connection, so it can tell when SQLite rolls back on its own. */
+    gboolean has_writer;
+    pthread_t writer;
+    sqlite3 *writer_conn;
+    pthread_mutex_t write_lock;
+    pthread_cond_t write_cond;  /* signaled when queued */
+    pthread_cond_t done_cond;   /* signaled when a batch is done */
+    GQueue *writes;             /* of WriteRequest */
+    gboolean stop_writer;
+
+    /* MySQL and PostgreSQL only. Reads outside transactions go to a
+     * usable replica, round robin, unless the last write through this
+     * db was less than @read_after_write msec ago. Guarded by @lock. */
+    GPtrArray *replicas;        /* of Replica */
+    guint next_replica;
+    gint64 last_write;          /* usec */
+    int read_after_write;       /* msec */
+    int max_lag;                /* seconds, 0 to not check */
+    int retry_interval;         /* seconds */
+    gboolean is_replica;
+
+    CcnetDBStats stats;
 };
 
+/* Outcome of a read, to tell whether to retry it on the primary and
+ * whether the replica is to blame. */
+enum {
+    READ_OK,
+    READ_BUSY,                  /* no free connection in the pool */
+    READ_FAILED,                /* failed to connect, or SQL error */
+};
+
+typedef struct Replica {
+    CcnetDB *db;
+    gint64 down_until;          /* usec, skipped until then */
+    gint64 next_lag_check;      /* usec */
+    gboolean checking;          /* a thread is checking the lag */
+} Replica;
+
+typedef struct WriteRequest {
+    const char *sql;
+    int ret;
+    gint64 changes;             /* rows changed if ret is 0 */
+    gboolean done;
+} WriteRequest;
+
+/* for SQLite databases opened later */
+static int sqlite_busy_timeout = DEFAULT_SQLITE_BUSY_TIMEOUT_MSEC;
+static int sqlite_mmap_size;
+
+/* process wide, for all databases. Pool and query latency is kept
+ * per db in CcnetDBStats, see ccnet_db_get_stats(). */
+static CcnetCounter *replica_reads;
+static CcnetCounter *replica_fallbacks;
+static CcnetCounter *replica_busy;
+static CcnetCounter *primary_reads_after_write;
+
 struct CcnetDBRow {
     ResultSet_T res;
 };
 
+struct CcnetDBTrans {
+    CcnetDB *db;
+    Connection_T conn;
+    gint64 start;
+};
+
+static void
+init_pool_sync (CcnetDB *db)
+{
+    pthread_mutex_init (&db->lock, NULL);
+    pthread_cond_init (&db->cond, NULL);
+    db->max_connections = ConnectionPool_getMaxConnections (db->pool);
+    db->wait_timeout = DEFAULT_WAIT_TIMEOUT_MSEC;
+    db->main_thread = pthread_self ();
+    db->read_after_write = DEFAULT_READ_AFTER_WRITE_MSEC;
+    db->max_lag = DEFAULT_MAX_REPLICA_LAG;
+    db->retry_interval = DEFAULT_REPLICA_RETRY_INTERVAL;
+
+    if (!replica_reads) {
+        replica_reads = ccnet_metrics_counter ("ccnet_db_replica_reads_total");
+        replica_fallbacks = ccnet_metrics_counter ("ccnet_db_replica_fallbacks_total");
+        replica_busy = ccnet_metrics_counter ("ccnet_db_replica_busy_total");
+        primary_reads_after_write =
+            ccnet_metrics_counter ("ccnet_db_primary_reads_after_write_total");
+    }
+}
+
 CcnetDB *
 ccnet_db_new_mysql (const char *host, 
                     const char *port,
@@ -74,6 +181,7 @@ ccnet_db_new_mysql (const char *host,
 
     ConnectionPool_start (db->pool);
     db->type = CCNET_DB_TYPE_MYSQL;
+    init_pool_sync (db);
 
     return db;
 }
@@ -113,10 +221,22 @@ ccnet_db_new_pgsql (const char *host,
 
     ConnectionPool_start (db->pool);
     db->type = CCNET_DB_TYPE_PGSQL;
+    init_pool_sync (db);
 
     return db;
 }
 
+void
+ccnet_db_set_sqlite_options (int busy_timeout, int mmap_size)
+{
+    if (busy_timeout >= 0)
+        sqlite_busy_timeout = busy_timeout;
+    if (mmap_size >= 0)
+        sqlite_mmap_size = mmap_size;
+}
+
+static void *writer_thread (void *vdb);
+
 CcnetDB *
 ccnet_db_new_sqlite (const char *db_path)
 {
@@ -130,8 +250,17 @@ ccnet_db_new_sqlite (const char *db_path)
         return NULL;
     }
 
+    /* zdb runs the url parameters as pragmas on each new connection.
+     * In WAL mode readers don't block on the writer, and with
+     * synchronous=normal commits don't wait for fsync; a power loss
+     * may lose the last commits, but doesn't corrupt the db. */
     url = g_string_new ("");
-    g_string_append_printf (url, "sqlite://%s", db_path);
+    g_string_append_printf (url, "sqlite://%s?journal_mode=wal"
+                            "&synchronous=normal&busy_timeout=%d",
+                            db_path, sqlite_busy_timeout);
+    if (sqlite_mmap_size > 0)
+        g_string_append_printf (url, "&mmap_size=%"G_GINT64_FORMAT,
+                                (gint64)sqlite_mmap_size << 20);
     zdb_url = URL_new (url->str);
     db->pool = ConnectionPool_new (zdb_url);
     if (!db->pool) {
@@ -143,15 +272,142 @@ ccnet_db_new_sqlite (const char *db_path)
 
     ConnectionPool_start (db->pool);
     db->type = CCNET_DB_TYPE_SQLITE;
+    init_pool_sync (db);
+
+    pthread_mutex_init (&db->write_lock, NULL);
+    pthread_cond_init (&db->write_cond, NULL);
+    pthread_cond_init (&db->done_cond, NULL);
+    db->writes = g_queue_new ();
+    if (sqlite_open_db (db_path, &db->writer_conn) < 0) {
+        g_warning ("Failed to open db for the writer thread, write directly.\n");
+        db->writer_conn = NULL;
+    } else {
+        sqlite3_busy_timeout (db->writer_conn, sqlite_busy_timeout);
+        if (pthread_create (&db->writer, NULL, writer_thread, db) != 0) {
+            g_warning ("Failed to start db writer thread, write directly.\n");
+            sqlite_close_db (db->writer_conn);
+            db->writer_conn = NULL;
+        } else
+            db->has_writer = TRUE;
+    }
 
     return db;
 }
 
+void
+ccnet_db_set_pool_options (CcnetDB *db,
+                           int min_connections,
+                           int max_connections,
+                           int idle_timeout,
+                           int wait_timeout)
+{
+    /* Initial connections and the reaper only take effect on start. */
+    ConnectionPool_stop (db->pool);
+
+    /* zdb requires initial <= max at every step. */
+    if (max_connections > 0) {
+        if (min_connections > max_connections)
+            min_connections = max_connections;
+        if (max_connections < ConnectionPool_getInitialConnections (db->pool))
+            ConnectionPool_setInitialConnections (db->pool, max_connections);
+        ConnectionPool_setMaxConnections (db->pool, max_connections);
+    }
+    if (min_connections > 0 &&
+        min_connections <= ConnectionPool_getMaxConnections (db->pool))
+        ConnectionPool_setInitialConnections (db->pool, min_connections);
+    if (idle_timeout > 0) {
+        ConnectionPool_setConnectionTimeout (db->pool, idle_timeout);
+        ConnectionPool_setReaper (db->pool, idle_timeout);
+    }
+
+    ConnectionPool_start (db->pool);
+
+    pthread_mutex_lock (&db->lock);
+    db->max_connections = ConnectionPool_getMaxConnections (db->pool);
+    if (wait_timeout >= 0)
+        db->wait_timeout = wait_timeout;
+    pthread_mutex_unlock (&db->lock);
+
+    if (db->replicas) {
+        guint i;
+        for (i = 0; i < db->replicas->len; ++i) {
+            Replica *r = g_ptr_array_index (db->replicas, i);
+            ccnet_db_set_pool_options (r->db, min_connections, max_connections,
+                                       idle_timeout, wait_timeout);
+        }
+    }
+}
+
+void
+ccnet_db_add_replica (CcnetDB *db, CcnetDB *replica)
+{
+    Replica *r;
+
+    if (db->type == CCNET_DB_TYPE_SQLITE) {
+        g_warning ("SQLite databases have no replicas.\n");
+        ccnet_db_free (replica);
+        return;
+    }
+
+    r = g_new0 (Replica, 1);
+    r->db = replica;
+    replica->is_replica = TRUE;
+
+    pthread_mutex_lock (&db->lock);
+    if (!db->replicas)
+        db->replicas = g_ptr_array_new ();
+    g_ptr_array_add (db->replicas, r);
+    pthread_mutex_unlock (&db->lock);
+}
+
+void
+ccnet_db_set_replica_options (CcnetDB *db,
+                              int read_after_write,
+                              int max_lag,
+                              int retry_interval)
+{
+    pthread_mutex_lock (&db->lock);
+    if (read_after_write >= 0)
+        db->read_after_write = read_after_write;
+    if (max_lag >= 0)
+        db->max_lag = max_lag;
+    if (retry_interval >= 0)
+        db->retry_interval = retry_interval;
+    pthread_mutex_unlock (&db->lock);
+}
+
 void
 ccnet_db_free (CcnetDB *db)
 {
+    if (db->has_writer) {
+        pthread_mutex_lock (&db->write_lock);
+        db->stop_writer = TRUE;
+        pthread_cond_signal (&db->write_cond);
+        pthread_mutex_unlock (&db->write_lock);
+        pthread_join (db->writer, NULL);
+        sqlite_close_db (db->writer_conn);
+    }
+    if (db->writes) {
+        g_queue_free (db->writes);
+        pthread_mutex_destroy (&db->write_lock);
+        pthread_cond_destroy (&db->write_cond);
+        pthread_cond_destroy (&db->done_cond);
+    }
+
+    if (db->replicas) {
+        guint i;
+        for (i = 0; i < db->replicas->len; ++i) {
+            Replica *r = g_ptr_array_index (db->replicas, i);
+            ccnet_db_free (r->db);
+            g_free (r);
+        }
+        g_ptr_array_free (db->replicas, TRUE);
+    }
+
     ConnectionPool_stop (db->pool);
     ConnectionPool_free (&db->pool);
+    pthread_mutex_destroy (&db->lock);
+    pthread_cond_destroy (&db->cond);
     g_free (db);
 }
 
@@ -161,48 +417,314 @@ ccnet_db_type (CcnetDB *db)
     return db->type;
 }
 
+static gint64
+now_usec ()
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return (gint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+histogram_add (CcnetDBHistogram *h, gint64 usec)
+{
+    int i;
+
+    for (i = 0; i < CCNET_DB_LATENCY_BUCKETS - 1; ++i)
+        if (usec < latency_bounds[i])
+            break;
+    h->buckets[i]++;
+    h->count++;
+    h->sum_usec += usec;
+}
+
+/*
+ * Take a connection from the pool. When all connections are in use,
+ * callers that @may_wait wait up to db->wait_timeout msec for one to
+ * be released; others fail right away. *@pool_full, if given, tells
+ * that apart from failing to connect, and silences the warning.
+ * Returns NULL on failure.
+ */
 static Connection_T
-get_db_connection (CcnetDB *db)
+acquire_connection (CcnetDB *db, gint64 *acquired,
+                    gboolean may_wait, gboolean *pool_full)
 {
     Connection_T conn;
-    int retries = 0;
+    gint64 start = now_usec ();
+    struct timespec deadline = { 0, 0 };
+    int rc = 0;
 
-    conn = ConnectionPool_getConnection (db->pool);
-    /* If max_connections of the pool has been reached, retry 3 times
-     * and then return NULL.
-     */
-    while (!conn) {
-        if (retries++ == MAX_GET_CONNECTION_RETRIES) {
+    if (pool_full)
+        *pool_full = FALSE;
+
+    if (may_wait) {
+        gint64 end = start + (gint64)db->wait_timeout * 1000;
+        deadline.tv_sec = end / 1000000;
+        deadline.tv_nsec = (end % 1000000) * 1000;
+    }
+
+    pthread_mutex_lock (&db->lock);
+    while (db->in_use >= db->max_connections && may_wait && rc == 0)
+        rc = pthread_cond_timedwait (&db->cond, &db->lock, &deadline);
+
+    if (db->in_use >= db->max_connections) {
+        db->stats.wait_timeouts++;
+        pthread_mutex_unlock (&db->lock);
+        if (pool_full)
+            *pool_full = TRUE;
+        else
             g_warning ("Too many concurrent connections. "
-                       "Failed to create new connection.\n");
-            goto out;
-        }
-        sleep (1);
-        conn = ConnectionPool_getConnection (db->pool);
+                       "Failed to get db connection.\n");
+        return NULL;
     }
+    db->in_use++;
+    *acquired = now_usec ();
+    histogram_add (&db->stats.pool_wait, *acquired - start);
+    pthread_mutex_unlock (&db->lock);
 
-    if (!conn)
+    conn = ConnectionPool_getConnection (db->pool);
+    if (!conn) {
         g_warning ("Failed to create new connection.\n");
+        pthread_mutex_lock (&db->lock);
+        db->in_use--;
+        pthread_cond_signal (&db->cond);
+        pthread_mutex_unlock (&db->lock);
+    }
 
-out:
     return conn;
 }
 
-int
-ccnet_db_query (CcnetDB *db, const char *sql)
+/* Worker threads wait for a free connection. The event loop thread
+ * never waits, so the daemon doesn't freeze. */
+static Connection_T
+get_db_connection (CcnetDB *db, gint64 *acquired)
+{
+    gboolean may_wait = !pthread_equal (pthread_self (), db->main_thread);
+
+    return acquire_connection (db, acquired, may_wait, NULL);
+}
+
+static void
+release_db_connection (CcnetDB *db, Connection_T conn, gint64 acquired)
+{
+    gint64 elapsed;
+
+    Connection_close (conn);
+    elapsed = now_usec () - acquired;
+
+    pthread_mutex_lock (&db->lock);
+    db->in_use--;
+    histogram_add (&db->stats.query, elapsed);
+    pthread_cond_signal (&db->cond);
+    pthread_mutex_unlock (&db->lock);
+}
+
+void
+ccnet_db_get_stats (CcnetDB *db, CcnetDBStats *stats)
+{
+    pthread_mutex_lock (&db->lock);
+    *stats = db->stats;
+    stats->in_use = db->in_use;
+    stats->max_connections = db->max_connections;
+    pthread_mutex_unlock (&db->lock);
+}
+
+static void
+format_histogram (GString *buf, const char *name, CcnetDBHistogram *h)
+{
+    int i;
+
+    g_string_append_printf (buf, "%s_count %"G_GUINT64_FORMAT"\n",
+                            name, h->count);
+    g_string_append_printf (buf, "%s_sum_usec %"G_GUINT64_FORMAT"\n",
+                            name, h->sum_usec);
+    for (i = 0; i < CCNET_DB_LATENCY_BUCKETS; ++i) {
+        if (i < CCNET_DB_LATENCY_BUCKETS - 1)
+            g_string_append_printf (buf, "%s_bucket{le_usec=\"%"G_GINT64_FORMAT"\"}",
+                                    name, latency_bounds[i]);
+        else
+            g_string_append_printf (buf, "%s_bucket{le_usec=\"+Inf\"}", name);
+        g_string_append_printf (buf, " %"G_GUINT64_FORMAT"\n", h->buckets[i]);
+    }
+}
+
+char *
+ccnet_db_format_stats (CcnetDB *db)
+{
+    CcnetDBStats stats;
+    GString *buf = g_string_new (NULL);
+
+    ccnet_db_get_stats (db, &stats);
+
+    g_string_append_printf (buf, "db_pool_in_use %d\n", stats.in_use);
+    g_string_append_printf (buf, "db_pool_max %d\n", stats.max_connections);
+    g_string_append_printf (buf, "db_pool_wait_timeouts %"G_GUINT64_FORMAT"\n",
+                            stats.wait_timeouts);
+    format_histogram (buf, "db_pool_wait", &stats.pool_wait);
+    format_histogram (buf, "db_query", &stats.query);
+
+    return g_string_free (buf, FALSE);
+}
+
+static int
+writer_exec (sqlite3 *conn, const char *sql)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec (conn, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        g_warning ("Error exec query %s: %s.\n", sql,
+                   errmsg ? errmsg : sqlite3_errmsg (conn));
+        sqlite3_free (errmsg);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+fail_requests (GList *from, GList *to)
+{
+    GList *ptr;
+
+    for (ptr = from; ptr != to; ptr = ptr->next)
+        ((WriteRequest *)ptr->data)->ret = -1;
+}
+
+/*
+ * Run a batch of queued statements, in one transaction if more than
+ * one. A failed statement only fails its own request, unless SQLite
+ * rolled back the whole transaction, which it does on errors such as
+ * SQLITE_FULL, SQLITE_IOERR or SQLITE_BUSY. Then the statements before
+ * it fail too, and the rest run on their own.
+ */
+static void
+run_write_batch (CcnetDB *db, GQueue *batch)
+{
+    sqlite3 *conn = db->writer_conn;
+    WriteRequest *req;
+    gboolean in_trans = g_queue_get_length (batch) > 1;
+    gint64 start = now_usec ();
+    GList *ptr;
+
+    if (in_trans && writer_exec (conn, "BEGIN") < 0)
+        in_trans = FALSE;
+
+    for (ptr = batch->head; ptr; ptr = ptr->next) {
+        req = ptr->data;
+        req->ret = writer_exec (conn, req->sql);
+        if (req->ret == 0)
+            req->changes = sqlite3_changes (conn);
+
+        if (in_trans && sqlite3_get_autocommit (conn)) {
+            g_warning ("Transaction rolled back, %u statements lost.\n",
+                       g_list_position (batch->head, ptr) + 1);
+            fail_requests (batch->head, ptr->next);
+            in_trans = FALSE;
+        }
+    }
+
+    if (in_trans && writer_exec (conn, "COMMIT") < 0) {
+        /* Still open if the commit was only busy. */
+        if (!sqlite3_get_autocommit (conn))
+            writer_exec (conn, "ROLLBACK");
+        fail_requests (batch->head, NULL);
+    }
+
+    pthread_mutex_lock (&db->lock);
+    histogram_add (&db->stats.query, now_usec () - start);
+    pthread_mutex_unlock (&db->lock);
+}
+
+static void *
+writer_thread (void *vdb)
+{
+    CcnetDB *db = vdb;
+    GQueue *batch;
+    GList *ptr;
+
+    pthread_mutex_lock (&db->write_lock);
+    while (1) {
+        while (g_queue_is_empty (db->writes) && !db->stop_writer)
+            pthread_cond_wait (&db->write_cond, &db->write_lock);
+        if (g_queue_is_empty (db->writes))
+            break;
+
+        /* Statements queued while this batch runs go in the next. */
+        batch = db->writes;
+        db->writes = g_queue_new ();
+        pthread_mutex_unlock (&db->write_lock);
+
+        run_write_batch (db, batch);
+
+        pthread_mutex_lock (&db->write_lock);
+        for (ptr = batch->head; ptr; ptr = ptr->next)
+            ((WriteRequest *)ptr->data)->done = TRUE;
+        pthread_cond_broadcast (&db->done_cond);
+        g_queue_free (batch);
+    }
+    pthread_mutex_unlock (&db->write_lock);
+
+    return NULL;
+}
+
+static int
+queue_write (CcnetDB *db, const char *sql, gint64 *changes)
+{
+    WriteRequest req;
+
+    req.sql = sql;
+    req.ret = -1;
+    req.changes = 0;
+    req.done = FALSE;
+
+    pthread_mutex_lock (&db->write_lock);
+    g_queue_push_tail (db->writes, &req);
+    pthread_cond_signal (&db->write_cond);
+    while (!req.done)
+        pthread_cond_wait (&db->done_cond, &db->write_lock);
+    pthread_mutex_unlock (&db->write_lock);
+
+    *changes = req.changes;
+    return req.ret;
+}
+
+/* Reads started after this see the write, see pick_replica(). */
+static void
+note_write (CcnetDB *db)
+{
+    if (!db->replicas)
+        return;
+
+    pthread_mutex_lock (&db->lock);
+    db->last_write = now_usec ();
+    pthread_mutex_unlock (&db->lock);
+}
+
+static int
+exec_query (CcnetDB *db, const char *sql, gint64 *changes)
 {
-    Connection_T conn = get_db_connection (db);
+    gint64 start;
+    Connection_T conn;
+
+    /* The event loop doesn't wait for the writer. */
+    if (db->has_writer && !pthread_equal (pthread_self (), db->main_thread))
+        return queue_write (db, sql, changes);
+
+    conn = get_db_connection (db, &start);
     if (!conn)
         return -1;
 
     /* Handle zdb "exception"s. */
     TRY
         Connection_execute (conn, "%s", sql);
-        Connection_close (conn);
+        *changes = Connection_rowsChanged (conn);
+        release_db_connection (db, conn, start);
+        note_write (db);
         RETURN (0);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        note_write (db);
         return -1;
     END_TRY;
 
@@ -210,23 +732,209 @@ ccnet_db_query (CcnetDB *db, const char *sql)
     return 0;
 }
 
-gboolean
-ccnet_db_check_for_existence (CcnetDB *db, const char *sql)
+int
+ccnet_db_query (CcnetDB *db, const char *sql)
+{
+    gint64 changes;
+
+    return exec_query (db, sql, &changes);
+}
+
+gint64
+ccnet_db_query_changes (CcnetDB *db, const char *sql)
+{
+    gint64 changes = 0;
+
+    if (exec_query (db, sql, &changes) < 0)
+        return -1;
+    return changes;
+}
+
+#define LAG_FAILED -1
+#define LAG_BUSY -2
+
+/*
+ * Seconds the replica is behind its primary, LAG_FAILED on error or
+ * LAG_BUSY if all its connections are in use.
+ *
+ * A MySQL server that is no replica has no slave status and is taken
+ * as up to date. On PostgreSQL, a replica that has replayed all it
+ * received is up to date, however old its last transaction.
+ */
+static int
+get_replica_lag (CcnetDB *replica)
+{
+    Connection_T conn;
+    gint64 start;
+    ResultSet_T result;
+    const char *s;
+    gboolean pool_full;
+    int lag = 0;
+
+    conn = acquire_connection (replica, &start, FALSE, &pool_full);
+    if (!conn)
+        return pool_full ? LAG_BUSY : LAG_FAILED;
+
+    TRY
+        if (replica->type == CCNET_DB_TYPE_MYSQL) {
+            result = Connection_executeQuery (conn, "SHOW SLAVE STATUS");
+            if (ResultSet_next (result)) {
+                /* NULL when replication is stopped */
+                s = ResultSet_getStringByName (result, "Seconds_Behind_Master");
+                lag = s ? atoi (s) : LAG_FAILED;
+            }
+        } else {
+            result = Connection_executeQuery (conn,
+                "SELECT CASE WHEN pg_last_wal_receive_lsn() = "
+                "pg_last_wal_replay_lsn() THEN 0 ELSE CAST(COALESCE("
+                "EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()),"
+                " 0) AS INTEGER) END");
+            if (ResultSet_next (result))
+                lag = ResultSet_getInt (result, 1);
+        }
+    CATCH (SQLException)
+        g_warning ("Failed to get replica lag: %s.\n", Exception_frame.message);
+        lag = LAG_FAILED;
+    END_TRY;
+
+    release_db_connection (replica, conn, start);
+    return lag;
+}
+
+/* Skip @r for a while. Reads fall back to the primary meanwhile. */
+static void
+mark_replica_down (CcnetDB *db, Replica *r)
+{
+    pthread_mutex_lock (&db->lock);
+    r->down_until = now_usec () + (gint64)db->retry_interval * 1000000;
+    pthread_mutex_unlock (&db->lock);
+}
+
+/*
+ * Pick the replica for the next read, NULL to read from the primary.
+ * A replica due for a lag check is checked first, by a worker thread;
+ * the event loop uses the result of the last check.
+ */
+static Replica *
+pick_replica (CcnetDB *db)
+{
+    Replica *r;
+    gint64 now;
+    gboolean check;
+    guint i, n, tries;
+    int max_lag, lag;
+
+    if (!db->replicas)
+        return NULL;
+
+    for (tries = 0; tries < db->replicas->len; ++tries) {
+        r = NULL;
+        now = now_usec ();
+
+        pthread_mutex_lock (&db->lock);
+        if (now - db->last_write < (gint64)db->read_after_write * 1000) {
+            pthread_mutex_unlock (&db->lock);
+            ccnet_counter_inc (primary_reads_after_write);
+            return NULL;
+        }
+        n = db->replicas->len;
+        for (i = 0; i < n; ++i) {
+            Replica *p = g_ptr_array_index (db->replicas,
+                                            (db->next_replica + i) % n);
+            if (p->down_until <= now) {
+                r = p;
+                db->next_replica = (db->next_replica + i + 1) % n;
+                break;
+            }
+        }
+        if (!r) {
+            pthread_mutex_unlock (&db->lock);
+            return NULL;
+        }
+        max_lag = db->max_lag;
+        check = max_lag > 0 && !r->checking && r->next_lag_check <= now &&
+            !pthread_equal (pthread_self (), db->main_thread);
+        if (check)
+            r->checking = TRUE;
+        pthread_mutex_unlock (&db->lock);
+
+        if (!check)
+            return r;
+
+        lag = get_replica_lag (r->db);
+
+        pthread_mutex_lock (&db->lock);
+        r->checking = FALSE;
+        /* A busy replica is checked again on the next read. */
+        if (lag != LAG_BUSY)
+            r->next_lag_check = now_usec () + REPLICA_LAG_CHECK_INTERVAL * 1000000LL;
+        pthread_mutex_unlock (&db->lock);
+
+        if (lag >= 0 && lag <= max_lag)
+            return r;
+        if (lag == LAG_BUSY) {
+            ccnet_counter_inc (replica_busy);
+            return NULL;
+        }
+
+        if (lag > max_lag)
+            g_message ("DB replica is %d seconds behind, skip it.\n", lag);
+        mark_replica_down (db, r);
+    }
+
+    return NULL;
+}
+
+/* Called when a read from @r didn't succeed and is retried on the
+ * primary. Only a failure takes the replica out of rotation; a full
+ * pool just sends this one read to the primary. */
+static void
+replica_failed (CcnetDB *db, Replica *r, int status)
+{
+    ccnet_counter_inc (replica_fallbacks);
+    if (status == READ_BUSY) {
+        ccnet_counter_inc (replica_busy);
+        return;
+    }
+    g_message ("Read from DB replica failed, fall back to primary.\n");
+    mark_replica_down (db, r);
+}
+
+/* Replicas don't make readers wait: when all their connections are
+ * in use, the read goes to the primary instead. */
+static Connection_T
+get_read_connection (CcnetDB *db, gint64 *acquired, int *status)
+{
+    gboolean pool_full = FALSE;
+    Connection_T conn;
+
+    if (db->is_replica)
+        conn = acquire_connection (db, acquired, FALSE, &pool_full);
+    else
+        conn = get_db_connection (db, acquired);
+    if (!conn)
+        *status = pool_full ? READ_BUSY : READ_FAILED;
+    return conn;
+}
+
+static gboolean
+check_for_existence (CcnetDB *db, const char *sql, int *status)
 {
     Connection_T conn;
+    gint64 start;
     ResultSet_T result;
     gboolean ret = TRUE;
 
-    conn = get_db_connection (db);
-    if (!conn) {
+    conn = get_read_connection (db, &start, status);
+    if (!conn)
         return FALSE;
-    }
 
     TRY
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return FALSE;
     END_TRY;
 
@@ -235,51 +943,120 @@ ccnet_db_check_for_existence (CcnetDB *db, const char *sql)
             ret = FALSE;
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return FALSE;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn, start);
 
     return ret;
 }
 
-int
-ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql, 
-                               CcnetDBRowFunc callback, void *data)
+gboolean
+ccnet_db_check_for_existence (CcnetDB *db, const char *sql)
+{
+    Replica *r = pick_replica (db);
+    int status = READ_OK;
+    gboolean ret;
+
+    if (r) {
+        ccnet_counter_inc (replica_reads);
+        ret = check_for_existence (r->db, sql, &status);
+        if (status == READ_OK)
+            return ret;
+        replica_failed (db, r, status);
+    }
+
+    return check_for_existence (db, sql, &status);
+}
+
+/* *@n_rows is the number of rows passed to @callback, also on error. */
+static int
+foreach_selected_row_on_conn (Connection_T conn, const char *sql,
+                              CcnetDBRowFunc callback, void *data,
+                              int *n_rows)
 {
-    Connection_T conn;
     ResultSet_T result;
     CcnetDBRow ccnet_row;
-    int n_rows = 0;
 
-    conn = get_db_connection (db);
-    if (!conn)
-        return -1;
+    *n_rows = 0;
 
     TRY
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
         return -1;
     END_TRY;
 
     ccnet_row.res = result;
     TRY
         while (ResultSet_next (result)) {
-            n_rows++;
+            (*n_rows)++;
             if (!callback (&ccnet_row, data))
                 break;
         }
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
         return -1;
     END_TRY;
 
-    Connection_close (conn);
-    return n_rows;
+    return *n_rows;
+}
+
+static int
+foreach_selected_row (CcnetDB *db, const char *sql,
+                      CcnetDBRowFunc callback, void *data,
+                      int *n_rows, int *status)
+{
+    Connection_T conn;
+    gint64 start;
+    int ret;
+
+    *n_rows = 0;
+
+    conn = get_read_connection (db, &start, status);
+    if (!conn)
+        return -1;
+
+    ret = foreach_selected_row_on_conn (conn, sql, callback, data, n_rows);
+    if (ret < 0)
+        *status = READ_FAILED;
+
+    release_db_connection (db, conn, start);
+    return ret;
+}
+
+int
+ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql, 
+                               CcnetDBRowFunc callback, void *data)
+{
+    Replica *r = pick_replica (db);
+    int status = READ_OK;
+    int n_rows;
+    int ret;
+
+    if (r) {
+        ccnet_counter_inc (replica_reads);
+        ret = foreach_selected_row (r->db, sql, callback, data,
+                                    &n_rows, &status);
+        /* Rows already passed to the callback can't be taken back. */
+        if (status == READ_OK || n_rows > 0)
+            return ret;
+        replica_failed (db, r, status);
+    }
+
+    return foreach_selected_row (db, sql, callback, data, &n_rows, &status);
+}
+
+int
+ccnet_db_foreach_selected_row_primary (CcnetDB *db, const char *sql,
+                                       CcnetDBRowFunc callback, void *data)
+{
+    int status = READ_OK;
+    int n_rows;
+
+    return foreach_selected_row (db, sql, callback, data, &n_rows, &status);
 }
 
 const char *
@@ -306,15 +1083,27 @@ ccnet_db_row_get_column_int64 (CcnetDBRow *row, guint32 idx)
     return ResultSet_getLLong (row->res, idx+1);
 }
 
-int
-ccnet_db_get_int (CcnetDB *db, const char *sql)
+gboolean
+ccnet_db_collect_string_set (CcnetDBRow *row, void *data)
+{
+    GHashTable *set = data;
+    const char *str = ccnet_db_row_get_column_text (row, 0);
+
+    if (str)
+        g_hash_table_insert (set, g_strdup(str), GINT_TO_POINTER(1));
+    return TRUE;
+}
+
+static int
+get_int (CcnetDB *db, const char *sql, int *status)
 {
     int ret = -1;
     Connection_T conn;
+    gint64 start;
     ResultSet_T result;
     CcnetDBRow ccnet_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db, &start, status);
     if (!conn)
         return -1;
 
@@ -322,7 +1111,8 @@ ccnet_db_get_int (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return -1;
     END_TRY;
 
@@ -333,23 +1123,43 @@ ccnet_db_get_int (CcnetDB *db, const char *sql)
             ret = ccnet_db_row_get_column_int (&ccnet_row, 0);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return -1;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn, start);
     return ret;
 }
 
-gint64
-ccnet_db_get_int64 (CcnetDB *db, const char *sql)
+int
+ccnet_db_get_int (CcnetDB *db, const char *sql)
+{
+    Replica *r = pick_replica (db);
+    int status = READ_OK;
+    int ret;
+
+    if (r) {
+        ccnet_counter_inc (replica_reads);
+        ret = get_int (r->db, sql, &status);
+        if (status == READ_OK)
+            return ret;
+        replica_failed (db, r, status);
+    }
+
+    return get_int (db, sql, &status);
+}
+
+static gint64
+get_int64 (CcnetDB *db, const char *sql, int *status)
 {
     gint64 ret = -1;
     Connection_T conn;
+    gint64 start;
     ResultSet_T result;
     CcnetDBRow ccnet_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db, &start, status);
     if (!conn)
         return -1;
 
@@ -357,7 +1167,8 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return -1;
     END_TRY;
 
@@ -368,24 +1179,44 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql)
             ret = ccnet_db_row_get_column_int64 (&ccnet_row, 0);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return -1;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn, start);
     return ret;
 }
 
-char *
-ccnet_db_get_string (CcnetDB *db, const char *sql)
+gint64
+ccnet_db_get_int64 (CcnetDB *db, const char *sql)
+{
+    Replica *r = pick_replica (db);
+    int status = READ_OK;
+    gint64 ret;
+
+    if (r) {
+        ccnet_counter_inc (replica_reads);
+        ret = get_int64 (r->db, sql, &status);
+        if (status == READ_OK)
+            return ret;
+        replica_failed (db, r, status);
+    }
+
+    return get_int64 (db, sql, &status);
+}
+
+static char *
+get_string (CcnetDB *db, const char *sql, int *status)
 {
     char *ret = NULL;
     const char *s;
     Connection_T conn;
+    gint64 start;
     ResultSet_T result;
     CcnetDBRow ccnet_row;
 
-    conn = get_db_connection (db);
+    conn = get_read_connection (db, &start, status);
     if (!conn)
         return NULL;
 
@@ -393,7 +1224,8 @@ ccnet_db_get_string (CcnetDB *db, const char *sql)
         result = Connection_executeQuery (conn, "%s", sql);
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return NULL;
     END_TRY;
 
@@ -406,14 +1238,130 @@ ccnet_db_get_string (CcnetDB *db, const char *sql)
         }
     CATCH (SQLException)
         g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
-        Connection_close (conn);
+        release_db_connection (db, conn, start);
+        *status = READ_FAILED;
         return NULL;
     END_TRY;
 
-    Connection_close (conn);
+    release_db_connection (db, conn, start);
     return ret;
 }
 
+char *
+ccnet_db_get_string (CcnetDB *db, const char *sql)
+{
+    Replica *r = pick_replica (db);
+    int status = READ_OK;
+    char *ret;
+
+    if (r) {
+        ccnet_counter_inc (replica_reads);
+        ret = get_string (r->db, sql, &status);
+        if (status == READ_OK)
+            return ret;
+        replica_failed (db, r, status);
+    }
+
+    return get_string (db, sql, &status);
+}
+
+CcnetDBTrans *
+ccnet_db_begin (CcnetDB *db)
+{
+    CcnetDBTrans *trans;
+    Connection_T conn;
+    gint64 start;
+
+    conn = get_db_connection (db, &start);
+    if (!conn)
+        return NULL;
+
+    /* A deferred BEGIN on SQLite takes a read snapshot first. The batch
+     * transactions SELECT before they INSERT, and if the writer thread
+     * commits in between, upgrading that snapshot fails at once with
+     * SQLITE_BUSY_SNAPSHOT, which busy_timeout doesn't retry. BEGIN
+     * IMMEDIATE takes the write lock up front and waits for it instead.
+     * zdb doesn't know about this transaction, see ccnet_db_rollback(). */
+    TRY
+        if (db->type == CCNET_DB_TYPE_SQLITE)
+            Connection_execute (conn, "BEGIN IMMEDIATE");
+        else
+            Connection_beginTransaction (conn);
+    CATCH (SQLException)
+        g_warning ("Failed to begin transaction: %s.\n", Exception_frame.message);
+        release_db_connection (db, conn, start);
+        return NULL;
+    END_TRY;
+
+    trans = g_new0 (CcnetDBTrans, 1);
+    trans->db = db;
+    trans->conn = conn;
+    trans->start = start;
+
+    return trans;
+}
+
+int
+ccnet_db_trans_query (CcnetDBTrans *trans, const char *sql)
+{
+    TRY
+        Connection_execute (trans->conn, "%s", sql);
+    CATCH (SQLException)
+        g_warning ("Error exec query %s: %s.\n", sql, Exception_frame.message);
+        return -1;
+    END_TRY;
+
+    return 0;
+}
+
+int
+ccnet_db_trans_foreach_selected_row (CcnetDBTrans *trans, const char *sql,
+                                     CcnetDBRowFunc callback, void *data)
+{
+    int n_rows;
+
+    return foreach_selected_row_on_conn (trans->conn, sql, callback, data,
+                                         &n_rows);
+}
+
+static void
+trans_free (CcnetDBTrans *trans)
+{
+    release_db_connection (trans->db, trans->conn, trans->start);
+    g_free (trans);
+}
+
+int
+ccnet_db_commit (CcnetDBTrans *trans)
+{
+    TRY
+        Connection_commit (trans->conn);
+    CATCH (SQLException)
+        g_warning ("Failed to commit transaction: %s.\n", Exception_frame.message);
+        ccnet_db_rollback (trans);
+        return -1;
+    END_TRY;
+
+    note_write (trans->db);
+    trans_free (trans);
+    return 0;
+}
+
+void
+ccnet_db_rollback (CcnetDBTrans *trans)
+{
+    /* zdb only clears pending result sets itself for transactions it
+     * started, which SQLite ones aren't. */
+    TRY
+        Connection_clear (trans->conn);
+        Connection_rollback (trans->conn);
+    CATCH (SQLException)
+        g_warning ("Failed to rollback transaction: %s.\n", Exception_frame.message);
+    END_TRY;
+
+    trans_free (trans);
+}
+
 gboolean
 pgsql_index_exists (CcnetDB *db, const char *index_name)
 {
@@ -20,9 +20,26 @@ enum {
 
 typedef struct CcnetDB CcnetDB;
 typedef struct CcnetDBRow CcnetDBRow;
+typedef struct CcnetDBTrans CcnetDBTrans;
 
 typedef gboolean (*CcnetDBRowFunc) (CcnetDBRow *, void *);
 
+#define CCNET_DB_LATENCY_BUCKETS 6
+
+typedef struct CcnetDBHistogram {
+    guint64 buckets[CCNET_DB_LATENCY_BUCKETS];
+    guint64 count;
+    guint64 sum_usec;
+} CcnetDBHistogram;
+
+typedef struct CcnetDBStats {
+    int              in_use;
+    int              max_connections;
+    guint64          wait_timeouts;
+    CcnetDBHistogram pool_wait;  /* time spent waiting for a connection */
+    CcnetDBHistogram query;      /* time a connection is held */
+} CcnetDBStats;
+
 CcnetDB *
 ccnet_db_new_mysql (const char *host,
                     const char *port,
@@ -40,18 +57,80 @@ ccnet_db_new_pgsql (const char *host,
                     const char *db,
                     const char *unix_socket);
 
+/*
+ * SQLite databases are opened in WAL mode. ccnet_db_query() calls
+ * from worker threads are committed by a writer thread, in batches.
+ */
 CcnetDB *
 ccnet_db_new_sqlite (const char *db_path);
 
+/*
+ * Settings for SQLite databases opened afterwards. @busy_timeout is
+ * how long to wait for a locked db, in milliseconds; @mmap_size is
+ * in MB, 0 to not map the db. Negative values keep the current one.
+ */
+void
+ccnet_db_set_sqlite_options (int busy_timeout, int mmap_size);
+
+/*
+ * Configure the connection pool. Sizes and @idle_timeout (seconds)
+ * <= 0 and a negative @wait_timeout keep the current setting.
+ * @wait_timeout is how long a worker thread waits for a free
+ * connection, in milliseconds. Call before the db is used.
+ */
+void
+ccnet_db_set_pool_options (CcnetDB *db,
+                           int min_connections,
+                           int max_connections,
+                           int idle_timeout,
+                           int wait_timeout);
+
+/*
+ * Add a read replica of a MySQL or PostgreSQL db; @db takes ownership.
+ * Reads outside transactions then go to the replicas, round robin,
+ * except within a while of a write through @db, so callers see their
+ * own writes. Pool options set on @db apply to the replicas too.
+ */
+void
+ccnet_db_add_replica (CcnetDB *db, CcnetDB *replica);
+
+/*
+ * Reads go to the primary for @read_after_write msec after any write
+ * through @db, so a db written every few seconds rarely reads from its
+ * replicas. A replica more than @max_lag seconds behind, or that fails
+ * a read, is skipped for @retry_interval seconds; reads fall back to
+ * the primary meanwhile. A replica with no free connection only sends
+ * that read to the primary. Keep @max_lag within @read_after_write.
+ * @max_lag 0 disables the lag check; negative values keep the current
+ * setting.
+ */
+void
+ccnet_db_set_replica_options (CcnetDB *db,
+                              int read_after_write,
+                              int max_lag,
+                              int retry_interval);
+
 void
 ccnet_db_free (CcnetDB *db);
 
+void
+ccnet_db_get_stats (CcnetDB *db, CcnetDBStats *stats);
+
+/* Pool and query latency stats, one "name value" pair per line. */
+char *
+ccnet_db_format_stats (CcnetDB *db);
+
 int
 ccnet_db_type (CcnetDB *db);
 
 int
 ccnet_db_query (CcnetDB *db, const char *sql);
 
+/* Like ccnet_db_query(), but returns the number of rows the statement
+ * changed, or -1 on error. */
+gint64
+ccnet_db_query_changes (CcnetDB *db, const char *sql);
+
 gboolean
 ccnet_db_check_for_existence (CcnetDB *db, const char *sql);
 
@@ -59,6 +138,12 @@ int
 ccnet_db_foreach_selected_row (CcnetDB *db, const char *sql,
                                CcnetDBRowFunc callback, void *data);
 
+/* Always reads the primary. Use it to load in-memory indexes and
+ * caches, which must not be filled from a replica that is behind. */
+int
+ccnet_db_foreach_selected_row_primary (CcnetDB *db, const char *sql,
+                                       CcnetDBRowFunc callback, void *data);
+
 const char *
 ccnet_db_row_get_column_text (CcnetDBRow *row, guint32 idx);
 
@@ -77,6 +162,35 @@ ccnet_db_get_int64 (CcnetDB *db, const char *sql);
 char *
 ccnet_db_get_string (CcnetDB *db, const char *sql);
 
+/*
+ * Transactions. ccnet_db_begin() holds a pool connection until the
+ * transaction is committed or rolled back; both free @trans. A failed
+ * commit is rolled back.
+ */
+CcnetDBTrans *
+ccnet_db_begin (CcnetDB *db);
+
+int
+ccnet_db_trans_query (CcnetDBTrans *trans, const char *sql);
+
+int
+ccnet_db_trans_foreach_selected_row (CcnetDBTrans *trans, const char *sql,
+                                     CcnetDBRowFunc callback, void *data);
+
+int
+ccnet_db_commit (CcnetDBTrans *trans);
+
+void
+ccnet_db_rollback (CcnetDBTrans *trans);
+
+/* Max number of rows in one multi-row INSERT. */
+#define CCNET_DB_BATCH_INSERT_ROWS 200
+
+/* Row callback adding the text of column 0 to @data, a GHashTable
+ * used as a set whose keys are freed with g_free(). */
+gboolean
+ccnet_db_collect_string_set (CcnetDBRow *row, void *data);
+
 gboolean
 pgsql_index_exists (CcnetDB *db, const char *index_name);
 
@@ -91,6 +205,7 @@ pgsql_index_exists (CcnetDB *db, const char *index_name);
 #define ccnet_db_end_transaction sqlite_end_transaction
 #define ccnet_db_check_for_existence sqlite_check_for_existence
 #define ccnet_db_foreach_selected_row sqlite_foreach_selected_row
+#define ccnet_db_foreach_selected_row_primary sqlite_foreach_selected_row
 #define ccnet_db_row_get_column_text  sqlite3_column_text
 #define ccnet_db_row_get_column_int   sqlite3_column_int
 #define ccnet_db_row_get_column_int64 sqlite3_column_int64
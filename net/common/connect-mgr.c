@@ -16,11 +16,15 @@
 #include "connect-mgr.h"
 #include "message-manager.h"
 #include "proc-factory.h"
+#include "reconnect-backoff.h"
 
 
 #define MAX_RECONNECTIONS_PER_PULSE  5
 #define LISTEN_INTERVAL 1000        /* 1s */
-#define RECONNECT_PERIOD_MSEC             10000
+#define RECONNECT_PERIOD_MSEC             1000
+
+/* Max number of outgoing connects and handshakes in progress. */
+#define MAX_CONCURRENT_CONNECTS      32
 
 
 #define DEBUG_FLAG CCNET_DEBUG_CONNECTION
@@ -194,6 +198,14 @@ static void set_peer_address_from_socket(CcnetPeer *peer, CcnetPacketIO *io)
     peer->addr_str = strdup(p);
 }
 
+static void
+clear_in_connection (CcnetConnManager *manager, CcnetPeer *peer)
+{
+    if (peer->in_connection && manager->n_connecting > 0)
+        manager->n_connecting--;
+    peer->in_connection = 0;
+}
+
 static void
 myHandshakeDoneCB (CcnetHandshake *handshake,
                    CcnetPacketIO  *io,
@@ -232,13 +244,13 @@ myHandshakeDoneCB (CcnetHandshake *handshake,
         ccnet_packet_io_free (io);
 
         peer->num_fails++;
-        peer->in_connection = 0;
+        clear_in_connection (manager, peer);
         return;
     }
 
     if (!ccnet_packet_io_is_incoming (io)) {
         peer = handshake->peer;
-        peer->in_connection = 0;
+        clear_in_connection (manager, peer);
         
         if (peer->to_resolve) {
             if (!peer_id_valid(peer_id)) {
@@ -288,6 +300,8 @@ myHandshakeDoneCB (CcnetHandshake *handshake,
     ccnet_message ("[Conn] Peer %s (%.10s) connected\n",
                    peer->name, peer->id);
     peer->num_fails = 0;
+    peer->next_reconnect = 0;
+    peer->reconnect_delay = 0;
     on_peer_connected (peer, io);
     g_object_unref (peer);
 }
@@ -374,6 +388,7 @@ ccnet_conn_manager_connect_peer (CcnetConnManager *manager, CcnetPeer *peer)
         goto err_connect;
     } else {
         peer->in_connection = 1;
+        manager->n_connecting++;
         ccnet_handshake_new (manager->session, peer, io, 
                              myHandshakeDoneCB, manager);
         return TRUE;
@@ -399,35 +414,111 @@ reconnect_peer (CcnetConnManager *manager, CcnetPeer *peer)
     ccnet_conn_manager_connect_peer (manager, peer);
 }
 
+static gboolean
+is_cluster_master (CcnetPeer *peer)
+{
+    return ccnet_peer_has_role (peer, "ClusterMaster");
+}
+
+/* Cluster masters first, then relays, then the rest. */
+static int
+reconnect_priority (CcnetPeer *peer)
+{
+    if (is_cluster_master (peer))
+        return 0;
+    if (ccnet_peer_has_role (peer, "MyRelay"))
+        return 1;
+    return 2;
+}
+
+static gint
+cmp_reconnect (gconstpointer a, gconstpointer b)
+{
+    CcnetPeer *pa = (CcnetPeer *)a, *pb = (CcnetPeer *)b;
+    int prio_a = reconnect_priority (pa), prio_b = reconnect_priority (pb);
+
+    if (prio_a != prio_b)
+        return prio_a - prio_b;
+    /* the one waiting longest goes first */
+    if (pa->next_reconnect != pb->next_reconnect)
+        return pa->next_reconnect < pb->next_reconnect ? -1 : 1;
+    return 0;
+}
+
+static void
+schedule_reconnect (CcnetPeer *peer, time_t now)
+{
+    peer->reconnect_delay = reconnect_next_delay (peer->reconnect_delay,
+                                                  is_cluster_master (peer));
+    peer->next_reconnect = now + peer->reconnect_delay;
+}
+
+static gboolean
+reconnect_due (CcnetPeer *peer, time_t now)
+{
+    if (peer->net_state == PEER_CONNECTED || peer->in_connection)
+        return FALSE;
+
+    /* The peer just went down. */
+    if (peer->next_reconnect == 0)
+        peer->next_reconnect = now + reconnect_first_delay (
+            is_cluster_master (peer));
+
+    return now >= peer->next_reconnect;
+}
+
+static GList *
+add_if_due (GList *due, CcnetPeer *peer, time_t now)
+{
+    if (peer->redirected) {
+        if (peer->num_fails > 2)
+            ccnet_peer_unset_redirect (peer);
+    }
+
+    if (!reconnect_due (peer, now))
+        return due;
+
+    g_object_ref (peer);
+    return g_list_prepend (due, peer);
+}
+
 static int reconnect_pulse (void *vmanager)
 {
     CcnetConnManager *manager = vmanager;
     /* int conn = 0; */
-    GList  *ptr;
+    GList  *ptr, *due = NULL;
+    time_t now = time (NULL);
 
 #ifndef CCNET_SERVER
     GList *peers = ccnet_peer_manager_get_peers_with_role (
         manager->session->peer_mgr, "MyRelay");
     for (ptr = peers; ptr; ptr = ptr->next) {
         CcnetPeer *peer = ptr->data;
-        if (peer->redirected) {
-            if (peer->num_fails > 2)
-                ccnet_peer_unset_redirect (peer);
-        }
-        reconnect_peer (manager, peer);
+        due = add_if_due (due, peer, now);
         g_object_unref (peer);
     }
     g_list_free (peers);
 #endif
 
-    for (ptr = manager->conn_list; ptr; ptr = ptr->next) {
+    for (ptr = manager->conn_list; ptr; ptr = ptr->next)
+        due = add_if_due (due, ptr->data, now);
+
+    due = g_list_sort (due, cmp_reconnect);
+    for (ptr = due; ptr; ptr = ptr->next) {
         CcnetPeer *peer = ptr->data;
-        if (peer->redirected) {
-            if (peer->num_fails > 2)
-                ccnet_peer_unset_redirect (peer);
+
+        /* a relay may also be in conn_list */
+        if (reconnect_due (peer, now)) {
+            if (manager->n_connecting < MAX_CONCURRENT_CONNECTS) {
+                schedule_reconnect (peer, now);
+                manager->n_attempts++;
+                reconnect_peer (manager, peer);
+            } else
+                manager->n_deferred++;
         }
-        reconnect_peer (manager, peer);
+        g_object_unref (peer);
     }
+    g_list_free (due);
 
     /*
     peers = ccnet_peer_manager_get_peers_with_role (
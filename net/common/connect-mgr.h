@@ -19,6 +19,10 @@ struct CcnetConnManager
     evutil_socket_t  bind_socket;
 
     GList           *conn_list;
+
+    int              n_connecting;  /* outgoing connects and handshakes */
+    guint64          n_attempts;
+    guint64          n_deferred;    /* due but over the concurrency cap */
 };
 
 CcnetConnManager *ccnet_conn_manager_new (CcnetSession *session);
@@ -0,0 +1,286 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "json-stream.h"
+
+struct CcnetJsonStream {
+    GQueue   *chunks;           /* of GString */
+    gsize     chunk_size;
+    gsize     length;
+
+    gboolean  in_list;
+    gboolean  finished;
+    gboolean  first_elem;       /* no comma before the next element */
+    gboolean  first_member;     /* no comma before the next member */
+};
+
+static pthread_key_t current_key;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+static void
+init_current_key (void)
+{
+    pthread_key_create (&current_key, NULL);
+}
+
+CcnetJsonStream *
+ccnet_json_stream_get_current (void)
+{
+    pthread_once (&current_once, init_current_key);
+    return pthread_getspecific (current_key);
+}
+
+void
+ccnet_json_stream_set_current (CcnetJsonStream *js)
+{
+    pthread_once (&current_once, init_current_key);
+    pthread_setspecific (current_key, js);
+}
+
+CcnetJsonStream *
+ccnet_json_stream_new (gsize chunk_size)
+{
+    CcnetJsonStream *js = g_new0 (CcnetJsonStream, 1);
+
+    js->chunks = g_queue_new ();
+    js->chunk_size = chunk_size;
+    return js;
+}
+
+static void
+free_chunks (CcnetJsonStream *js)
+{
+    GString *chunk;
+
+    while ((chunk = g_queue_pop_head (js->chunks)) != NULL)
+        g_string_free (chunk, TRUE);
+    js->length = 0;
+}
+
+void
+ccnet_json_stream_free (CcnetJsonStream *js)
+{
+    if (!js)
+        return;
+
+    free_chunks (js);
+    g_queue_free (js->chunks);
+    g_free (js);
+}
+
+void
+ccnet_json_stream_reset (CcnetJsonStream *js)
+{
+    free_chunks (js);
+    js->in_list = FALSE;
+    js->finished = FALSE;
+}
+
+/* Append @len bytes, filling the last chunk before starting a new one. */
+static void
+write_data (CcnetJsonStream *js, const char *data, gsize len)
+{
+    GString *chunk = g_queue_peek_tail (js->chunks);
+    gsize n;
+
+    while (len > 0) {
+        if (!chunk || chunk->len == js->chunk_size) {
+            chunk = g_string_sized_new (js->chunk_size);
+            g_queue_push_tail (js->chunks, chunk);
+        }
+
+        n = MIN (len, js->chunk_size - chunk->len);
+        g_string_append_len (chunk, data, n);
+        js->length += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static inline void
+write_str (CcnetJsonStream *js, const char *str)
+{
+    write_data (js, str, strlen(str));
+}
+
+static void
+write_escaped (CcnetJsonStream *js, const char *str)
+{
+    const char *p, *run = str;
+    char esc[8];
+
+    write_data (js, "\"", 1);
+    for (p = str; *p; ++p) {
+        unsigned char c = *p;
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        write_data (js, run, p - run);
+        switch (c) {
+        case '"':  write_data (js, "\\\"", 2); break;
+        case '\\': write_data (js, "\\\\", 2); break;
+        case '\n': write_data (js, "\\n", 2); break;
+        case '\r': write_data (js, "\\r", 2); break;
+        case '\t': write_data (js, "\\t", 2); break;
+        default:
+            snprintf (esc, sizeof(esc), "\\u%04x", c);
+            write_data (js, esc, 6);
+        }
+        run = p + 1;
+    }
+    write_data (js, run, p - run);
+    write_data (js, "\"", 1);
+}
+
+void
+ccnet_json_stream_begin_list (CcnetJsonStream *js)
+{
+    ccnet_json_stream_reset (js);
+    write_str (js, "{\"ret\": [");
+    js->in_list = TRUE;
+    js->first_elem = TRUE;
+}
+
+void
+ccnet_json_stream_end_list (CcnetJsonStream *js)
+{
+    write_str (js, "]}");
+    js->in_list = FALSE;
+    js->finished = TRUE;
+}
+
+gboolean
+ccnet_json_stream_finished (CcnetJsonStream *js)
+{
+    return js->finished;
+}
+
+void
+ccnet_json_stream_begin_object (CcnetJsonStream *js)
+{
+    if (!js->first_elem)
+        write_data (js, ", ", 2);
+    js->first_elem = FALSE;
+
+    write_data (js, "{", 1);
+    js->first_member = TRUE;
+}
+
+void
+ccnet_json_stream_end_object (CcnetJsonStream *js)
+{
+    write_data (js, "}", 1);
+}
+
+static void
+write_key (CcnetJsonStream *js, const char *key)
+{
+    if (!js->first_member)
+        write_data (js, ", ", 2);
+    js->first_member = FALSE;
+
+    write_escaped (js, key);
+    write_data (js, ": ", 2);
+}
+
+void
+ccnet_json_stream_add_string (CcnetJsonStream *js, const char *key,
+                              const char *value)
+{
+    write_key (js, key);
+    if (value)
+        write_escaped (js, value);
+    else
+        write_data (js, "null", 4);
+}
+
+void
+ccnet_json_stream_add_int (CcnetJsonStream *js, const char *key,
+                           gint64 value)
+{
+    char buf[32];
+
+    write_key (js, key);
+    snprintf (buf, sizeof(buf), "%"G_GINT64_FORMAT, value);
+    write_str (js, buf);
+}
+
+void
+ccnet_json_stream_add_bool (CcnetJsonStream *js, const char *key,
+                            gboolean value)
+{
+    write_key (js, key);
+    write_str (js, value ? "true" : "false");
+}
+
+void
+ccnet_json_stream_add_gobject (CcnetJsonStream *js, GObject *obj)
+{
+    GParamSpec **pspecs;
+    guint n_pspecs, i;
+    GValue value = {0};
+
+    pspecs = g_object_class_list_properties (G_OBJECT_GET_CLASS(obj),
+                                             &n_pspecs);
+
+    ccnet_json_stream_begin_object (js);
+    for (i = 0; i < n_pspecs; ++i) {
+        GParamSpec *pspec = pspecs[i];
+
+        if (!(pspec->flags & G_PARAM_READABLE))
+            continue;
+
+        g_value_init (&value, G_PARAM_SPEC_VALUE_TYPE(pspec));
+        g_object_get_property (obj, pspec->name, &value);
+
+        switch (G_VALUE_TYPE(&value)) {
+        case G_TYPE_STRING:
+            ccnet_json_stream_add_string (js, pspec->name,
+                                          g_value_get_string (&value));
+            break;
+        case G_TYPE_INT:
+            ccnet_json_stream_add_int (js, pspec->name,
+                                       g_value_get_int (&value));
+            break;
+        case G_TYPE_INT64:
+            ccnet_json_stream_add_int (js, pspec->name,
+                                       g_value_get_int64 (&value));
+            break;
+        case G_TYPE_BOOLEAN:
+            ccnet_json_stream_add_bool (js, pspec->name,
+                                        g_value_get_boolean (&value));
+            break;
+        default:
+            /* not used by ccnet objects */
+            break;
+        }
+        g_value_unset (&value);
+    }
+    ccnet_json_stream_end_object (js);
+
+    g_free (pspecs);
+}
+
+gsize
+ccnet_json_stream_length (CcnetJsonStream *js)
+{
+    return js->length;
+}
+
+char *
+ccnet_json_stream_pop_chunk (CcnetJsonStream *js, gsize *len, gboolean *last)
+{
+    GString *chunk = g_queue_pop_head (js->chunks);
+
+    if (!chunk)
+        return NULL;
+
+    *len = chunk->len;
+    *last = g_queue_is_empty (js->chunks);
+    js->length -= chunk->len;
+    return g_string_free (chunk, FALSE);
+}
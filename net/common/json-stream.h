@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_JSON_STREAM_H
+#define CCNET_JSON_STREAM_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+/*
+ * Chunked JSON writer for large list RPCs.
+ *
+ * searpc turns an objlist result into a GList of GObjects, then a JSON
+ * tree, then a string. For lists of thousands of rows that is three
+ * copies of the result plus the GObject overhead. Instead, DB row
+ * callbacks write the searpc reply ({"ret": [...]}) straight into a
+ * queue of fixed size chunks, which the threaded rpc server sends out
+ * one by one.
+ *
+ * The threaded rpc server makes a stream current for the calling thread
+ * before invoking a function. A list RPC that supports streaming checks
+ * ccnet_json_stream_get_current(), writes its result into the stream and
+ * returns NULL; the server then sends the stream instead of what searpc
+ * returned. A function that fails halfway calls ccnet_json_stream_reset()
+ * and sets its GError as usual.
+ */
+
+typedef struct CcnetJsonStream CcnetJsonStream;
+
+CcnetJsonStream *
+ccnet_json_stream_new (gsize chunk_size);
+
+void
+ccnet_json_stream_free (CcnetJsonStream *js);
+
+/* The stream list RPCs should write into, or NULL. */
+CcnetJsonStream *
+ccnet_json_stream_get_current (void);
+
+void
+ccnet_json_stream_set_current (CcnetJsonStream *js);
+
+/* Start and finish a searpc objlist reply. */
+void
+ccnet_json_stream_begin_list (CcnetJsonStream *js);
+
+void
+ccnet_json_stream_end_list (CcnetJsonStream *js);
+
+/* TRUE once a complete reply has been written. */
+gboolean
+ccnet_json_stream_finished (CcnetJsonStream *js);
+
+/* Drop everything written so far. */
+void
+ccnet_json_stream_reset (CcnetJsonStream *js);
+
+void
+ccnet_json_stream_begin_object (CcnetJsonStream *js);
+
+void
+ccnet_json_stream_end_object (CcnetJsonStream *js);
+
+/*
+ * Object members. Keys are GObject property names in canonical form
+ * ("is-staff"), the same as searpc produces. A NULL @value is written
+ * as null.
+ */
+void
+ccnet_json_stream_add_string (CcnetJsonStream *js, const char *key,
+                              const char *value);
+
+void
+ccnet_json_stream_add_int (CcnetJsonStream *js, const char *key,
+                           gint64 value);
+
+void
+ccnet_json_stream_add_bool (CcnetJsonStream *js, const char *key,
+                            gboolean value);
+
+/* Write all readable properties of @obj as one list element. */
+void
+ccnet_json_stream_add_gobject (CcnetJsonStream *js, GObject *obj);
+
+/* Total number of bytes written. */
+gsize
+ccnet_json_stream_length (CcnetJsonStream *js);
+
+/*
+ * Remove and return the next chunk. *@last is set if it's the final
+ * one. Returns NULL when the stream is empty. Free with g_free().
+ */
+char *
+ccnet_json_stream_pop_chunk (CcnetJsonStream *js, gsize *len, gboolean *last);
+
+#endif
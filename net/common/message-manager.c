@@ -13,6 +13,11 @@
 #include "message-manager.h"
 #include "peer-mgr.h"
 
+#ifdef CCNET_CLUSTER
+#include "cluster-mgr.h"
+extern CcnetClusterManager *cluster_mgr;
+#endif
+
 #define DEBUG_FLAG CCNET_DEBUG_MESSAGE
 #include "log.h"
 
@@ -74,6 +79,14 @@ handle_inner_message (CcnetMessageManager *manager,
         return TRUE;
     }
 
+#ifdef CCNET_CLUSTER
+    if (strcmp(msg->app, CLUSTER_APP) == 0) {
+        if (cluster_mgr)
+            ccnet_cluster_manager_receive_message (cluster_mgr, msg);
+        return TRUE;
+    }
+#endif
+
     return FALSE;
 }
 
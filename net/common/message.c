@@ -8,6 +8,8 @@
 #include "ccnet-db.h"
 #include "string-util.h"
 
+#include <ccnet/message-wire.h>
+
 static CcnetMessage *
 ccnet_message_new_full (const char *from,
                         const char *to,
@@ -65,7 +67,10 @@ ccnet_message_unref (CcnetMessage *message)
 void
 ccnet_message_free (CcnetMessage *message)
 {
-    g_free (message->id);
+    /* A message from ccnet_message_from_binary() keeps its id in the
+     * same block as the body. */
+    if (!message->id_in_body)
+        g_free (message->id);
     g_free (message->body);
     g_free (message);
 }
@@ -221,6 +226,49 @@ error:
     return NULL;
 }
 
+int
+ccnet_message_to_binary_buf (CcnetMessage *msg, GString *buf)
+{
+    g_string_truncate (buf, 0);
+    return ccnet_message_wire_encode (buf, msg->flags, msg->from, msg->to,
+                                      msg->id, msg->ctime, msg->rtime,
+                                      msg->app, msg->body);
+}
+
+CcnetMessage *
+ccnet_message_from_binary (const char *buf, int len)
+{
+    CcnetMessageWire wire;
+    CcnetMessage *message;
+
+    if (ccnet_message_wire_parse (buf, len, &wire) < 0)
+        return NULL;
+
+    message = g_new0 (CcnetMessage, 1);
+
+    message->flags = (char)wire.flags;
+    memcpy (message->from, wire.from, 40);
+    message->from[40] = '\0';
+    memcpy (message->to, wire.to, 40);
+    message->to[40] = '\0';
+    message->app = g_intern_string (wire.app);
+    message->ctime = (wire.ctime ? wire.ctime : time(NULL));
+    message->rtime = wire.rtime;
+
+    /* The packet buffer is reused once the processor returns, so copy
+     * the body and id into a single block "body\0id\0". */
+    message->body = g_malloc (wire.body_len + 1 + MESSAGE_ID_LEN + 1);
+    memcpy (message->body, wire.body, wire.body_len + 1);
+    message->id = message->body + wire.body_len + 1;
+    memcpy (message->id, wire.id, MESSAGE_ID_LEN);
+    message->id[MESSAGE_ID_LEN] = '\0';
+    message->id_in_body = TRUE;
+
+    message->ref_count = 1;
+
+    return message;
+}
+
 #if 0
 CcnetMessage *
 ccnet_message_from_db_stmt (CcnetDBRow *stmt)
@@ -46,6 +46,8 @@ struct _CcnetMessage {
 
     const char *app;            /* application */
     char       *body;
+
+    gboolean    id_in_body;     /* id shares the body allocation */
 };
 
 
@@ -66,5 +68,14 @@ void ccnet_message_to_string_buf_local (CcnetMessage *msg, GString *buf);
 CcnetMessage *ccnet_message_from_string (char *buf, int len);
 CcnetMessage *ccnet_message_from_string_local (char *buf, int len);
 
+/*
+ * Binary encoding, see <ccnet/message-wire.h>. Unlike the string
+ * parsers, ccnet_message_from_binary() does not modify @buf.
+ * ccnet_message_to_binary_buf() returns -1 if the app name is longer
+ * than 65535 bytes.
+ */
+int ccnet_message_to_binary_buf (CcnetMessage *msg, GString *buf);
+CcnetMessage *ccnet_message_from_binary (const char *buf, int len);
+
 
 #endif
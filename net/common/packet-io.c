@@ -22,6 +22,7 @@
 
 #include "session.h"
 #include "packet-io.h"
+#include "metrics.h"
 
 #include "log.h"
 
@@ -41,6 +42,42 @@ didWriteWrapper (struct bufferevent *e, void *user_data)
         c->didWrite (e, c->user_data);
 }
 
+static const char *packet_type_names[] = {
+    "ok", "handshake", "request", "response", "update", "relay", "encrypted",
+};
+
+/* Wire level traffic, so packets of encrypted channels are counted as
+ * "encrypted". */
+void
+ccnet_packet_io_count (int in, int type, uint32_t bytes)
+{
+    static CcnetCounter *packets[2][G_N_ELEMENTS(packet_type_names) + 1];
+    static CcnetCounter *total_bytes[2];
+    char series[128];
+    int t;
+
+    /* only called in the main thread */
+    if (!total_bytes[in]) {
+        for (t = 0; t <= G_N_ELEMENTS(packet_type_names); ++t) {
+            snprintf (series, sizeof(series),
+                      "ccnet_packets_%s_total{type=\"%s\"}",
+                      in ? "in" : "out",
+                      t < G_N_ELEMENTS(packet_type_names) ?
+                      packet_type_names[t] : "other");
+            packets[in][t] = ccnet_metrics_counter (series);
+        }
+        total_bytes[in] = ccnet_metrics_counter (in ? "ccnet_bytes_in_total" :
+                                                 "ccnet_bytes_out_total");
+    }
+
+    if (type >= 0) {
+        t = type < G_N_ELEMENTS(packet_type_names) ?
+            type : G_N_ELEMENTS(packet_type_names);
+        ccnet_counter_inc (packets[in][t]);
+    }
+    ccnet_counter_add (total_bytes[in], bytes);
+}
+
 static void
 canReadWrapper (struct bufferevent *e, void *user_data)
 {
@@ -71,6 +108,9 @@ canReadWrapper (struct bufferevent *e, void *user_data)
         if (EVBUFFER_LENGTH (e->input) - CCNET_PACKET_LENGTH_HEADER < len)
             break;                 /* wait for more data */
 
+        ccnet_packet_io_count (TRUE, packet->header.type,
+                               len + CCNET_PACKET_LENGTH_HEADER);
+
         /* byte order, from network to host */
         packet->header.length = len;
         packet->header.id = ntohl (packet->header.id);
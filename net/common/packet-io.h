@@ -68,6 +68,11 @@ void  ccnet_packet_io_set_timeout_secs (CcnetPacketIO *io, int secs);
 
 void  ccnet_packet_io_write_packet (CcnetPacketIO *io, ccnet_packet *packet);
 
+/* Count a packet of @type and @bytes on the wire, @in or out. A
+ * negative @type only adds the bytes, for content sent apart from
+ * its packet. */
+void  ccnet_packet_io_count (int in, int type, uint32_t bytes);
+
 void  ccnet_packet_io_set_iofuncs (CcnetPacketIO *io,
                                    ccnet_can_read_cb  readcb,
                                    ccnet_did_write_cb writecb,
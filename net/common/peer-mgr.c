@@ -6,6 +6,7 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <glib/gstdio.h>
+#include <pthread.h>
 
 #include "timer.h"
 #include "ccnet-db.h"
@@ -41,6 +42,10 @@ struct CcnetPeerManagerPriv {
 
     /* the list of peers to be resolved */
     GList       *resolve_peers;
+
+    /* Serializes changes to peer_hash against lookups from
+     * rpc worker threads (see ccnet_peer_manager_get_peer). */
+    pthread_mutex_t hash_lock;
 };
 
 
@@ -48,6 +53,7 @@ enum {
     ADDED_SIG,
     DELETING_SIG,
     PEER_AUTH_DONE_SIG,
+    PEER_UPDATED_SIG,
     LAST_SIGNAL
 };
 
@@ -92,6 +98,15 @@ ccnet_peer_manager_class_init (CcnetPeerManagerClass *klass)
                       g_cclosure_marshal_VOID__POINTER,
                       G_TYPE_NONE, 1, G_TYPE_POINTER);
 
+    /* roles or public address of a peer changed */
+    signals[PEER_UPDATED_SIG] = 
+        g_signal_new ("peer-updated", CCNET_TYPE_PEER_MANAGER, 
+                      G_SIGNAL_RUN_LAST,
+                      0,        /* no class singal handler */
+                      NULL, NULL, /* no accumulator */
+                      g_cclosure_marshal_VOID__POINTER,
+                      G_TYPE_NONE, 1, G_TYPE_POINTER);
+
     g_type_class_add_private (klass, sizeof (CcnetPeerManagerPriv));
 }
 
@@ -100,6 +115,7 @@ static void
 ccnet_peer_manager_init (CcnetPeerManager *manager)
 {
     manager->priv = GET_PRIV (manager);
+    pthread_mutex_init (&manager->priv->hash_lock, NULL);
 }
 
 
@@ -135,7 +151,9 @@ ccnet_peer_manager_prepare (CcnetPeerManager *manager)
     peer->is_self = 1;
     peer->manager = manager;
     
+    pthread_mutex_lock (&manager->priv->hash_lock);
     g_hash_table_insert (manager->peer_hash, peer->id, peer);
+    pthread_mutex_unlock (&manager->priv->hash_lock);
     session->myself = peer;
 
     return 0;
@@ -182,7 +200,9 @@ add_peer (CcnetPeerManager *manager, CcnetPeer *peer)
 
     g_assert (peer->id != NULL);
     g_object_ref (peer);
+    pthread_mutex_lock (&manager->priv->hash_lock);
     g_hash_table_insert (manager->peer_hash, peer->id, peer);
+    pthread_mutex_unlock (&manager->priv->hash_lock);
 
     if (!peer->is_self) {
         g_signal_emit (manager, signals[ADDED_SIG], 0, peer);
@@ -207,7 +227,9 @@ delete_peer(CcnetPeerManager *manager, CcnetPeer *peer)
     if (g_unlink(path) < 0)
         ccnet_warning("delete file %s error\n", path);
 
+    pthread_mutex_lock (&manager->priv->hash_lock);
     g_hash_table_remove (manager->peer_hash, peer->id);
+    pthread_mutex_unlock (&manager->priv->hash_lock);
     remove_peer_roles (manager, peer->id);
     g_signal_emit (manager, signals[DELETING_SIG], 0, peer);
 
@@ -505,8 +527,10 @@ ccnet_peer_manager_set_peer_public_addr (CcnetPeerManager *manager,
         peer->public_port = port;
         need_save = 1;
     }
-    if (need_save)
+    if (need_save) {
         save_peer_addr (manager, peer);
+        g_signal_emit (manager, signals[PEER_UPDATED_SIG], 0, peer);
+    }
 }
 
 
@@ -550,6 +574,7 @@ ccnet_peer_manager_add_role (CcnetPeerManager *manager,
 {
     ccnet_peer_add_role (peer, role);
     save_peer_roles (manager, peer);
+    g_signal_emit (manager, signals[PEER_UPDATED_SIG], 0, peer);
 }
 
 void ccnet_peer_manager_remove_role (CcnetPeerManager *manager,
@@ -558,6 +583,7 @@ void ccnet_peer_manager_remove_role (CcnetPeerManager *manager,
 {
     ccnet_peer_remove_role (peer, role);
     save_peer_roles (manager, peer);
+    g_signal_emit (manager, signals[PEER_UPDATED_SIG], 0, peer);
 }
 
 CcnetPeer*
@@ -639,12 +665,29 @@ ccnet_peer_manager_get_peer (CcnetPeerManager *manager,
 {
     CcnetPeer *peer;
 
+    pthread_mutex_lock (&manager->priv->hash_lock);
     peer = g_hash_table_lookup (manager->peer_hash, peer_id);
     if (peer)
         g_object_ref (peer);
+    pthread_mutex_unlock (&manager->priv->hash_lock);
     return peer;
 }
 
+RSA *
+ccnet_peer_manager_get_peer_pubkey (CcnetPeerManager *manager,
+                                    const char *peer_id)
+{
+    CcnetPeer *peer;
+    RSA *pubkey;
+
+    peer = ccnet_peer_manager_get_peer (manager, peer_id);
+    if (!peer)
+        return NULL;
+    pubkey = ccnet_peer_ref_pubkey (peer);
+    g_object_unref (peer);
+    return pubkey;
+}
+
 CcnetPeer*
 ccnet_peer_manager_get_peer_by_name (CcnetPeerManager *manager,
                                      const char *name)
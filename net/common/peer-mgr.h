@@ -61,6 +61,10 @@ void ccnet_peer_manager_remove_peer (CcnetPeerManager *manager, CcnetPeer *peer)
 CcnetPeer* ccnet_peer_manager_get_peer (CcnetPeerManager *manager,
                                         const char *peer_id);
 
+/* Thread safe. Returns a new reference to the key, free with RSA_free(). */
+RSA* ccnet_peer_manager_get_peer_pubkey (CcnetPeerManager *manager,
+                                         const char *peer_id);
+
 CcnetPeer* ccnet_peer_manager_get_peer_by_name (CcnetPeerManager *manager,
                                                 const char *name);
 
@@ -15,6 +15,7 @@
 #include "net.h"
 
 #include <ctype.h>
+#include <pthread.h>
 
 #include "timer.h"
 
@@ -29,7 +30,10 @@
 #include "processor.h"
 #include "proc-factory.h"
 #include "processors/service-proxy-proc.h"
+#include "processors/service-stub-proc.h"
+#include "rpc-common.h"
 #include "connect-mgr.h"
+#include "metrics.h"
 
 #include "utils.h"
 
@@ -51,6 +55,38 @@ static guint signals[LAST_SIGNAL] = { 0 };
 
 #define OBJECT_TYPE_STRING "peer"
 
+/* Guards replacing peer->pubkey, which rpc worker threads may read
+ * through ccnet_peer_ref_pubkey(). */
+static pthread_mutex_t pubkey_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+replace_pubkey (CcnetPeer *peer, RSA *pubkey)
+{
+    RSA *old;
+
+    pthread_mutex_lock (&pubkey_lock);
+    old = peer->pubkey;
+    peer->pubkey = pubkey;
+    pthread_mutex_unlock (&pubkey_lock);
+
+    if (old)
+        RSA_free (old);
+}
+
+RSA *
+ccnet_peer_ref_pubkey (CcnetPeer *peer)
+{
+    RSA *pubkey;
+
+    pthread_mutex_lock (&pubkey_lock);
+    pubkey = peer->pubkey;
+    if (pubkey)
+        RSA_up_ref (pubkey);
+    pthread_mutex_unlock (&pubkey_lock);
+
+    return pubkey;
+}
+
 #include "../lib/peer-common.h"
 
 void ccnet_peer_set_net_state (CcnetPeer *peer, int net_state);
@@ -75,6 +111,8 @@ ccnet_peer_finalize (GObject *object)
     g_free (peer->service_url);
     g_hash_table_unref (peer->processors);
     g_free (peer->session_key);
+    g_free (peer->resume_ticket);
+    g_free (peer->resume_key);
     evbuffer_free (peer->packet);
 
     if (peer->pubkey)
@@ -214,9 +252,7 @@ static void parse_field (CcnetPeer *peer, const char *key, char *value)
     }
 
     if (strcmp(key, "pubkey") == 0) {
-        if (peer->pubkey)
-            RSA_free(peer->pubkey);
-        peer->pubkey = public_key_from_string (value);
+        replace_pubkey (peer, public_key_from_string (value));
         return;
     }
 }
@@ -453,6 +489,7 @@ _peer_shutdown (CcnetPeer *peer)
     peer->encrypt_channel = 0;
     g_free (peer->session_key);
     peer->session_key = NULL;
+    peer->ticket_issued = 0;
 
     ccnet_debug ("Shutdown all processors for peer %s\n", peer->name);
     shutdown_processors (peer);
@@ -516,8 +553,34 @@ create_remote_processor (CcnetPeer *peer, CcnetPeer *remote_peer,
     ccnet_service_proxy_invoke_remote (processor, remote_peer, argc, argv);
 }
 
+/*
+ * A request "<service>\n<fcall>" is a one-shot rpc: the function is
+ * called right away as if the client had sent SC_CLIENT_CALL, and the
+ * processor finishes after SC_SERVER_RET, so the client needn't wait
+ * for "200" or send "103". Services that can't do this answer
+ * SC_UNKNOWN_SERVICE and the client falls back to the old way.
+ */
 static void
-create_local_processor (CcnetPeer *peer, int req_id, int argc, char **argv)
+start_one_shot (CcnetProcessor *processor, int argc, char **argv,
+                char *call, int call_len)
+{
+    if (!CCNET_PROCESSOR_GET_CLASS (processor)->one_shot_rpc) {
+        ccnet_processor_send_response (processor, SC_UNKNOWN_SERVICE,
+                                       SS_UNKNOWN_SERVICE, NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    processor->one_shot = 1;
+    if (ccnet_processor_start (processor, argc-1, argv+1) < 0)
+        return;
+    ccnet_processor_handle_update (processor, SC_CLIENT_CALL, SS_CLIENT_CALL,
+                                   call, call_len);
+}
+
+static void
+create_local_processor (CcnetPeer *peer, int req_id, int argc, char **argv,
+                        char *call, int call_len)
 {
     CcnetProcessor *processor;
     CcnetProcFactory *factory = peer->manager->session->proc_factory;
@@ -525,7 +588,12 @@ create_local_processor (CcnetPeer *peer, int req_id, int argc, char **argv)
     processor = ccnet_proc_factory_create_slave_processor (
         factory, argv[0], peer, req_id);
 
-    if (processor) {
+    if (processor && call) {
+        start_one_shot (processor, argc, argv, call, call_len);
+    } else if (call) {
+        ccnet_peer_send_response (peer, req_id, SC_UNKNOWN_SERVICE,
+                                  SS_UNKNOWN_SERVICE, NULL, 0);
+    } else if (processor) {
         ccnet_processor_start (processor, argc-1, argv+1);
     } else {
         CcnetService *service;
@@ -548,7 +616,8 @@ create_local_processor (CcnetPeer *peer, int req_id, int argc, char **argv)
 }
 
 static void create_processor (CcnetPeer *peer, int req_id,
-                             int argc, char **argv)
+                             int argc, char **argv,
+                             char *call, int call_len)
 {
     CcnetSession *session = peer->manager->session;
 
@@ -576,30 +645,46 @@ static void create_processor (CcnetPeer *peer, int req_id,
          * local host. Translate this call into a local one.
          */
         if (session->myself == remote_peer) {
-            create_local_processor (peer, req_id, argc-2, argv+2);
+            create_local_processor (peer, req_id, argc-2, argv+2,
+                                    call, call_len);
             g_object_unref (remote_peer);
             return;
         }
         
+        if (call) {
+            /* not relayed by service-proxy */
+            ccnet_peer_send_response (peer, req_id, SC_UNKNOWN_SERVICE,
+                                      SS_UNKNOWN_SERVICE, NULL, 0);
+            g_object_unref (remote_peer);
+            return;
+        }
         create_remote_processor (peer, remote_peer, req_id, argc-2, argv+2);
         g_object_unref (remote_peer);
         return;
     }
 
-    create_local_processor (peer, req_id, argc, argv);
+    create_local_processor (peer, req_id, argc, argv, call, call_len);
 }
 
 static void
 handle_request (CcnetPeer *peer, int req_id, char *data, int len)
 {
-    char *msg;
+    char *msg, *call = NULL, *nl;
     gchar **commands;
     gchar **pcmd;
-    int  i, perm;
+    int  i, perm, call_len = 0;
 
     /* TODO: remove string copy */
     if (len < 1)
         return;
+
+    /* one-shot rpc, see start_one_shot() */
+    if ((nl = memchr (data, '\n', len)) != NULL) {
+        call = nl + 1;
+        call_len = len - (call - data);
+        len = nl - data;
+    }
+
     msg = g_malloc (len+1);
     memcpy (msg, data, len);
     msg[len] = '\0';
@@ -639,12 +724,50 @@ handle_request (CcnetPeer *peer, int req_id, char *data, int len)
         goto ret;
     }
 
-    create_processor (peer, req_id, i, commands);
+    create_processor (peer, req_id, i, commands, call, call_len);
 
 ret:
     g_strfreev (commands);
 }
 
+/*
+ * A service proxy and its stub pass data responses and updates
+ * between two peers unchanged. Forward such a packet under the id of
+ * the other processor without parsing it into a code line and
+ * building it again. Returns FALSE if @processor doesn't relay the
+ * packet or it must be handled by the processors, e.g. keepalive and
+ * errors.
+ */
+static gboolean
+relay_packet (CcnetProcessor *processor, int type, const char *data, int len)
+{
+    CcnetProcessor *to;
+    int id;
+
+    if (len < 4 || (data[0] != '2' && data[0] != '3'))
+        return FALSE;
+
+    if (type == CCNET_MSG_RESPONSE && CCNET_IS_SERVICE_STUB_PROC(processor)) {
+        to = ccnet_service_stub_proc_get_proxy_proc (
+            (CcnetServiceStubProc *)processor);
+        if (!to)
+            return FALSE;
+        id = RESPONSE_ID (to->id);
+    } else if (type == CCNET_MSG_UPDATE &&
+               CCNET_IS_SERVICE_PROXY_PROC(processor)) {
+        to = ccnet_service_proxy_proc_get_stub_proc (
+            (CcnetServiceProxyProc *)processor);
+        if (!to)
+            return FALSE;
+        id = UPDATE_ID (to->id);
+    } else
+        return FALSE;
+
+    processor->t_packet_recv = to->t_packet_recv = time (NULL);
+    ccnet_peer_relay_packet (to->peer, type, id, data, len);
+    return TRUE;
+}
+
 static void
 handle_response (CcnetPeer *peer, int req_id, char *data, int len)
 {
@@ -656,6 +779,10 @@ handle_response (CcnetPeer *peer, int req_id, char *data, int len)
     if (len < 4)
         goto error;
 
+    processor = ccnet_peer_get_processor (peer, MASTER_ID (req_id));
+    if (processor && relay_packet (processor, CCNET_MSG_RESPONSE, data, len))
+        return;
+
     code = data;
     
     ptr = data + 3;
@@ -686,7 +813,6 @@ handle_response (CcnetPeer *peer, int req_id, char *data, int len)
     clen = len - (ptr - data);
     
 parsed:
-    processor = ccnet_peer_get_processor (peer, MASTER_ID (req_id));
     if (processor == NULL) {
         /* do nothing if receiving SC_PROC_DEAD and the processor on
          * this side is also not present. Otherwise send SC_PROC_DEAD
@@ -724,6 +850,10 @@ handle_update (CcnetPeer *peer, int req_id, char *data, int len)
 
     if (len < 4)
         goto error;
+
+    processor = ccnet_peer_get_processor (peer, SLAVE_ID(req_id));
+    if (processor && relay_packet (processor, CCNET_MSG_UPDATE, data, len))
+        return;
     
     code = data;
     
@@ -755,7 +885,6 @@ handle_update (CcnetPeer *peer, int req_id, char *data, int len)
     clen = len - (ptr - data);
     
 parsed:
-    processor = ccnet_peer_get_processor (peer, SLAVE_ID(req_id));
     if (processor == NULL) {
         if (memcmp(code, SC_PROC_DEAD, 3) != 0 
             && memcmp(code, SC_PROC_DONE, 3) != 0) {
@@ -827,11 +956,17 @@ canRead (ccnet_packet *packet, void *vpeer)
             goto out;
         }
 
+        static CcnetHistogram *decrypt_time;
         char *data;
         int len;
         int ret;
+        gint64 start = get_current_time ();
+
         ret = ccnet_decrypt_with_key (&data, &len, packet->data, packet->header.id,
                                       peer->key, peer->iv);
+        if (!decrypt_time)
+            decrypt_time = ccnet_metrics_histogram ("ccnet_decrypt_usec");
+        ccnet_histogram_record (decrypt_time, get_current_time () - start);
         if (ret < 0)
             ccnet_warning ("[SEND] decryption error for peer %s(%.8s) \n",
                            peer->name, peer->id);
@@ -1021,14 +1156,21 @@ ccnet_peer_packet_finish (const CcnetPeer *peer)
 void
 ccnet_peer_packet_send (const CcnetPeer *peer)
 {
+    static CcnetHistogram *encrypt_time;
     int ret = 0;
     if (peer->is_local) {
+        ccnet_packet_io_count (FALSE,
+                               ((ccnet_header *)EVBUFFER_DATA(peer->packet))->type,
+                               EVBUFFER_LENGTH(peer->packet));
         bufferevent_write_buffer (peer->io->bufev, peer->packet);
         return;
     }
 
     if (peer->net_state == PEER_CONNECTED) {
         if (!peer->encrypt_channel) {
+            ccnet_packet_io_count (FALSE,
+                                   ((ccnet_header *)EVBUFFER_DATA(peer->packet))->type,
+                                   EVBUFFER_LENGTH(peer->packet));
             ret = bufferevent_write_buffer (peer->io->bufev, peer->packet);
         } else {
             ccnet_header enc_header;
@@ -1036,8 +1178,13 @@ ccnet_peer_packet_send (const CcnetPeer *peer)
             uint32_t len = EVBUFFER_LENGTH(peer->packet);
             char *enc_data;
             int enc_len;
+            gint64 start = get_current_time ();
+
             ret = ccnet_encrypt_with_key (&enc_data, &enc_len, data, len,
                                           peer->key, peer->iv);
+            if (!encrypt_time)
+                encrypt_time = ccnet_metrics_histogram ("ccnet_encrypt_usec");
+            ccnet_histogram_record (encrypt_time, get_current_time () - start);
             if (ret < 0) {
                 ccnet_warning ("[SEND] encryption error for sending packet "
                                "to peer %s(%.8s) \n", peer->name, peer->id);
@@ -1049,6 +1196,8 @@ ccnet_peer_packet_send (const CcnetPeer *peer)
             enc_header.type = CCNET_MSG_ENCPACKET;
             enc_header.length = 0;
             enc_header.id = htonl(enc_len);
+            ccnet_packet_io_count (FALSE, CCNET_MSG_ENCPACKET,
+                                   sizeof (enc_header) + enc_len);
             bufferevent_write (peer->io->bufev, &enc_header, sizeof (enc_header));
             bufferevent_write (peer->io->bufev, enc_data, enc_len);
             g_free (enc_data);
@@ -1081,21 +1230,53 @@ ccnet_peer_send_request (const CcnetPeer *peer, int req_id, const char *req)
 }
 
 
+/* Content shorter than this is copied, a reference chain does not pay
+ * off for it. */
+#define REF_CONTENT_MIN 4096
+
+#if defined(LIBEVENT_VERSION_NUMBER) && LIBEVENT_VERSION_NUMBER >= 0x02000000
+#define HAVE_EVBUFFER_ADD_REFERENCE 1
+#endif
+
+static CcnetPeerSendStats send_stats;
+
 void
-ccnet_peer_send_response (const CcnetPeer *peer, int req_id, 
-                          const char *code, const char *reason,
-                          const char *content, int clen)
+ccnet_peer_get_send_stats (CcnetPeerSendStats *stats)
 {
-    g_assert (req_id > 0);
-    if ( (strlen(code) != 3) || !isdigit(code[0]) || !isdigit(code[1])
-         || !isdigit(code[1]) ) {
-        ccnet_warning ("Bad code number\n");
-        return;
-    }
+    *stats = send_stats;
+}
 
-    g_return_if_fail (clen < 65536);
+typedef struct {
+    GDestroyNotify  func;
+    void           *data;
+} ContentRef;
 
-    ccnet_peer_packet_prepare (peer, CCNET_MSG_RESPONSE, req_id);
+#ifdef HAVE_EVBUFFER_ADD_REFERENCE
+static void
+content_ref_cleanup (const void *content, size_t len, void *vref)
+{
+    ContentRef *ref = vref;
+
+    ref->func (ref->data);
+    g_free (ref);
+}
+#endif
+
+/*
+ * Build a response or update packet. If @free_func is set, @content
+ * is queued to the connection by reference when possible and
+ * @free_func (@free_data) is called once it has been written.
+ *
+ * Packets queued in one main loop iteration are written out together
+ * by the bufferevent, so no explicit coalescing is needed here.
+ */
+static void
+send_code_packet (const CcnetPeer *peer, int type, int req_id,
+                  const char *code, const char *reason,
+                  const char *content, int clen,
+                  GDestroyNotify free_func, void *free_data)
+{
+    ccnet_peer_packet_prepare (peer, type, req_id);
 
     /* code line */
     evbuffer_add (peer->packet, code, 3);
@@ -1105,11 +1286,81 @@ ccnet_peer_send_response (const CcnetPeer *peer, int req_id,
     }
     evbuffer_add (peer->packet, "\n", 1);
 
-    if (content)
+    send_stats.packets++;
+    send_stats.bytes += EVBUFFER_LENGTH(peer->packet) + (content ? clen : 0);
+
+#ifdef HAVE_EVBUFFER_ADD_REFERENCE
+    /* Encrypted packets are built contiguously, so only plain
+     * connections can take the content by reference. */
+    if (content && free_func && clen >= REF_CONTENT_MIN &&
+        (peer->is_local || (peer->net_state == PEER_CONNECTED &&
+                            !peer->encrypt_channel))) {
+        ccnet_header *header = (ccnet_header *) EVBUFFER_DATA(peer->packet);
+        ContentRef *ref = g_new (ContentRef, 1);
+
+        header->length = htons (EVBUFFER_LENGTH(peer->packet)
+                                - CCNET_PACKET_LENGTH_HEADER + clen);
+        ccnet_peer_packet_send (peer);
+
+        ref->func = free_func;
+        ref->data = free_data;
+        if (evbuffer_add_reference (peer->io->bufev->output, content, clen,
+                                    content_ref_cleanup, ref) < 0) {
+            ccnet_warning ("[SEND] failed to queue content to peer(%.8s)\n",
+                           peer->id);
+            content_ref_cleanup (content, clen, ref);
+        } else
+            ccnet_packet_io_count (FALSE, -1, clen);
+        send_stats.bytes_referenced += clen;
+        return;
+    }
+#endif
+
+    if (content) {
         evbuffer_add (peer->packet, content, clen);
+        send_stats.bytes_copied += clen;
+    }
 
     ccnet_peer_packet_finish_send (peer);
 
+    if (free_func)
+        free_func (free_data);
+}
+
+void
+ccnet_peer_send_response (const CcnetPeer *peer, int req_id, 
+                          const char *code, const char *reason,
+                          const char *content, int clen)
+{
+    ccnet_peer_send_response_full (peer, req_id, code, reason,
+                                   content, clen, NULL, NULL);
+}
+
+void
+ccnet_peer_send_response_full (const CcnetPeer *peer, int req_id,
+                               const char *code, const char *reason,
+                               const char *content, int clen,
+                               GDestroyNotify free_func, void *free_data)
+{
+    g_assert (req_id > 0);
+    if ( (strlen(code) != 3) || !isdigit(code[0]) || !isdigit(code[1])
+         || !isdigit(code[1]) ) {
+        ccnet_warning ("Bad code number\n");
+        if (free_func)
+            free_func (free_data);
+        return;
+    }
+
+    if (clen >= 65536) {
+        ccnet_warning ("Response content too long: %d\n", clen);
+        if (free_func)
+            free_func (free_data);
+        return;
+    }
+
+    send_code_packet (peer, CCNET_MSG_RESPONSE, req_id, code, reason,
+                      content, clen, free_func, free_data);
+
     if (!peer->is_local)
         ccnet_debug ("[SEND] Send a response: id %d code %s %s\n",
                      req_id, code, reason);
@@ -1122,26 +1373,41 @@ ccnet_peer_send_update (const CcnetPeer *peer, int req_id,
 {
     g_assert (req_id > 0);
 
-    ccnet_peer_packet_prepare (peer, CCNET_MSG_UPDATE, req_id);
-
-    /* code line */
-    evbuffer_add (peer->packet, code, 3);
-    if (reason) {
-        evbuffer_add (peer->packet, " ", 1);
-        ccnet_peer_packet_write_string (peer, reason);
-    }
-    evbuffer_add (peer->packet, "\n", 1);
-
-    if (content)
-        evbuffer_add (peer->packet, content, clen);
-
-    ccnet_peer_packet_finish_send (peer);
+    send_code_packet (peer, CCNET_MSG_UPDATE, req_id, code, reason,
+                      content, clen, NULL, NULL);
 
     if (!peer->is_local)
         ccnet_debug ("[SEND] Send an update: id %d code %s %s\n",
                      req_id, code, reason?reason:"NULL");
 }
 
+void
+ccnet_peer_relay_packet (const CcnetPeer *peer, int type, int req_id,
+                         const char *data, int len)
+{
+    ccnet_header *header;
+
+    ccnet_peer_packet_prepare (peer, type, req_id);
+    send_stats.packets++;
+    send_stats.bytes += EVBUFFER_LENGTH(peer->packet) + len;
+    send_stats.bytes_copied += len;
+
+    /* Plain connections take the data straight after the header, so
+     * it is copied once, from the input to the output buffer. */
+    if (peer->is_local || (peer->net_state == PEER_CONNECTED &&
+                           !peer->encrypt_channel)) {
+        header = (ccnet_header *) EVBUFFER_DATA(peer->packet);
+        header->length = htons (len);
+        ccnet_peer_packet_send (peer);
+        bufferevent_write (peer->io->bufev, data, len);
+        ccnet_packet_io_count (FALSE, -1, len);
+        return;
+    }
+
+    evbuffer_add (peer->packet, data, len);
+    ccnet_peer_packet_finish_send (peer);
+}
+
 
 /* ----------------  Processors ---------------- */
 
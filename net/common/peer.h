@@ -97,8 +97,26 @@ struct _CcnetPeer
 
     unsigned int  encrypt_channel : 1;
 
+    unsigned int  no_msg_stream : 1; /* peer lacks receive-msg-stream */
+
     struct CcnetPacketIO  *io;
 
+    /* Reconnect backoff, see connect-mgr. next_reconnect is 0 until the
+     * first attempt after the peer went down. */
+    time_t    next_reconnect;
+    int       reconnect_delay;  /* last backoff in seconds */
+
+    /* Resumption ticket issued by this peer and the session key it
+     * holds. Kept across reconnects, see keepalive2-proc. */
+    char     *resume_ticket;
+    int       resume_ticket_len;
+    char     *resume_key;
+    /* when we last handed this peer a ticket on this connection */
+    time_t    ticket_issued;
+
+
+    /* Long-lived message channel, see sendmsg-stream-proc. */
+    struct _CcnetProcessor *msg_stream;
 
     int      last_net_state;
 
@@ -157,6 +175,10 @@ void        ccnet_peer_update_address (CcnetPeer *peer,
 
 void        ccnet_peer_set_pubkey (CcnetPeer *peer, char *str);
 
+/* Return a new reference to the peer's public key, or NULL.
+ * Safe to call from worker threads. Release it with RSA_free(). */
+RSA        *ccnet_peer_ref_pubkey (CcnetPeer *peer);
+
 int         ccnet_peer_prepare_channel_encryption (CcnetPeer *peer);
 
 /* role management */
@@ -207,6 +229,33 @@ void        ccnet_peer_send_update (const CcnetPeer *peer, int req_id,
                                     const char *code, const char *reason,
                                     const char *content, int clen);
 
+/*
+ * Like ccnet_peer_send_response(), but @content may be queued without
+ * copying. It must stay valid until @free_func (@free_data) is called,
+ * which may happen before this function returns.
+ */
+void        ccnet_peer_send_response_full (const CcnetPeer *peer, int req_id,
+                                           const char *code, const char *reason,
+                                           const char *content, int clen,
+                                           GDestroyNotify free_func,
+                                           void *free_data);
+
+/*
+ * Send a response or update packet received from another peer,
+ * @data being its code line and content, under @req_id.
+ */
+void        ccnet_peer_relay_packet (const CcnetPeer *peer, int type,
+                                     int req_id, const char *data, int len);
+
+typedef struct {
+    guint64     packets;
+    guint64     bytes;
+    guint64     bytes_copied;       /* content copied into packet buffers */
+    guint64     bytes_referenced;   /* content queued without copying */
+} CcnetPeerSendStats;
+
+void        ccnet_peer_get_send_stats (CcnetPeerSendStats *stats);
+
 /* middle level IO */
 
 void        ccnet_peer_set_io (CcnetPeer *peer, struct CcnetPacketIO *io);
@@ -36,6 +36,7 @@ struct ServiceGroup service_groups[] = {
     { "receive-session-key",            "basic" },
     { "receive-skey2",                  "basic" },
     { "receive-msg",                    "basic" },
+    { "receive-msg-stream",             "basic" },
     { "echo",                           "basic" },
     { "ccnet-rpcserver",                "rpc-inner" },
 #ifdef CCNET_SERVER
@@ -86,6 +86,8 @@ GType ccnet_putpubinfo_proc_get_type ();
 
 GType ccnet_sendmsg_proc_get_type ();
 GType ccnet_rcvmsg_proc_get_type ();
+GType ccnet_sendmsg_stream_proc_get_type ();
+GType ccnet_rcvmsg_stream_proc_get_type ();
 
 GType ccnet_rcvcmd_proc_get_type ();
 GType ccnet_getperm_proc_get_type ();
@@ -125,6 +127,10 @@ ccnet_proc_factory_new (CcnetSession *session)
                                            ccnet_sendmsg_proc_get_type ());
     ccnet_proc_factory_register_processor (factory, "receive-msg",
                                            ccnet_rcvmsg_proc_get_type ());
+    ccnet_proc_factory_register_processor (factory, "send-msg-stream",
+                                           ccnet_sendmsg_stream_proc_get_type ());
+    ccnet_proc_factory_register_processor (factory, "receive-msg-stream",
+                                           ccnet_rcvmsg_stream_proc_get_type ());
 
     ccnet_proc_factory_register_processor (factory, "receive-cmd",
                                            ccnet_rcvcmd_proc_get_type ());
@@ -58,7 +58,7 @@ ccnet_processor_class_init (CcnetProcessorClass *klass)
 static void
 ccnet_processor_init (CcnetProcessor *processor)
 {
-    
+    ccnet_wheel_timer_init (&processor->idle_timer);
 }
 
 int ccnet_processor_start (CcnetProcessor *processor, int argc, char **argv)
@@ -127,6 +127,7 @@ static void default_release_resource(CcnetProcessor *processor)
 {
     if (processor->retry_timer)
         ccnet_timer_free (&processor->retry_timer);
+    ccnet_wheel_timer_cancel (&processor->idle_timer);
 
     g_free (processor->name);
     if (processor->peer) {
@@ -405,6 +406,20 @@ ccnet_processor_send_response (CcnetProcessor *processor,
                               code, code_msg, content, clen);
 }
 
+void
+ccnet_processor_send_response_full (CcnetProcessor *processor,
+                                    const char *code,
+                                    const char *code_msg,
+                                    const char *content, int clen,
+                                    GDestroyNotify free_func,
+                                    void *free_data)
+{
+    ccnet_peer_send_response_full (processor->peer,
+                                   RESPONSE_ID (processor->id),
+                                   code, code_msg, content, clen,
+                                   free_func, free_data);
+}
+
 void ccnet_processor_keep_alive (CcnetProcessor *processor)
 {
     if (IS_SLAVE (processor))
@@ -9,6 +9,7 @@
 #include <status-code.h>
 
 #include "list.h"
+#include "timer-wheel.h"
 
 struct CcnetSession;
 struct _CcnetPeer;
@@ -52,6 +53,10 @@ struct _CcnetProcessor {
     struct CcnetTimer     *retry_timer;
     int                    num_retry;
 
+    /* Coarse timeout on the session timer wheel, cancelled
+     * automatically in default_release_resource(). */
+    CcnetWheelTimer        idle_timer;
+
     int                    err_code;
 
     time_t                 start_time;    
@@ -59,6 +64,9 @@ struct _CcnetProcessor {
     /* Set to 1 if removed from peer->processors */
     unsigned int           detached  : 1;
 
+    /* Started by a one-shot rpc request, see peer.c. */
+    unsigned int           one_shot  : 1;
+
     struct list_head       list;
 
     /* last time when a packet received  */
@@ -112,6 +120,11 @@ struct _CcnetProcessorClass {
 
     char          *name;
 
+    /* Can serve one-shot rpc requests: start() sends no reply when
+     * processor->one_shot is set, and the processor is done after it
+     * sent SC_SERVER_RET. */
+    gboolean       one_shot_rpc;
+
     /* pure virtual function */
     int       (*start)           (CcnetProcessor *processor, 
                                   int argc, char **argv);
@@ -177,6 +190,14 @@ void ccnet_processor_send_response(CcnetProcessor *processor,
                                    const char *code_msg,
                                    const char *content, int clen);
 
+/* See ccnet_peer_send_response_full(). */
+void ccnet_processor_send_response_full (CcnetProcessor *processor,
+                                         const char *code,
+                                         const char *code_msg,
+                                         const char *content, int clen,
+                                         GDestroyNotify free_func,
+                                         void *free_data);
+
 void ccnet_processor_keep_alive (CcnetProcessor *processor);
 
 /*
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 
 #include "keepalive2-proc.h"
@@ -12,6 +13,7 @@
 #include "peer.h"
 #include "session.h"
 #include "peer-mgr.h"
+#include "ticket-mgr.h"
 
 #include "processor.h"
 #include "proc-factory.h"
@@ -34,7 +36,9 @@ enum {
     WAIT_PUBKEY,
     WAIT_CHALLENGE,
     WAIT_KEEPALIVE,
-    FULL
+    FULL,
+    WAIT_RESUME,
+    WAIT_RESUME_KEY
 };
 
 
@@ -71,6 +75,25 @@ enum {
      FULL (keepalive interval)
 
      ....
+
+  Session resumption: once the session key is set, the slave may attach
+  a ticket (see ticket-mgr.h) to its 300 response. On the next connection
+  the master presents it instead of doing the RSA challenge:
+
+                 312 <nonce_m> [enc]  <ticket>
+    WAIT_RESUME ----------------->
+               <-----------------
+                 312 <nonce_s> <proof_s>     (or 314 if ticket rejected,
+                                              then fall back to 311)
+                 313 <proof_m>
+ WAIT_RESUME_KEY ----------------->
+               <-----------------
+                 313 <flags>
+
+  The proofs are HMACs of both nonces under the key in the ticket. If
+  the master would have sent the session key, the slave derives a new
+  one from the ticket key and the nonces and sets flag 'k' ('e' if the
+  channel is encrypted too), so send-skey2 is skipped as well.
  */
 
 
@@ -80,11 +103,26 @@ enum {
 #define SS_BAD_CHALLENGE "Bad challenge format"
 #define SC_DECRYPT_ERROR "412"
 #define SS_DECRYPT_ERROR "Decrypt error"
+#define SC_RESUME "312"
+#define SC_RESUME_KEY "313"
+#define SC_RESUME_REJECTED "314"
+#define SS_RESUME_REJECTED "Ticket rejected"
+
+#define RESUME_NONCE_LEN 20
 
 
 typedef struct  {
     unsigned char random_buf[40];
     int count;
+
+    /* session resumption */
+    unsigned char nonce_m[RESUME_NONCE_LEN];
+    unsigned char nonce_s[RESUME_NONCE_LEN];
+    char resume_key[CCNET_TICKET_KEY_LEN + 1];
+    unsigned int resume_pending : 1;
+    unsigned int want_encrypt : 1;
+
+    gint64 start_time;
 } CcnetKeepalive2ProcPriv;
 
 extern CcnetSession *session;
@@ -197,19 +235,19 @@ static int timeout_cb(CcnetProcessor *processor)
     return FALSE;
 }
 
+/* Called on every packet, so use the timer wheel, re-arming is cheap. */
 static void reset_timeout(CcnetProcessor *processor)
 {
-    if (processor->retry_timer)
-        ccnet_timer_free(&processor->retry_timer);
-    processor->retry_timer = ccnet_timer_new ((TimerCB)timeout_cb, processor,
-                                             KEEPALIVE_INTERVAL);
+    ccnet_wheel_timer_arm (processor->session->timer_wheel,
+                           &processor->idle_timer, KEEPALIVE_INTERVAL,
+                           (TimerCB)timeout_cb, processor);
 }
 
 static void close_processor(CcnetProcessor *processor)
 {
     CcnetPeer *peer = processor->peer;
 
-    ccnet_timer_free (&processor->retry_timer);
+    ccnet_wheel_timer_cancel (&processor->idle_timer);
     ccnet_processor_done (processor, FALSE);
     ccnet_peer_shutdown (peer);
     peer->num_fails++;
@@ -230,6 +268,7 @@ static int keepalive2_start (CcnetProcessor *processor,
     /* master */
     g_assert (processor->peer->keepalive_sending == 0);
     priv->count = 0;
+    priv->start_time = get_current_time ();
     processor->state = INIT;
     processor->peer->keepalive_sending = 1;
     send_request (processor);
@@ -277,11 +316,26 @@ static void verify_challenge(CcnetProcessor *processor,
                              char *code, char *code_msg,
                              char *content, int clen);
 
+static void verify_resume(CcnetProcessor *processor,
+                          char *code, char *code_msg,
+                          char *content, int clen);
+
+static void recv_resume_key(CcnetProcessor *processor,
+                            char *code, char *code_msg,
+                            char *content, int clen);
+
+static void recv_resume_rejected(CcnetProcessor *processor,
+                                 char *code, char *code_msg,
+                                 char *content, int clen);
+
 static struct Handler rsp_handler_tab[] = {
     { "200", recv_ok }, 
     { "300", recv_keepalive_rsp },
     { "310", recv_pubkey },
     { "311", verify_challenge },
+    { "312", verify_resume },
+    { "313", recv_resume_key },
+    { "314", recv_resume_rejected },
     { 0 },
 };
 
@@ -324,6 +378,40 @@ static void send_challenge(CcnetProcessor *processor)
     reset_timeout (processor);
 }
 
+/* Present the ticket this peer gave us last time. Returns FALSE if
+ * there is no ticket to use. */
+static gboolean send_resume(CcnetProcessor *processor)
+{
+    CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
+    CcnetPeer *peer = processor->peer;
+    char buf[64];
+
+    if (!peer->resume_ticket || !peer->resume_key)
+        return FALSE;
+
+    ccnet_debug ("[Keepalive] Resume session with %s(%.8s)\n",
+                 peer->name, peer->id);
+
+    RAND_pseudo_bytes (priv->nonce_m, RESUME_NONCE_LEN);
+    rawdata_to_hex (priv->nonce_m, buf, RESUME_NONCE_LEN);
+    if (ccnet_session_should_encrypt_channel (processor->session))
+        strcat (buf, " enc");
+    memcpy (priv->resume_key, peer->resume_key, CCNET_TICKET_KEY_LEN + 1);
+
+    ccnet_processor_send_update (processor, SC_RESUME, buf,
+                                 peer->resume_ticket, peer->resume_ticket_len);
+
+    /* a ticket is only good for one try */
+    g_free (peer->resume_ticket);
+    peer->resume_ticket = NULL;
+    g_free (peer->resume_key);
+    peer->resume_key = NULL;
+
+    processor->state = WAIT_RESUME;
+    reset_timeout (processor);
+    return TRUE;
+}
+
 static void get_pubkey(CcnetProcessor *processor)
 {
     ccnet_processor_send_update (processor,
@@ -342,6 +430,8 @@ static void recv_ok(CcnetProcessor *processor,
     }
     
     if (processor->peer->pubkey) {
+        if (send_resume (processor))
+            return;
         ccnet_debug ("[Keepalive] Receive ok, send challenge\n");
         send_challenge(processor);
     } else {
@@ -381,8 +471,20 @@ static void recv_keepalive_rsp(CcnetProcessor *processor,
                                char *code, char *code_msg,
                                char *content, int clen)
 {
+    CcnetPeer *peer = processor->peer;
+
     /* ccnet_debug ("[Keepalive] Receive keepalive responese from peer %.8s #%s\n", */
     /*              processor->peer->id, code_msg); */
+
+    /* the peer handed us a resumption ticket for the current key */
+    if (clen > 0 && peer->session_key) {
+        g_free (peer->resume_ticket);
+        g_free (peer->resume_key);
+        peer->resume_ticket = g_memdup (content, clen);
+        peer->resume_ticket_len = clen;
+        peer->resume_key = g_strdup (peer->session_key);
+    }
+
     processor->state = FULL;
 }
 
@@ -441,6 +543,25 @@ send_session_key (CcnetPeer *peer)
     }
 }
 
+static void on_peer_verified(CcnetProcessor *processor, gboolean has_skey)
+{
+    CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
+
+    ccnet_debug ("[Keepalive] Peer %.8s verified in %d ms\n",
+                 processor->peer->id,
+                 (int)((get_current_time() - priv->start_time) / 1000));
+
+    get_peer_pubinfo (processor->peer);
+    /* ccnet_peer_manager_notify_peer_role (processor->peer->manager,  */
+    /*                                      processor->peer); */
+
+    if (!has_skey && strcmp(session->base.id, processor->peer->id) < 0)
+        send_session_key (processor->peer);
+        
+    send_keepalive (processor);
+    reset_timeout (processor);
+}
+
 static void verify_challenge(CcnetProcessor *processor, 
                              char *code, char *code_msg,
                              char *content, int clen)
@@ -455,16 +576,90 @@ static void verify_challenge(CcnetProcessor *processor,
 
     ccnet_debug ("[Keepalive] Verify Peer Challenge\n");
 
-    get_peer_pubinfo (processor->peer);
-    /* ccnet_peer_manager_notify_peer_role (processor->peer->manager,  */
-    /*                                      processor->peer); */
+    on_peer_verified (processor, FALSE);
+}
 
-    if (strcmp(session->base.id, processor->peer->id) < 0)
-        send_session_key (processor->peer);
-        
-    send_keepalive (processor);
+static void verify_resume(CcnetProcessor *processor,
+                          char *code, char *code_msg,
+                          char *content, int clen)
+{
+    CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
+    char proof[41];
+
+    if (processor->state != WAIT_RESUME) {
+        close_processor (processor);
+        return;
+    }
+
+    /* "<nonce_s> <proof_s>" */
+    if (!code_msg || strlen(code_msg) != 81 || code_msg[40] != ' ' ||
+        hex_to_rawdata (code_msg, priv->nonce_s, RESUME_NONCE_LEN) < 0) {
+        ccnet_debug ("[Keepalive] Bad resume response\n");
+        close_processor (processor);
+        return;
+    }
+
+    ccnet_ticket_compute_proof (priv->resume_key, "keepalive2 slave",
+                                priv->nonce_m, priv->nonce_s,
+                                RESUME_NONCE_LEN, proof);
+    if (CRYPTO_memcmp (proof, code_msg + 41, 40) != 0) {
+        ccnet_debug ("[Conn] Peer resume proof failed\n");
+        close_processor (processor);
+        return;
+    }
+
+    ccnet_ticket_compute_proof (priv->resume_key, "keepalive2 master",
+                                priv->nonce_m, priv->nonce_s,
+                                RESUME_NONCE_LEN, proof);
+    ccnet_processor_send_update (processor, SC_RESUME_KEY, proof, NULL, 0);
+
+    processor->state = WAIT_RESUME_KEY;
     reset_timeout (processor);
-    return;
+}
+
+static void recv_resume_key(CcnetProcessor *processor,
+                            char *code, char *code_msg,
+                            char *content, int clen)
+{
+    CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
+    CcnetPeer *peer = processor->peer;
+    char skey[41];
+    gboolean has_skey = FALSE;
+
+    if (processor->state != WAIT_RESUME_KEY) {
+        close_processor (processor);
+        return;
+    }
+
+    ccnet_debug ("[Keepalive] Resumed session with %s(%.8s)\n",
+                 peer->name, peer->id);
+
+    if (code_msg && strchr (code_msg, 'k') && !peer->session_key) {
+        ccnet_ticket_compute_proof (priv->resume_key, "keepalive2 skey",
+                                    priv->nonce_m, priv->nonce_s,
+                                    RESUME_NONCE_LEN, skey);
+        peer->session_key = g_strdup (skey);
+        if (strchr (code_msg, 'e'))
+            ccnet_peer_prepare_channel_encryption (peer);
+        ccnet_peer_manager_on_peer_session_key_sent (peer->manager, peer);
+        has_skey = TRUE;
+    }
+
+    on_peer_verified (processor, has_skey);
+}
+
+static void recv_resume_rejected(CcnetProcessor *processor,
+                                 char *code, char *code_msg,
+                                 char *content, int clen)
+{
+    if (processor->state != WAIT_RESUME) {
+        close_processor (processor);
+        return;
+    }
+
+    ccnet_debug ("[Keepalive] Ticket rejected by %.8s, send challenge\n",
+                 processor->peer->id);
+    send_challenge (processor);
 }
 
 static void handle_response (CcnetProcessor *processor, 
@@ -504,11 +699,21 @@ static void response_challenge(CcnetProcessor *processor,
                                char *code, char *code_msg,
                                char *content, int clen);
 
+static void response_resume(CcnetProcessor *processor,
+                            char *code, char *code_msg,
+                            char *content, int clen);
+
+static void response_resume_key(CcnetProcessor *processor,
+                                char *code, char *code_msg,
+                                char *content, int clen);
+
 
 static struct Handler update_handler_tab[] = {
     { "300", receive_keepalive },
     { "310", send_pubkey },
     { "311", response_challenge },
+    { "312", response_resume },
+    { "313", response_resume_key },
     { 0 },
 };
 
@@ -554,10 +759,27 @@ static void receive_keepalive(CcnetProcessor *processor,
                               char *code, char *code_msg,
                               char *content, int clen)
 {
+    CcnetPeer *peer = processor->peer;
+    CcnetTicketManager *ticket_mgr = processor->session->ticket_mgr;
+    char *ticket = NULL;
+    int len = 0;
+
     /* ccnet_debug ("[Keepalive] Receive keepalive from %.8s #%s\n", */
     /*              processor->peer->id, code_msg); */
+
+    /* Once the session key is set, hand the peer a ticket so its next
+     * connection can skip the RSA handshake. Renew it at half life. */
+    if (peer->session_key &&
+        time(NULL) - peer->ticket_issued > ticket_mgr->lifetime / 2) {
+        ticket = ccnet_ticket_manager_issue (ticket_mgr, peer->id,
+                                             peer->session_key, &len);
+        if (ticket)
+            peer->ticket_issued = time(NULL);
+    }
+
     ccnet_processor_send_response (
-        processor, code, code_msg, NULL, 0);
+        processor, code, code_msg, ticket, len);
+    g_free (ticket);
 }
 
 static void send_pubkey(CcnetProcessor *processor, 
@@ -598,3 +820,83 @@ static void response_challenge(CcnetProcessor *processor,
             processor, code, "", (char *)buf, decrypt_len);
     g_free(buf);
 }
+
+static void response_resume(CcnetProcessor *processor,
+                            char *code, char *code_msg,
+                            char *content, int clen)
+{
+    CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
+    char buf[128];
+
+    if (!code_msg || strlen(code_msg) < 40 ||
+        hex_to_rawdata (code_msg, priv->nonce_m, RESUME_NONCE_LEN) < 0 ||
+        clen == 0 ||
+        ccnet_ticket_manager_open (processor->session->ticket_mgr,
+                                   content, clen, processor->peer->id,
+                                   priv->resume_key) < 0) {
+        ccnet_debug ("[Keepalive] Reject ticket from %.8s\n",
+                     processor->peer->id);
+        ccnet_processor_send_response (
+            processor, SC_RESUME_REJECTED, SS_RESUME_REJECTED, NULL, 0);
+        return;
+    }
+
+    priv->want_encrypt = (strstr (code_msg + 40, "enc") != NULL);
+    priv->resume_pending = 1;
+
+    RAND_pseudo_bytes (priv->nonce_s, RESUME_NONCE_LEN);
+    rawdata_to_hex (priv->nonce_s, buf, RESUME_NONCE_LEN);
+    buf[40] = ' ';
+    ccnet_ticket_compute_proof (priv->resume_key, "keepalive2 slave",
+                                priv->nonce_m, priv->nonce_s,
+                                RESUME_NONCE_LEN, buf + 41);
+
+    ccnet_processor_send_response (processor, code, buf, NULL, 0);
+}
+
+static void response_resume_key(CcnetProcessor *processor,
+                                char *code, char *code_msg,
+                                char *content, int clen)
+{
+    CcnetKeepalive2ProcPriv *priv = GET_PRIV (processor);
+    CcnetPeer *peer = processor->peer;
+    char proof[41];
+    gboolean adopt, encrypt;
+
+    if (priv->resume_pending)
+        ccnet_ticket_compute_proof (priv->resume_key, "keepalive2 master",
+                                    priv->nonce_m, priv->nonce_s,
+                                    RESUME_NONCE_LEN, proof);
+    if (!priv->resume_pending || !code_msg || strlen(code_msg) != 40 ||
+        CRYPTO_memcmp (proof, code_msg, 40) != 0) {
+        ccnet_warning ("Peer %s(%.8s) send bad resume proof\n",
+                       peer->name, peer->id);
+        ccnet_processor_send_response (
+            processor, SC_BAD_CHALLENGE, SS_BAD_CHALLENGE, NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+    priv->resume_pending = 0;
+
+    /* Take over the session key in place of receive-skey2, when the
+     * peer is the one that would have sent it. */
+    adopt = (!peer->session_key && strcmp(session->base.id, peer->id) > 0);
+    encrypt = adopt && priv->want_encrypt &&
+        ccnet_session_should_encrypt_channel (processor->session);
+
+    if (adopt) {
+        ccnet_ticket_compute_proof (priv->resume_key, "keepalive2 skey",
+                                    priv->nonce_m, priv->nonce_s,
+                                    RESUME_NONCE_LEN, proof);
+        peer->session_key = g_strdup (proof);
+    }
+
+    ccnet_processor_send_response (processor, code,
+                                   encrypt ? "ke" : (adopt ? "k" : "-"),
+                                   NULL, 0);
+
+    if (encrypt && ccnet_peer_prepare_channel_encryption (peer) < 0)
+        ccnet_warning ("Error in prepare channel encryption\n");
+    if (adopt)
+        ccnet_peer_manager_on_peer_session_key_received (peer->manager, peer);
+}
@@ -12,6 +12,8 @@
 #define DEBUG_FLAG CCNET_DEBUG_MESSAGE
 #include "log.h"
 
+#include <ccnet/message-wire.h>
+
 #define SC_MSG "300"
 
 enum {
@@ -23,6 +25,7 @@ typedef struct {
     int n_app;
     char **apps;
     int subscribed : 1;
+    int binary : 1;             /* client negotiated binary messages */
 } MqserverProcPriv;
 
 #define GET_PRIV(o)  \
@@ -101,24 +104,38 @@ mq_server_start (CcnetProcessor *processor, int argc, char **argv)
     MqserverProcPriv *priv = GET_PRIV (processor);
     int i;
 
-    priv->n_app = argc;
     priv->apps = g_new (char*, argc);
-    for (i = 0; i < argc; ++i)
-        priv->apps[i] = g_strdup (argv[i]);
+    for (i = 0; i < argc; ++i) {
+        if (strcmp (argv[i], CCNET_MSG_WIRE_OPTION) == 0) {
+            priv->binary = 1;
+            continue;
+        }
+        priv->apps[priv->n_app++] = g_strdup (argv[i]);
+    }
 
     subscribe_message (processor);
 
-    ccnet_processor_send_response (processor, "200", "OK", NULL, 0);
+    /* Old clients only check the status code, so the binary ack is
+     * carried in the status message. */
+    ccnet_processor_send_response (processor, "200",
+                                   priv->binary ? CCNET_MSG_WIRE_SS_OK : "OK",
+                                   NULL, 0);
     return 0;
 }
 
 static void send_message (CcnetProcessor *processor, CcnetMessage *message)
 {
-    GString *buf = g_string_new (NULL);
-
-    ccnet_message_to_string_buf_local (message, buf);
-    ccnet_processor_send_response (processor, SC_MSG, NULL,
-                                   buf->str, buf->len+1);
+    MqserverProcPriv *priv = GET_PRIV (processor);
+    GString *buf = g_string_sized_new (CCNET_MSG_WIRE_HEADER_LEN + 256);
+
+    if (priv->binary && ccnet_message_to_binary_buf (message, buf) == 0) {
+        ccnet_processor_send_response (processor, SC_BIN_MSG, NULL,
+                                       buf->str, buf->len);
+    } else {
+        ccnet_message_to_string_buf_local (message, buf);
+        ccnet_processor_send_response (processor, SC_MSG, NULL,
+                                       buf->str, buf->len+1);
+    }
     g_string_free (buf, TRUE);
 }
 
@@ -142,10 +159,20 @@ static void handle_update (CcnetProcessor *processor,
         return;
     }
 
-    if (code[2] == '0') {
-        /* SC_MSG */
+    if (code[2] == '0' || code[2] == '2') {
+        /* SC_MSG or SC_BIN_MSG */
         CcnetMessage *msg;
-        msg = ccnet_message_from_string_local (content, clen);
+        if (code[2] == '0')
+            msg = ccnet_message_from_string_local (content, clen);
+        else
+            msg = ccnet_message_from_binary (content, clen);
+        if (!msg) {
+            ccnet_warning ("received bad message from %.8s\n",
+                           processor->peer->id);
+            ccnet_processor_send_response (processor, SC_BAD_UPDATE_CODE,
+                                           SS_BAD_UPDATE_CODE, NULL, 0);
+            return;
+        }
 
         /* ccnet_debug ("[msg] send msg: %.10s\n", msg->body); */
 
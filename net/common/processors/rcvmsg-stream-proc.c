@@ -0,0 +1,102 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "peer.h"
+#include "message.h"
+#include "session.h"
+#include "message-manager.h"
+#include "peer-mgr.h"
+#include "rcvmsg-stream-proc.h"
+#include "sendmsg-stream-proc.h"
+#include "algorithms.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_MESSAGE
+#include "log.h"
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen);
+
+
+G_DEFINE_TYPE (CcnetRcvmsgStreamProc, ccnet_rcvmsg_stream_proc, CCNET_TYPE_PROCESSOR)
+
+static void
+ccnet_rcvmsg_stream_proc_class_init (CcnetRcvmsgStreamProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "rcvmsg-stream-proc";
+    proc_class->start = start;
+    proc_class->handle_update = handle_update;
+}
+
+static void
+ccnet_rcvmsg_stream_proc_init (CcnetRcvmsgStreamProc *processor)
+{
+}
+
+static int start (CcnetProcessor *processor, int argc, char **argv)
+{
+    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+    return 0;
+}
+
+static void
+receive_one (CcnetProcessor *processor, char *buf, int len)
+{
+    CcnetMessage *msg;
+
+    if (processor->peer->is_local) {
+        msg = ccnet_message_from_string_local (buf, len);
+        if (!msg)
+            return;
+        ccnet_send_message (processor->session, msg);
+        ccnet_message_unref (msg);
+        return;
+    }
+
+    msg = ccnet_message_from_string (buf, len);
+    if (!msg)
+        return;
+    msg->rtime = time(NULL);
+    ccnet_debug ("[msg] Received a message : %s - %.10s\n",
+                 msg->app, msg->body);
+
+    /* One bad message must not close the stream. */
+    if (ccnet_recv_message (processor->session, msg) == -1)
+        ccnet_message ("[msg] Message from %.8s permission error\n",
+                       msg->from);
+    ccnet_message_unref (msg);
+}
+
+static void handle_update (CcnetProcessor *processor,
+                           char *code, char *code_msg,
+                           char *content, int clen)
+{
+    char *p, *end, *nul;
+
+    if (memcmp (code, SC_MSG_BATCH, 3) != 0) {
+        ccnet_processor_send_response (processor, SC_BAD_UPDATE_CODE,
+                                       SS_BAD_UPDATE_CODE, NULL, 0);
+        ccnet_processor_done (processor, FALSE);
+        return;
+    }
+
+    /* '\0' separated messages */
+    p = content;
+    end = content + clen;
+    while (p < end) {
+        if (!(nul = memchr (p, '\0', end - p))) {
+            ccnet_message ("[msg] Truncated message batch from %.8s\n",
+                           processor->peer->id);
+            break;
+        }
+        receive_one (processor, p, nul - p + 1);
+        p = nul + 1;
+    }
+
+    /* ack */
+    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+}
@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_RCVMSG_STREAM_PROC_H
+#define CCNET_RCVMSG_STREAM_PROC_H
+
+#include <glib-object.h>
+#include "processor.h"
+
+#define CCNET_TYPE_RCVMSG_STREAM_PROC                  (ccnet_rcvmsg_stream_proc_get_type ())
+#define CCNET_RCVMSG_STREAM_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_RCVMSG_STREAM_PROC, CcnetRcvmsgStreamProc))
+#define CCNET_IS_RCVMSG_STREAM_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CCNET_TYPE_RCVMSG_STREAM_PROC))
+#define CCNET_RCVMSG_STREAM_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), CCNET_TYPE_RCVMSG_STREAM_PROC, CcnetRcvmsgStreamProcClass))
+#define CCNET_IS_RCVMSG_STREAM_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), CCNET_TYPE_RCVMSG_STREAM_PROC))
+#define CCNET_RCVMSG_STREAM_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), CCNET_TYPE_RCVMSG_STREAM_PROC, CcnetRcvmsgStreamProcClass))
+
+typedef struct _CcnetRcvmsgStreamProc CcnetRcvmsgStreamProc;
+typedef struct _CcnetRcvmsgStreamProcClass CcnetRcvmsgStreamProcClass;
+
+struct _CcnetRcvmsgStreamProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _CcnetRcvmsgStreamProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType ccnet_rcvmsg_stream_proc_get_type ();
+
+#endif
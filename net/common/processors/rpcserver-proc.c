@@ -5,6 +5,7 @@
 #include <searpc-server.h>
 #include "rpcserver-proc.h"
 #include "rpc-common.h"
+#include "metrics.h"
 
 #define DEBUG_FLAG CCNET_DEBUG_PEER
 #include "log.h"
@@ -50,6 +51,7 @@ ccnet_rpcserver_proc_class_init (CcnetRpcserverProcClass *klass)
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
     proc_class->name = "rpcserver-proc";
+    proc_class->one_shot_rpc = TRUE;
 
     g_type_class_add_private (klass, sizeof(CcnetRpcserverProcPriv));
 }
@@ -65,7 +67,8 @@ start (CcnetProcessor *processor, int argc, char **argv)
 {
     /* CcnetRpcserverProcPriv *priv = GET_PRIV (processor); */
     /* gettimeofday(&priv->start, NULL); */
-    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+    if (!processor->one_shot)
+        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
 
     return 0;
 }
@@ -81,14 +84,18 @@ handle_update (CcnetProcessor *processor,
     if (memcmp (code, SC_CLIENT_CALL, 3) == 0) {
         gsize ret_len;
         char *svc_name = processor->name;
+        gint64 start = get_current_time ();
         char *ret = searpc_server_call_function (svc_name, content, clen, &ret_len);
 
+        ccnet_metrics_record_rpc (content, clen, get_current_time () - start);
+
         g_assert (ret);
         if (ret_len < MAX_TRANSFER_LENGTH) {
-            ccnet_processor_send_response (
-                processor, SC_SERVER_RET, SS_SERVER_RET, ret, ret_len);
-            g_free (ret);
-            /* ccnet_processor_done (processor, TRUE); */
+            ccnet_processor_send_response_full (
+                processor, SC_SERVER_RET, SS_SERVER_RET, ret, ret_len,
+                g_free, ret);
+            if (processor->one_shot)
+                ccnet_processor_done (processor, TRUE);
             return;
         }
 
@@ -115,11 +122,13 @@ handle_update (CcnetProcessor *processor,
             priv->off += MAX_TRANSFER_LENGTH;
         } else {
             /* fprintf (stderr, "Send %d\n", priv->len - priv->off); */
-            ccnet_processor_send_response (
+            ccnet_processor_send_response_full (
                 processor, SC_SERVER_RET, SS_SERVER_RET,
-                priv->buf + priv->off, priv->len - priv->off);
-            g_free (priv->buf);
-            /* ccnet_processor_done (processor, TRUE); */
+                priv->buf + priv->off, priv->len - priv->off,
+                g_free, priv->buf);
+            priv->buf = NULL;
+            if (processor->one_shot)
+                ccnet_processor_done (processor, TRUE);
         }
         return;
     }
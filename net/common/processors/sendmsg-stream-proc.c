@@ -0,0 +1,221 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "session.h"
+#include "peer.h"
+#include "message.h"
+#include "timer.h"
+#include "algorithms.h"
+#include "sendmsg-stream-proc.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_MESSAGE
+#include "log.h"
+
+#define MSG_STREAM_WINDOW      16       /* unacked batches */
+#define MSG_STREAM_BATCH_MAX   60000    /* bytes, must fit in a packet */
+#define MSG_STREAM_QUEUE_MAX   10000    /* messages */
+
+enum {
+    INIT,
+    REQUEST_SENT,
+    CONNECTED
+};
+
+typedef struct  {
+    GQueue       *pending;      /* of CcnetMessage */
+    int           n_inflight;
+    CcnetTimer   *flush_timer;
+} CcnetSendmsgStreamProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_SENDMSG_STREAM_PROC, CcnetSendmsgStreamProcPriv))
+
+static int start (CcnetProcessor *processor, int argc, char **argv);
+static void handle_response (CcnetProcessor *processor,
+                             char *code, char *code_msg,
+                             char *content, int clen);
+
+G_DEFINE_TYPE (CcnetSendmsgStreamProc, ccnet_sendmsg_stream_proc, CCNET_TYPE_PROCESSOR)
+
+static void
+release_resource(CcnetProcessor *processor)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+    CcnetMessage *msg;
+
+    if (processor->peer->msg_stream == processor)
+        processor->peer->msg_stream = NULL;
+
+    if (priv->flush_timer)
+        ccnet_timer_free (&priv->flush_timer);
+
+    /* Like one-shot send-msg, messages are lost if the peer goes down. */
+    while ((msg = g_queue_pop_head (priv->pending)) != NULL)
+        ccnet_message_unref (msg);
+    g_queue_free (priv->pending);
+    priv->pending = NULL;
+
+    CCNET_PROCESSOR_CLASS (ccnet_sendmsg_stream_proc_parent_class)->release_resource (processor);
+}
+
+static void
+ccnet_sendmsg_stream_proc_class_init (CcnetSendmsgStreamProcClass *klass)
+{
+    CcnetProcessorClass *proc_class = CCNET_PROCESSOR_CLASS (klass);
+
+    proc_class->name = "sendmsg-stream-proc";
+    proc_class->start = start;
+    proc_class->handle_response = handle_response;
+    proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (CcnetSendmsgStreamProcPriv));
+}
+
+static void
+ccnet_sendmsg_stream_proc_init (CcnetSendmsgStreamProc *processor)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+
+    priv->pending = g_queue_new ();
+}
+
+static int
+start (CcnetProcessor *processor, int argc, char **argv)
+{
+    ccnet_processor_send_request (processor, "receive-msg-stream");
+    processor->state = REQUEST_SENT;
+
+    return 0;
+}
+
+/* Pack as many queued messages as fit into one update. */
+static void
+send_batch (CcnetProcessor *processor)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+    GString *batch = g_string_new (NULL);
+    GString *buf = g_string_new (NULL);
+    CcnetMessage *msg;
+
+    while ((msg = g_queue_peek_head (priv->pending)) != NULL) {
+        ccnet_message_to_string_buf (msg, buf);
+        if (batch->len > 0 && batch->len + buf->len + 1 > MSG_STREAM_BATCH_MAX)
+            break;
+
+        /* including '\0' */
+        g_string_append_len (batch, buf->str, buf->len + 1);
+        g_queue_pop_head (priv->pending);
+        ccnet_message_unref (msg);
+    }
+
+    ccnet_processor_send_update (processor, SC_MSG_BATCH, SS_MSG_BATCH,
+                                 batch->str, batch->len);
+    priv->n_inflight++;
+
+    g_string_free (buf, TRUE);
+    g_string_free (batch, TRUE);
+}
+
+static void
+flush (CcnetProcessor *processor)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+
+    while (priv->n_inflight < MSG_STREAM_WINDOW &&
+           !g_queue_is_empty (priv->pending))
+        send_batch (processor);
+}
+
+static int
+flush_cb (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+
+    priv->flush_timer = NULL;
+    flush (processor);
+    return FALSE;
+}
+
+/* Flush once the current loop iteration is done, so that messages sent
+ * together go out in one batch. */
+static void
+schedule_flush (CcnetProcessor *processor)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+
+    if (processor->state == CONNECTED && !priv->flush_timer)
+        priv->flush_timer = ccnet_timer_new (flush_cb, processor, 0);
+}
+
+/* The peer doesn't know the stream, resend the queue one by one. */
+static void
+fall_back (CcnetProcessor *processor)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+    CcnetPeer *peer = processor->peer;
+    CcnetMessage *msg;
+
+    ccnet_debug ("[msg] %.8s has no message stream, fall back to send-msg\n",
+                 peer->id);
+
+    peer->no_msg_stream = 1;
+    if (peer->msg_stream == processor)
+        peer->msg_stream = NULL;
+
+    while ((msg = g_queue_pop_head (priv->pending)) != NULL) {
+        ccnet_send_message (processor->session, msg);
+        ccnet_message_unref (msg);
+    }
+}
+
+static void
+handle_response (CcnetProcessor *processor,
+                 char *code, char *code_msg,
+                 char *content, int clen)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (processor);
+
+    switch (processor->state) {
+    case REQUEST_SENT:
+        if (memcmp (code, SC_OK, 3) != 0) {
+            fall_back (processor);
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        processor->state = CONNECTED;
+        flush (processor);
+        break;
+    case CONNECTED:
+        if (memcmp (code, SC_OK, 3) != 0) {
+            ccnet_warning ("[msg] Bad response from %.8s: %s %s\n",
+                           processor->peer->id, code, code_msg);
+            ccnet_processor_done (processor, FALSE);
+            return;
+        }
+        priv->n_inflight--;
+        flush (processor);
+        break;
+    default:
+        break;
+    }
+}
+
+void
+ccnet_sendmsg_stream_proc_send (CcnetSendmsgStreamProc *proc,
+                                CcnetMessage *msg)
+{
+    CcnetSendmsgStreamProcPriv *priv = GET_PRIV (proc);
+    CcnetProcessor *processor = (CcnetProcessor *)proc;
+
+    if (g_queue_get_length (priv->pending) >= MSG_STREAM_QUEUE_MAX) {
+        ccnet_warning ("[msg] Message queue to %.8s is full, drop message\n",
+                       processor->peer->id);
+        return;
+    }
+
+    ccnet_message_ref (msg);
+    g_queue_push_tail (priv->pending, msg);
+    schedule_flush (processor);
+}
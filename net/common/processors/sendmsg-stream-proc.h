@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_SENDMSG_STREAM_PROC_H
+#define CCNET_SENDMSG_STREAM_PROC_H
+
+#include <glib-object.h>
+
+#include "processor.h"
+#include "message.h"
+
+#define CCNET_TYPE_SENDMSG_STREAM_PROC                  (ccnet_sendmsg_stream_proc_get_type ())
+#define CCNET_SENDMSG_STREAM_PROC(obj)                  (G_TYPE_CHECK_INSTANCE_CAST ((obj), CCNET_TYPE_SENDMSG_STREAM_PROC, CcnetSendmsgStreamProc))
+#define CCNET_IS_SENDMSG_STREAM_PROC(obj)               (G_TYPE_CHECK_INSTANCE_TYPE ((obj), CCNET_TYPE_SENDMSG_STREAM_PROC))
+#define CCNET_SENDMSG_STREAM_PROC_CLASS(klass)          (G_TYPE_CHECK_CLASS_CAST ((klass), CCNET_TYPE_SENDMSG_STREAM_PROC, CcnetSendmsgStreamProcClass))
+#define CCNET_IS_SENDMSG_STREAM_PROC_CLASS(klass)       (G_TYPE_CHECK_CLASS_TYPE ((klass), CCNET_TYPE_SENDMSG_STREAM_PROC))
+#define CCNET_SENDMSG_STREAM_PROC_GET_CLASS(obj)        (G_TYPE_INSTANCE_GET_CLASS ((obj), CCNET_TYPE_SENDMSG_STREAM_PROC, CcnetSendmsgStreamProcClass))
+
+/*
+ * Long-lived message channel to one peer (peer->msg_stream).
+ *
+ * Messages queued in the same loop iteration are packed into one
+ * update, NUL separated. The receiver acks every batch, and once a
+ * window of batches is unacked the rest wait in the queue. Peers without "receive-msg-stream" get the queued messages
+ * through one "send-msg" processor each, as before.
+ */
+
+/* update code of a message batch */
+#define SC_MSG_BATCH  "301"
+#define SS_MSG_BATCH  "message batch"
+
+typedef struct _CcnetSendmsgStreamProc CcnetSendmsgStreamProc;
+typedef struct _CcnetSendmsgStreamProcClass CcnetSendmsgStreamProcClass;
+
+struct _CcnetSendmsgStreamProc {
+    CcnetProcessor parent_instance;
+};
+
+struct _CcnetSendmsgStreamProcClass {
+    CcnetProcessorClass parent_class;
+};
+
+GType ccnet_sendmsg_stream_proc_get_type ();
+
+void
+ccnet_sendmsg_stream_proc_send (CcnetSendmsgStreamProc *proc,
+                                CcnetMessage *msg);
+
+#endif
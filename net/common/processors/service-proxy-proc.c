@@ -145,7 +145,8 @@ ccnet_service_proxy_invoke_local (CcnetProcessor *processor,
         return;
     }
 
-    priv->name = proc_name_strjoin_n(" ", argc, argv);
+    /* The name is only for logging, which is skipped for local
+     * services. */
 
     stub_proc = CCNET_SERVICE_STUB_PROC (
         ccnet_proc_factory_create_master_processor (
@@ -157,6 +158,12 @@ ccnet_service_proxy_invoke_local (CcnetProcessor *processor,
     ccnet_processor_start (CCNET_PROCESSOR(stub_proc), argc, argv);
 }
 
+CcnetProcessor *
+ccnet_service_proxy_proc_get_stub_proc (CcnetServiceProxyProc *proc)
+{
+    return (CcnetProcessor *)GET_PRIV (proc)->stub_proc;
+}
+
 static void handle_update (CcnetProcessor *processor,
                            char *code, char *code_msg,
                            char *content, int clen)
@@ -35,4 +35,7 @@ void ccnet_service_proxy_invoke_local (CcnetProcessor *processor,
                                        CcnetPeer *local,
                                        int argc, char **argv);
 
+CcnetProcessor *
+ccnet_service_proxy_proc_get_stub_proc (CcnetServiceProxyProc *proc);
+
 #endif
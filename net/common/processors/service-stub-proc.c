@@ -97,6 +97,12 @@ ccnet_service_stub_proc_set_proxy_proc (CcnetServiceStubProc *proc,
     priv->proxy_proc = (CcnetServiceProxyProc *)proxy_proc;
 }
 
+CcnetProcessor *
+ccnet_service_stub_proc_get_proxy_proc (CcnetServiceStubProc *proc)
+{
+    return (CcnetProcessor *)GET_PRIV (proc)->proxy_proc;
+}
+
 static void handle_response (CcnetProcessor *processor,
                              char *code, char *code_msg,
                              char *content, int clen)
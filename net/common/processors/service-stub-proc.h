@@ -33,6 +33,9 @@ GType ccnet_service_stub_proc_get_type ();
 void ccnet_service_stub_proc_set_proxy_proc (CcnetServiceStubProc *proc,
                                              CcnetProcessor *processor);
 
+CcnetProcessor *
+ccnet_service_stub_proc_get_proxy_proc (CcnetServiceStubProc *proc);
+
 void ccnet_service_stub_proc_send_update (CcnetServiceStubProc *proc,
                                           char *code, char *code_msg,
                                           char *content, int clen);
@@ -7,6 +7,9 @@
 #include "searpc-server.h"
 #include "rpc-common.h"
 #include "job-mgr.h"
+#include "json-stream.h"
+#include "utils.h"
+#include "metrics.h"
 
 typedef struct {
     char *call_buf;
@@ -15,6 +18,7 @@ typedef struct {
     gsize len;
     int   off;
     char *error_message;
+    CcnetJsonStream *stream;    /* set if the function streamed its result */
 } CcnetThreadedRpcserverProcPriv;
 
 #define GET_PRIV(o) \
@@ -33,6 +37,7 @@ release_resource(CcnetProcessor *processor)
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV (processor);
 
     g_free (priv->buf);
+    ccnet_json_stream_free (priv->stream);
 
     CCNET_PROCESSOR_CLASS (ccnet_threaded_rpcserver_proc_parent_class)->release_resource (processor);
 }
@@ -47,6 +52,7 @@ ccnet_threaded_rpcserver_proc_class_init (CcnetThreadedRpcserverProcClass *klass
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
     proc_class->name = "threaded-rpcserver-proc";
+    proc_class->one_shot_rpc = TRUE;
 
     g_type_class_add_private (klass, sizeof(CcnetThreadedRpcserverProcPriv));
 }
@@ -60,7 +66,8 @@ ccnet_threaded_rpcserver_proc_init (CcnetThreadedRpcserverProc *processor)
 static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
-    ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
+    if (!processor->one_shot)
+        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
 
     return 0;
 }
@@ -71,27 +78,75 @@ call_function_job (void *vprocessor)
     CcnetProcessor *processor = vprocessor;
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV(processor);
     char *svc_name = processor->name;
+    CcnetJsonStream *js = ccnet_json_stream_new (MAX_TRANSFER_LENGTH);
+    gint64 start = get_current_time ();
 
+    ccnet_json_stream_set_current (js);
     priv->buf = searpc_server_call_function (svc_name, priv->call_buf, priv->call_len,
                                              &priv->len);
+    ccnet_json_stream_set_current (NULL);
+    ccnet_metrics_record_rpc (priv->call_buf, priv->call_len,
+                              get_current_time () - start);
     g_free (priv->call_buf);
 
+    if (ccnet_json_stream_finished (js)) {
+        /* searpc only returned an empty list */
+        g_free (priv->buf);
+        priv->buf = NULL;
+        priv->stream = js;
+    } else
+        ccnet_json_stream_free (js);
+
     return vprocessor;
 }
 
+/* Streamed results are already split into MAX_TRANSFER_LENGTH chunks. */
+static void
+send_stream_chunk (CcnetProcessor *processor)
+{
+    CcnetThreadedRpcserverProcPriv *priv = GET_PRIV(processor);
+    char *chunk;
+    gsize len;
+    gboolean last;
+
+    chunk = ccnet_json_stream_pop_chunk (priv->stream, &len, &last);
+    if (!last) {
+        ccnet_processor_send_response_full (processor,
+                                            SC_SERVER_MORE, SS_SERVER_MORE,
+                                            chunk, len, g_free, chunk);
+        return;
+    }
+
+    ccnet_processor_send_response_full (processor,
+                                        SC_SERVER_RET, SS_SERVER_RET,
+                                        chunk, len, g_free, chunk);
+    ccnet_json_stream_free (priv->stream);
+    priv->stream = NULL;
+
+    if (processor->one_shot)
+        ccnet_processor_done (processor, TRUE);
+}
+
 static void
 call_function_done (void *vprocessor)
 {
     CcnetProcessor *processor = vprocessor;
     CcnetThreadedRpcserverProcPriv *priv = GET_PRIV(processor);
 
+    if (priv->stream) {
+        send_stream_chunk (processor);
+        return;
+    }
+
     if (priv->buf) {
         if (priv->len < MAX_TRANSFER_LENGTH) {
-            ccnet_processor_send_response (processor, SC_SERVER_RET, SS_SERVER_RET,
-                                           priv->buf, priv->len);
-            g_free (priv->buf);
+            ccnet_processor_send_response_full (processor,
+                                                SC_SERVER_RET, SS_SERVER_RET,
+                                                priv->buf, priv->len,
+                                                g_free, priv->buf);
             priv->buf = NULL;
-            /* ccnet_processor_done (processor, TRUE); */
+            if (processor->one_shot)
+                ccnet_processor_done (processor, TRUE);
             return;
         }
 
@@ -129,18 +184,24 @@ handle_update (CcnetProcessor *processor,
     }
 
     if (memcmp (code, SC_CLIENT_MORE, 3) == 0) {
+        if (priv->stream) {
+            send_stream_chunk (processor);
+            return;
+        }
+
         if (priv->off + MAX_TRANSFER_LENGTH < priv->len) {
             ccnet_processor_send_response (
                 processor, SC_SERVER_MORE, SS_SERVER_MORE,
                 priv->buf + priv->off, MAX_TRANSFER_LENGTH);
             priv->off += MAX_TRANSFER_LENGTH;
         } else {
-            ccnet_processor_send_response (
+            ccnet_processor_send_response_full (
                 processor, SC_SERVER_RET, SS_SERVER_RET,
-                priv->buf + priv->off, priv->len - priv->off);
-            g_free (priv->buf);
+                priv->buf + priv->off, priv->len - priv->off,
+                g_free, priv->buf);
             priv->buf = NULL;
-            /* ccnet_processor_done (processor, TRUE); */
+            if (processor->one_shot)
+                ccnet_processor_done (processor, TRUE);
         }
         return;
     }
@@ -11,6 +11,9 @@
 #include "peer-mgr.h"
 
 #include "proc-factory.h"
+#include "connect-mgr.h"
+#include "ticket-mgr.h"
+#include "metrics.h"
 #include "rpc-service.h"
 
 #include "ccnet-object.h"
@@ -18,6 +21,7 @@
 #include "processors/rpcserver-proc.h"
 #ifdef CCNET_SERVER
 #include "processors/threaded-rpcserver-proc.h"
+#include "json-stream.h"
 #endif
 #include "searpc-server.h"
 #include "ccnet-config.h"
@@ -40,6 +44,14 @@ extern CcnetSession *session;
 #include "searpc-signature.h"
 #include "searpc-marshal.h"
 
+static void
+register_rpc_function (const char *svc_name, void *func,
+                       const char *fname, gchar *signature)
+{
+    searpc_server_register_function (svc_name, func, fname, signature);
+    ccnet_metrics_register_rpc (fname);
+}
+
 void
 ccnet_start_rpc(CcnetSession *session)
 {
@@ -57,296 +69,355 @@ ccnet_start_rpc(CcnetSession *session)
                                            CCNET_TYPE_THREADED_RPCSERVER_PROC);
 #endif
 
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_list_peers,
-                                     "list_peers",
-                                     searpc_signature_string__void());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_list_resolving_peers,
-                                     "list_resolving_peers",
-                                     searpc_signature_objlist__void());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_peers_by_role,
-                                     "get_peers_by_role",
-                                     searpc_signature_objlist__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_peer,
-                                     "get_peer",
-                                     searpc_signature_object__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_peer_by_idname,
-                                     "get_peer_by_idname",
-                                     searpc_signature_object__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_update_peer_address,
-                                     "update_peer_address",
-                                     searpc_signature_int__string_string_int());
-
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_session_info,
-                                     "get_session_info",
-                                     searpc_signature_object__void());
-
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_add_client,
-                                     "add_client",
-                                     searpc_signature_int__string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_add_role,
-                                     "add_role",
-                                     searpc_signature_int__string_string());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_remove_role,
-                                     "remove_role",
-                                     searpc_signature_int__string_string());
-
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_procs_alive,
-                                     "get_procs_alive",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_count_procs_alive,
-                                     "count_procs_alive",
-                                     searpc_signature_int__void());
-
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_procs_dead,
-                                     "get_procs_dead",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_count_procs_dead,
-                                     "count_procs_dead",
-                                     searpc_signature_int__void());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_list_peers,
+                           "list_peers",
+                           searpc_signature_string__void());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_list_resolving_peers,
+                           "list_resolving_peers",
+                           searpc_signature_objlist__void());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_peers_by_role,
+                           "get_peers_by_role",
+                           searpc_signature_objlist__string());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_peer,
+                           "get_peer",
+                           searpc_signature_object__string());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_peer_by_idname,
+                           "get_peer_by_idname",
+                           searpc_signature_object__string());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_update_peer_address,
+                           "update_peer_address",
+                           searpc_signature_int__string_string_int());
+
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_session_info,
+                           "get_session_info",
+                           searpc_signature_object__void());
+
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_add_client,
+                           "add_client",
+                           searpc_signature_int__string());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_add_role,
+                           "add_role",
+                           searpc_signature_int__string_string());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_remove_role,
+                           "remove_role",
+                           searpc_signature_int__string_string());
+
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_procs_alive,
+                           "get_procs_alive",
+                           searpc_signature_objlist__int_int());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_count_procs_alive,
+                           "count_procs_alive",
+                           searpc_signature_int__void());
+
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_procs_dead,
+                           "get_procs_dead",
+                           searpc_signature_objlist__int_int());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_count_procs_dead,
+                           "count_procs_dead",
+                           searpc_signature_int__void());
     
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_get_config,
-                                     "get_config",
-                                     searpc_signature_string__string());
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_set_config,
-                                     "set_config",
-                                     searpc_signature_int__string_string());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_config,
+                           "get_config",
+                           searpc_signature_string__string());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_set_config,
+                           "set_config",
+                           searpc_signature_int__string_string());
 
     /* RSA encrypt a message with peer's public key. */
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_pubkey_encrypt,
-                                     "pubkey_encrypt",
-                                     searpc_signature_string__string_string());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_pubkey_encrypt,
+                           "pubkey_encrypt",
+                           searpc_signature_string__string_string());
 
     /* RSA decrypt a message with my private key. */
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_privkey_decrypt,
-                                     "privkey_decrypt",
-                                     searpc_signature_string__string());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_privkey_decrypt,
+                           "privkey_decrypt",
+                           searpc_signature_string__string());
+
+    /* counters and latency histograms in Prometheus text format */
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_get_metrics,
+                           "get_metrics",
+                           searpc_signature_string__void());
 
 #ifdef CCNET_SERVER
 
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_list_peer_stat,
-                                     "list_peer_stat",
-                                     searpc_signature_objlist__void());
-
-
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_add_emailuser,
-                                     "add_emailuser",
-                                     searpc_signature_int__string_string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_emailuser,
-                                     "remove_emailuser",
-                                     searpc_signature_int__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_validate_emailuser,
-                                     "validate_emailuser",
-                                     searpc_signature_int__string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_emailuser,
-                                     "get_emailuser",
-                                     searpc_signature_object__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_emailuser_by_id,
-                                     "get_emailuser_by_id",
-                                     searpc_signature_object__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_emailusers,
-                                     "get_emailusers",
-                                     searpc_signature_objlist__string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_search_emailusers,
-                                     "search_emailusers",
-                                     searpc_signature_objlist__string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_count_emailusers,
-                                     "count_emailusers",
-                                     searpc_signature_int64__void());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_filter_emailusers_by_emails,
-                                     "filter_emailusers_by_emails",
-                                     searpc_signature_objlist__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_update_emailuser,
-                                     "update_emailuser",
-                                     searpc_signature_int__int_string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_superusers,
-                                     "get_superusers",
-                                     searpc_signature_objlist__void());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_list_peer_stat,
+                           "list_peer_stat",
+                           searpc_signature_objlist__void());
+
+
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_add_emailuser,
+                           "add_emailuser",
+                           searpc_signature_int__string_string_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_add_emailusers,
+                           "add_emailusers",
+                           searpc_signature_string__string_string_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_remove_emailuser,
+                           "remove_emailuser",
+                           searpc_signature_int__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_validate_emailuser,
+                           "validate_emailuser",
+                           searpc_signature_int__string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_emailuser,
+                           "get_emailuser",
+                           searpc_signature_object__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_emailuser_by_id,
+                           "get_emailuser_by_id",
+                           searpc_signature_object__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_emailusers,
+                           "get_emailusers",
+                           searpc_signature_objlist__string_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_search_emailusers,
+                           "search_emailusers",
+                           searpc_signature_objlist__string_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_count_emailusers,
+                           "count_emailusers",
+                           searpc_signature_int64__void());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_refresh_emailuser_count,
+                           "refresh_emailuser_count",
+                           searpc_signature_int64__void());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_filter_emailusers_by_emails,
+                           "filter_emailusers_by_emails",
+                           searpc_signature_objlist__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_update_emailuser,
+                           "update_emailuser",
+                           searpc_signature_int__int_string_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_superusers,
+                           "get_superusers",
+                           searpc_signature_objlist__void());
+
+    /* connection pool and query latency histograms */
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_db_stats,
+                           "get_db_stats",
+                           searpc_signature_string__void());
 
     /* RSA sign a message with my private key. */
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_sign_message,
-                                     "sign_message",
-                                     searpc_signature_string__string());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_sign_message,
+                           "sign_message",
+                           searpc_signature_string__string());
 
     /* Verify a message with a peer's public key */
-    searpc_server_register_function ("ccnet-rpcserver",
-                                     ccnet_rpc_verify_message,
-                                     "verify_message",
-                                     searpc_signature_int__string_string_string());
-
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_create_group,
-                                     "create_group",
-                                     searpc_signature_int__string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_create_org_group,
-                                     "create_org_group",
-                                 searpc_signature_int__int_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_group,
-                                     "remove_group",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_add_member,
-                                     "group_add_member",
-                                     searpc_signature_int__int_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_remove_member,
-                                     "group_remove_member",
-                                     searpc_signature_int__int_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_set_admin,
-                                     "group_set_admin",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_group_unset_admin,
-                                     "group_unset_admin",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_set_group_name,
-                                     "set_group_name",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_quit_group,
-                                     "quit_group",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_groups,
-                                     "get_groups",
-                                     searpc_signature_objlist__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_all_groups,
-                                     "get_all_groups",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_group,
-                                     "get_group",
-                                     searpc_signature_object__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_group_members,
-                                     "get_group_members",
-                                     searpc_signature_objlist__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_check_group_staff,
-                                     "check_group_staff",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_group_user,
-                                     "remove_group_user",
-                                     searpc_signature_int__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_is_group_user,
-                                     "is_group_user",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_set_group_creator,
-                                     "set_group_creator",
-                                     searpc_signature_int__int_string());
-
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_create_org,
-                                     "create_org",
-                                     searpc_signature_int__string_string_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_org,
-                                     "remove_org",
-                                     searpc_signature_int__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_all_orgs,
-                                     "get_all_orgs",
-                                     searpc_signature_objlist__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_by_url_prefix,
-                                     "get_org_by_url_prefix",
-                                     searpc_signature_object__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_by_id,
-                                     "get_org_by_id",
-                                     searpc_signature_object__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_add_org_user,
-                                     "add_org_user",
-                                     searpc_signature_int__int_string_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_org_user,
-                                     "remove_org_user",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_orgs_by_user,
-                                     "get_orgs_by_user",
-                                     searpc_signature_objlist__string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_emailusers,
-                                     "get_org_emailusers",
-                                     searpc_signature_objlist__string_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_add_org_group,
-                                     "add_org_group",
-                                     searpc_signature_int__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_remove_org_group,
-                                     "remove_org_group",
-                                     searpc_signature_int__int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_is_org_group,
-                                     "is_org_group",
-                                     searpc_signature_int__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_id_by_group,
-                                     "get_org_id_by_group",
-                                     searpc_signature_int__int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_get_org_groups,
-                                     "get_org_groups",
-                                     searpc_signature_objlist__int_int_int());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_org_user_exists,
-                                     "org_user_exists",
-                                     searpc_signature_int__int_string());
-    searpc_server_register_function ("ccnet-threaded-rpcserver",
-                                     ccnet_rpc_is_org_staff,
-                                     "is_org_staff",
-                                     searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-rpcserver",
+                           ccnet_rpc_verify_message,
+                           "verify_message",
+                           searpc_signature_int__string_string_string());
+
+    /* The RSA operations are CPU bound. Also serve them from the
+     * threaded service so they don't stall the event loop. */
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_sign_message,
+                           "sign_message",
+                           searpc_signature_string__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_verify_message,
+                           "verify_message",
+                           searpc_signature_int__string_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_sign_messages,
+                           "sign_messages",
+                           searpc_signature_string__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_verify_messages,
+                           "verify_messages",
+                           searpc_signature_string__string_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_pubkey_encrypt,
+                           "pubkey_encrypt",
+                           searpc_signature_string__string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_privkey_decrypt,
+                           "privkey_decrypt",
+                           searpc_signature_string__string());
+
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_create_group,
+                           "create_group",
+                           searpc_signature_int__string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_create_org_group,
+                           "create_org_group",
+                       searpc_signature_int__int_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_remove_group,
+                           "remove_group",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_group_add_member,
+                           "group_add_member",
+                           searpc_signature_int__int_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_group_add_members,
+                           "group_add_members",
+                           searpc_signature_string__int_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_group_remove_member,
+                           "group_remove_member",
+                           searpc_signature_int__int_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_group_set_admin,
+                           "group_set_admin",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_group_unset_admin,
+                           "group_unset_admin",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_set_group_name,
+                           "set_group_name",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_quit_group,
+                           "quit_group",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_groups,
+                           "get_groups",
+                           searpc_signature_objlist__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_all_groups,
+                           "get_all_groups",
+                           searpc_signature_objlist__int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_group,
+                           "get_group",
+                           searpc_signature_object__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_group_members,
+                           "get_group_members",
+                           searpc_signature_objlist__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_check_group_staff,
+                           "check_group_staff",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_remove_group_user,
+                           "remove_group_user",
+                           searpc_signature_int__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_is_group_user,
+                           "is_group_user",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_set_group_creator,
+                           "set_group_creator",
+                           searpc_signature_int__int_string());
+
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_create_org,
+                           "create_org",
+                           searpc_signature_int__string_string_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_remove_org,
+                           "remove_org",
+                           searpc_signature_int__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_all_orgs,
+                           "get_all_orgs",
+                           searpc_signature_objlist__int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_org_by_url_prefix,
+                           "get_org_by_url_prefix",
+                           searpc_signature_object__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_org_by_id,
+                           "get_org_by_id",
+                           searpc_signature_object__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_add_org_user,
+                           "add_org_user",
+                           searpc_signature_int__int_string_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_add_org_users,
+                           "add_org_users",
+                           searpc_signature_string__int_string_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_remove_org_user,
+                           "remove_org_user",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_orgs_by_user,
+                           "get_orgs_by_user",
+                           searpc_signature_objlist__string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_org_emailusers,
+                           "get_org_emailusers",
+                           searpc_signature_objlist__string_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_add_org_group,
+                           "add_org_group",
+                           searpc_signature_int__int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_remove_org_group,
+                           "remove_org_group",
+                           searpc_signature_int__int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_is_org_group,
+                           "is_org_group",
+                           searpc_signature_int__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_org_id_by_group,
+                           "get_org_id_by_group",
+                           searpc_signature_int__int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_org_groups,
+                           "get_org_groups",
+                           searpc_signature_objlist__int_int_int());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_org_user_exists,
+                           "org_user_exists",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_is_org_staff,
+                           "is_org_staff",
+                           searpc_signature_int__int_string());
+    register_rpc_function ("ccnet-threaded-rpcserver",
+                           ccnet_rpc_get_org_cache_stats,
+                           "get_org_cache_stats",
+                           searpc_signature_string__void());
 
 #endif  /* CCNET_SERVER */
 
@@ -602,26 +673,28 @@ ccnet_rpc_pubkey_encrypt (const char *msg_base64, const char *peer_id, GError **
 {
     unsigned char *msg;
     gsize msg_len;
-    CcnetPeer *peer;
+    RSA *pubkey;
     unsigned char *enc_msg;
     int enc_msg_len;
     char *ret;
 
-    peer = ccnet_peer_manager_get_peer (session->peer_mgr, peer_id);
-    if (!peer) {
-        g_warning ("Cannot find peer %s.\n", peer_id);
+    /* May run on a worker thread, so hold our own key reference
+     * instead of touching the peer object. */
+    pubkey = ccnet_peer_manager_get_peer_pubkey (session->peer_mgr, peer_id);
+    if (!pubkey) {
+        g_warning ("Cannot find public key of peer %s.\n", peer_id);
         return NULL;
     }
 
     msg = g_base64_decode (msg_base64, &msg_len);
 
-    enc_msg = public_key_encrypt (peer->pubkey, msg, (int)msg_len, &enc_msg_len);
+    enc_msg = public_key_encrypt (pubkey, msg, (int)msg_len, &enc_msg_len);
 
     ret = g_base64_encode (enc_msg, enc_msg_len);
 
     g_free (msg);
     g_free (enc_msg);
-    g_object_unref (peer);
+    RSA_free (pubkey);
     return ret;
 }
 
@@ -652,6 +725,47 @@ ccnet_rpc_privkey_decrypt (const char *msg_base64, GError **error)
     return ret;
 }
 
+static void
+format_value (GString *buf, const char *name, const char *type, guint64 value)
+{
+    g_string_append_printf (buf, "# TYPE %s %s\n%s %"G_GUINT64_FORMAT"\n",
+                            name, type, name, value);
+}
+
+char *
+ccnet_rpc_get_metrics (GError **error)
+{
+    GString *buf = g_string_new (NULL);
+    CcnetPeerSendStats send_stats;
+
+    ccnet_metrics_format (buf);
+
+    /* Kept by their modules, which only run in the main loop, as
+     * is this function. */
+    format_value (buf, "ccnet_procs_alive", "gauge",
+                  session->proc_factory->procs_alive_cnt);
+    format_value (buf, "ccnet_connecting", "gauge",
+                  session->connMgr->n_connecting);
+    format_value (buf, "ccnet_connect_attempts_total", "counter",
+                  session->connMgr->n_attempts);
+    format_value (buf, "ccnet_connect_deferred_total", "counter",
+                  session->connMgr->n_deferred);
+    format_value (buf, "ccnet_tickets_issued_total", "counter",
+                  session->ticket_mgr->n_issued);
+    format_value (buf, "ccnet_tickets_resumed_total", "counter",
+                  session->ticket_mgr->n_resumed);
+    format_value (buf, "ccnet_tickets_rejected_total", "counter",
+                  session->ticket_mgr->n_rejected);
+
+    ccnet_peer_get_send_stats (&send_stats);
+    format_value (buf, "ccnet_content_bytes_copied_total", "counter",
+                  send_stats.bytes_copied);
+    format_value (buf, "ccnet_content_bytes_referenced_total", "counter",
+                  send_stats.bytes_referenced);
+
+    return g_string_free (buf, FALSE);
+}
+
 #ifdef CCNET_SERVER
 
 #include "user-mgr.h"
@@ -700,6 +814,18 @@ ccnet_rpc_list_peer_stat (GError **error)
 }
 
 
+/* Batch RPCs take newline separated items and return one status per line. */
+static char *
+format_batch_status (const int *status, int n)
+{
+    GString *buf = g_string_new (NULL);
+    int i;
+
+    for (i = 0; i < n; ++i)
+        g_string_append_printf (buf, "%d\n", status[i]);
+    return g_string_free (buf, FALSE);
+}
+
 int
 ccnet_rpc_add_emailuser (const char *email, const char *passwd,
                          int is_staff, int is_active, GError **error)
@@ -719,6 +845,42 @@ ccnet_rpc_add_emailuser (const char *email, const char *passwd,
     return ret;
 }
 
+char *
+ccnet_rpc_add_emailusers (const char *emails, const char *passwds,
+                          int is_staff, int is_active, GError **error)
+{
+    CcnetUserManager *user_mgr =
+        ((CcnetServerSession *)session)->user_mgr;
+    char **email_list, **passwd_list;
+    int *status, n;
+    char *ret = NULL;
+
+    if (!emails || !passwds) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Email and passwd can not be NULL");
+        return NULL;
+    }
+
+    email_list = g_strsplit (emails, "\n", -1);
+    passwd_list = g_strsplit (passwds, "\n", -1);
+    n = g_strv_length (email_list);
+    if (g_strv_length (passwd_list) != n) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Number of emails and passwds differ");
+        goto out;
+    }
+
+    status = g_new (int, n);
+    ccnet_user_manager_add_emailusers (user_mgr, email_list, passwd_list,
+                                       is_staff, is_active, status);
+    ret = format_batch_status (status, n);
+    g_free (status);
+
+out:
+    g_strfreev (email_list);
+    g_strfreev (passwd_list);
+    return ret;
+}
+
 int
 ccnet_rpc_remove_emailuser (const char *email, GError **error)
 {
@@ -782,8 +944,15 @@ ccnet_rpc_get_emailusers (const char *source, int start, int limit, GError **err
 {
    CcnetUserManager *user_mgr = 
         ((CcnetServerSession *)session)->user_mgr;
+    CcnetJsonStream *js = ccnet_json_stream_get_current ();
     GList *emailusers = NULL;
 
+    /* called from the threaded rpc server, write rows out directly */
+    if (js) {
+        ccnet_user_manager_stream_emailusers (user_mgr, source, start, limit, js);
+        return NULL;
+    }
+
     emailusers = ccnet_user_manager_get_emailusers (user_mgr, source, start, limit);
     
     return emailusers;
@@ -812,6 +981,21 @@ ccnet_rpc_count_emailusers (GError **error)
    return ccnet_user_manager_count_emailusers (user_mgr);
 }
 
+gint64
+ccnet_rpc_refresh_emailuser_count (GError **error)
+{
+    CcnetUserManager *user_mgr = 
+        ((CcnetServerSession *)session)->user_mgr;
+    gint64 ret;
+
+    ret = ccnet_user_manager_refresh_user_counts (user_mgr);
+    if (ret < 0)
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Failed to count users");
+
+    return ret;
+}
+
 GList*
 ccnet_rpc_filter_emailusers_by_emails (const char *emails, GError **error)
 {
@@ -843,8 +1027,8 @@ ccnet_rpc_get_superusers (GError **error)
     return ccnet_user_manager_get_superusers(user_mgr);
 }
 
-char *
-ccnet_rpc_sign_message (const char *message, GError **error)
+static char *
+sign_one (const char *message, int len)
 {
     unsigned char *sig;
     unsigned int sig_len;
@@ -852,9 +1036,10 @@ ccnet_rpc_sign_message (const char *message, GError **error)
 
     sig = g_new0(unsigned char, RSA_size(session->privkey));
 
-    if (!RSA_sign (NID_sha1, (const unsigned char *)message, strlen(message),
+    if (!RSA_sign (NID_sha1, (const unsigned char *)message, len,
                    sig, &sig_len, session->privkey)) {
         g_warning ("Failed to sign message: %lu.\n", ERR_get_error());
+        g_free (sig);
         return NULL;
     }
 
@@ -864,32 +1049,137 @@ ccnet_rpc_sign_message (const char *message, GError **error)
     return sigret;
 }
 
+static int
+verify_one (RSA *pubkey, const char *message, int len, const char *sig_base64)
+{
+    unsigned char *sig;
+    gsize sig_len;
+    int ret = 0;
+
+    sig = g_base64_decode (sig_base64, &sig_len);
+
+    if (!RSA_verify (NID_sha1, (const unsigned char *)message, len,
+                     sig, (guint)sig_len, pubkey))
+        ret = -1;
+
+    g_free (sig);
+    return ret;
+}
+
+char *
+ccnet_rpc_get_db_stats (GError **error)
+{
+    return ccnet_db_format_stats (session->db);
+}
+
+char *
+ccnet_rpc_sign_message (const char *message, GError **error)
+{
+    return sign_one (message, strlen(message));
+}
+
+/*
+ * Sign a batch of newline separated messages in one call.
+ * Returns the base64 signatures in the same order, one per line;
+ * a line is left empty if its message could not be signed.
+ */
+char *
+ccnet_rpc_sign_messages (const char *messages, GError **error)
+{
+    GString *buf = g_string_new (NULL);
+    const char *p = messages, *end;
+    char *sig;
+
+    while (1) {
+        end = strchr (p, '\n');
+        if (!end)
+            end = p + strlen(p);
+
+        sig = sign_one (p, end - p);
+        if (sig) {
+            g_string_append (buf, sig);
+            g_free (sig);
+        }
+
+        if (*end == '\0')
+            break;
+        g_string_append_c (buf, '\n');
+        p = end + 1;
+    }
+
+    return g_string_free (buf, FALSE);
+}
+
 int
 ccnet_rpc_verify_message (const char *message,
                           const char *sig_base64,
                           const char *peer_id,
                           GError **error)
 {
-    unsigned char *sig;
-    gsize sig_len;
-    CcnetPeer *peer;
-
-    sig = g_base64_decode (sig_base64, &sig_len);
+    RSA *pubkey;
+    int ret;
 
-    peer = ccnet_peer_manager_get_peer (session->peer_mgr, peer_id);
-    if (!peer) {
-        g_warning ("Cannot find peer %s.\n", peer_id);
+    pubkey = ccnet_peer_manager_get_peer_pubkey (session->peer_mgr, peer_id);
+    if (!pubkey) {
+        g_warning ("Cannot find public key of peer %s.\n", peer_id);
         return -1;
     }
 
-    if (!RSA_verify (NID_sha1, (const unsigned char *)message, strlen(message),
-                     sig, (guint)sig_len, peer->pubkey)) {
-        g_object_unref (peer);
-        return -1;
+    ret = verify_one (pubkey, message, strlen(message), sig_base64);
+
+    RSA_free (pubkey);
+    return ret;
+}
+
+/*
+ * Verify newline separated messages against newline separated
+ * signatures from the same peer. Returns one "0" (valid) or "-1"
+ * line per message.
+ */
+char *
+ccnet_rpc_verify_messages (const char *messages,
+                           const char *sigs,
+                           const char *peer_id,
+                           GError **error)
+{
+    RSA *pubkey;
+    GString *buf;
+    char **sigv;
+    const char *p = messages, *end;
+    int i = 0, ret;
+
+    pubkey = ccnet_peer_manager_get_peer_pubkey (session->peer_mgr, peer_id);
+    if (!pubkey) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Cannot find public key of peer %s", peer_id);
+        return NULL;
     }
 
-    g_object_unref (peer);
-    return 0;
+    sigv = g_strsplit (sigs, "\n", -1);
+    buf = g_string_new (NULL);
+
+    while (1) {
+        end = strchr (p, '\n');
+        if (!end)
+            end = p + strlen(p);
+
+        if (sigv[i] && sigv[i][0] != '\0')
+            ret = verify_one (pubkey, p, end - p, sigv[i]);
+        else
+            ret = -1;
+        if (sigv[i])
+            ++i;
+        g_string_append (buf, ret == 0 ? "0" : "-1");
+
+        if (*end == '\0')
+            break;
+        g_string_append_c (buf, '\n');
+        p = end + 1;
+    }
+
+    g_strfreev (sigv);
+    RSA_free (pubkey);
+    return g_string_free (buf, FALSE);
 }
 
 int
@@ -969,6 +1259,36 @@ ccnet_rpc_group_add_member (int group_id, const char *user_name,
     return ret;
 }
 
+char *
+ccnet_rpc_group_add_members (int group_id, const char *user_name,
+                             const char *member_names, GError **error)
+{
+    CcnetGroupManager *group_mgr =
+        ((CcnetServerSession *)session)->group_mgr;
+    char **members;
+    int *status, n;
+    char *ret;
+
+    if (group_id <= 0 || !user_name || !member_names) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL,
+                     "Group id and user name and member names can not be NULL");
+        return NULL;
+    }
+
+    members = g_strsplit (member_names, "\n", -1);
+    n = g_strv_length (members);
+    status = g_new (int, n);
+
+    /* per member status is reported even if the batch failed */
+    ccnet_group_manager_add_members (group_mgr, group_id, user_name,
+                                     members, status, NULL);
+    ret = format_batch_status (status, n);
+
+    g_free (status);
+    g_strfreev (members);
+    return ret;
+}
+
 int
 ccnet_rpc_group_remove_member (int group_id, const char *user_name,
                                const char *member_name, GError **error)
@@ -1112,8 +1432,14 @@ ccnet_rpc_get_all_groups (int start, int limit, GError **error)
 {
     CcnetGroupManager *group_mgr = 
         ((CcnetServerSession *)session)->group_mgr;
+    CcnetJsonStream *js = ccnet_json_stream_get_current ();
     GList *ret = NULL;
 
+    if (js) {
+        ccnet_group_manager_stream_all_groups (group_mgr, start, limit, js);
+        return NULL;
+    }
+
     ret = ccnet_group_manager_get_all_groups (group_mgr, start, limit, error);
 
     return ret;
@@ -1141,8 +1467,14 @@ ccnet_rpc_get_group_members (int group_id, GError **error)
 {
     CcnetGroupManager *group_mgr = 
         ((CcnetServerSession *)session)->group_mgr;
+    CcnetJsonStream *js = ccnet_json_stream_get_current ();
     GList *ret = NULL;
 
+    if (js) {
+        ccnet_group_manager_stream_group_members (group_mgr, group_id, js);
+        return NULL;
+    }
+
     ret = ccnet_group_manager_get_group_members (group_mgr, group_id, error);
     if (ret == NULL)
         return NULL;
@@ -1324,6 +1656,33 @@ ccnet_rpc_add_org_user (int org_id, const char *email, int is_staff,
                                            error);
 }
 
+char *
+ccnet_rpc_add_org_users (int org_id, const char *emails, int is_staff,
+                         GError **error)
+{
+    CcnetOrgManager *org_mgr = ((CcnetServerSession *)session)->org_mgr;
+    char **email_list;
+    int *status, n;
+    char *ret;
+
+    if (org_id < 0 || !emails) {
+        g_set_error (error, CCNET_DOMAIN, CCNET_ERR_INTERNAL, "Bad arguments");
+        return NULL;
+    }
+
+    email_list = g_strsplit (emails, "\n", -1);
+    n = g_strv_length (email_list);
+    status = g_new (int, n);
+
+    ccnet_org_manager_add_org_users (org_mgr, org_id, email_list, is_staff,
+                                     status, NULL);
+    ret = format_batch_status (status, n);
+
+    g_free (status);
+    g_strfreev (email_list);
+    return ret;
+}
+
 int
 ccnet_rpc_remove_org_user (int org_id, const char *email, GError **error)
 {
@@ -1354,6 +1713,7 @@ ccnet_rpc_get_org_emailusers (const char *url_prefix, int start , int limit,
 {
     CcnetUserManager *user_mgr = ((CcnetServerSession *)session)->user_mgr;
     CcnetOrgManager *org_mgr = ((CcnetServerSession *)session)->org_mgr;
+    CcnetJsonStream *js = ccnet_json_stream_get_current ();
     GList *email_list = NULL, *ptr;
     GList *ret = NULL;
 
@@ -1368,18 +1728,30 @@ ccnet_rpc_get_org_emailusers (const char *url_prefix, int start , int limit,
         return NULL;
     }
     
+    /* Users are looked up one by one anyway (they may come from LDAP),
+     * so when streaming, write each one out and drop it right away. */
+    if (js)
+        ccnet_json_stream_begin_list (js);
+
     ptr = email_list;
     while (ptr) {
         char *email = ptr->data;
         CcnetEmailUser *emailuser = ccnet_user_manager_get_emailuser (user_mgr,
                                                                       email);
         if (emailuser != NULL) {
-            ret = g_list_prepend (ret, emailuser);
+            if (js) {
+                ccnet_json_stream_add_gobject (js, (GObject *)emailuser);
+                g_object_unref (emailuser);
+            } else
+                ret = g_list_prepend (ret, emailuser);
         }
 
         ptr = ptr->next;
     }
 
+    if (js)
+        ccnet_json_stream_end_list (js);
+
     string_list_free (email_list);
 
     return g_list_reverse (ret);
@@ -1493,5 +1865,13 @@ ccnet_rpc_is_org_staff (int org_id, const char *email, GError **error)
     return ccnet_org_manager_is_org_staff (org_mgr, org_id, email, error);
 }
 
+char *
+ccnet_rpc_get_org_cache_stats (GError **error)
+{
+    CcnetOrgManager *org_mgr = ((CcnetServerSession *)session)->org_mgr;
+
+    return ccnet_org_manager_format_cache_stats (org_mgr);
+}
+
 
 #endif  /* CCNET_SERVER */
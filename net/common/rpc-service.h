@@ -88,6 +88,9 @@ ccnet_rpc_pubkey_encrypt (const char *msg_base64,
 char *
 ccnet_rpc_privkey_decrypt (const char *msg_base64, GError **error);
 
+char *
+ccnet_rpc_get_metrics (GError **error);
+
 #ifdef CCNET_SERVER
 
 GList *
@@ -97,6 +100,11 @@ int
 ccnet_rpc_add_emailuser (const char *email, const char *passwd,
                          int is_staff, int is_active, GError **error);
 
+/* @emails and @passwds are newline separated. */
+char *
+ccnet_rpc_add_emailusers (const char *emails, const char *passwds,
+                          int is_staff, int is_active, GError **error);
+
 int
 ccnet_rpc_remove_emailuser (const char *email, GError **error);
 
@@ -120,6 +128,10 @@ ccnet_rpc_search_emailusers (const char *email_patt, int start, int limit,
 gint64
 ccnet_rpc_count_emailusers (GError **error);
 
+/* Recount email users and update the cached count. */
+gint64
+ccnet_rpc_refresh_emailuser_count (GError **error);
+
 /**
  * Select multiple users according to the given emails.
  *
@@ -154,6 +166,9 @@ ccnet_rpc_remove_one_binding (const char *email, const char *peer_id,
 GList *
 ccnet_rpc_get_peers_by_email (const char *email, GError **error);
 
+char *
+ccnet_rpc_get_db_stats (GError **error);
+
 char *
 ccnet_rpc_sign_message (const char *message, GError **error);
 
@@ -163,6 +178,15 @@ ccnet_rpc_verify_message (const char *message,
                           const char *peer_id,
                           GError **error);
 
+char *
+ccnet_rpc_sign_messages (const char *messages, GError **error);
+
+char *
+ccnet_rpc_verify_messages (const char *messages,
+                           const char *sigs,
+                           const char *peer_id,
+                           GError **error);
+
 int
 ccnet_rpc_create_group (const char *group_name, const char *user_name,
                         GError **error);
@@ -177,6 +201,11 @@ ccnet_rpc_remove_group (int group_id, const char *user_name, GError **error);
 int
 ccnet_rpc_group_add_member (int group_id, const char *user_name,
                             const char *member_name, GError **error);
+
+char *
+ccnet_rpc_group_add_members (int group_id, const char *user_name,
+                             const char *member_names, GError **error);
+
 int
 ccnet_rpc_group_remove_member (int group_id, const char *user_name,
                                const char *member_name, GError **error);
@@ -242,6 +271,10 @@ int
 ccnet_rpc_add_org_user (int org_id, const char *email, int is_staff,
                         GError **error);
 
+char *
+ccnet_rpc_add_org_users (int org_id, const char *emails, int is_staff,
+                         GError **error);
+
 int
 ccnet_rpc_remove_org_user (int org_id, const char *email, GError **error);
 
@@ -273,6 +306,9 @@ ccnet_rpc_org_user_exists (int org_id, const char *email, GError **error);
 int
 ccnet_rpc_is_org_staff (int org_id, const char *email, GError **error);
 
+char *
+ccnet_rpc_get_org_cache_stats (GError **error);
+
 #endif /* CCNET_SERVER */
 
 /**
@@ -17,6 +17,8 @@
 #include "peer.h"
 #include "peer-mgr.h"
 #include "perm-mgr.h"
+#include "ticket-mgr.h"
+#include "timer-wheel.h"
 #include "packet-io.h"
 #include "connect-mgr.h"
 #include "message.h"
@@ -55,7 +57,9 @@ ccnet_session_init (CcnetSession *session)
     session->connMgr = ccnet_conn_manager_new (session);
     session->msg_mgr = ccnet_message_manager_new (session);
     session->perm_mgr = ccnet_perm_manager_new (session);
+    session->ticket_mgr = ccnet_ticket_manager_new (session);
     session->job_mgr = ccnet_job_manager_new (THREAD_POOL_SIZE);
+    session->timer_wheel = ccnet_timer_wheel_new ();
 }
 
 static int load_rsakey(CcnetSession *session)
@@ -218,6 +222,9 @@ ccnet_session_prepare (CcnetSession *session, const char *config_dir_r, gboolean
     /* permission manager */
     ccnet_perm_manager_prepare (session->perm_mgr);
 
+    /* session resumption tickets */
+    ccnet_ticket_manager_prepare (session->ticket_mgr);
+
     g_free (misc_path);
 
     if (test_config) {
@@ -431,6 +438,7 @@ restart_network (CcnetSession *session)
 void
 ccnet_session_start (CcnetSession *session)
 {
+    ccnet_timer_wheel_start (session->timer_wheel);
     ccnet_proc_factory_start (session->proc_factory);
     ccnet_message_manager_start (session->msg_mgr);
 
@@ -440,6 +448,11 @@ ccnet_session_start (CcnetSession *session)
     }
 
     ccnet_peer_manager_start (session->peer_mgr);
+    ccnet_ticket_manager_start (session->ticket_mgr);
+
+    /* call subclass start */
+    if (CCNET_SESSION_GET_CLASS (session)->start)
+        CCNET_SESSION_GET_CLASS (session)->start (session);
 }
 
 
@@ -65,8 +65,12 @@ struct CcnetSession
 
     struct _CcnetPermManager   *perm_mgr;
 
+    struct _CcnetTicketManager *ticket_mgr;
+
     struct _CcnetJobManager    *job_mgr;
 
+    struct CcnetTimerWheel     *timer_wheel;
+
     GHashTable                 *service_hash;
 
     unsigned int                saving : 1;
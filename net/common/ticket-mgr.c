@@ -0,0 +1,354 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/evp.h>
+
+#include "session.h"
+#include "ticket-mgr.h"
+#include "timer.h"
+#include "utils.h"
+
+#define DEBUG_FLAG CCNET_DEBUG_CONNECTION
+#include "log.h"
+
+#define TICKET_KEYS_FILE         "ticket-keys"
+#define DEFAULT_TICKET_LIFETIME  (12 * 3600)   /* 12 hours */
+#define ROTATE_CHECK_MSEC        60000
+
+#define TICKET_AES_KEY_LEN  32
+#define TICKET_MAC_KEY_LEN  20
+#define TICKET_IV_LEN       16
+#define TICKET_MAC_LEN      20
+#define TICKET_HEADER_LEN   (4 + TICKET_IV_LEN)
+
+/*
+  Ticket layout:
+
+    key_id (4 bytes, network order) | iv (16) | ciphertext | mac (20)
+
+  The ciphertext is AES-256-CBC of "<expire> <peer_id> <session_key>",
+  the mac is HMAC-SHA1 over everything before it.
+ */
+
+typedef struct {
+    guint32        id;
+    gint64         ctime;
+    unsigned char  aes_key[TICKET_AES_KEY_LEN];
+    unsigned char  mac_key[TICKET_MAC_KEY_LEN];
+} TicketKey;
+
+struct _CcnetTicketManagerPriv {
+    TicketKey     keys[2];      /* [0] is current, [1] the previous one */
+    int           n_keys;
+    char         *keys_path;
+    CcnetTimer   *rotate_timer;
+};
+
+CcnetTicketManager *
+ccnet_ticket_manager_new (CcnetSession *session)
+{
+    CcnetTicketManager *mgr = g_new0 (CcnetTicketManager, 1);
+    mgr->priv = g_new0 (CcnetTicketManagerPriv, 1);
+    mgr->session = session;
+    return mgr;
+}
+
+static void
+save_keys (CcnetTicketManager *mgr)
+{
+    CcnetTicketManagerPriv *priv = mgr->priv;
+    GString *buf = g_string_new (NULL);
+    char aes_hex[TICKET_AES_KEY_LEN * 2 + 1];
+    char mac_hex[TICKET_MAC_KEY_LEN * 2 + 1];
+    GError *error = NULL;
+    int i;
+
+    for (i = 0; i < priv->n_keys; ++i) {
+        rawdata_to_hex (priv->keys[i].aes_key, aes_hex, TICKET_AES_KEY_LEN);
+        rawdata_to_hex (priv->keys[i].mac_key, mac_hex, TICKET_MAC_KEY_LEN);
+        g_string_append_printf (buf, "%u %"G_GINT64_FORMAT" %s %s\n",
+                                priv->keys[i].id, priv->keys[i].ctime,
+                                aes_hex, mac_hex);
+    }
+
+    if (!g_file_set_contents (priv->keys_path, buf->str, buf->len, &error)) {
+        ccnet_warning ("Failed to save ticket keys to %s: %s\n",
+                       priv->keys_path, error->message);
+        g_clear_error (&error);
+    } else
+        g_chmod (priv->keys_path, 0600);
+
+    g_string_free (buf, TRUE);
+}
+
+static void
+load_keys (CcnetTicketManager *mgr)
+{
+    CcnetTicketManagerPriv *priv = mgr->priv;
+    char *contents = NULL;
+    char **lines, **ptr;
+    TicketKey *key;
+
+    if (!g_file_get_contents (priv->keys_path, &contents, NULL, NULL))
+        return;
+
+    lines = g_strsplit (contents, "\n", -1);
+    for (ptr = lines; *ptr && priv->n_keys < 2; ++ptr) {
+        char **tokens = g_strsplit (*ptr, " ", -1);
+
+        if (g_strv_length (tokens) == 4) {
+            key = &priv->keys[priv->n_keys];
+            key->id = (guint32) strtoul (tokens[0], NULL, 10);
+            key->ctime = g_ascii_strtoll (tokens[1], NULL, 10);
+            if (hex_to_rawdata (tokens[2], key->aes_key,
+                                TICKET_AES_KEY_LEN) == 0 &&
+                hex_to_rawdata (tokens[3], key->mac_key,
+                                TICKET_MAC_KEY_LEN) == 0)
+                priv->n_keys++;
+        }
+        g_strfreev (tokens);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+}
+
+static void
+rotate_keys (CcnetTicketManager *mgr)
+{
+    CcnetTicketManagerPriv *priv = mgr->priv;
+    TicketKey *key = &priv->keys[0];
+
+    if (priv->n_keys > 0) {
+        priv->keys[1] = priv->keys[0];
+        priv->n_keys = 2;
+    } else
+        priv->n_keys = 1;
+
+    RAND_bytes (key->aes_key, TICKET_AES_KEY_LEN);
+    RAND_bytes (key->mac_key, TICKET_MAC_KEY_LEN);
+    key->id = priv->keys[1].id + 1;
+    key->ctime = (gint64) time (NULL);
+
+    ccnet_debug ("[Ticket] Rotated ticket key, new key id %u\n", key->id);
+    save_keys (mgr);
+}
+
+static gboolean
+key_expired (CcnetTicketManager *mgr)
+{
+    return (mgr->priv->n_keys == 0 ||
+            (gint64) time (NULL) - mgr->priv->keys[0].ctime >= mgr->lifetime);
+}
+
+static int
+rotate_timer_cb (void *vmgr)
+{
+    CcnetTicketManager *mgr = vmgr;
+
+    if (key_expired (mgr))
+        rotate_keys (mgr);
+    return TRUE;
+}
+
+int
+ccnet_ticket_manager_prepare (CcnetTicketManager *mgr)
+{
+    CcnetSession *session = mgr->session;
+    char *lifetime_str;
+
+    lifetime_str = ccnet_key_file_get_string (session->keyf,
+                                              "Network", "TICKET_LIFETIME");
+    if (lifetime_str) {
+        mgr->lifetime = atoi (lifetime_str);
+        if (mgr->lifetime < 0)
+            mgr->lifetime = 0;
+        g_free (lifetime_str);
+    } else
+        mgr->lifetime = DEFAULT_TICKET_LIFETIME;
+
+    if (mgr->lifetime == 0) {
+        ccnet_message ("Session resumption tickets are disabled.\n");
+        return 0;
+    }
+
+    mgr->priv->keys_path = g_build_filename (session->config_dir, "misc",
+                                             TICKET_KEYS_FILE, NULL);
+    load_keys (mgr);
+    if (key_expired (mgr))
+        rotate_keys (mgr);
+
+    return 0;
+}
+
+void
+ccnet_ticket_manager_start (CcnetTicketManager *mgr)
+{
+    if (mgr->lifetime == 0)
+        return;
+
+    mgr->priv->rotate_timer = ccnet_timer_new (rotate_timer_cb, mgr,
+                                               ROTATE_CHECK_MSEC);
+}
+
+gboolean
+ccnet_ticket_manager_enabled (CcnetTicketManager *mgr)
+{
+    return mgr->lifetime > 0 && mgr->priv->n_keys > 0;
+}
+
+static void
+compute_mac (const TicketKey *key, const char *data, int len,
+             unsigned char *mac)
+{
+    unsigned int mac_len = TICKET_MAC_LEN;
+
+    HMAC (EVP_sha1(), key->mac_key, TICKET_MAC_KEY_LEN,
+          (const unsigned char *)data, len, mac, &mac_len);
+}
+
+char *
+ccnet_ticket_manager_issue (CcnetTicketManager *mgr,
+                            const char *peer_id,
+                            const char *key,
+                            int *len)
+{
+    TicketKey *tkey = &mgr->priv->keys[0];
+    unsigned char iv[TICKET_IV_LEN];
+    char *plain, *enc = NULL, *ticket;
+    int enc_len;
+    guint32 id_n;
+
+    if (!ccnet_ticket_manager_enabled (mgr))
+        return NULL;
+
+    plain = g_strdup_printf ("%"G_GINT64_FORMAT" %s %s",
+                             (gint64) time (NULL) + mgr->lifetime,
+                             peer_id, key);
+
+    RAND_pseudo_bytes (iv, TICKET_IV_LEN);
+    if (ccnet_encrypt_with_key (&enc, &enc_len, plain, strlen(plain),
+                                tkey->aes_key, iv) < 0) {
+        g_free (plain);
+        return NULL;
+    }
+    g_free (plain);
+
+    *len = TICKET_HEADER_LEN + enc_len + TICKET_MAC_LEN;
+    ticket = g_malloc (*len);
+
+    id_n = g_htonl (tkey->id);
+    memcpy (ticket, &id_n, 4);
+    memcpy (ticket + 4, iv, TICKET_IV_LEN);
+    memcpy (ticket + TICKET_HEADER_LEN, enc, enc_len);
+    compute_mac (tkey, ticket, TICKET_HEADER_LEN + enc_len,
+                 (unsigned char *)ticket + TICKET_HEADER_LEN + enc_len);
+    g_free (enc);
+
+    mgr->n_issued++;
+    return ticket;
+}
+
+static TicketKey *
+find_key (CcnetTicketManager *mgr, guint32 id)
+{
+    int i;
+
+    for (i = 0; i < mgr->priv->n_keys; ++i)
+        if (mgr->priv->keys[i].id == id)
+            return &mgr->priv->keys[i];
+    return NULL;
+}
+
+static int
+open_ticket (CcnetTicketManager *mgr, const char *ticket, int len,
+             const char *peer_id, char *key)
+{
+    TicketKey *tkey;
+    unsigned char mac[TICKET_MAC_LEN];
+    char *plain = NULL;
+    int enc_len, plain_len, ret = -1;
+    guint32 id_n;
+    char **tokens = NULL;
+
+    enc_len = len - TICKET_HEADER_LEN - TICKET_MAC_LEN;
+    if (enc_len <= 0)
+        return -1;
+
+    memcpy (&id_n, ticket, 4);
+    tkey = find_key (mgr, g_ntohl (id_n));
+    if (!tkey)
+        return -1;
+
+    compute_mac (tkey, ticket, TICKET_HEADER_LEN + enc_len, mac);
+    if (CRYPTO_memcmp (mac, ticket + TICKET_HEADER_LEN + enc_len,
+                       TICKET_MAC_LEN) != 0)
+        return -1;
+
+    if (ccnet_decrypt_with_key (&plain, &plain_len,
+                                ticket + TICKET_HEADER_LEN, enc_len,
+                                tkey->aes_key,
+                                (unsigned char *)ticket + 4) < 0)
+        return -1;
+
+    plain = g_realloc (plain, plain_len + 1);
+    plain[plain_len] = '\0';
+
+    tokens = g_strsplit (plain, " ", -1);
+    if (g_strv_length (tokens) != 3 ||
+        g_ascii_strtoll (tokens[0], NULL, 10) < (gint64) time (NULL) ||
+        g_strcmp0 (tokens[1], peer_id) != 0 ||
+        strlen (tokens[2]) != CCNET_TICKET_KEY_LEN)
+        goto out;
+
+    memcpy (key, tokens[2], CCNET_TICKET_KEY_LEN + 1);
+    ret = 0;
+
+out:
+    g_strfreev (tokens);
+    g_free (plain);
+    return ret;
+}
+
+int
+ccnet_ticket_manager_open (CcnetTicketManager *mgr,
+                           const char *ticket,
+                           int len,
+                           const char *peer_id,
+                           char *key)
+{
+    if (!ccnet_ticket_manager_enabled (mgr) ||
+        open_ticket (mgr, ticket, len, peer_id, key) < 0) {
+        mgr->n_rejected++;
+        return -1;
+    }
+
+    mgr->n_resumed++;
+    return 0;
+}
+
+void
+ccnet_ticket_compute_proof (const char *key,
+                            const char *label,
+                            const unsigned char *nonce1,
+                            const unsigned char *nonce2,
+                            int nonce_len,
+                            char *out)
+{
+    HMAC_CTX ctx;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    HMAC_CTX_init (&ctx);
+    HMAC_Init_ex (&ctx, key, strlen(key), EVP_sha1(), NULL);
+    HMAC_Update (&ctx, (const unsigned char *)label, strlen(label));
+    HMAC_Update (&ctx, nonce1, nonce_len);
+    HMAC_Update (&ctx, nonce2, nonce_len);
+    HMAC_Final (&ctx, md, &md_len);
+    HMAC_CTX_cleanup (&ctx);
+
+    rawdata_to_hex (md, out, 20);
+}
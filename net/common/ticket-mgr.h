@@ -0,0 +1,87 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_TICKET_MGR_H
+#define CCNET_TICKET_MGR_H
+
+#include <glib.h>
+
+/*
+ * Session resumption tickets.
+ *
+ * At the end of a full handshake we hand the peer a ticket holding its
+ * id and the current session key, encrypted and MACed under a master
+ * key only we know. When the peer reconnects it presents the ticket in
+ * keepalive2 and proves it knows the key, so neither side has to redo
+ * the RSA challenge and session key exchange.
+ *
+ * Master keys are rotated every lifetime seconds and the previous one
+ * is kept, so a ticket is accepted for at most one lifetime. Keys are
+ * saved under misc/ so tickets survive a restart.
+ */
+
+#define CCNET_TICKET_KEY_LEN 40   /* session keys are 40 hex chars */
+
+typedef struct _CcnetTicketManager CcnetTicketManager;
+typedef struct _CcnetTicketManagerPriv CcnetTicketManagerPriv;
+
+struct _CcnetTicketManager {
+    CcnetSession         *session;
+
+    int                   lifetime; /* in seconds, 0 disables tickets */
+
+    guint64               n_issued;
+    guint64               n_resumed;
+    guint64               n_rejected;
+
+    CcnetTicketManagerPriv *priv;
+};
+
+CcnetTicketManager*
+ccnet_ticket_manager_new (CcnetSession *session);
+
+int
+ccnet_ticket_manager_prepare (CcnetTicketManager *mgr);
+
+void
+ccnet_ticket_manager_start (CcnetTicketManager *mgr);
+
+gboolean
+ccnet_ticket_manager_enabled (CcnetTicketManager *mgr);
+
+/*
+ * Issue a ticket binding @key to @peer_id. Returns a newly allocated
+ * binary blob of *len bytes, or NULL if tickets are disabled.
+ */
+char *
+ccnet_ticket_manager_issue (CcnetTicketManager *mgr,
+                            const char *peer_id,
+                            const char *key,
+                            int *len);
+
+/*
+ * Check a ticket presented by @peer_id. On success returns 0 and stores
+ * the session key from the ticket in @key (CCNET_TICKET_KEY_LEN + 1
+ * bytes). Returns -1 if the ticket is malformed, forged, expired or
+ * issued to another peer.
+ */
+int
+ccnet_ticket_manager_open (CcnetTicketManager *mgr,
+                           const char *ticket,
+                           int len,
+                           const char *peer_id,
+                           char *key);
+
+/*
+ * Compute HMAC-SHA1(@key, @label | @nonce1 | @nonce2) as 40 hex chars
+ * into @out. Used for the resumption proofs and to derive the new
+ * session key.
+ */
+void
+ccnet_ticket_compute_proof (const char *key,
+                            const char *label,
+                            const unsigned char *nonce1,
+                            const unsigned char *nonce2,
+                            int nonce_len,
+                            char *out);
+
+#endif
@@ -0,0 +1,251 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#include "common.h"
+
+#include "timer-wheel.h"
+#include "utils.h"
+
+/*
+ * Four levels: 256 slots of one tick, then 3 x 64 slots each covering
+ * a whole turn of the level below. At 100ms per tick that's 25.6s,
+ * 27min, 29h and 77 days. Timers in higher levels are cascaded down
+ * when the level below wraps around, as in the classic Linux kernel
+ * timer wheel.
+ */
+#define ROOT_BITS  8
+#define LEVEL_BITS 6
+#define ROOT_SIZE  (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define ROOT_MASK  (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define N_LEVELS   3
+
+#define MAX_TICKS  ((G_GUINT64_CONSTANT(1) << (ROOT_BITS + N_LEVELS * LEVEL_BITS)) - 1)
+
+#define LEVEL_INDEX(t, n) \
+    (((t) >> (ROOT_BITS + (n) * LEVEL_BITS)) & LEVEL_MASK)
+
+#define TICK_USEC  ((gint64)CCNET_TIMER_WHEEL_TICK * 1000)
+
+struct CcnetTimerWheel {
+    guint64           now;          /* ticks processed so far */
+    guint64           target;       /* tick tick_cb() is catching up to */
+    gint64            base_time;    /* clock time of tick 0, usec */
+
+    struct list_head  root[ROOT_SIZE];
+    struct list_head  levels[N_LEVELS][LEVEL_SIZE];
+
+    CcnetTimer       *tick_timer;
+};
+
+/*
+ * The wheel only measures intervals, so it follows the monotonic clock:
+ * a step of the wall clock would fire or delay every timer at once.
+ */
+static gint64
+wheel_clock (void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+    return g_get_monotonic_time ();
+#else
+    return get_current_time ();
+#endif
+}
+
+/* The tick new timers count from. While tick_cb() catches up this is
+ * the tick it is heading for, not the one being processed. */
+static guint64
+current_tick (CcnetTimerWheel *wheel)
+{
+    return MAX (wheel->now, wheel->target);
+}
+
+CcnetTimerWheel *
+ccnet_timer_wheel_new (void)
+{
+    CcnetTimerWheel *wheel = g_new0 (CcnetTimerWheel, 1);
+    int i, j;
+
+    for (i = 0; i < ROOT_SIZE; ++i)
+        INIT_LIST_HEAD (&wheel->root[i]);
+    for (i = 0; i < N_LEVELS; ++i)
+        for (j = 0; j < LEVEL_SIZE; ++j)
+            INIT_LIST_HEAD (&wheel->levels[i][j]);
+
+    wheel->base_time = wheel_clock ();
+    return wheel;
+}
+
+void
+ccnet_timer_wheel_free (CcnetTimerWheel *wheel)
+{
+    ccnet_timer_free (&wheel->tick_timer);
+    g_free (wheel);
+}
+
+static void
+add_timer (CcnetTimerWheel *wheel, CcnetWheelTimer *timer)
+{
+    guint64 expires = timer->expires;
+    guint64 delta;
+    struct list_head *slot;
+
+    if (expires <= wheel->now) {
+        /* run at the next tick */
+        slot = &wheel->root[wheel->now & ROOT_MASK];
+    } else {
+        delta = expires - wheel->now;
+        if (delta < ROOT_SIZE)
+            slot = &wheel->root[expires & ROOT_MASK];
+        else if (delta < (1 << (ROOT_BITS + LEVEL_BITS)))
+            slot = &wheel->levels[0][LEVEL_INDEX(expires, 0)];
+        else if (delta < (1 << (ROOT_BITS + 2 * LEVEL_BITS)))
+            slot = &wheel->levels[1][LEVEL_INDEX(expires, 1)];
+        else {
+            if (delta > MAX_TICKS) {
+                expires = wheel->now + MAX_TICKS;
+                timer->expires = expires;
+            }
+            slot = &wheel->levels[2][LEVEL_INDEX(expires, 2)];
+        }
+    }
+
+    list_add_tail (&timer->list, slot);
+}
+
+/* Move all timers of one slot down to the lower levels. */
+static int
+cascade (CcnetTimerWheel *wheel, int level, int index)
+{
+    struct list_head tmp, *pos, *n;
+
+    INIT_LIST_HEAD (&tmp);
+    list_splice_init (&wheel->levels[level][index], &tmp);
+
+    list_for_each_safe (pos, n, &tmp) {
+        CcnetWheelTimer *timer = list_entry (pos, CcnetWheelTimer, list);
+        list_del_init (&timer->list);
+        add_timer (wheel, timer);
+    }
+
+    return index;
+}
+
+static void
+run_tick (CcnetTimerWheel *wheel)
+{
+    struct list_head expired;
+    CcnetWheelTimer *timer;
+    int index = wheel->now & ROOT_MASK;
+    int level;
+
+    if (index == 0) {
+        for (level = 0; level < N_LEVELS; ++level)
+            if (cascade (wheel, level, LEVEL_INDEX(wheel->now, level)) != 0)
+                break;
+    }
+    wheel->now++;
+
+    INIT_LIST_HEAD (&expired);
+    list_splice_init (&wheel->root[index], &expired);
+
+    /* A callback may cancel or re-arm any timer, including ones still
+     * on @expired, so always take the head again. */
+    while (!list_empty (&expired)) {
+        timer = list_entry (expired.next, CcnetWheelTimer, list);
+        list_del_init (&timer->list);
+
+        /* Don't touch @timer after a FALSE return, its owner may be
+         * gone by then. */
+        if (timer->func (timer->user_data) && !ccnet_wheel_timer_pending (timer)) {
+            timer->expires = current_tick (wheel) + timer->interval;
+            add_timer (wheel, timer);
+        }
+    }
+}
+
+static int
+tick_cb (void *vwheel)
+{
+    CcnetTimerWheel *wheel = vwheel;
+    gint64 now = wheel_clock ();
+    guint64 target;
+
+    /* Only possible with the wall clock fallback of wheel_clock(): move
+     * on one tick and rebase. */
+    if (now < wheel->base_time + (gint64)wheel->now * TICK_USEC) {
+        wheel->target = wheel->now + 1;
+        run_tick (wheel);
+        wheel->base_time = now - (gint64)wheel->now * TICK_USEC;
+        return TRUE;
+    }
+
+    target = (now - wheel->base_time) / TICK_USEC;
+    if (target <= wheel->now)
+        target = wheel->now + 1;
+
+    /* Catch up if the event loop was blocked or the host was suspended,
+     * but by one turn of the root level at most, so every slot runs
+     * once. The rest of the gap is dropped and all timers run late. */
+    if (target - wheel->now > ROOT_SIZE) {
+        target = wheel->now + ROOT_SIZE;
+        wheel->base_time = now - (gint64)target * TICK_USEC;
+    }
+
+    wheel->target = target;
+    while (wheel->now < target)
+        run_tick (wheel);
+
+    return TRUE;
+}
+
+void
+ccnet_timer_wheel_start (CcnetTimerWheel *wheel)
+{
+    wheel->base_time = wheel_clock () - (gint64)wheel->now * TICK_USEC;
+    wheel->tick_timer = ccnet_timer_new (tick_cb, wheel,
+                                         CCNET_TIMER_WHEEL_TICK);
+}
+
+void
+ccnet_wheel_timer_init (CcnetWheelTimer *timer)
+{
+    memset (timer, 0, sizeof(*timer));
+    INIT_LIST_HEAD (&timer->list);
+}
+
+void
+ccnet_wheel_timer_arm (CcnetTimerWheel *wheel,
+                       CcnetWheelTimer *timer,
+                       guint64 interval_msec,
+                       TimerCB func,
+                       void *user_data)
+{
+    guint64 ticks;
+
+    ticks = (interval_msec + CCNET_TIMER_WHEEL_TICK - 1) / CCNET_TIMER_WHEEL_TICK;
+    if (ticks == 0)
+        ticks = 1;
+
+    if (ccnet_wheel_timer_pending (timer))
+        list_del_init (&timer->list);
+
+    timer->func = func;
+    timer->user_data = user_data;
+    timer->interval = ticks;
+    timer->expires = current_tick (wheel) + ticks;
+    add_timer (wheel, timer);
+}
+
+void
+ccnet_wheel_timer_cancel (CcnetWheelTimer *timer)
+{
+    if (ccnet_wheel_timer_pending (timer))
+        list_del_init (&timer->list);
+}
+
+gboolean
+ccnet_wheel_timer_pending (CcnetWheelTimer *timer)
+{
+    return timer->list.next != NULL && !list_empty (&timer->list);
+}
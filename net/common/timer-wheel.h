@@ -0,0 +1,70 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+#ifndef CCNET_TIMER_WHEEL_H
+#define CCNET_TIMER_WHEEL_H
+
+#include <glib.h>
+
+#include "list.h"
+#include "timer.h"
+
+/*
+ * Hierarchical timing wheel for coarse timeouts.
+ *
+ * Every CcnetTimer is a separate libevent heap entry, and processors
+ * that re-arm their timeout on each packet free and recreate one every
+ * time. With many peers that churns the heap constantly. A wheel timer
+ * is embedded in its owner, arming, re-arming and cancelling are O(1)
+ * list operations, and the whole wheel is driven by one libevent timer
+ * ticking every CCNET_TIMER_WHEEL_TICK msec.
+ *
+ * Use it for idle and keepalive timeouts where a tick of slack doesn't
+ * matter. Timers fire in the main thread.
+ */
+
+#define CCNET_TIMER_WHEEL_TICK  100     /* msec */
+
+typedef struct CcnetTimerWheel CcnetTimerWheel;
+typedef struct CcnetWheelTimer CcnetWheelTimer;
+
+struct CcnetWheelTimer {
+    struct list_head  list;
+    guint64           expires;      /* in ticks */
+    guint64           interval;     /* in ticks, used to re-arm */
+    TimerCB           func;
+    void             *user_data;
+};
+
+CcnetTimerWheel *
+ccnet_timer_wheel_new (void);
+
+void
+ccnet_timer_wheel_free (CcnetTimerWheel *wheel);
+
+/* Start ticking. Needs the event loop to be initialized. */
+void
+ccnet_timer_wheel_start (CcnetTimerWheel *wheel);
+
+void
+ccnet_wheel_timer_init (CcnetWheelTimer *timer);
+
+/*
+ * Call @func(@user_data) after @interval_msec, rounded up to a tick.
+ * Like CcnetTimer, the timer is re-armed with the same interval if
+ * @func returns TRUE. Arming a pending timer moves it.
+ */
+void
+ccnet_wheel_timer_arm (CcnetTimerWheel *wheel,
+                       CcnetWheelTimer *timer,
+                       guint64 interval_msec,
+                       TimerCB func,
+                       void *user_data);
+
+/* Safe to call on a timer that is not pending. */
+void
+ccnet_wheel_timer_cancel (CcnetWheelTimer *timer);
+
+gboolean
+ccnet_wheel_timer_pending (CcnetWheelTimer *timer);
+
+#endif
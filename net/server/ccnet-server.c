@@ -10,6 +10,7 @@
 #include "server-session.h"
 #include "user-mgr.h"
 #include "rpc-service.h"
+#include "rsa.h"
 #include "log.h"
 
 char *pidfile = NULL;
@@ -239,6 +240,7 @@ main (int argc, char **argv)
 #endif
 
     g_type_init ();
+    ccnet_crypto_init_threads ();
 
     /* log */
     if (!debug_str)
@@ -2,21 +2,64 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "server-session.h"
 
 #include "ccnet-db.h"
 #include "group-mgr.h"
+#include "json-stream.h"
 #include "org-mgr.h"
+#include "timer.h"
 
 #include "utils.h"
 #include "log.h"
 
+#define GROUP_INDEX_SCRUB_INTERVAL_MSEC (10 * 60 * 1000)
+
+/*
+ * In-memory copy of the Group and GroupUser tables, so that membership
+ * checks never hit the DB. Every group has an array of members sorted
+ * by user name, and every user an array of sorted group ids. The user
+ * name strings are owned by the user entries and shared by the member
+ * arrays. User names are kept in lower case and looked up ignoring
+ * case, the way MySQL compares them.
+ */
+typedef struct GroupMember {
+    const char *user;
+    gboolean    is_staff;
+} GroupMember;
+
+typedef struct UserGroups {
+    char       *user;
+    GArray     *group_ids;
+} UserGroups;
+
+typedef struct GroupIndex {
+    GHashTable *groups;         /* group id -> GArray of GroupMember */
+    GHashTable *users;          /* user name -> UserGroups */
+} GroupIndex;
+
 struct _CcnetGroupManagerPriv {
     CcnetDB	*db;
+
+    /* Mutations hold write_lock across the DB write and the index
+     * update, so that both see them in the same order. Readers only
+     * take lock, which protects the index itself.
+     */
+    pthread_mutex_t write_lock;
+    pthread_mutex_t lock;
+    GroupIndex *index;
+    /* Bumped on every index update, so that a scrub which raced with
+     * a mutation is discarded. */
+    guint       gen;
+    gboolean    scrubbing;
+    CcnetTimer *scrub_timer;
 };
 
 static int open_db (CcnetGroupManager *manager);
 static int check_db_table (CcnetDB *db);
+static GroupIndex *load_group_index (CcnetDB *db);
 
 CcnetGroupManager* ccnet_group_manager_new (CcnetSession *session)
 {
@@ -24,6 +67,8 @@ CcnetGroupManager* ccnet_group_manager_new (CcnetSession *session)
 
     manager->session = session;
     manager->priv = g_new0 (CcnetGroupManagerPriv, 1);
+    pthread_mutex_init (&manager->priv->write_lock, NULL);
+    pthread_mutex_init (&manager->priv->lock, NULL);
 
     return manager;
 }
@@ -31,11 +76,23 @@ CcnetGroupManager* ccnet_group_manager_new (CcnetSession *session)
 int
 ccnet_group_manager_prepare (CcnetGroupManager *manager)
 {
-    return open_db(manager);
+    if (open_db(manager) < 0)
+        return -1;
+
+    manager->priv->index = load_group_index (manager->priv->db);
+    if (!manager->priv->index) {
+        ccnet_warning ("Failed to load groups.\n");
+        return -1;
+    }
+    return 0;
 }
 
+static int scrub_pulse (void *vmanager);
+
 void ccnet_group_manager_start (CcnetGroupManager *manager)
 {
+    manager->priv->scrub_timer = ccnet_timer_new (scrub_pulse, manager,
+                                                  GROUP_INDEX_SCRUB_INTERVAL_MSEC);
 }
 
 static CcnetDB *
@@ -150,6 +207,489 @@ static int check_db_table (CcnetDB *db)
     return 0;
 }
 
+/* -------- Group Index ---------------- */
+
+static void
+free_user_groups (UserGroups *ug)
+{
+    g_free (ug->user);
+    g_array_free (ug->group_ids, TRUE);
+    g_free (ug);
+}
+
+static void
+free_member_array (GArray *members)
+{
+    g_array_free (members, TRUE);
+}
+
+static guint
+user_hash (gconstpointer key)
+{
+    const char *p;
+    guint h = 5381;
+
+    for (p = key; *p; ++p)
+        h = (h << 5) + h + g_ascii_tolower (*p);
+    return h;
+}
+
+static gboolean
+user_equal (gconstpointer a, gconstpointer b)
+{
+    return g_ascii_strcasecmp (a, b) == 0;
+}
+
+static GroupIndex *
+group_index_new (void)
+{
+    GroupIndex *index = g_new0 (GroupIndex, 1);
+
+    index->groups = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                           NULL,
+                                           (GDestroyNotify)free_member_array);
+    index->users = g_hash_table_new_full (user_hash, user_equal,
+                                          NULL,
+                                          (GDestroyNotify)free_user_groups);
+    return index;
+}
+
+static void
+group_index_free (GroupIndex *index)
+{
+    if (!index)
+        return;
+    /* Member arrays point into the user entries. */
+    g_hash_table_destroy (index->groups);
+    g_hash_table_destroy (index->users);
+    g_free (index);
+}
+
+/* Binary search. On return *pos is the match, or where to insert. */
+static gboolean
+find_member (GArray *members, const char *user, guint *pos)
+{
+    guint lo = 0, hi = members->len, mid;
+    int cmp;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = g_ascii_strcasecmp (g_array_index (members, GroupMember, mid).user,
+                                  user);
+        if (cmp == 0) {
+            *pos = mid;
+            return TRUE;
+        }
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return FALSE;
+}
+
+static gboolean
+find_group_id (GArray *ids, int group_id, guint *pos)
+{
+    guint lo = 0, hi = ids->len, mid;
+    int id;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        id = g_array_index (ids, int, mid);
+        if (id == group_id) {
+            *pos = mid;
+            return TRUE;
+        }
+        if (id < group_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+    return FALSE;
+}
+
+static GroupMember *
+index_lookup_member (GroupIndex *index, int group_id, const char *user)
+{
+    GArray *members;
+    guint pos;
+
+    members = g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id));
+    if (!members || !find_member (members, user, &pos))
+        return NULL;
+    return &g_array_index (members, GroupMember, pos);
+}
+
+static void
+index_add_group (GroupIndex *index, int group_id)
+{
+    if (g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id)))
+        return;
+    g_hash_table_insert (index->groups, GINT_TO_POINTER(group_id),
+                         g_array_new (FALSE, FALSE, sizeof(GroupMember)));
+}
+
+static UserGroups *
+get_user_groups (GroupIndex *index, const char *user)
+{
+    UserGroups *ug;
+
+    ug = g_hash_table_lookup (index->users, user);
+    if (!ug) {
+        ug = g_new0 (UserGroups, 1);
+        ug->user = g_ascii_strdown (user, -1);
+        ug->group_ids = g_array_new (FALSE, FALSE, sizeof(int));
+        g_hash_table_insert (index->users, ug->user, ug);
+    }
+    return ug;
+}
+
+/* Adding an existing member only updates its staff bit. */
+static void
+index_add_member (GroupIndex *index, int group_id, const char *user,
+                  gboolean is_staff)
+{
+    GArray *members;
+    UserGroups *ug;
+    GroupMember member;
+    guint pos;
+
+    members = g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id));
+    if (!members)
+        return;
+
+    if (find_member (members, user, &pos)) {
+        g_array_index (members, GroupMember, pos).is_staff = is_staff;
+        return;
+    }
+
+    ug = get_user_groups (index, user);
+
+    member.user = ug->user;
+    member.is_staff = is_staff;
+    g_array_insert_val (members, pos, member);
+
+    if (!find_group_id (ug->group_ids, group_id, &pos))
+        g_array_insert_val (ug->group_ids, pos, group_id);
+}
+
+/* Drop @group_id from the groups of @user, and @user if that was the
+ * last one. */
+static void
+index_unlink_user (GroupIndex *index, const char *user, int group_id)
+{
+    UserGroups *ug;
+    guint pos;
+
+    ug = g_hash_table_lookup (index->users, user);
+    if (!ug)
+        return;
+    if (find_group_id (ug->group_ids, group_id, &pos))
+        g_array_remove_index (ug->group_ids, pos);
+    if (ug->group_ids->len == 0)
+        g_hash_table_remove (index->users, user);
+}
+
+static void
+index_remove_member (GroupIndex *index, int group_id, const char *user)
+{
+    GArray *members;
+    guint pos;
+
+    members = g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id));
+    if (!members || !find_member (members, user, &pos))
+        return;
+
+    g_array_remove_index (members, pos);
+    index_unlink_user (index, user, group_id);
+}
+
+static void
+index_remove_group (GroupIndex *index, int group_id)
+{
+    GArray *members;
+    guint i;
+
+    members = g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id));
+    if (!members)
+        return;
+
+    for (i = 0; i < members->len; ++i)
+        index_unlink_user (index, g_array_index (members, GroupMember, i).user,
+                           group_id);
+    g_hash_table_remove (index->groups, GINT_TO_POINTER(group_id));
+}
+
+static void
+index_remove_user (GroupIndex *index, const char *user)
+{
+    UserGroups *ug;
+    GArray *members;
+    guint i, pos;
+
+    ug = g_hash_table_lookup (index->users, user);
+    if (!ug)
+        return;
+
+    for (i = 0; i < ug->group_ids->len; ++i) {
+        int group_id = g_array_index (ug->group_ids, int, i);
+        members = g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id));
+        if (members && find_member (members, user, &pos))
+            g_array_remove_index (members, pos);
+    }
+    g_hash_table_remove (index->users, user);
+}
+
+static gboolean
+load_group_cb (CcnetDBRow *row, void *data)
+{
+    index_add_group (data, ccnet_db_row_get_column_int (row, 0));
+    return TRUE;
+}
+
+/* Append unsorted while loading, sort_loaded_index() sorts afterwards.
+ * That keeps loading linear in the number of rows. */
+static gboolean
+load_group_user_cb (CcnetDBRow *row, void *data)
+{
+    GroupIndex *index = data;
+    GArray *members;
+    UserGroups *ug;
+    GroupMember member;
+
+    int group_id = ccnet_db_row_get_column_int (row, 0);
+    const char *user = (const char *)ccnet_db_row_get_column_text (row, 1);
+    int is_staff = ccnet_db_row_get_column_int (row, 2);
+
+    /* Skip members of removed groups. */
+    members = g_hash_table_lookup (index->groups, GINT_TO_POINTER(group_id));
+    if (!members || !user)
+        return TRUE;
+
+    ug = get_user_groups (index, user);
+
+    member.user = ug->user;
+    member.is_staff = (is_staff == 1);
+    g_array_append_val (members, member);
+    g_array_append_val (ug->group_ids, group_id);
+
+    return TRUE;
+}
+
+static gint
+cmp_member (gconstpointer a, gconstpointer b)
+{
+    return strcmp (((const GroupMember *)a)->user,
+                   ((const GroupMember *)b)->user);
+}
+
+static gint
+cmp_int (gconstpointer a, gconstpointer b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+
+    return x < y ? -1 : (x > y);
+}
+
+/* Rows of one user that differ only in case end up next to each other
+ * after sorting; keep one, staff if any of them is. */
+static void
+dedup_members (GArray *members)
+{
+    GroupMember *m, *last;
+    guint i, n = 0;
+
+    for (i = 0; i < members->len; ++i) {
+        m = &g_array_index (members, GroupMember, i);
+        last = n > 0 ? &g_array_index (members, GroupMember, n - 1) : NULL;
+        if (last && last->user == m->user) {
+            last->is_staff = last->is_staff || m->is_staff;
+            continue;
+        }
+        g_array_index (members, GroupMember, n++) = *m;
+    }
+    g_array_set_size (members, n);
+}
+
+static void
+dedup_group_ids (GArray *ids)
+{
+    guint i, n = 0;
+    int id;
+
+    for (i = 0; i < ids->len; ++i) {
+        id = g_array_index (ids, int, i);
+        if (n > 0 && g_array_index (ids, int, n - 1) == id)
+            continue;
+        g_array_index (ids, int, n++) = id;
+    }
+    g_array_set_size (ids, n);
+}
+
+static void
+sort_loaded_index (GroupIndex *index)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init (&iter, index->groups);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_array_sort ((GArray *)value, cmp_member);
+        dedup_members ((GArray *)value);
+    }
+
+    g_hash_table_iter_init (&iter, index->users);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        g_array_sort (((UserGroups *)value)->group_ids, cmp_int);
+        dedup_group_ids (((UserGroups *)value)->group_ids);
+    }
+}
+
+static GroupIndex *
+load_group_index (CcnetDB *db)
+{
+    GroupIndex *index = group_index_new ();
+    const char *sql;
+
+    if (ccnet_db_type(db) == CCNET_DB_TYPE_PGSQL)
+        sql = "SELECT group_id FROM \"Group\"";
+    else
+        sql = "SELECT `group_id` FROM `Group`";
+    if (ccnet_db_foreach_selected_row_primary (db, sql,
+                                               load_group_cb, index) < 0)
+        goto error;
+
+    sql = "SELECT group_id, user_name, is_staff FROM GroupUser";
+    if (ccnet_db_foreach_selected_row_primary (db, sql,
+                                               load_group_user_cb, index) < 0)
+        goto error;
+
+    sort_loaded_index (index);
+    return index;
+
+error:
+    group_index_free (index);
+    return NULL;
+}
+
+/* The user entries are derived from the groups, so comparing the
+ * groups is enough. */
+static gboolean
+group_index_equal (GroupIndex *a, GroupIndex *b)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    GArray *ma, *mb;
+    GroupMember *x, *y;
+    guint i;
+
+    if (g_hash_table_size (a->groups) != g_hash_table_size (b->groups))
+        return FALSE;
+
+    g_hash_table_iter_init (&iter, a->groups);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        ma = value;
+        mb = g_hash_table_lookup (b->groups, key);
+        if (!mb || ma->len != mb->len)
+            return FALSE;
+        for (i = 0; i < ma->len; ++i) {
+            x = &g_array_index (ma, GroupMember, i);
+            y = &g_array_index (mb, GroupMember, i);
+            if (x->is_staff != y->is_staff || strcmp (x->user, y->user) != 0)
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+typedef struct ScrubData {
+    CcnetGroupManager *manager;
+    guint gen;
+    GroupIndex *index;
+} ScrubData;
+
+static void *
+scrub_job (void *vdata)
+{
+    ScrubData *data = vdata;
+    CcnetGroupManagerPriv *priv = data->manager->priv;
+
+    /* Hold off mutations, so that the DB isn't caught between a write
+     * and the matching index update. */
+    pthread_mutex_lock (&priv->write_lock);
+    data->index = load_group_index (priv->db);
+    data->gen = priv->gen;
+    pthread_mutex_unlock (&priv->write_lock);
+
+    return vdata;
+}
+
+static void
+scrub_done (void *result)
+{
+    ScrubData *data = result;
+    CcnetGroupManagerPriv *priv = data->manager->priv;
+    GroupIndex *old = NULL;
+
+    pthread_mutex_lock (&priv->lock);
+    if (data->index && data->gen == priv->gen &&
+        !group_index_equal (priv->index, data->index)) {
+        ccnet_warning ("Group index is out of sync with the database, "
+                       "reloaded.\n");
+        old = priv->index;
+        priv->index = data->index;
+        data->index = NULL;
+        priv->gen++;
+    }
+    priv->scrubbing = FALSE;
+    pthread_mutex_unlock (&priv->lock);
+
+    group_index_free (old);
+    group_index_free (data->index);
+    g_free (data);
+}
+
+static int
+scrub_pulse (void *vmanager)
+{
+    CcnetGroupManager *manager = vmanager;
+    CcnetGroupManagerPriv *priv = manager->priv;
+    ScrubData *data;
+
+    pthread_mutex_lock (&priv->lock);
+    if (priv->scrubbing) {
+        pthread_mutex_unlock (&priv->lock);
+        return TRUE;
+    }
+    priv->scrubbing = TRUE;
+    pthread_mutex_unlock (&priv->lock);
+
+    data = g_new0 (ScrubData, 1);
+    data->manager = manager;
+    ccnet_job_manager_schedule_job (manager->session->job_mgr,
+                                    scrub_job, scrub_done, data);
+    return TRUE;
+}
+
+/* Index updates mirror mutations that are already in the DB, and are
+ * made with write_lock held. */
+static void
+begin_index_update (CcnetGroupManagerPriv *priv)
+{
+    pthread_mutex_lock (&priv->lock);
+}
+
+static void
+end_index_update (CcnetGroupManagerPriv *priv)
+{
+    priv->gen++;
+    pthread_mutex_unlock (&priv->lock);
+}
+
 static int
 create_group_common (CcnetGroupManager *mgr,
                      const char *group_name,
@@ -162,7 +702,9 @@ create_group_common (CcnetGroupManager *mgr,
     int group_id = -1;
 
     char *user_name_l = g_ascii_strdown (user_name, -1);
-    
+
+    pthread_mutex_lock (&mgr->priv->write_lock);
+
     if (ccnet_db_type(db) == CCNET_DB_TYPE_PGSQL)
         snprintf (sql, sizeof(sql), "INSERT INTO \"Group\"(group_name, "
                   "creator_name, timestamp) VALUES('%s', '%s', "
@@ -206,7 +748,13 @@ create_group_common (CcnetGroupManager *mgr,
         goto out;
     }
 
+    begin_index_update (mgr->priv);
+    index_add_group (mgr->priv->index, group_id);
+    index_add_member (mgr->priv->index, group_id, user_name_l, TRUE);
+    end_index_update (mgr->priv);
+
 out:
+    pthread_mutex_unlock (&mgr->priv->write_lock);
     g_free (user_name_l);
     return group_id;
 }
@@ -323,15 +871,18 @@ int ccnet_group_manager_create_org_group (CcnetGroupManager *mgr,
 }
 
 static gboolean
-check_group_staff (CcnetDB *db, int group_id, const char *user_name)
+check_group_staff (CcnetGroupManager *mgr, int group_id, const char *user_name)
 {
-    char sql[512];
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GroupMember *member;
+    gboolean ret;
 
-    snprintf (sql, sizeof(sql), "SELECT group_id FROM GroupUser WHERE "
-              "group_id = %d AND user_name = '%s' AND is_staff = 1",
-              group_id, user_name);
-    
-    return ccnet_db_check_for_existence (db, sql);
+    pthread_mutex_lock (&priv->lock);
+    member = index_lookup_member (priv->index, group_id, user_name);
+    ret = (member && member->is_staff);
+    pthread_mutex_unlock (&priv->lock);
+
+    return ret;
 }
 
 int ccnet_group_manager_remove_group (CcnetGroupManager *mgr,
@@ -345,35 +896,56 @@ int ccnet_group_manager_remove_group (CcnetGroupManager *mgr,
     /* No permission check here, since both group staff and seahub staff
      * can remove group.
      */
-    
+
+    pthread_mutex_lock (&mgr->priv->write_lock);
+
     if (ccnet_db_type(db) == CCNET_DB_TYPE_PGSQL)
         snprintf (sql, sizeof(sql), "DELETE FROM \"Group\" WHERE group_id=%d",
                   group_id);
     else
         snprintf (sql, sizeof(sql), "DELETE FROM `Group` WHERE group_id=%d",
                   group_id);
-    ccnet_db_query (db, sql);
+    if (ccnet_db_query (db, sql) == 0) {
+        /* Members of a removed group are skipped when loading, so the
+         * group is gone from the index even if the next delete fails. */
+        begin_index_update (mgr->priv);
+        index_remove_group (mgr->priv->index, group_id);
+        end_index_update (mgr->priv);
+    }
 
     snprintf (sql, sizeof(sql), "DELETE FROM GroupUser WHERE group_id=%d",
               group_id);
     ccnet_db_query (db, sql);
-    
+
+    pthread_mutex_unlock (&mgr->priv->write_lock);
+
     return 0;
 }
 
+/*
+ * SQL condition matching @user in GroupUser. The index matches user
+ * names ignoring case, like MySQL's default collation, so make SQLite
+ * and PostgreSQL match the same rows.
+ */
+static void
+format_user_cond (CcnetDB *db, char *buf, size_t size, const char *user)
+{
+    snprintf (buf, size, ccnet_db_type(db) == CCNET_DB_TYPE_MYSQL ?
+              "user_name='%s'" : "LOWER(user_name)=LOWER('%s')", user);
+}
+
 static gboolean
-check_group_exists (CcnetDB *db, int group_id)
+check_group_exists (CcnetGroupManager *mgr, int group_id)
 {
-    char sql[512];
-    
-    if (ccnet_db_type(db) == CCNET_DB_TYPE_PGSQL)
-        snprintf (sql, sizeof(sql), "SELECT group_id FROM \"Group\" WHERE "
-                  "group_id=%d", group_id);
-    else
-        snprintf (sql, sizeof(sql), "SELECT group_id FROM `Group` WHERE "
-                  "group_id=%d", group_id);
-    
-    return ccnet_db_check_for_existence (db, sql);
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    gboolean ret;
+
+    pthread_mutex_lock (&priv->lock);
+    ret = g_hash_table_lookup (priv->index->groups,
+                               GINT_TO_POINTER(group_id)) != NULL;
+    pthread_mutex_unlock (&priv->lock);
+
+    return ret;
 }
 
 int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
@@ -386,14 +958,14 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
     char sql[512];
 
     /* check whether user is the staff of the group */
-    if (!check_group_staff (db, group_id, user_name)) {
+    if (!check_group_staff (mgr, group_id, user_name)) {
         g_set_error (error, CCNET_DOMAIN, 0,
                      "Permission error: only group staff can add member");
         return -1; 
     }    
 
     /* check whether group exists */
-    if (!check_group_exists (db, group_id)) {
+    if (!check_group_exists (mgr, group_id)) {
         g_set_error (error, CCNET_DOMAIN, 0, "Group not exists");
         return -1;
     }
@@ -407,18 +979,130 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
     /*     return -1; */
     /* } */
 
-    char *member_name_l = g_ascii_strdown (member_name, -1);
     snprintf (sql, sizeof(sql), "INSERT INTO GroupUser VALUES (%d, '%s', %d)",
               group_id, member_name, 0);
-    g_free (member_name_l);
+
+    pthread_mutex_lock (&mgr->priv->write_lock);
     if (ccnet_db_query (db, sql) < 0) {
+        pthread_mutex_unlock (&mgr->priv->write_lock);
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to add member to group");
         return -1;
     }
 
+    begin_index_update (mgr->priv);
+    index_add_member (mgr->priv->index, group_id, member_name, FALSE);
+    end_index_update (mgr->priv);
+    pthread_mutex_unlock (&mgr->priv->write_lock);
+
     return 0;
 }
 
+int ccnet_group_manager_add_members (CcnetGroupManager *mgr,
+                                     int group_id,
+                                     const char *user_name,
+                                     char **member_names,
+                                     int *status,
+                                     GError **error)
+{
+    CcnetDB *db = mgr->priv->db;
+    CcnetDBTrans *trans;
+    GHashTable *members;
+    GString *sql;
+    char query[256];
+    int i, n_rows = 0, ret = 0;
+
+    for (i = 0; member_names[i] != NULL; ++i)
+        status[i] = -1;
+
+    if (!check_group_staff (mgr, group_id, user_name)) {
+        g_set_error (error, CCNET_DOMAIN, 0,
+                     "Permission error: only group staff can add member");
+        return -1; 
+    }    
+
+    if (!check_group_exists (mgr, group_id)) {
+        g_set_error (error, CCNET_DOMAIN, 0, "Group not exists");
+        return -1;
+    }
+
+    pthread_mutex_lock (&mgr->priv->write_lock);
+
+    trans = ccnet_db_begin (db);
+    if (!trans) {
+        pthread_mutex_unlock (&mgr->priv->write_lock);
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to add members to group");
+        return -1;
+    }
+
+    members = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    snprintf (query, sizeof(query),
+              "SELECT user_name FROM GroupUser WHERE group_id=%d", group_id);
+    if (ccnet_db_trans_foreach_selected_row (trans, query,
+                                             ccnet_db_collect_string_set,
+                                             members) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    sql = g_string_new (NULL);
+    for (i = 0; member_names[i] != NULL; ++i) {
+        if (member_names[i][0] == '\0') {
+            status[i] = -1;
+            continue;
+        }
+        if (g_hash_table_lookup (members, member_names[i])) {
+            status[i] = 1;      /* already a member */
+            continue;
+        }
+        g_hash_table_insert (members, g_strdup(member_names[i]),
+                             GINT_TO_POINTER(1));
+        status[i] = 0;
+
+        g_string_append_printf (sql, "%s(%d, '%s', 0)",
+                                n_rows ? ", " : "INSERT INTO GroupUser VALUES ",
+                                group_id, member_names[i]);
+        if (++n_rows == CCNET_DB_BATCH_INSERT_ROWS) {
+            if (ccnet_db_trans_query (trans, sql->str) < 0) {
+                ret = -1;
+                break;
+            }
+            g_string_truncate (sql, 0);
+            n_rows = 0;
+        }
+    }
+    if (ret == 0 && n_rows > 0 && ccnet_db_trans_query (trans, sql->str) < 0)
+        ret = -1;
+    g_string_free (sql, TRUE);
+
+out:
+    g_hash_table_destroy (members);
+
+    if (ret == 0)
+        ret = ccnet_db_commit (trans);
+    else
+        ccnet_db_rollback (trans);
+
+    if (ret == 0) {
+        begin_index_update (mgr->priv);
+        for (i = 0; member_names[i] != NULL; ++i)
+            if (status[i] == 0)
+                index_add_member (mgr->priv->index, group_id,
+                                  member_names[i], FALSE);
+        end_index_update (mgr->priv);
+    }
+    pthread_mutex_unlock (&mgr->priv->write_lock);
+
+    if (ret < 0) {
+        /* nothing was added */
+        for (i = 0; member_names[i] != NULL; ++i)
+            if (status[i] == 0)
+                status[i] = -1;
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to add members to group");
+    }
+
+    return ret;
+}
+
 int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
                                        int group_id,
                                        const char *user_name,
@@ -426,17 +1110,17 @@ int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
                                        GError **error)
 {
     CcnetDB *db = mgr->priv->db;
-    char sql[512];
+    char sql[512], cond[320];
 
     /* check whether user is the staff of the group */
-    if (!check_group_staff (db, group_id, user_name)) {
+    if (!check_group_staff (mgr, group_id, user_name)) {
         g_set_error (error, CCNET_DOMAIN, 0,
                      "Only group staff can remove member");
         return -1; 
     }    
 
     /* check whether group exists */
-    if (!check_group_exists (db, group_id)) {
+    if (!check_group_exists (mgr, group_id)) {
         g_set_error (error, CCNET_DOMAIN, 0, "Group not exists");
         return -1;
     }
@@ -447,9 +1131,16 @@ int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
         return -1;
     }
 
+    format_user_cond (db, cond, sizeof(cond), member_name);
     snprintf (sql, sizeof(sql), "DELETE FROM GroupUser WHERE group_id=%d AND "
-              "user_name='%s'", group_id, member_name);
-    ccnet_db_query (db, sql);
+              "%s", group_id, cond);
+    pthread_mutex_lock (&mgr->priv->write_lock);
+    if (ccnet_db_query_changes (db, sql) > 0) {
+        begin_index_update (mgr->priv);
+        index_remove_member (mgr->priv->index, group_id, member_name);
+        end_index_update (mgr->priv);
+    }
+    pthread_mutex_unlock (&mgr->priv->write_lock);
 
     return 0;
 }
@@ -460,12 +1151,22 @@ int ccnet_group_manager_set_admin (CcnetGroupManager *mgr,
                                    GError **error)
 {
     CcnetDB *db = mgr->priv->db;
-    char sql[512];
+    char sql[512], cond[320];
 
+    format_user_cond (db, cond, sizeof(cond), member_name);
     snprintf (sql, sizeof(sql), "UPDATE GroupUser SET is_staff = 1 "
-              "WHERE group_id = %d and user_name = '%s'",
-              group_id, member_name);
-    ccnet_db_query (db, sql);
+              "WHERE group_id = %d and %s", group_id, cond);
+    pthread_mutex_lock (&mgr->priv->write_lock);
+    if (ccnet_db_query_changes (db, sql) > 0) {
+        GroupMember *member;
+
+        begin_index_update (mgr->priv);
+        member = index_lookup_member (mgr->priv->index, group_id, member_name);
+        if (member)
+            member->is_staff = TRUE;
+        end_index_update (mgr->priv);
+    }
+    pthread_mutex_unlock (&mgr->priv->write_lock);
 
     return 0;
 }
@@ -476,12 +1177,22 @@ int ccnet_group_manager_unset_admin (CcnetGroupManager *mgr,
                                      GError **error)
 {
     CcnetDB *db = mgr->priv->db;
-    char sql[512];
+    char sql[512], cond[320];
 
+    format_user_cond (db, cond, sizeof(cond), member_name);
     snprintf (sql, sizeof(sql), "UPDATE GroupUser SET is_staff = 0 "
-              "WHERE group_id = %d and user_name = '%s'",
-              group_id, member_name);
-    ccnet_db_query (db, sql);
+              "WHERE group_id = %d and %s", group_id, cond);
+    pthread_mutex_lock (&mgr->priv->write_lock);
+    if (ccnet_db_query_changes (db, sql) > 0) {
+        GroupMember *member;
+
+        begin_index_update (mgr->priv);
+        member = index_lookup_member (mgr->priv->index, group_id, member_name);
+        if (member)
+            member->is_staff = FALSE;
+        end_index_update (mgr->priv);
+    }
+    pthread_mutex_unlock (&mgr->priv->write_lock);
 
     return 0;
 }
@@ -507,58 +1218,55 @@ int ccnet_group_manager_quit_group (CcnetGroupManager *mgr,
                                     GError **error)
 {
     CcnetDB *db = mgr->priv->db;
-    char sql[512];
+    char sql[512], cond[320];
     
     /* check where user is the staff of the group */
-    if (check_group_staff (db, group_id, user_name)) {
+    if (check_group_staff (mgr, group_id, user_name)) {
         g_set_error (error, CCNET_DOMAIN, 0,
                      "Group staff can not quit group");
         return -1; 
     }    
 
     /* check whether group exists */
-    if (!check_group_exists (db, group_id)) {
+    if (!check_group_exists (mgr, group_id)) {
         g_set_error (error, CCNET_DOMAIN, 0, "Group not exists");
         return -1;
     }
     
+    format_user_cond (db, cond, sizeof(cond), user_name);
     snprintf (sql, sizeof(sql), "DELETE FROM GroupUser WHERE group_id=%d "
-              "AND user_name='%s'", group_id, user_name);
-    ccnet_db_query (db, sql);
+              "AND %s", group_id, cond);
+    pthread_mutex_lock (&mgr->priv->write_lock);
+    if (ccnet_db_query_changes (db, sql) > 0) {
+        begin_index_update (mgr->priv);
+        index_remove_member (mgr->priv->index, group_id, user_name);
+        end_index_update (mgr->priv);
+    }
+    pthread_mutex_unlock (&mgr->priv->write_lock);
 
     return 0;
 }
 
-static gboolean
-get_group_ids_cb (CcnetDBRow *row, void *data)
-{
-    GList **plist = data;
-
-    int group_id = ccnet_db_row_get_column_int (row, 0);
-
-    *plist = g_list_prepend (*plist, (gpointer)(long)group_id);
-
-    return TRUE;
-}
-
 GList *
 ccnet_group_manager_get_groupids_by_user (CcnetGroupManager *mgr,
                                           const char *user_name,
                                           GError **error)
 {
-    CcnetDB *db = mgr->priv->db;
-    char sql[512];
+    CcnetGroupManagerPriv *priv = mgr->priv;
     GList *group_ids = NULL;
-
-    snprintf (sql, sizeof(sql), "SELECT group_id FROM GroupUser "
-              "WHERE user_name='%s'", user_name);
-    if (ccnet_db_foreach_selected_row (db, sql, get_group_ids_cb,
-                                       &group_ids) < 0) {
-        g_list_free (group_ids);
-        return NULL;
+    UserGroups *ug;
+    int i;
+
+    pthread_mutex_lock (&priv->lock);
+    ug = g_hash_table_lookup (priv->index->users, user_name);
+    if (ug) {
+        for (i = (int)ug->group_ids->len - 1; i >= 0; --i)
+            group_ids = g_list_prepend (group_ids,
+                (gpointer)(long)g_array_index (ug->group_ids, int, i));
     }
+    pthread_mutex_unlock (&priv->lock);
 
-    return g_list_reverse (group_ids);
+    return group_ids;
 }
 
 static gboolean
@@ -608,45 +1316,63 @@ ccnet_group_manager_get_group (CcnetGroupManager *mgr, int group_id,
     return ccnetgroup;
 }
 
-static gboolean
-get_ccnet_groupuser_cb (CcnetDBRow *row, void *data)
+GList *
+ccnet_group_manager_get_group_members (CcnetGroupManager *mgr, int group_id,
+                                       GError **error)
 {
-    GList **plist = data;
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GList *group_users = NULL;
     CcnetGroupUser *group_user;
-    
-    int group_id = ccnet_db_row_get_column_int (row, 0);
-    const char *user = (const char *)ccnet_db_row_get_column_text (row, 1);
-    int is_staff = ccnet_db_row_get_column_int (row, 2);
-
-    char *user_l = g_ascii_strdown (user, -1);
-    group_user = g_object_new (CCNET_TYPE_GROUP_USER,
-                               "group_id", group_id,
-                               "user_name", user_l,
-                               "is_staff", is_staff,
-                               NULL);
-    g_free (user_l);
-    if (group_user != NULL) {
-        *plist = g_list_prepend (*plist, group_user);
+    GroupMember *member;
+    GArray *members;
+    int i;
+
+    pthread_mutex_lock (&priv->lock);
+    members = g_hash_table_lookup (priv->index->groups,
+                                   GINT_TO_POINTER(group_id));
+    for (i = members ? (int)members->len - 1 : -1; i >= 0; --i) {
+        member = &g_array_index (members, GroupMember, i);
+        group_user = g_object_new (CCNET_TYPE_GROUP_USER,
+                                   "group_id", group_id,
+                                   "user_name", member->user,
+                                   "is_staff", member->is_staff,
+                                   NULL);
+        if (group_user != NULL)
+            group_users = g_list_prepend (group_users, group_user);
     }
-    
-    return TRUE;
+    pthread_mutex_unlock (&priv->lock);
+
+    return group_users;
 }
 
-GList *
-ccnet_group_manager_get_group_members (CcnetGroupManager *mgr, int group_id,
-                                       GError **error)
+int
+ccnet_group_manager_stream_group_members (CcnetGroupManager *mgr,
+                                          int group_id,
+                                          CcnetJsonStream *js)
 {
-    CcnetDB *db = mgr->priv->db;
-    char sql[512];
-    GList *group_users = NULL;
-    
-    snprintf (sql, sizeof(sql),
-              "SELECT * FROM GroupUser WHERE group_id = %d", group_id);
-    if (ccnet_db_foreach_selected_row (db, sql, get_ccnet_groupuser_cb,
-                                       &group_users) < 0)
-        return NULL;
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    GroupMember *member;
+    GArray *members;
+    guint i;
+
+    ccnet_json_stream_begin_list (js);
+
+    pthread_mutex_lock (&priv->lock);
+    members = g_hash_table_lookup (priv->index->groups,
+                                   GINT_TO_POINTER(group_id));
+    for (i = 0; members && i < members->len; ++i) {
+        member = &g_array_index (members, GroupMember, i);
+        ccnet_json_stream_begin_object (js);
+        ccnet_json_stream_add_int (js, "group-id", group_id);
+        ccnet_json_stream_add_string (js, "user-name", member->user);
+        ccnet_json_stream_add_int (js, "is-staff", member->is_staff);
+        ccnet_json_stream_end_object (js);
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    ccnet_json_stream_end_list (js);
 
-    return g_list_reverse (group_users);
+    return 0;
 }
 
 int
@@ -654,7 +1380,7 @@ ccnet_group_manager_check_group_staff (CcnetGroupManager *mgr,
                                        int group_id,
                                        const char *user_name)
 {
-    return check_group_staff (mgr->priv->db, group_id, user_name);
+    return check_group_staff (mgr, group_id, user_name);
 }
 
 int
@@ -662,11 +1388,21 @@ ccnet_group_manager_remove_group_user (CcnetGroupManager *mgr,
                                        const char *user)
 {
     CcnetDB *db = mgr->priv->db;
-    char sql[256];
+    char sql[512], cond[320];
+    gint64 changes;
+
+    format_user_cond (db, cond, sizeof(cond), user);
+    snprintf (sql, sizeof(sql), "DELETE FROM GroupUser WHERE %s", cond);
+    pthread_mutex_lock (&mgr->priv->write_lock);
+    changes = ccnet_db_query_changes (db, sql);
+    if (changes > 0) {
+        begin_index_update (mgr->priv);
+        index_remove_user (mgr->priv->index, user);
+        end_index_update (mgr->priv);
+    }
+    pthread_mutex_unlock (&mgr->priv->write_lock);
 
-    snprintf (sql, sizeof(sql), "DELETE FROM GroupUser "
-              "WHERE user_name = '%s'", user);
-    return ccnet_db_query (db, sql);
+    return changes < 0 ? -1 : 0;
 }
 
 int
@@ -674,12 +1410,14 @@ ccnet_group_manager_is_group_user (CcnetGroupManager *mgr,
                                    int group_id,
                                    const char *user)
 {
-    CcnetDB *db = mgr->priv->db;
-    char sql[512];
+    CcnetGroupManagerPriv *priv = mgr->priv;
+    gboolean ret;
+
+    pthread_mutex_lock (&priv->lock);
+    ret = index_lookup_member (priv->index, group_id, user) != NULL;
+    pthread_mutex_unlock (&priv->lock);
 
-    snprintf (sql, sizeof(sql), "SELECT group_id FROM GroupUser "
-              "WHERE group_id=%d AND user_name='%s'", group_id, user);
-    return ccnet_db_check_for_existence (db, sql);
+    return ret;
 }
 
 static gboolean
@@ -710,33 +1448,40 @@ get_all_ccnetgroups_cb (CcnetDBRow *row, void *data)
     return TRUE;
 }
 
-GList*
-ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
-                                    int start, int limit, GError **error)
+static void
+format_all_groups_sql (CcnetGroupManager *mgr, int start, int limit,
+                       char *sql, int size)
 {
-    GList *ret = NULL;
-    char sql[256];
-
     if (ccnet_db_type(mgr->priv->db) == CCNET_DB_TYPE_PGSQL) {
         if (start == -1 && limit == -1) {
-            snprintf (sql, sizeof(sql), "SELECT group_id, group_name, "
+            snprintf (sql, size, "SELECT group_id, group_name, "
                       "creator_name, timestamp FROM \"Group\"");
         } else {
-            snprintf (sql, sizeof(sql), "SELECT group_id, group_name, "
+            snprintf (sql, size, "SELECT group_id, group_name, "
                       "creator_name, timestamp FROM \"Group\" "
                       "ORDER BY group_id LIMIT %d OFFSET %d",
                       limit, start);
         }
     } else {
         if (start == -1 && limit == -1) {
-            snprintf (sql, sizeof(sql), "SELECT `group_id`, `group_name`, "
+            snprintf (sql, size, "SELECT `group_id`, `group_name`, "
                       "`creator_name`, `timestamp` FROM `Group`");
         } else {
-            snprintf (sql, sizeof(sql), "SELECT `group_id`, `group_name`, "
+            snprintf (sql, size, "SELECT `group_id`, `group_name`, "
                       "`creator_name`, `timestamp` FROM `Group` LIMIT %d, %d",
                       start, limit);
         }
     }
+}
+
+GList*
+ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
+                                    int start, int limit, GError **error)
+{
+    GList *ret = NULL;
+    char sql[256];
+
+    format_all_groups_sql (mgr, start, limit, sql, sizeof(sql));
 
     if (ccnet_db_foreach_selected_row (mgr->priv->db, sql,
                                        get_all_ccnetgroups_cb, &ret) < 0) 
@@ -745,6 +1490,48 @@ ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
     return g_list_reverse (ret);
 }
 
+static gboolean
+stream_groups_cb (CcnetDBRow *row, void *data)
+{
+    CcnetJsonStream *js = data;
+
+    int group_id = ccnet_db_row_get_column_int (row, 0);
+    const char *group_name = (const char *)ccnet_db_row_get_column_text (row, 1);
+    const char *creator = (const char *)ccnet_db_row_get_column_text (row, 2);
+    gint64 ts = ccnet_db_row_get_column_int64 (row, 3);
+
+    char *creator_l = g_ascii_strdown (creator, -1);
+    ccnet_json_stream_begin_object (js);
+    ccnet_json_stream_add_int (js, "id", group_id);
+    ccnet_json_stream_add_string (js, "group-name", group_name);
+    ccnet_json_stream_add_string (js, "creator-name", creator_l);
+    ccnet_json_stream_add_int (js, "timestamp", ts);
+    ccnet_json_stream_end_object (js);
+    g_free (creator_l);
+
+    return TRUE;
+}
+
+int
+ccnet_group_manager_stream_all_groups (CcnetGroupManager *mgr,
+                                       int start, int limit,
+                                       CcnetJsonStream *js)
+{
+    char sql[256];
+
+    format_all_groups_sql (mgr, start, limit, sql, sizeof(sql));
+
+    ccnet_json_stream_begin_list (js);
+    if (ccnet_db_foreach_selected_row (mgr->priv->db, sql,
+                                       stream_groups_cb, js) < 0) {
+        ccnet_json_stream_reset (js);
+        return -1;
+    }
+    ccnet_json_stream_end_list (js);
+
+    return 0;
+}
+
 int
 ccnet_group_manager_set_group_creator (CcnetGroupManager *mgr,
                                        int group_id,
@@ -46,6 +46,18 @@ int ccnet_group_manager_add_member (CcnetGroupManager *mgr,
                                     const char *member_name,
                                     GError **error);
 
+/*
+ * Add the NULL terminated @member_names in one transaction. @status
+ * gets one entry per name: 0 added, 1 already a member, -1 failed.
+ * If the transaction fails, nothing is added and -1 is returned.
+ */
+int ccnet_group_manager_add_members (CcnetGroupManager *mgr,
+                                     int group_id,
+                                     const char *user_name,
+                                     char **member_names,
+                                     int *status,
+                                     GError **error);
+
 int ccnet_group_manager_remove_member (CcnetGroupManager *mgr,
                                        int group_id,
                                        const char *user_name,
@@ -85,6 +97,12 @@ GList *
 ccnet_group_manager_get_group_members (CcnetGroupManager *mgr, int group_id,
                                        GError **error);
 
+/* Write group members into @js. See json-stream.h. */
+int
+ccnet_group_manager_stream_group_members (CcnetGroupManager *mgr,
+                                          int group_id,
+                                          struct CcnetJsonStream *js);
+
 int
 ccnet_group_manager_check_group_staff (CcnetGroupManager *mgr,
                                        int group_id,
@@ -103,6 +121,11 @@ GList*
 ccnet_group_manager_get_all_groups (CcnetGroupManager *mgr,
                                     int start, int limit, GError **error);
 
+int
+ccnet_group_manager_stream_all_groups (CcnetGroupManager *mgr,
+                                       int start, int limit,
+                                       struct CcnetJsonStream *js);
+
 int
 ccnet_group_manager_set_group_creator (CcnetGroupManager *mgr,
                                        int group_id,
@@ -2,14 +2,60 @@
 
 #include "common.h"
 
+#include <pthread.h>
+
 #include "ccnet-db.h"
 #include "org-mgr.h"
 
 #include "log.h"
 
+typedef struct OrgInfo {
+    int     org_id;
+    char   *org_name;
+    char   *url_prefix;
+    char   *creator;
+    gint64  ctime;
+} OrgInfo;
+
+/* Immutable copy of the Organization and OrgGroup tables. A change
+ * builds a new one. */
+typedef struct OrgSnapshot {
+    int         ref;            /* protected by priv->lock */
+    GHashTable *by_id;          /* org id -> OrgInfo */
+    GHashTable *by_prefix;      /* url prefix -> OrgInfo */
+    GHashTable *group_orgs;     /* group id -> org id */
+} OrgSnapshot;
+
 struct _CcnetOrgManagerPriv
 {
     CcnetDB	*db;
+
+    pthread_mutex_t lock;
+    OrgSnapshot *snap;          /* NULL until (re)loaded */
+    gboolean     loading;
+    /* Bumped on invalidation, so that a load which raced with a
+     * change isn't published. */
+    guint        gen;
+
+    guint64      hits;
+    guint64      misses;
+    guint64      reloads;
+
+    /* OrgUser changes far more often than the other tables, so it is
+     * cached on its own and updated in place. Mutations hold
+     * users_write_lock across the DB write and the cache update, so
+     * both see them in the same order; readers only take users_lock.
+     */
+    pthread_mutex_t users_write_lock;
+    pthread_mutex_t users_lock;
+    GHashTable  *users;         /* "org_id:email" -> is_staff, NULL
+                                 * until (re)loaded */
+    gboolean     users_loading;
+    guint        users_gen;
+
+    guint64      user_hits;
+    guint64      user_misses;
+    guint64      user_reloads;
 };
 
 static int open_db (CcnetOrgManager *manager);
@@ -21,6 +67,9 @@ CcnetOrgManager* ccnet_org_manager_new (CcnetSession *session)
 
     manager->session = session;
     manager->priv = g_new0 (CcnetOrgManagerPriv, 1);
+    pthread_mutex_init (&manager->priv->lock, NULL);
+    pthread_mutex_init (&manager->priv->users_write_lock, NULL);
+    pthread_mutex_init (&manager->priv->users_lock, NULL);
 
     return manager;
 }
@@ -189,6 +238,412 @@ static int check_db_table (CcnetDB *db)
     return 0;
 }
 
+/* -------- Cache ---------------- */
+
+static void
+free_org_info (OrgInfo *info)
+{
+    g_free (info->org_name);
+    g_free (info->url_prefix);
+    g_free (info->creator);
+    g_free (info);
+}
+
+static OrgSnapshot *
+org_snapshot_new (void)
+{
+    OrgSnapshot *snap = g_new0 (OrgSnapshot, 1);
+
+    snap->ref = 1;
+    snap->by_id = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                         NULL, (GDestroyNotify)free_org_info);
+    snap->by_prefix = g_hash_table_new (g_str_hash, g_str_equal);
+    snap->group_orgs = g_hash_table_new (g_direct_hash, g_direct_equal);
+    return snap;
+}
+
+static void
+org_snapshot_free (OrgSnapshot *snap)
+{
+    g_hash_table_destroy (snap->by_prefix);
+    g_hash_table_destroy (snap->by_id);
+    g_hash_table_destroy (snap->group_orgs);
+    g_free (snap);
+}
+
+/* Emails are matched ignoring case, as the OrgUser queries do on
+ * MySQL. */
+static void
+format_user_key (char *buf, int size, int org_id, const char *email)
+{
+    char *p;
+
+    snprintf (buf, size, "%d:%s", org_id, email);
+    for (p = buf; *p; ++p)
+        *p = g_ascii_tolower (*p);
+}
+
+static gboolean
+load_org_cb (CcnetDBRow *row, void *data)
+{
+    OrgSnapshot *snap = data;
+    OrgInfo *info = g_new0 (OrgInfo, 1);
+
+    info->org_id = ccnet_db_row_get_column_int (row, 0);
+    info->org_name = g_strdup (ccnet_db_row_get_column_text (row, 1));
+    info->url_prefix = g_strdup (ccnet_db_row_get_column_text (row, 2));
+    info->creator = g_strdup (ccnet_db_row_get_column_text (row, 3));
+    info->ctime = ccnet_db_row_get_column_int64 (row, 4);
+
+    g_hash_table_replace (snap->by_id, GINT_TO_POINTER(info->org_id), info);
+    if (info->url_prefix)
+        g_hash_table_replace (snap->by_prefix, info->url_prefix, info);
+    return TRUE;
+}
+
+static gboolean
+load_org_group_cb (CcnetDBRow *row, void *data)
+{
+    OrgSnapshot *snap = data;
+    int org_id = ccnet_db_row_get_column_int (row, 0);
+    int group_id = ccnet_db_row_get_column_int (row, 1);
+
+    g_hash_table_insert (snap->group_orgs, GINT_TO_POINTER(group_id),
+                         GINT_TO_POINTER(org_id));
+    return TRUE;
+}
+
+static OrgSnapshot *
+load_org_snapshot (CcnetDB *db)
+{
+    OrgSnapshot *snap = org_snapshot_new ();
+
+    if (ccnet_db_foreach_selected_row_primary (db, "SELECT org_id, org_name, "
+                                               "url_prefix, creator, ctime "
+                                               "FROM Organization",
+                                               load_org_cb, snap) < 0 ||
+        ccnet_db_foreach_selected_row_primary (db, "SELECT org_id, group_id "
+                                               "FROM OrgGroup",
+                                               load_org_group_cb, snap) < 0) {
+        org_snapshot_free (snap);
+        return NULL;
+    }
+
+    return snap;
+}
+
+/*
+ * Return a reference to the current snapshot, or NULL if the caller
+ * should ask the DB. Readers only take the lock to grab a reference,
+ * so a reload or invalidation never waits for them, and a replaced
+ * snapshot is freed by whoever drops the last reference.
+ *
+ * After an invalidation the first reader reloads the snapshot, others
+ * go to the DB meanwhile.
+ */
+static OrgSnapshot *
+get_snapshot (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    OrgSnapshot *snap;
+    guint gen;
+
+    pthread_mutex_lock (&priv->lock);
+    snap = priv->snap;
+    if (snap) {
+        snap->ref++;
+        priv->hits++;
+        pthread_mutex_unlock (&priv->lock);
+        return snap;
+    }
+    priv->misses++;
+    if (priv->loading) {
+        pthread_mutex_unlock (&priv->lock);
+        return NULL;
+    }
+    priv->loading = TRUE;
+    gen = priv->gen;
+    pthread_mutex_unlock (&priv->lock);
+
+    snap = load_org_snapshot (priv->db);
+
+    pthread_mutex_lock (&priv->lock);
+    priv->loading = FALSE;
+    if (snap) {
+        priv->reloads++;
+        /* Only publish it if nothing was changed during the load. The
+         * caller can still use it, since it raced with the change. */
+        if (gen == priv->gen) {
+            priv->snap = snap;
+            snap->ref++;
+        }
+    }
+    pthread_mutex_unlock (&priv->lock);
+
+    return snap;
+}
+
+static void
+put_snapshot (CcnetOrgManager *mgr, OrgSnapshot *snap)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    gboolean last;
+
+    pthread_mutex_lock (&priv->lock);
+    last = (--snap->ref == 0);
+    pthread_mutex_unlock (&priv->lock);
+
+    if (last)
+        org_snapshot_free (snap);
+}
+
+/* Called after every write to Organization or OrgGroup. */
+static void
+invalidate_cache (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    OrgSnapshot *snap;
+
+    pthread_mutex_lock (&priv->lock);
+    snap = priv->snap;
+    priv->snap = NULL;
+    priv->gen++;
+    if (snap && --snap->ref > 0)
+        snap = NULL;
+    pthread_mutex_unlock (&priv->lock);
+
+    if (snap)
+        org_snapshot_free (snap);
+}
+
+/* -------- OrgUser cache ---------------- */
+
+static gboolean
+load_org_user_cb (CcnetDBRow *row, void *data)
+{
+    GHashTable *users = data;
+    int org_id = ccnet_db_row_get_column_int (row, 0);
+    const char *email = ccnet_db_row_get_column_text (row, 1);
+    int is_staff = ccnet_db_row_get_column_int (row, 2);
+    char key[512];
+
+    if (email) {
+        format_user_key (key, sizeof(key), org_id, email);
+        g_hash_table_insert (users, g_strdup(key), GINT_TO_POINTER(is_staff));
+    }
+    return TRUE;
+}
+
+static GHashTable *
+load_org_users (CcnetDB *db)
+{
+    GHashTable *users = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+    if (ccnet_db_foreach_selected_row_primary (db, "SELECT org_id, email, "
+                                               "is_staff FROM OrgUser",
+                                               load_org_user_cb, users) < 0) {
+        g_hash_table_destroy (users);
+        return NULL;
+    }
+    return users;
+}
+
+/* Load the OrgUser cache if it isn't. Only the first caller loads it,
+ * others go to the DB meanwhile. */
+static void
+ensure_org_users (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    GHashTable *users;
+    guint gen;
+
+    pthread_mutex_lock (&priv->users_lock);
+    if (priv->users || priv->users_loading) {
+        pthread_mutex_unlock (&priv->users_lock);
+        return;
+    }
+    priv->users_loading = TRUE;
+    gen = priv->users_gen;
+    pthread_mutex_unlock (&priv->users_lock);
+
+    users = load_org_users (priv->db);
+
+    pthread_mutex_lock (&priv->users_lock);
+    priv->users_loading = FALSE;
+    if (users) {
+        priv->user_reloads++;
+        /* A change during the load may be missing from it. */
+        if (gen == priv->users_gen) {
+            priv->users = users;
+            users = NULL;
+        }
+    }
+    pthread_mutex_unlock (&priv->users_lock);
+
+    if (users)
+        g_hash_table_destroy (users);
+}
+
+static int
+lookup_loaded_org_user (CcnetOrgManagerPriv *priv, const char *key,
+                        int *is_staff)
+{
+    gpointer value;
+    int ret = -1;
+
+    pthread_mutex_lock (&priv->users_lock);
+    if (priv->users) {
+        priv->user_hits++;
+        ret = g_hash_table_lookup_extended (priv->users, key, NULL, &value);
+        if (ret && is_staff)
+            *is_staff = GPOINTER_TO_INT(value);
+    }
+    pthread_mutex_unlock (&priv->users_lock);
+
+    return ret;
+}
+
+/*
+ * Look up @email in @org_id. Returns 1 and sets *@is_staff if it is a
+ * member, 0 if not, or -1 if the cache isn't loaded and the caller
+ * should ask the DB.
+ */
+static int
+lookup_org_user (CcnetOrgManager *mgr, int org_id, const char *email,
+                 int *is_staff)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    char key[512];
+    int ret;
+
+    format_user_key (key, sizeof(key), org_id, email);
+
+    if ((ret = lookup_loaded_org_user (priv, key, is_staff)) >= 0)
+        return ret;
+
+    ensure_org_users (mgr);
+    if ((ret = lookup_loaded_org_user (priv, key, is_staff)) >= 0)
+        return ret;
+
+    pthread_mutex_lock (&priv->users_lock);
+    priv->user_misses++;
+    pthread_mutex_unlock (&priv->users_lock);
+    return -1;
+}
+
+/* Record a written OrgUser row; @is_staff -1 removes it. Called with
+ * users_write_lock held. */
+static void
+update_org_user (CcnetOrgManager *mgr, int org_id, const char *email,
+                 int is_staff)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    char key[512];
+
+    format_user_key (key, sizeof(key), org_id, email);
+
+    pthread_mutex_lock (&priv->users_lock);
+    priv->users_gen++;
+    if (priv->users) {
+        if (is_staff < 0)
+            g_hash_table_remove (priv->users, key);
+        else
+            g_hash_table_replace (priv->users, g_strdup(key),
+                                  GINT_TO_POINTER(is_staff));
+    }
+    pthread_mutex_unlock (&priv->users_lock);
+}
+
+static gboolean
+user_in_org (gpointer key, gpointer value, gpointer data)
+{
+    return g_str_has_prefix (key, data);
+}
+
+static void
+remove_org_users (CcnetOrgManager *mgr, int org_id)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    char prefix[32];
+
+    format_user_key (prefix, sizeof(prefix), org_id, "");
+
+    pthread_mutex_lock (&priv->users_lock);
+    priv->users_gen++;
+    if (priv->users)
+        g_hash_table_foreach_remove (priv->users, user_in_org, prefix);
+    pthread_mutex_unlock (&priv->users_lock);
+}
+
+/* After a failed write we don't know what the DB holds; reload. */
+static void
+invalidate_org_users (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    GHashTable *users;
+
+    pthread_mutex_lock (&priv->users_lock);
+    users = priv->users;
+    priv->users = NULL;
+    priv->users_gen++;
+    pthread_mutex_unlock (&priv->users_lock);
+
+    if (users)
+        g_hash_table_destroy (users);
+}
+
+char *
+ccnet_org_manager_format_cache_stats (CcnetOrgManager *mgr)
+{
+    CcnetOrgManagerPriv *priv = mgr->priv;
+    GString *buf = g_string_new (NULL);
+    guint64 hits, misses, reloads;
+    guint64 user_hits, user_misses, user_reloads;
+
+    pthread_mutex_lock (&priv->lock);
+    hits = priv->hits;
+    misses = priv->misses;
+    reloads = priv->reloads;
+    pthread_mutex_unlock (&priv->lock);
+
+    pthread_mutex_lock (&priv->users_lock);
+    user_hits = priv->user_hits;
+    user_misses = priv->user_misses;
+    user_reloads = priv->user_reloads;
+    pthread_mutex_unlock (&priv->users_lock);
+
+    g_string_append_printf (buf, "org_cache_hits %"G_GUINT64_FORMAT"\n", hits);
+    g_string_append_printf (buf, "org_cache_misses %"G_GUINT64_FORMAT"\n",
+                            misses);
+    g_string_append_printf (buf, "org_cache_reloads %"G_GUINT64_FORMAT"\n",
+                            reloads);
+    g_string_append_printf (buf, "org_cache_hit_ratio %.4f\n",
+                            hits + misses ? (double)hits / (hits + misses) : 0.0);
+    g_string_append_printf (buf, "org_user_cache_hits %"G_GUINT64_FORMAT"\n",
+                            user_hits);
+    g_string_append_printf (buf, "org_user_cache_misses %"G_GUINT64_FORMAT"\n",
+                            user_misses);
+    g_string_append_printf (buf, "org_user_cache_reloads %"G_GUINT64_FORMAT"\n",
+                            user_reloads);
+
+    return g_string_free (buf, FALSE);
+}
+
+static CcnetOrganization *
+org_from_info (OrgInfo *info)
+{
+    if (!info)
+        return NULL;
+    return g_object_new (CCNET_TYPE_ORGANIZATION,
+                         "org_id", info->org_id,
+                         "org_name", info->org_name,
+                         "url_prefix", info->url_prefix,
+                         "creator", info->creator,
+                         "ctime", info->ctime,
+                         NULL);
+}
+
 int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
                                   const char *org_name,
                                   const char *url_prefix,
@@ -216,16 +671,23 @@ int ccnet_org_manager_create_org (CcnetOrgManager *mgr,
         return -1;
     }
 
+    pthread_mutex_lock (&mgr->priv->users_write_lock);
     snprintf (sql, sizeof(sql), "INSERT INTO OrgUser values (%d, '%s', %d)",
               org_id, creator, 1);
     if (ccnet_db_query (db, sql) < 0) {
+        invalidate_org_users (mgr);
+        pthread_mutex_unlock (&mgr->priv->users_write_lock);
         snprintf (sql, sizeof(sql), "DELETE FROM Organization WHERE org_id=%d",
                   org_id);
         ccnet_db_query (db, sql);
         g_set_error (error, CCNET_DOMAIN, 0, "Failed to create organization");
+        invalidate_cache (mgr);
         return -1;
     }
-    
+    update_org_user (mgr, org_id, creator, 1);
+    pthread_mutex_unlock (&mgr->priv->users_write_lock);
+
+    invalidate_cache (mgr);
     return org_id;
 }
 
@@ -241,14 +703,20 @@ ccnet_org_manager_remove_org (CcnetOrgManager *mgr,
               org_id);
     ccnet_db_query (db, sql);
 
+    pthread_mutex_lock (&mgr->priv->users_write_lock);
     snprintf (sql, sizeof(sql), "DELETE FROM OrgUser WHERE org_id = %d",
               org_id);
-    ccnet_db_query (db, sql);
+    if (ccnet_db_query (db, sql) < 0)
+        invalidate_org_users (mgr);
+    else
+        remove_org_users (mgr, org_id);
+    pthread_mutex_unlock (&mgr->priv->users_write_lock);
 
     snprintf (sql, sizeof(sql), "DELETE FROM OrgGroup WHERE org_id = %d",
               org_id);
     ccnet_db_query (db, sql);
 
+    invalidate_cache (mgr);
     return 0;
 }
 
@@ -336,6 +804,13 @@ ccnet_org_manager_get_org_by_url_prefix (CcnetOrgManager *mgr,
     CcnetDB *db = mgr->priv->db;
     char sql[512];
     CcnetOrganization *org = NULL;
+    OrgSnapshot *snap;
+
+    if ((snap = get_snapshot (mgr)) != NULL) {
+        org = org_from_info (g_hash_table_lookup (snap->by_prefix, url_prefix));
+        put_snapshot (mgr, snap);
+        return org;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT org_id, org_name, url_prefix, creator,"
               " ctime FROM Organization WHERE url_prefix = '%s'", url_prefix);    
@@ -355,6 +830,14 @@ ccnet_org_manager_get_org_by_id (CcnetOrgManager *mgr,
     CcnetDB *db = mgr->priv->db;
     char sql[256];
     CcnetOrganization *org = NULL;
+    OrgSnapshot *snap;
+
+    if ((snap = get_snapshot (mgr)) != NULL) {
+        org = org_from_info (g_hash_table_lookup (snap->by_id,
+                                                  GINT_TO_POINTER(org_id)));
+        put_snapshot (mgr, snap);
+        return org;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT org_id, org_name, url_prefix, creator,"
               " ctime FROM Organization WHERE org_id = '%d'", org_id);    
@@ -375,11 +858,110 @@ ccnet_org_manager_add_org_user (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    int ret;
 
     snprintf (sql, sizeof(sql), "INSERT INTO OrgUser values (%d, '%s', %d)",
               org_id, email, is_staff);
 
-    return ccnet_db_query (db, sql);
+    pthread_mutex_lock (&mgr->priv->users_write_lock);
+    ret = ccnet_db_query (db, sql);
+    if (ret < 0)
+        invalidate_org_users (mgr);
+    else
+        update_org_user (mgr, org_id, email, is_staff);
+    pthread_mutex_unlock (&mgr->priv->users_write_lock);
+    return ret;
+}
+
+int
+ccnet_org_manager_add_org_users (CcnetOrgManager *mgr,
+                                 int org_id,
+                                 char **emails,
+                                 int is_staff,
+                                 int *status,
+                                 GError **error)
+{
+    CcnetDB *db = mgr->priv->db;
+    CcnetDBTrans *trans;
+    GHashTable *users;
+    GString *sql;
+    char query[256];
+    int i, n_rows = 0, ret = 0;
+
+    for (i = 0; emails[i] != NULL; ++i)
+        status[i] = -1;
+
+    pthread_mutex_lock (&mgr->priv->users_write_lock);
+
+    trans = ccnet_db_begin (db);
+    if (!trans) {
+        pthread_mutex_unlock (&mgr->priv->users_write_lock);
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to add org users");
+        return -1;
+    }
+
+    users = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    snprintf (query, sizeof(query),
+              "SELECT email FROM OrgUser WHERE org_id=%d", org_id);
+    if (ccnet_db_trans_foreach_selected_row (trans, query,
+                                             ccnet_db_collect_string_set,
+                                             users) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    sql = g_string_new (NULL);
+    for (i = 0; emails[i] != NULL; ++i) {
+        if (emails[i][0] == '\0')
+            continue;
+        if (g_hash_table_lookup (users, emails[i])) {
+            status[i] = 1;      /* already in the org */
+            continue;
+        }
+        g_hash_table_insert (users, g_strdup(emails[i]), GINT_TO_POINTER(1));
+        status[i] = 0;
+
+        g_string_append_printf (sql, "%s(%d, '%s', %d)",
+                                n_rows ? ", " : "INSERT INTO OrgUser values ",
+                                org_id, emails[i], is_staff);
+        if (++n_rows == CCNET_DB_BATCH_INSERT_ROWS) {
+            if (ccnet_db_trans_query (trans, sql->str) < 0) {
+                ret = -1;
+                break;
+            }
+            g_string_truncate (sql, 0);
+            n_rows = 0;
+        }
+    }
+    if (ret == 0 && n_rows > 0 && ccnet_db_trans_query (trans, sql->str) < 0)
+        ret = -1;
+    g_string_free (sql, TRUE);
+
+out:
+    g_hash_table_destroy (users);
+
+    if (ret == 0)
+        ret = ccnet_db_commit (trans);
+    else
+        ccnet_db_rollback (trans);
+
+    if (ret == 0) {
+        for (i = 0; emails[i] != NULL; ++i)
+            if (status[i] == 0)
+                update_org_user (mgr, org_id, emails[i], is_staff);
+    } else {
+        invalidate_org_users (mgr);
+    }
+    pthread_mutex_unlock (&mgr->priv->users_write_lock);
+
+    if (ret < 0) {
+        for (i = 0; emails[i] != NULL; ++i)
+            if (status[i] == 0)
+                status[i] = -1;
+        g_set_error (error, CCNET_DOMAIN, 0, "Failed to add org users");
+    }
+
+    return ret;
 }
 
 int
@@ -390,11 +972,21 @@ ccnet_org_manager_remove_org_user (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    gint64 changes;
 
     snprintf (sql, sizeof(sql), "DELETE FROM OrgUser WHERE org_id=%d AND "
               "email='%s'", org_id, email);
 
-    return ccnet_db_query (db, sql);
+    /* On SQLite and PostgreSQL a differently-cased email removes no row,
+     * so keep the cache entry then. */
+    pthread_mutex_lock (&mgr->priv->users_write_lock);
+    changes = ccnet_db_query_changes (db, sql);
+    if (changes < 0)
+        invalidate_org_users (mgr);
+    else if (changes > 0)
+        update_org_user (mgr, org_id, email, -1);
+    pthread_mutex_unlock (&mgr->priv->users_write_lock);
+    return changes < 0 ? -1 : 0;
 }
 
 static gboolean
@@ -490,11 +1082,14 @@ ccnet_org_manager_add_org_group (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    int ret;
 
     snprintf (sql, sizeof(sql), "INSERT INTO OrgGroup VALUES (%d, %d)",
               org_id, group_id);
-    
-    return ccnet_db_query (db, sql);
+
+    ret = ccnet_db_query (db, sql);
+    invalidate_cache (mgr);
+    return ret;
 }
 
 int
@@ -505,11 +1100,14 @@ ccnet_org_manager_remove_org_group (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    int ret;
 
     snprintf (sql, sizeof(sql), "DELETE FROM OrgGroup WHERE org_id=%d"
               " AND group_id=%d", org_id, group_id);
-    
-    return ccnet_db_query (db, sql);
+
+    ret = ccnet_db_query (db, sql);
+    invalidate_cache (mgr);
+    return ret;
 }
 
 int
@@ -519,6 +1117,16 @@ ccnet_org_manager_is_org_group (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[256];
+    OrgSnapshot *snap;
+    int ret;
+
+    if ((snap = get_snapshot (mgr)) != NULL) {
+        ret = g_hash_table_lookup_extended (snap->group_orgs,
+                                            GINT_TO_POINTER(group_id),
+                                            NULL, NULL);
+        put_snapshot (mgr, snap);
+        return ret;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT group_id FROM OrgGroup "
               "WHERE group_id = %d", group_id);
@@ -533,6 +1141,18 @@ ccnet_org_manager_get_org_id_by_group (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[256];
+    OrgSnapshot *snap;
+    gpointer value;
+    int ret = -1;
+
+    if ((snap = get_snapshot (mgr)) != NULL) {
+        if (g_hash_table_lookup_extended (snap->group_orgs,
+                                          GINT_TO_POINTER(group_id),
+                                          NULL, &value))
+            ret = GPOINTER_TO_INT(value);
+        put_snapshot (mgr, snap);
+        return ret;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT org_id FROM OrgGroup "
               "WHERE group_id = %d", group_id);
@@ -585,6 +1205,10 @@ ccnet_org_manager_org_user_exists (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    int ret;
+
+    if ((ret = lookup_org_user (mgr, org_id, email, NULL)) >= 0)
+        return ret;
 
     snprintf (sql, sizeof(sql), "SELECT org_id FROM OrgUser WHERE "
               "org_id = %d AND email = '%s'", org_id, email);
@@ -599,6 +1223,16 @@ ccnet_org_manager_get_url_prefix_by_org_id (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[512];
+    OrgSnapshot *snap;
+    OrgInfo *info;
+    char *ret;
+
+    if ((snap = get_snapshot (mgr)) != NULL) {
+        info = g_hash_table_lookup (snap->by_id, GINT_TO_POINTER(org_id));
+        ret = info ? g_strdup (info->url_prefix) : NULL;
+        put_snapshot (mgr, snap);
+        return ret;
+    }
 
     snprintf (sql, sizeof(sql), "SELECT url_prefix FROM Organization "
               "WHERE org_id = %d", org_id);
@@ -614,6 +1248,11 @@ ccnet_org_manager_is_org_staff (CcnetOrgManager *mgr,
 {
     CcnetDB *db = mgr->priv->db;
     char sql[256];
+    int is_staff;
+    int ret;
+
+    if ((ret = lookup_org_user (mgr, org_id, email, &is_staff)) >= 0)
+        return ret ? is_staff : -1;
 
     snprintf (sql, sizeof(sql), "SELECT is_staff FROM OrgUser "
               "WHERE org_id=%d AND email='%s'", org_id, email);
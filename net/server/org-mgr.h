@@ -57,6 +57,16 @@ ccnet_org_manager_add_org_user (CcnetOrgManager *mgr,
                                 int is_staff,
                                 GError **error);
 
+/* Batch version of the above, in one transaction. See
+ * ccnet_group_manager_add_members() for the meaning of @status. */
+int
+ccnet_org_manager_add_org_users (CcnetOrgManager *mgr,
+                                 int org_id,
+                                 char **emails,
+                                 int is_staff,
+                                 int *status,
+                                 GError **error);
+
 int
 ccnet_org_manager_remove_org_user (CcnetOrgManager *mgr,
                                    int org_id,
@@ -116,4 +126,8 @@ ccnet_org_manager_is_org_staff (CcnetOrgManager *mgr,
                                 int org_id,
                                 const char *email,
                                 GError **error);
+
+/* Hit/miss counters of the org cache, one "name value" per line. */
+char *
+ccnet_org_manager_format_cache_stats (CcnetOrgManager *mgr);
 #endif /* _ORG_MGR_H_ */
@@ -18,6 +18,18 @@
 #define SS_INTERNAL_ERROR "relay internal error"
 
 
+typedef struct {
+    char *email;
+    char *passwd;
+    char  peer_id[41];
+    /* result of the check, sent back in the main thread */
+    const char *code;
+    const char *code_msg;
+} CcnetRecvloginProcPriv;
+
+#define GET_PRIV(o)  \
+   (G_TYPE_INSTANCE_GET_PRIVATE ((o), CCNET_TYPE_RECVLOGIN_PROC, CcnetRecvloginProcPriv))
+
 G_DEFINE_TYPE (CcnetRecvloginProc, ccnet_recvlogin_proc, CCNET_TYPE_PROCESSOR)
 
 static int start (CcnetProcessor *processor, int argc, char **argv);
@@ -28,7 +40,15 @@ static void handle_update (CcnetProcessor *processor,
 static void
 release_resource(CcnetProcessor *processor)
 {
-    /* FILL IT */
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
+
+    g_free (priv->email);
+    priv->email = NULL;
+    if (priv->passwd) {
+        memset (priv->passwd, 0, strlen(priv->passwd));
+        g_free (priv->passwd);
+        priv->passwd = NULL;
+    }
 
     CCNET_PROCESSOR_CLASS (ccnet_recvlogin_proc_parent_class)->release_resource (processor);
 }
@@ -42,6 +62,8 @@ ccnet_recvlogin_proc_class_init (CcnetRecvloginProcClass *klass)
     proc_class->start = start;
     proc_class->handle_update = handle_update;
     proc_class->release_resource = release_resource;
+
+    g_type_class_add_private (klass, sizeof (CcnetRecvloginProcPriv));
 }
 
 static void
@@ -49,59 +71,77 @@ ccnet_recvlogin_proc_init (CcnetRecvloginProc *processor)
 {
 }
 
-static void
-check_emailuser (CcnetProcessor *processor,
-                 const char *email, const char *passwd)
+/* Runs in a job thread: the password check hashes and queries the db,
+ * which must not stall the event loop. */
+static void *
+check_emailuser (void *vprocessor)
 {
+    CcnetProcessor *processor = vprocessor;
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
     char *prev_email;
     CcnetUserManager *user_mgr = 
         ((CcnetServerSession *)processor->session)->user_mgr;
 
+    priv->code = SC_OK;
+    priv->code_msg = SS_OK;
+
     prev_email = ccnet_user_manager_get_binding_email (user_mgr,
-                                                       processor->peer->id);
+                                                       priv->peer_id);
     if (prev_email) {
         /* This peer id has already been binded to some email address. */
-        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
-        
-    } else if (!ccnet_user_manager_validate_emailuser (user_mgr,
-                                               email, passwd)) {
-        
-        ccnet_processor_send_response (processor, SC_ERR_WRONG_PASSWD,
-                                       SS_ERR_WRONG_PASSWD, NULL, 0);
+
+    } else if (ccnet_user_manager_validate_emailuser (user_mgr,
+                                                      priv->email,
+                                                      priv->passwd) != 0) {
+        priv->code = SC_ERR_WRONG_PASSWD;
+        priv->code_msg = SS_ERR_WRONG_PASSWD;
 
     } else {
-        CcnetPeer *peer = processor->peer;
         /* ccnet_peer_manager_add_role (session->peer_mgr, peer, "MyClient"); */
         /* ccnet_debug ("add role 'MyClient' for peer %.10s\n", peer->id); */
-        if (ccnet_user_manager_add_binding (user_mgr, email, 
-                                            peer->id) < 0) {
+        if (ccnet_user_manager_add_binding (user_mgr, priv->email, 
+                                            priv->peer_id) < 0) {
             ccnet_warning ("Failed to add binding for email(%s), user(%.10s)\n",
-                           email, peer->id);
-
-            ccnet_processor_send_response (processor,
-                                           SC_INTERNAL_ERROR,
-                                           SS_INTERNAL_ERROR,
-                                           NULL, 0);
+                           priv->email, priv->peer_id);
+            priv->code = SC_INTERNAL_ERROR;
+            priv->code_msg = SS_INTERNAL_ERROR;
         }
-        ccnet_processor_send_response (processor, SC_OK, SS_OK, NULL, 0);
     }
     g_free (prev_email);
+
+    return vprocessor;
+}
+
+static void
+check_emailuser_done (void *vprocessor)
+{
+    CcnetProcessor *processor = vprocessor;
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
+
+    ccnet_processor_send_response (processor, priv->code, priv->code_msg,
+                                   NULL, 0);
+    ccnet_processor_done (processor, TRUE);
 }
 
 static int
 start (CcnetProcessor *processor, int argc, char **argv)
 {
+    CcnetRecvloginProcPriv *priv = GET_PRIV (processor);
+
     if (argc != 2 || !argv[0] || !argv[1]) {
         ccnet_processor_error (processor, SC_BAD_ARGS, SS_BAD_ARGS);
         return -1;
     }
-    char *email = argv[0];
-    char *passwd = argv[1];
     /* ccnet_message ("receive login info from %s : email(%s), passwd(%s)\n", */
     /*                processor->peer->id, email, passwd); */
 
-    check_emailuser (processor, email, passwd);
-    ccnet_processor_done(processor, TRUE);
+    priv->email = g_strdup (argv[0]);
+    priv->passwd = g_strdup (argv[1]);
+    memcpy (priv->peer_id, processor->peer->id, 41);
+
+    ccnet_processor_thread_create (processor, NULL,
+                                   check_emailuser, check_emailuser_done,
+                                   processor);
 
     return 0;
 }
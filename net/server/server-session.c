@@ -103,8 +103,12 @@ server_session_prepare (CcnetSession *session)
 void
 server_session_start (CcnetSession *session)
 {
-    g_signal_connect (session->peer_mgr, "peer-auth-done",
-                      G_CALLBACK(on_peer_auth_done), NULL);    
+    CcnetServerSession *server_session = (CcnetServerSession *)session;
+
+    /* "peer-auth-done" is already dispatched to on_peer_auth_done()
+     * by the common session code. */
+    ccnet_user_manager_start (server_session->user_mgr);
+    ccnet_group_manager_start (server_session->group_mgr);
 }
 
 
@@ -123,10 +127,43 @@ static int init_sqlite_database (CcnetSession *session)
 
 #define MYSQL_DEFAULT_PORT "3306"
 
+/* REPLICA_HOSTS is a comma separated list of host[:port]. Replicas
+ * share the user, password and db name of the primary. */
+static char **
+get_replica_hosts (GKeyFile *keyf)
+{
+    char *value, **hosts;
+    int i;
+
+    value = ccnet_key_file_get_string (keyf, "Database", "REPLICA_HOSTS");
+    if (!value)
+        return NULL;
+
+    hosts = g_strsplit (value, ",", -1);
+    for (i = 0; hosts[i] != NULL; ++i)
+        g_strstrip (hosts[i]);
+    g_free (value);
+
+    return hosts;
+}
+
+static void
+add_replica (CcnetSession *session, CcnetDB *replica, const char *host)
+{
+    if (!replica) {
+        ccnet_warning ("Failed to open database replica %s.\n", host);
+        return;
+    }
+    ccnet_message ("Use database replica %s for reads\n", host);
+    ccnet_db_add_replica (session->db, replica);
+}
+
 static int init_mysql_database (CcnetSession *session)
 {
     char *host, *port, *user, *passwd, *db, *unix_socket, *charset;
     gboolean use_ssl = FALSE;
+    char **replica_hosts, *replica_port;
+    int i;
 
     host = ccnet_key_file_get_string (session->keyf, "Database", "HOST");
     port = ccnet_key_file_get_string (session->keyf, "Database", "PORT");
@@ -165,6 +202,22 @@ static int init_mysql_database (CcnetSession *session)
         return -1;
     }
 
+    replica_hosts = get_replica_hosts (session->keyf);
+    for (i = 0; replica_hosts && replica_hosts[i] != NULL; ++i) {
+        if (*replica_hosts[i] == '\0')
+            continue;
+        replica_port = strchr (replica_hosts[i], ':');
+        if (replica_port)
+            *replica_port++ = '\0';
+        add_replica (session,
+                     ccnet_db_new_mysql (replica_hosts[i],
+                                         replica_port ? replica_port : port,
+                                         user, passwd, db, NULL,
+                                         use_ssl, charset),
+                     replica_hosts[i]);
+    }
+    g_strfreev (replica_hosts);
+
     g_free (host);
     g_free (port);
     g_free (user);
@@ -179,6 +232,8 @@ static int init_mysql_database (CcnetSession *session)
 static int init_pgsql_database (CcnetSession *session)
 {
     char *host, *user, *passwd, *db, *unix_socket;
+    char **replica_hosts;
+    int i;
 
     host = ccnet_key_file_get_string (session->keyf, "Database", "HOST");
     user = ccnet_key_file_get_string (session->keyf, "Database", "USER");
@@ -210,9 +265,70 @@ static int init_pgsql_database (CcnetSession *session)
         return -1;
     }
 
+    /* host:port goes into the url as is */
+    replica_hosts = get_replica_hosts (session->keyf);
+    for (i = 0; replica_hosts && replica_hosts[i] != NULL; ++i) {
+        if (*replica_hosts[i] == '\0')
+            continue;
+        add_replica (session,
+                     ccnet_db_new_pgsql (replica_hosts[i], user, passwd, db, NULL),
+                     replica_hosts[i]);
+    }
+    g_strfreev (replica_hosts);
+
    return 0;
 }
 
+static int
+get_db_int_option (GKeyFile *keyf, const char *key, int default_val)
+{
+    GError *error = NULL;
+    int val;
+
+    val = g_key_file_get_integer (keyf, "Database", key, &error);
+    if (error) {
+        g_clear_error (&error);
+        return default_val;
+    }
+    return val;
+}
+
+static void
+load_db_pool_options (CcnetSession *session)
+{
+    GKeyFile *keyf = session->keyf;
+
+    ccnet_db_set_pool_options (
+        session->db,
+        get_db_int_option (keyf, "POOL_MIN_CONNECTIONS", 0),
+        get_db_int_option (keyf, "POOL_MAX_CONNECTIONS", 0),
+        get_db_int_option (keyf, "POOL_IDLE_TIMEOUT", 0),
+        get_db_int_option (keyf, "POOL_WAIT_TIMEOUT", -1));
+}
+
+static void
+load_db_replica_options (CcnetSession *session)
+{
+    GKeyFile *keyf = session->keyf;
+
+    ccnet_db_set_replica_options (
+        session->db,
+        get_db_int_option (keyf, "READ_AFTER_WRITE", -1),
+        get_db_int_option (keyf, "REPLICA_MAX_LAG", -1),
+        get_db_int_option (keyf, "REPLICA_RETRY_INTERVAL", -1));
+}
+
+/* Also used by the user, group and org dbs, opened later. */
+static void
+load_sqlite_options (CcnetSession *session)
+{
+    GKeyFile *keyf = session->keyf;
+
+    ccnet_db_set_sqlite_options (
+        get_db_int_option (keyf, "SQLITE_BUSY_TIMEOUT", -1),
+        get_db_int_option (keyf, "SQLITE_MMAP_SIZE", -1));
+}
+
 static int
 load_database_config (CcnetSession *session)
 {
@@ -222,6 +338,7 @@ load_database_config (CcnetSession *session)
     engine = ccnet_key_file_get_string (session->keyf, "Database", "ENGINE");
     if (!engine || strncasecmp (engine, DB_SQLITE, sizeof(DB_SQLITE)) == 0) {
         ccnet_debug ("Use database sqlite\n");
+        load_sqlite_options (session);
         ret = init_sqlite_database (session);
     } else if (strncasecmp (engine, DB_MYSQL, sizeof(DB_MYSQL)) == 0) {
         ccnet_debug ("Use database Mysql\n");
@@ -234,6 +351,11 @@ load_database_config (CcnetSession *session)
         ret = -1;
     }
 
+    if (ret == 0) {
+        load_db_pool_options (session);
+        load_db_replica_options (session);
+    }
+
     return ret;
 }
 
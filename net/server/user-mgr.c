@@ -4,8 +4,10 @@
 
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include "ccnet-db.h"
+#include "json-stream.h"
 #include "timer.h"
 #include "utils.h"
 
@@ -16,6 +18,9 @@
 #include "user-mgr.h"
 
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
 
 #ifdef HAVE_LDAP
   #ifndef WIN32
@@ -30,6 +35,7 @@
 #include "log.h"
 
 #define DEFAULT_SAVING_INTERVAL_MSEC 30000
+#define USER_COUNT_REFRESH_INTERVAL_MSEC (5 * 60 * 1000)
 
 
 G_DEFINE_TYPE (CcnetUserManager, ccnet_user_manager, G_TYPE_OBJECT);
@@ -40,15 +46,39 @@ G_DEFINE_TYPE (CcnetUserManager, ccnet_user_manager, G_TYPE_OBJECT);
 
 
 static int open_db (CcnetUserManager *manager);
+static int load_passwd_hash_settings (CcnetUserManager *manager);
+static gint64 count_db_users (CcnetUserManager *manager);
 
 #ifdef HAVE_LDAP
 static int try_load_ldap_settings (CcnetUserManager *manager);
+static int ldap_count_users (CcnetUserManager *manager, const char *uid);
 #endif
 
 struct CcnetUserManagerPriv {
     CcnetDB    *db;
     int         max_users;
-    int         cur_users;
+
+    /* Cached user counts of each source. They're adjusted on add/remove
+     * and periodically recounted in the job thread pool, so that
+     * count_emailusers never has to hit the DB or LDAP server.
+     */
+    pthread_mutex_t count_lock;
+    gint64      db_users;
+    gint64      ldap_users;
+    /* Bumped on every mutation, so that a recount which raced with
+     * a mutation is discarded. */
+    guint       count_gen;
+    gboolean    count_refreshing;
+    CcnetTimer *count_timer;
+
+    /* Password hashing */
+    const struct PasswdHashScheme *hash_scheme;
+    char       *hash_params;
+    GThreadPool *passwd_pool;
+    /* Checks hashing or waiting for a hashing thread. Each one ties
+     * up the job thread that waits for it. */
+    volatile gint passwd_in_flight;
+    gint        passwd_max_in_flight;
 };
 
 
@@ -63,6 +93,7 @@ static void
 ccnet_user_manager_init (CcnetUserManager *manager)
 {
     manager->priv = GET_PRIV(manager);
+    pthread_mutex_init (&manager->priv->count_lock, NULL);
 }
 
 CcnetUserManager*
@@ -87,17 +118,25 @@ ccnet_user_manager_prepare (CcnetUserManager *manager)
         return -1;
 #endif
 
+    if (load_passwd_hash_settings (manager) < 0)
+        return -1;
+
     manager->userdb_path = g_build_filename (manager->session->config_dir,
                                              "user-db", NULL);
     ret = open_db(manager);
     if (ret < 0)
         return ret;
 
-    manager->priv->cur_users = ccnet_user_manager_count_emailusers (manager);
+    gint64 cur_users = ccnet_user_manager_refresh_user_counts (manager);
+    if (cur_users < 0) {
+        ccnet_warning ("Failed to count users.\n");
+        return -1;
+    }
     if (manager->priv->max_users != 0
-        && manager->priv->cur_users > manager->priv->max_users) {
-        ccnet_warning ("The number of users exceeds limit, max %d, current %d\n",
-                       manager->priv->max_users, manager->priv->cur_users);
+        && cur_users > manager->priv->max_users) {
+        ccnet_warning ("The number of users exceeds limit, max %d, current %"
+                       G_GINT64_FORMAT"\n",
+                       manager->priv->max_users, cur_users);
         return -1;
     }
     return 0;
@@ -109,10 +148,79 @@ ccnet_user_manager_free (CcnetUserManager *manager)
     g_object_unref (manager);
 }
 
+typedef struct CountUsersData {
+    CcnetUserManager *manager;
+    guint gen;
+    gint64 db_users;
+    gint64 ldap_users;
+} CountUsersData;
+
+static void *
+count_users_job (void *vdata)
+{
+    CountUsersData *data = vdata;
+
+    data->db_users = count_db_users (data->manager);
+#ifdef HAVE_LDAP
+    if (data->manager->use_ldap)
+        data->ldap_users = ldap_count_users (data->manager, "*");
+#endif
+
+    return vdata;
+}
+
+static void
+count_users_done (void *result)
+{
+    CountUsersData *data = result;
+    CcnetUserManagerPriv *priv = data->manager->priv;
+
+    pthread_mutex_lock (&priv->count_lock);
+    /* Only take the result if no user was added or removed meanwhile,
+     * otherwise the next pulse will catch up. */
+    if (data->gen == priv->count_gen) {
+        if (data->db_users >= 0)
+            priv->db_users = data->db_users;
+        if (data->ldap_users >= 0)
+            priv->ldap_users = data->ldap_users;
+    }
+    priv->count_refreshing = FALSE;
+    pthread_mutex_unlock (&priv->count_lock);
+
+    g_free (data);
+}
+
+static int
+count_refresh_pulse (void *vmanager)
+{
+    CcnetUserManager *manager = vmanager;
+    CcnetUserManagerPriv *priv = manager->priv;
+    CountUsersData *data;
+
+    pthread_mutex_lock (&priv->count_lock);
+    if (priv->count_refreshing) {
+        pthread_mutex_unlock (&priv->count_lock);
+        return TRUE;
+    }
+    priv->count_refreshing = TRUE;
+    data = g_new0 (CountUsersData, 1);
+    data->manager = manager;
+    data->gen = priv->count_gen;
+    data->ldap_users = -1;
+    pthread_mutex_unlock (&priv->count_lock);
+
+    ccnet_job_manager_schedule_job (manager->session->job_mgr,
+                                    count_users_job,
+                                    count_users_done,
+                                    data);
+    return TRUE;
+}
+
 void
 ccnet_user_manager_start (CcnetUserManager *manager)
 {
-
+    manager->priv->count_timer = ccnet_timer_new (count_refresh_pulse, manager,
+                                                  USER_COUNT_REFRESH_INTERVAL_MSEC);
 }
 
 void ccnet_user_manager_on_exit (CcnetUserManager *manager)
@@ -469,12 +577,21 @@ static int check_db_table (CcnetDB *db)
     if (db_type == CCNET_DB_TYPE_MYSQL) {
         sql = "CREATE TABLE IF NOT EXISTS EmailUser ("
             "id INTEGER NOT NULL PRIMARY KEY AUTO_INCREMENT, "
-            "email VARCHAR(255), passwd CHAR(64), "
+            "email VARCHAR(255), passwd VARCHAR(256), "
             "is_staff BOOL NOT NULL, is_active BOOL NOT NULL, "
             "ctime BIGINT, UNIQUE INDEX (email))"
             "ENGINE=INNODB";
         if (ccnet_db_query (db, sql) < 0)
             return -1;
+        /* Tables created by older versions can't hold salted hashes. */
+        sql = "SELECT CHARACTER_MAXIMUM_LENGTH FROM information_schema.COLUMNS "
+            "WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='EmailUser' "
+            "AND COLUMN_NAME='passwd'";
+        if (ccnet_db_get_int (db, sql) < 256) {
+            sql = "ALTER TABLE EmailUser MODIFY passwd VARCHAR(256)";
+            if (ccnet_db_query (db, sql) < 0)
+                return -1;
+        }
         sql = "CREATE TABLE IF NOT EXISTS Binding (email VARCHAR(255), peer_id CHAR(41),"
             "UNIQUE INDEX (peer_id), INDEX (email(20)))"
             "ENGINE=INNODB";
@@ -507,11 +624,18 @@ static int check_db_table (CcnetDB *db)
     } else if (db_type == CCNET_DB_TYPE_PGSQL) {
         sql = "CREATE TABLE IF NOT EXISTS EmailUser ("
             "id SERIAL PRIMARY KEY, "
-            "email VARCHAR(255), passwd VARCHAR(64), "
+            "email VARCHAR(255), passwd VARCHAR(256), "
             "is_staff INTEGER NOT NULL, is_active INTEGER NOT NULL, "
             "ctime BIGINT, UNIQUE (email))";
         if (ccnet_db_query (db, sql) < 0)
             return -1;
+        sql = "SELECT character_maximum_length FROM information_schema.columns "
+            "WHERE table_name='emailuser' AND column_name='passwd'";
+        if (ccnet_db_get_int (db, sql) < 256) {
+            sql = "ALTER TABLE EmailUser ALTER COLUMN passwd TYPE VARCHAR(256)";
+            if (ccnet_db_query (db, sql) < 0)
+                return -1;
+        }
         sql = "CREATE TABLE IF NOT EXISTS Binding (email VARCHAR(255), peer_id CHAR(41),"
             "UNIQUE (peer_id))";
         if (ccnet_db_query (db, sql) < 0)
@@ -573,11 +697,78 @@ open_db (CcnetUserManager *manager)
 }
 
 
-/* -------- EmailUser Management -------- */
+/* -------- Password Hashing -------- */
+
+/*
+ * Passwords are stored as "<scheme>$<params>$<salt hex>$<hash hex>",
+ * e.g. "PBKDF2SHA256$10000$<salt>$<hash>".
+ *
+ * Hashes without a '$' are created by older versions: 40 hex chars are
+ * unsalted SHA-1 and 64 hex chars are SHA-256 with the global salt below.
+ * They're re-hashed with the configured scheme on a successful login.
+ */
 
 /* truly random sequece read from /dev/urandom. */
 static unsigned char salt[8] = { 0xdb, 0x91, 0x45, 0xc3, 0x06, 0xc7, 0xcc, 0x26 };
 
+#define PASSWD_SALT_LEN 16
+#define PASSWD_HASH_LEN 32
+
+#define DEFAULT_PASSWD_HASH_SCHEME "PBKDF2SHA256"
+#define DEFAULT_PBKDF2_ITERATIONS "10000"
+
+/* Password checks in flight, per hashing thread and in total. The
+ * total must stay well below the 50 threads of the session job pool,
+ * which run both the callers and all other threaded rpcs. */
+#define PASSWD_IN_FLIGHT_PER_THREAD 2
+#define PASSWD_MAX_IN_FLIGHT 16
+
+typedef struct PasswdHashScheme {
+    const char *name;
+    const char *default_params;
+    /* Derive PASSWD_HASH_LEN bytes into @out. Returns 0 on success. */
+    int (*derive) (const char *passwd,
+                   const unsigned char *salt, int salt_len,
+                   const char *params,
+                   unsigned char *out);
+} PasswdHashScheme;
+
+static int
+pbkdf2_sha256_derive (const char *passwd,
+                      const unsigned char *salt, int salt_len,
+                      const char *params,
+                      unsigned char *out)
+{
+    int iterations = atoi (params);
+
+    if (iterations <= 0)
+        return -1;
+
+    if (!PKCS5_PBKDF2_HMAC (passwd, strlen(passwd), salt, salt_len,
+                            iterations, EVP_sha256(),
+                            PASSWD_HASH_LEN, out))
+        return -1;
+
+    return 0;
+}
+
+static const PasswdHashScheme hash_schemes[] = {
+    { "PBKDF2SHA256", DEFAULT_PBKDF2_ITERATIONS, pbkdf2_sha256_derive },
+    { NULL, NULL, NULL },
+};
+
+static const PasswdHashScheme *
+find_hash_scheme (const char *name)
+{
+    const PasswdHashScheme *scheme;
+
+    for (scheme = hash_schemes; scheme->name; ++scheme) {
+        if (g_ascii_strcasecmp (scheme->name, name) == 0)
+            return scheme;
+    }
+    return NULL;
+}
+
 static void
 hash_password (const char *passwd, char *hashed_passwd)
 {
@@ -603,6 +794,236 @@ hash_password_salted (const char *passwd, char *hashed_passwd)
     rawdata_to_hex (sha, hashed_passwd, SHA256_DIGEST_LENGTH);
 }
 
+/* Hash @passwd with the configured scheme and a fresh random salt. */
+static char *
+hash_password_with_scheme (CcnetUserManager *manager, const char *passwd)
+{
+    const PasswdHashScheme *scheme = manager->priv->hash_scheme;
+    const char *params = manager->priv->hash_params;
+    unsigned char salt_raw[PASSWD_SALT_LEN];
+    unsigned char hash[PASSWD_HASH_LEN];
+    char salt_hex[PASSWD_SALT_LEN * 2 + 1];
+    char hash_hex[PASSWD_HASH_LEN * 2 + 1];
+
+    if (RAND_bytes (salt_raw, sizeof(salt_raw)) != 1) {
+        ccnet_warning ("Failed to generate password salt.\n");
+        return NULL;
+    }
+
+    if (scheme->derive (passwd, salt_raw, sizeof(salt_raw), params, hash) < 0) {
+        ccnet_warning ("Failed to hash password with %s.\n", scheme->name);
+        return NULL;
+    }
+
+    rawdata_to_hex (salt_raw, salt_hex, sizeof(salt_raw));
+    rawdata_to_hex (hash, hash_hex, sizeof(hash));
+
+    return g_strdup_printf ("%s$%s$%s$%s", scheme->name, params,
+                            salt_hex, hash_hex);
+}
+
+/*
+ * Check @passwd against @stored_passwd. @need_upgrade is set if the
+ * stored hash doesn't use the configured scheme and parameters.
+ */
+static gboolean
+validate_passwd (CcnetUserManager *manager,
+                 const char *passwd, const char *stored_passwd,
+                 gboolean *need_upgrade)
+{
+    char hashed_passwd[SHA256_DIGEST_LENGTH * 2 + 1];
+    int hash_len = strlen(stored_passwd);
+    char **parts;
+    const PasswdHashScheme *scheme;
+    unsigned char salt_raw[PASSWD_SALT_LEN];
+    unsigned char hash[PASSWD_HASH_LEN], stored_hash[PASSWD_HASH_LEN];
+    gboolean ret = FALSE;
+
+    *need_upgrade = TRUE;
+
+    if (!strchr (stored_passwd, '$')) {
+        if (hash_len == SHA256_DIGEST_LENGTH * 2)
+            hash_password_salted (passwd, hashed_passwd);
+        else if (hash_len == SHA_DIGEST_LENGTH * 2)
+            hash_password (passwd, hashed_passwd);
+        else {
+            ccnet_warning ("Invalid hashed_password length %d.\n", hash_len);
+            return FALSE;
+        }
+
+        return (strcmp (hashed_passwd, stored_passwd) == 0);
+    }
+
+    parts = g_strsplit (stored_passwd, "$", 4);
+    if (g_strv_length (parts) != 4 ||
+        strlen(parts[2]) != PASSWD_SALT_LEN * 2 ||
+        strlen(parts[3]) != PASSWD_HASH_LEN * 2) {
+        ccnet_warning ("Invalid hashed password format.\n");
+        goto out;
+    }
+
+    scheme = find_hash_scheme (parts[0]);
+    if (!scheme) {
+        ccnet_warning ("Unsupported password hash scheme %s.\n", parts[0]);
+        goto out;
+    }
+
+    if (hex_to_rawdata (parts[2], salt_raw, PASSWD_SALT_LEN) < 0 ||
+        hex_to_rawdata (parts[3], stored_hash, PASSWD_HASH_LEN) < 0) {
+        ccnet_warning ("Invalid hashed password format.\n");
+        goto out;
+    }
+
+    if (scheme->derive (passwd, salt_raw, PASSWD_SALT_LEN, parts[1], hash) < 0)
+        goto out;
+
+    ret = (CRYPTO_memcmp (hash, stored_hash, PASSWD_HASH_LEN) == 0);
+    *need_upgrade = (scheme != manager->priv->hash_scheme ||
+                     strcmp (parts[1], manager->priv->hash_params) != 0);
+
+out:
+    g_strfreev (parts);
+    return ret;
+}
+
+/*
+ * Key derivation is deliberately expensive, so it runs on a dedicated,
+ * bounded thread pool instead of the shared RPC threads. When too many
+ * checks are already in flight (e.g. a brute-force burst), new ones fail
+ * immediately instead of tying up the job threads that other RPCs need.
+ * Callers block, so they must not run on the event loop.
+ */
+
+typedef struct PasswdJob {
+    CcnetUserManager *manager;
+    const char *passwd;
+    /* If NULL, hash @passwd with the configured scheme. */
+    const char *stored_passwd;
+
+    gboolean    valid;
+    /* New hash, for hashing jobs or upgraded valid passwords. */
+    char       *hashed_passwd;
+
+    gboolean    done;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} PasswdJob;
+
+static void
+passwd_job_func (void *vjob, void *unused)
+{
+    PasswdJob *job = vjob;
+    gboolean need_upgrade = FALSE;
+
+    if (job->stored_passwd) {
+        job->valid = validate_passwd (job->manager, job->passwd,
+                                      job->stored_passwd, &need_upgrade);
+        if (job->valid && need_upgrade)
+            job->hashed_passwd = hash_password_with_scheme (job->manager,
+                                                            job->passwd);
+    } else {
+        job->hashed_passwd = hash_password_with_scheme (job->manager,
+                                                        job->passwd);
+    }
+
+    pthread_mutex_lock (&job->lock);
+    job->done = TRUE;
+    pthread_cond_signal (&job->cond);
+    pthread_mutex_unlock (&job->lock);
+}
+
+static int
+run_passwd_job (CcnetUserManager *manager, PasswdJob *job)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    gint n;
+
+    do {
+        n = g_atomic_int_get (&priv->passwd_in_flight);
+        if (n >= priv->passwd_max_in_flight) {
+            ccnet_warning ("Too many pending password checks, rejected.\n");
+            return -1;
+        }
+    } while (!g_atomic_int_compare_and_exchange (&priv->passwd_in_flight,
+                                                 n, n + 1));
+
+    job->manager = manager;
+    pthread_mutex_init (&job->lock, NULL);
+    pthread_cond_init (&job->cond, NULL);
+
+    g_thread_pool_push (priv->passwd_pool, job, NULL);
+
+    pthread_mutex_lock (&job->lock);
+    while (!job->done)
+        pthread_cond_wait (&job->cond, &job->lock);
+    pthread_mutex_unlock (&job->lock);
+
+    pthread_mutex_destroy (&job->lock);
+    pthread_cond_destroy (&job->cond);
+
+    g_atomic_int_add (&priv->passwd_in_flight, -1);
+    return 0;
+}
+
+static char *
+hash_password_in_pool (CcnetUserManager *manager, const char *passwd)
+{
+    PasswdJob job;
+
+    memset (&job, 0, sizeof(job));
+    job.passwd = passwd;
+    if (run_passwd_job (manager, &job) < 0)
+        return NULL;
+
+    return job.hashed_passwd;
+}
+
+static int
+load_passwd_hash_settings (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    GKeyFile *config = manager->session->keyf;
+    char *scheme_name;
+    int n_threads = 0;
+
+    scheme_name = ccnet_key_file_get_string (config, "PASSWORD_HASH", "SCHEME");
+    if (!scheme_name)
+        scheme_name = g_strdup (DEFAULT_PASSWD_HASH_SCHEME);
+    priv->hash_scheme = find_hash_scheme (scheme_name);
+    if (!priv->hash_scheme) {
+        ccnet_warning ("Unsupported password hash scheme %s.\n", scheme_name);
+        g_free (scheme_name);
+        return -1;
+    }
+    g_free (scheme_name);
+
+    priv->hash_params = ccnet_key_file_get_string (config, "PASSWORD_HASH", "PARAMS");
+    if (!priv->hash_params)
+        priv->hash_params = g_strdup (priv->hash_scheme->default_params);
+    if (strchr (priv->hash_params, '$')) {
+        ccnet_warning ("Invalid password hash params %s.\n", priv->hash_params);
+        return -1;
+    }
+
+    if (g_key_file_has_key (config, "PASSWORD_HASH", "THREADS", NULL))
+        n_threads = g_key_file_get_integer (config, "PASSWORD_HASH", "THREADS",
+                                            NULL);
+#ifndef WIN32
+    if (n_threads <= 0)
+        n_threads = (int)sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+    if (n_threads <= 0)
+        n_threads = 2;
+
+    priv->passwd_max_in_flight = MIN (n_threads * PASSWD_IN_FLIGHT_PER_THREAD,
+                                      PASSWD_MAX_IN_FLIGHT);
+    priv->passwd_pool = g_thread_pool_new (passwd_job_func, NULL,
+                                           n_threads, FALSE, NULL);
+    return 0;
+}
+
+/* -------- EmailUser Management -------- */
+
 int
 ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
                                   const char *email,
@@ -611,33 +1032,228 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
 {
     CcnetDB *db = manager->priv->db;
     gint64 now = get_current_time();
-    char sql[512];
-    char hashed_passwd[SHA256_DIGEST_LENGTH * 2 + 1];
+    char sql[1024];
+    char *hashed_passwd;
     int ret;
 
-    if (manager->priv->max_users &&
-        manager->priv->cur_users >= manager->priv->max_users) {
-        ccnet_warning ("User number exceeds limit. Users %d, limit %d.\n",
-                       manager->priv->cur_users, manager->priv->max_users);
-        return -1;
+    if (manager->priv->max_users) {
+        gint64 cur_users = ccnet_user_manager_count_emailusers (manager);
+        if (cur_users >= manager->priv->max_users) {
+            ccnet_warning ("User number exceeds limit. Users %"G_GINT64_FORMAT
+                           ", limit %d.\n", cur_users, manager->priv->max_users);
+            return -1;
+        }
     }
 
+    hashed_passwd = hash_password_in_pool (manager, passwd);
+    if (!hashed_passwd)
+        return -1;
+
     /* convert email to lower case for case insensitive lookup. */
     char *email_down = g_ascii_strdown (email, strlen(email));
 
-    hash_password_salted (passwd, hashed_passwd);
-
-    snprintf (sql, 512, "INSERT INTO EmailUser(email, passwd, is_staff, "
+    snprintf (sql, sizeof(sql), "INSERT INTO EmailUser(email, passwd, is_staff, "
               "is_active, ctime) VALUES ('%s', '%s', '%d', '%d', "
               "%"G_GINT64_FORMAT")", email_down, hashed_passwd, is_staff,
               is_active, now);
     g_free (email_down);
+    g_free (hashed_passwd);
 
     ret = ccnet_db_query (db, sql);
     if (ret < 0)
         return ret;
 
-    manager->priv->cur_users ++;
+    pthread_mutex_lock (&manager->priv->count_lock);
+    manager->priv->db_users++;
+    manager->priv->count_gen++;
+    pthread_mutex_unlock (&manager->priv->count_lock);
+    return 0;
+}
+
+/* Find the next chunk [*begin, *end) of non-empty emails, at most
+ * CCNET_DB_BATCH_INSERT_ROWS long. Empty items are skipped and stay
+ * failed. Returns FALSE when there are no more. */
+static gboolean
+next_emails_chunk (char **emails, int n, int *begin, int *end)
+{
+    int i = *end;
+
+    while (i < n && emails[i][0] == '\0')
+        ++i;
+    *begin = i;
+    while (i < n && i - *begin < CCNET_DB_BATCH_INSERT_ROWS &&
+           emails[i][0] != '\0')
+        ++i;
+    *end = i;
+
+    return *begin < *end;
+}
+
+static void
+append_email_list (GString *sql, char **emails, int begin, int end)
+{
+    int i;
+
+    g_string_append (sql, "SELECT email FROM EmailUser WHERE email IN (");
+    for (i = begin; i < end; ++i)
+        g_string_append_printf (sql, "%s'%s'", i > begin ? ", " : "", emails[i]);
+    g_string_append (sql, ")");
+}
+
+/* Hash the passwords of users [begin, end) that don't exist yet. This
+ * is slow, so it's done before a transaction holds a connection and
+ * row locks. */
+static void
+hash_new_passwds (CcnetUserManager *manager, char **emails, char **passwds,
+                  int begin, int end, char **hashed_passwds)
+{
+    GString *sql = g_string_new (NULL);
+    GHashTable *existing;
+    int i;
+
+    existing = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    append_email_list (sql, emails, begin, end);
+    ccnet_db_foreach_selected_row (manager->priv->db, sql->str,
+                                   ccnet_db_collect_string_set, existing);
+    g_string_free (sql, TRUE);
+
+    for (i = begin; i < end; ++i)
+        if (!g_hash_table_lookup (existing, emails[i]))
+            hashed_passwds[i] = hash_password_in_pool (manager, passwds[i]);
+
+    g_hash_table_destroy (existing);
+}
+
+/* Insert users [begin, end) that don't exist yet, in one statement. */
+static int
+add_emailusers_chunk (CcnetDBTrans *trans,
+                      char **emails, char **hashed_passwds, int begin, int end,
+                      int is_staff, int is_active, int *status,
+                      GHashTable *seen, int *n_added)
+{
+    gint64 now = get_current_time();
+    GString *sql = g_string_new (NULL);
+    int i, n_rows = 0, ret = 0;
+
+    /* find out which of them exist, added since they were hashed too */
+    append_email_list (sql, emails, begin, end);
+    if (ccnet_db_trans_foreach_selected_row (trans, sql->str,
+                                             ccnet_db_collect_string_set,
+                                             seen) < 0) {
+        g_string_free (sql, TRUE);
+        return -1;
+    }
+
+    g_string_assign (sql, "INSERT INTO EmailUser(email, passwd, is_staff, "
+                     "is_active, ctime) VALUES ");
+    for (i = begin; i < end; ++i) {
+        if (g_hash_table_lookup (seen, emails[i])) {
+            status[i] = 1;      /* already exists */
+            continue;
+        }
+        /* hashing failed, or removed since */
+        if (!hashed_passwds[i])
+            continue;
+        g_hash_table_insert (seen, g_strdup(emails[i]), GINT_TO_POINTER(1));
+
+        g_string_append_printf (sql, "%s('%s', '%s', '%d', '%d', "
+                                "%"G_GINT64_FORMAT")", n_rows ? ", " : "",
+                                emails[i], hashed_passwds[i], is_staff,
+                                is_active, now);
+        status[i] = 0;
+        n_rows++;
+    }
+
+    if (n_rows > 0 && ccnet_db_trans_query (trans, sql->str) < 0)
+        ret = -1;
+    else
+        *n_added += n_rows;
+
+    g_string_free (sql, TRUE);
+    return ret;
+}
+
+int
+ccnet_user_manager_add_emailusers (CcnetUserManager *manager,
+                                   char **emails,
+                                   char **passwds,
+                                   int is_staff, int is_active,
+                                   int *status)
+{
+    CcnetDB *db = manager->priv->db;
+    CcnetDBTrans *trans;
+    GHashTable *seen;
+    char **emails_down, **hashed_passwds;
+    int n, i, begin, end, n_added = 0, ret = 0;
+
+    n = g_strv_length (emails);
+    for (i = 0; i < n; ++i)
+        status[i] = -1;
+    if (g_strv_length (passwds) != n)
+        return -1;
+
+    /* Items past the user limit are left failed. */
+    if (manager->priv->max_users) {
+        gint64 cur_users = ccnet_user_manager_count_emailusers (manager);
+        if (cur_users + n > manager->priv->max_users) {
+            ccnet_warning ("User number exceeds limit. Users %"G_GINT64_FORMAT
+                           ", limit %d.\n", cur_users, manager->priv->max_users);
+            n = MAX (0, manager->priv->max_users - cur_users);
+        }
+    }
+
+    /* convert email to lower case for case insensitive lookup. */
+    emails_down = g_new0 (char *, n + 1);
+    for (i = 0; i < n; ++i)
+        emails_down[i] = g_ascii_strdown (emails[i], -1);
+    hashed_passwds = g_new0 (char *, n + 1);
+
+    for (end = 0; next_emails_chunk (emails_down, n, &begin, &end); )
+        hash_new_passwds (manager, emails_down, passwds, begin, end,
+                          hashed_passwds);
+
+    trans = ccnet_db_begin (db);
+    if (!trans) {
+        ret = -1;
+        goto out;
+    }
+
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (end = 0; next_emails_chunk (emails_down, n, &begin, &end); ) {
+        if (add_emailusers_chunk (trans, emails_down, hashed_passwds,
+                                  begin, end, is_staff, is_active, status,
+                                  seen, &n_added) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    g_hash_table_destroy (seen);
+
+    if (ret == 0)
+        ret = ccnet_db_commit (trans);
+    else
+        ccnet_db_rollback (trans);
+
+out:
+    /* not NULL terminated, users that exist have no hash */
+    for (i = 0; i < n; ++i)
+        g_free (hashed_passwds[i]);
+    g_free (hashed_passwds);
+    g_strfreev (emails_down);
+
+    if (ret < 0) {
+        /* nothing was added */
+        for (i = 0; i < n; ++i)
+            if (status[i] == 0)
+                status[i] = -1;
+        return -1;
+    }
+
+    pthread_mutex_lock (&manager->priv->count_lock);
+    manager->priv->db_users += n_added;
+    manager->priv->count_gen++;
+    pthread_mutex_unlock (&manager->priv->count_lock);
     return 0;
 }
 
@@ -647,17 +1263,22 @@ ccnet_user_manager_remove_emailuser (CcnetUserManager *manager,
 {
     CcnetDB *db = manager->priv->db;
     char sql[512];
-    int ret;
+    gint64 changes;
 
     snprintf (sql, 512,
               "DELETE FROM EmailUser WHERE email='%s'",
               email);
 
-    ret = ccnet_db_query (db, sql);
-    if (ret < 0)
-        return ret;
+    changes = ccnet_db_query_changes (db, sql);
+    if (changes < 0)
+        return -1;
+    if (changes == 0)
+        return 0;
 
-    manager->priv->cur_users --;
+    pthread_mutex_lock (&manager->priv->count_lock);
+    manager->priv->db_users = MAX (manager->priv->db_users - changes, 0);
+    manager->priv->count_gen++;
+    pthread_mutex_unlock (&manager->priv->count_lock);
     return 0;
 }
 
@@ -670,25 +1291,50 @@ get_password (CcnetDBRow *row, void *data)
     return FALSE;
 }
 
-static gboolean
-validate_passwd (const char *passwd, const char *stored_passwd)
+/*
+ * Returns 0 if @passwd is right, -1 if it's wrong or the check failed,
+ * and 1 if there's no such user.
+ */
+static int
+check_user_passwd (CcnetUserManager *manager,
+                   const char *email,
+                   const char *passwd)
 {
-    char hashed_passwd[SHA256_DIGEST_LENGTH * 2 + 1];
-    int hash_len = strlen(stored_passwd);
+    CcnetDB *db = manager->priv->db;
+    char sql[1024];
+    char *stored_passwd = NULL;
+    PasswdJob job;
+
+    snprintf (sql, sizeof(sql),
+              "SELECT passwd FROM EmailUser WHERE email='%s'",
+              email);
+    if (ccnet_db_foreach_selected_row (db, sql,
+                                       get_password, &stored_passwd) <= 0)
+        return 1;
+
+    memset (&job, 0, sizeof(job));
+    job.passwd = passwd;
+    job.stored_passwd = stored_passwd;
+    if (run_passwd_job (manager, &job) < 0) {
+        g_free (stored_passwd);
+        return -1;
+    }
+    g_free (stored_passwd);
 
-    if (hash_len == SHA256_DIGEST_LENGTH * 2)
-        hash_password_salted (passwd, hashed_passwd);
-    else if (hash_len == SHA_DIGEST_LENGTH * 2)
-        hash_password (passwd, hashed_passwd);
-    else {
-        ccnet_warning ("Invalid hashed_password length %d.\n", hash_len);
-        return FALSE;
+    if (!job.valid)
+        return -1;
+
+    /* Transparently move the user to the configured hash scheme. */
+    if (job.hashed_passwd) {
+        snprintf (sql, sizeof(sql),
+                  "UPDATE EmailUser SET passwd='%s' WHERE email='%s'",
+                  job.hashed_passwd, email);
+        if (ccnet_db_query (db, sql) < 0)
+            ccnet_warning ("Failed to upgrade password hash for %s.\n", email);
+        g_free (job.hashed_passwd);
     }
 
-    if (strcmp (hashed_passwd, stored_passwd) == 0)
-        return TRUE;
-    else
-        return FALSE;
+    return 0;
 }
 
 int
@@ -696,10 +1342,8 @@ ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
                                        const char *email,
                                        const char *passwd)
 {
-    CcnetDB *db = manager->priv->db;
-    char sql[1024];
     char *email_down;
-    char *stored_passwd = NULL;
+    int ret;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap) {
@@ -708,37 +1352,15 @@ ccnet_user_manager_validate_emailuser (CcnetUserManager *manager,
     }
 #endif
 
-    snprintf (sql, sizeof(sql),
-              "SELECT passwd FROM EmailUser WHERE email='%s'",
-              email);
-    if (ccnet_db_foreach_selected_row (db, sql,
-                                       get_password, &stored_passwd) > 0) {
-        if (validate_passwd (passwd, stored_passwd)) {
-            g_free (stored_passwd);
-            return 0;
-        } else {
-            g_free (stored_passwd);
-            return -1;
-        }
-    }
+    ret = check_user_passwd (manager, email, passwd);
+    if (ret <= 0)
+        return ret;
 
     email_down = g_ascii_strdown (email, strlen(email));
-    snprintf (sql, sizeof(sql),
-              "SELECT passwd FROM EmailUser WHERE email='%s'",
-              email_down);
+    ret = check_user_passwd (manager, email_down, passwd);
     g_free (email_down);
-    if (ccnet_db_foreach_selected_row (db, sql,
-                                       get_password, &stored_passwd) > 0) {
-        if (validate_passwd (passwd, stored_passwd)) {
-            g_free (stored_passwd);
-            return 0;
-        } else {
-            g_free (stored_passwd);
-            return -1;
-        }
-    }
 
-    return -1;
+    return (ret == 0) ? 0 : -1;
 }
 
 static gboolean
@@ -894,6 +1516,80 @@ ccnet_user_manager_get_emailusers (CcnetUserManager *manager,
     return g_list_reverse (ret);
 }
 
+static gboolean
+stream_emailusers_cb (CcnetDBRow *row, void *data)
+{
+    CcnetJsonStream *js = data;
+
+    int id = ccnet_db_row_get_column_int (row, 0);
+    const char *email = (const char *)ccnet_db_row_get_column_text (row, 1);
+    int is_staff = ccnet_db_row_get_column_int (row, 2);
+    int is_active = ccnet_db_row_get_column_int (row, 3);
+    gint64 ctime = ccnet_db_row_get_column_int64 (row, 4);
+
+    char *email_l = g_ascii_strdown (email, -1);
+    ccnet_json_stream_begin_object (js);
+    ccnet_json_stream_add_int (js, "id", id);
+    ccnet_json_stream_add_string (js, "email", email_l);
+    ccnet_json_stream_add_bool (js, "is-staff", is_staff);
+    ccnet_json_stream_add_bool (js, "is-active", is_active);
+    ccnet_json_stream_add_int (js, "ctime", ctime);
+    ccnet_json_stream_add_string (js, "source", "DB");
+    ccnet_json_stream_end_object (js);
+    g_free (email_l);
+
+    return TRUE;
+}
+
+int
+ccnet_user_manager_stream_emailusers (CcnetUserManager *manager,
+                                      const char *source,
+                                      int start, int limit,
+                                      CcnetJsonStream *js)
+{
+    CcnetDB *db = manager->priv->db;
+    char sql[256];
+
+    ccnet_json_stream_begin_list (js);
+
+#ifdef HAVE_LDAP
+    if (manager->use_ldap && g_strcmp0 (source, "LDAP") == 0) {
+        GList *users, *ptr;
+
+        users = ccnet_user_manager_get_emailusers (manager, source,
+                                                   start, limit);
+        for (ptr = users; ptr; ptr = ptr->next) {
+            ccnet_json_stream_add_gobject (js, ptr->data);
+            g_object_unref (ptr->data);
+        }
+        g_list_free (users);
+        ccnet_json_stream_end_list (js);
+        return 0;
+    }
+#endif
+
+    if (g_strcmp0 (source, "DB") != 0) {
+        ccnet_json_stream_end_list (js);
+        return 0;
+    }
+
+    if (start == -1 && limit == -1)
+        snprintf (sql, 256, "SELECT id, email, is_staff, is_active, ctime "
+                  "FROM EmailUser");
+    else
+        snprintf (sql, 256, "SELECT id, email, is_staff, is_active, ctime "
+                  "FROM EmailUser ORDER BY id LIMIT %d OFFSET %d",
+                  limit, start);
+
+    if (ccnet_db_foreach_selected_row (db, sql, stream_emailusers_cb, js) < 0) {
+        ccnet_json_stream_reset (js);
+        return -1;
+    }
+
+    ccnet_json_stream_end_list (js);
+    return 0;
+}
+
 static char *
 db_pattern_to_ldap_pattern (const char *db_pattern)
 {
@@ -944,29 +1640,65 @@ ccnet_user_manager_search_emailusers (CcnetUserManager *manager,
 }
 
 
+static gboolean
+get_count_cb (CcnetDBRow *row, void *data)
+{
+    *(gint64 *)data = ccnet_db_row_get_column_int64 (row, 0);
+    return FALSE;
+}
+
+/* The result is cached in db_users, so read it from the primary. */
+static gint64
+count_db_users (CcnetUserManager *manager)
+{
+    gint64 count = -1;
+
+    if (ccnet_db_foreach_selected_row_primary (manager->priv->db,
+                                               "SELECT COUNT(*) FROM EmailUser",
+                                               get_count_cb, &count) < 0)
+        return -1;
+    return count;
+}
+
 gint64
 ccnet_user_manager_count_emailusers (CcnetUserManager *manager)
 {
-    CcnetDB* db = manager->priv->db;
-    char sql[512];
-    gint64 count = 0, ret;
+    CcnetUserManagerPriv *priv = manager->priv;
+    gint64 count;
+
+    pthread_mutex_lock (&priv->count_lock);
+    count = priv->db_users + priv->ldap_users;
+    pthread_mutex_unlock (&priv->count_lock);
+
+    return count;
+}
+
+gint64
+ccnet_user_manager_refresh_user_counts (CcnetUserManager *manager)
+{
+    CcnetUserManagerPriv *priv = manager->priv;
+    gint64 db_users, ldap_users = 0;
 
 #ifdef HAVE_LDAP
     if (manager->use_ldap) {
-        gint64 ret = ldap_count_users (manager, "*");
-        if (ret < 0)
+        ldap_users = ldap_count_users (manager, "*");
+        if (ldap_users < 0)
             return -1;
-        count += (gint64) ret;
     }
 #endif
 
-    snprintf (sql, 512, "SELECT COUNT(*) FROM EmailUser");
-
-    ret = ccnet_db_get_int64 (db, sql);
-    if (ret < 0)
+    db_users = count_db_users (manager);
+    if (db_users < 0)
         return -1;
-    count += ret;
-    return count;
+
+    pthread_mutex_lock (&priv->count_lock);
+    priv->db_users = db_users;
+    priv->ldap_users = ldap_users;
+    /* Invalidate any recount still running in the background. */
+    priv->count_gen++;
+    pthread_mutex_unlock (&priv->count_lock);
+
+    return db_users + ldap_users;
 }
 
 GList*
@@ -1015,17 +1747,20 @@ ccnet_user_manager_update_emailuser (CcnetUserManager *manager,
 {
     CcnetDB* db = manager->priv->db;
     char sql[512];
-    char hashed_passwd[SHA256_DIGEST_LENGTH * 2 + 1];
+    char *hashed_passwd;
 
     if (g_strcmp0 (passwd, "!") == 0) { /* Don't update unusable password. */
         snprintf (sql, 512, "UPDATE EmailUser SET is_staff='%d', "
                   "is_active='%d' WHERE id='%d'", is_staff, is_active, id);
     } else {
-        hash_password_salted (passwd, hashed_passwd);
+        hashed_passwd = hash_password_in_pool (manager, passwd);
+        if (!hashed_passwd)
+            return -1;
 
         snprintf (sql, 512, "UPDATE EmailUser SET passwd='%s', "
                   "is_staff='%d', is_active='%d' WHERE id='%d'",
                   hashed_passwd, is_staff, is_active, id);
+        g_free (hashed_passwd);
     }
         
     return ccnet_db_query (db, sql);
@@ -69,6 +69,18 @@ ccnet_user_manager_add_emailuser (CcnetUserManager *manager,
                                   const char *encry_passwd,
                                   int is_staff, int is_active);
 
+/*
+ * Add users in one transaction. @emails and @passwds are NULL
+ * terminated and of the same length. @status gets 0 (added),
+ * 1 (already exists) or -1 (failed) for each user.
+ */
+int
+ccnet_user_manager_add_emailusers (CcnetUserManager *manager,
+                                   char **emails,
+                                   char **passwds,
+                                   int is_staff, int is_active,
+                                   int *status);
+
 int
 ccnet_user_manager_remove_emailuser (CcnetUserManager *manager,
                                      const char *email);
@@ -91,14 +103,32 @@ GList*
 ccnet_user_manager_get_emailusers (CcnetUserManager *manager, const char *source,
                                    int start, int limit);
 
+/* Same as above, but write the result into @js. See json-stream.h. */
+int
+ccnet_user_manager_stream_emailusers (CcnetUserManager *manager,
+                                      const char *source,
+                                      int start, int limit,
+                                      struct CcnetJsonStream *js);
+
 GList*
 ccnet_user_manager_search_emailusers (CcnetUserManager *manager,
                                       const char *email_patt,
                                       int start, int limit);
 
+/*
+ * Return the cached number of users from all sources. The count is
+ * maintained on add/remove and refreshed in background periodically.
+ */
 gint64
 ccnet_user_manager_count_emailusers (CcnetUserManager *manager);
 
+/*
+ * Recount users from DB and LDAP synchronously and update the cache.
+ * Returns the new total, or -1 on error.
+ */
+gint64
+ccnet_user_manager_refresh_user_counts (CcnetUserManager *manager);
+
 GList*
 ccnet_user_manager_filter_emailusers_by_emails(CcnetUserManager *manager,
                                                const char *emails);
@@ -2,17 +2,23 @@ from pysearpc import SearpcClient, searpc_func, SearpcError
 
 from ccnet.status_code import SC_CLIENT_CALL, SS_CLIENT_CALL, \
     SC_CLIENT_MORE, SS_CLIENT_MORE, SC_SERVER_RET, \
-    SC_SERVER_MORE, SC_PROC_DEAD
+    SC_SERVER_MORE, SC_PROC_DEAD, SC_UNKNOWN_SERVICE
 
 from ccnet.errors import NetworkError
 
+# a one-shot call must fit in one request packet
+ONE_SHOT_MAX_LEN = 60000
+
 class DeadProcError(Exception):
     def __str__(self):
         return "Processor is dead"
 
 
 class RpcClientBase(SearpcClient):
-    
+
+    # services that don't take one-shot calls, e.g. on an older daemon
+    _no_one_shot = set()
+
     def __init__(self, ccnet_client_pool, service_name, retry_num=1,
                  is_remote=False, remote_peer_id='', req_pool=False):
         SearpcClient.__init__(self)
@@ -38,8 +44,21 @@ class RpcClientBase(SearpcClient):
 
     def _real_call(self, client, req_id, fcall_str):
         client.send_update(req_id, SC_CLIENT_CALL, SS_CLIENT_CALL, fcall_str)
-                
+        return self._read_result(client, req_id, client.read_response())
+
+    def _one_shot_call(self, client, fcall_str):
+        """Send the service name and the call in one request. The server
+        finishes the service by itself after returning. Returns None if
+        the service doesn't support this."""
+        req_id = client.get_request_id()
+        client.send_request(req_id, self.service_name + "\n" + fcall_str)
         rsp = client.read_response()
+        if rsp.code == SC_UNKNOWN_SERVICE:
+            RpcClientBase._no_one_shot.add(self.service_name)
+            return None
+        return self._read_result(client, req_id, rsp)
+
+    def _read_result(self, client, req_id, rsp):
         if rsp.code == SC_SERVER_RET:
             return rsp.content
         elif rsp.code == SC_SERVER_MORE:
@@ -65,6 +84,15 @@ class RpcClientBase(SearpcClient):
     def call_remote_func_sync(self, fcall_str):
         """Call remote function `fcall_str` and wait response."""
 
+        if getattr(self.pool, 'multiplexed', False):
+            # a SyncClient in multiplexed mode shared by all threads
+            peer_id = self.remote_peer_id if self.is_remote else None
+            try:
+                return self.pool.call_service(self.service_name, fcall_str,
+                                              peer_id)
+            except (NetworkError, RuntimeError), e:
+                raise SearpcError(str(e))
+
         retried = 0
         while True:
             try:
@@ -89,6 +117,14 @@ class RpcClientBase(SearpcClient):
                     return ret
                 else:
                     # no req pool
+                    if not self.is_remote and \
+                       len(fcall_str) < ONE_SHOT_MAX_LEN and \
+                       self.service_name not in RpcClientBase._no_one_shot:
+                        ret = self._one_shot_call(client, fcall_str)
+                        if ret is not None:
+                            self.pool.return_client(client)
+                            return ret
+
                     req_id = self._start_service(client)
                     ret = self._real_call(client, req_id, fcall_str)
                     client.send_update(req_id, "103", "service is done", "")
@@ -168,6 +204,10 @@ class CcnetRpcClient(RpcClientBase):
     def list_peer_stat(self, key, value):
         pass
 
+    @searpc_func("string", [])
+    def get_metrics(self):
+        pass
+
 
 class CcnetThreadedRpcClient(RpcClientBase):
 
@@ -178,6 +218,12 @@ class CcnetThreadedRpcClient(RpcClientBase):
     @searpc_func("int", ["string", "string", "int", "int"])
     def add_emailuser(self, email, passwd, is_staff, is_active):
         pass
+
+    # Batch versions take newline separated lists and return one status
+    # per line: 0 added, 1 already exists, -1 failed.
+    @searpc_func("string", ["string", "string", "int", "int"])
+    def add_emailusers(self, emails, passwds, is_staff, is_active):
+        pass
     
     @searpc_func("int", ["string"])
     def remove_emailuser(self, email):
@@ -207,6 +253,10 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def count_emailusers(self):
         pass
 
+    @searpc_func("int64", [])
+    def refresh_emailuser_count(self):
+        pass
+
     @searpc_func("objlist", ["string"])
     def filter_emailusers_by_emails(self):
         pass
@@ -219,6 +269,35 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def get_superusers(self):
         pass
 
+    @searpc_func("string", [])
+    def get_db_stats(self):
+        pass
+
+    @searpc_func("string", ["string"])
+    def sign_message(self, message):
+        pass
+
+    @searpc_func("int", ["string", "string", "string"])
+    def verify_message(self, message, sig_base64, peer_id):
+        pass
+
+    # Batched variants: messages and signatures are separated by '\n'.
+    @searpc_func("string", ["string"])
+    def sign_messages(self, messages):
+        pass
+
+    @searpc_func("string", ["string", "string", "string"])
+    def verify_messages(self, messages, sigs, peer_id):
+        pass
+
+    @searpc_func("string", ["string", "string"])
+    def pubkey_encrypt(self, msg_base64, peer_id):
+        pass
+
+    @searpc_func("string", ["string"])
+    def privkey_decrypt(self, msg_base64):
+        pass
+
     @searpc_func("int", ["string", "string"])
     def add_binding(self, email, peer_id):
         pass
@@ -258,6 +337,10 @@ class CcnetThreadedRpcClient(RpcClientBase):
     @searpc_func("int", ["int", "string", "string"])
     def group_add_member(self, group_id, user_name, member_name):
         pass
+
+    @searpc_func("string", ["int", "string", "string"])
+    def group_add_members(self, group_id, user_name, member_names):
+        pass
     
     @searpc_func("int", ["int", "string", "string"])
     def group_remove_member(self, group_id, user_name, member_name):
@@ -359,6 +442,10 @@ class CcnetThreadedRpcClient(RpcClientBase):
     def add_org_user(self, org_id, email, is_staff):
         pass
 
+    @searpc_func("string", ["int", "string", "int"])
+    def add_org_users(self, org_id, emails, is_staff):
+        pass
+
     @searpc_func("int", ["int", "string"])
     def remove_org_user(self, org_id, email):
         pass
@@ -398,5 +485,9 @@ class CcnetThreadedRpcClient(RpcClientBase):
     @searpc_func("int", ["int", "string"])
     def is_org_staff(self, org_id, user):
         pass
+
+    @searpc_func("string", [])
+    def get_org_cache_stats(self):
+        pass
     
     
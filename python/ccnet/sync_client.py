@@ -1,7 +1,14 @@
+import threading
+import time
+
 from ccnet.client import Client, parse_response
-from ccnet.packet import read_packet, CCNET_MSG_RESPONSE
-from ccnet.status_code import SC_PROC_DONE, SS_PROC_DONE
+from ccnet.packet import read_packet, to_request_id, CCNET_MSG_RESPONSE
+from ccnet.status_code import SC_PROC_DONE, SS_PROC_DONE, \
+    SC_PROC_KEEPALIVE, SC_PROC_ALIVE, SS_PROC_ALIVE, \
+    SC_CLIENT_CALL, SS_CLIENT_CALL, SC_CLIENT_MORE, SS_CLIENT_MORE, \
+    SC_SERVER_RET, SC_SERVER_MORE
 from ccnet.message import message_from_string, gen_inner_message_string
+from ccnet.errors import NetworkError
 
 _REQ_ID_START = 1000
 
@@ -11,12 +18,18 @@ class Response(object):
         self.code_msg = code_msg
         self.content = content
 
+class _PendingCall(object):
+    def __init__(self):
+        self.event = threading.Event()
+        self.response = None
+
 class SyncClient(Client):
     '''sync mode client'''
     def __init__(self, config_dir):
         Client.__init__(self, config_dir)
         self._req_id = _REQ_ID_START
         self.mq_req_id = -1
+        self.multiplexed = False
 
     def disconnect_daemon(self):
         if self.is_connected():
@@ -91,4 +104,132 @@ class SyncClient(Client):
 
         '''
         cmd = 'register-service %s %s' % (service, group)
-        self.send_cmd(cmd)
\ No newline at end of file
+        self.send_cmd(cmd)
+
+    # multiplexed mode
+
+    def start_multiplex(self, timeout=30):
+        '''Let many threads call rpc services on this client at the same
+        time with call_service(). A reader thread dispatches responses to
+        the callers by request id. After this, read_response() and the
+        other blocking methods must not be used any more.
+
+        '''
+        self._call_timeout = timeout
+        self._lock = threading.Lock()
+        self._send_lock = threading.Lock()
+        self._calls = {}
+        self._idle_reqs = {}
+        self._broken = False
+        self.multiplexed = True
+
+        reader = threading.Thread(target=self._read_loop,
+                                  name='ccnet-mux-reader')
+        reader.daemon = True
+        reader.start()
+
+    def _read_loop(self):
+        try:
+            while True:
+                packet = read_packet(self._connfd)
+                if packet.header.ptype != CCNET_MSG_RESPONSE:
+                    continue
+                req_id = to_request_id(packet.header.id)
+                code, code_msg, content = parse_response(packet.body)
+                if code == SC_PROC_KEEPALIVE:
+                    self._mux_send_update(req_id, SC_PROC_ALIVE, SS_PROC_ALIVE)
+                    continue
+
+                with self._lock:
+                    call = self._calls.get(req_id)
+                # responses to calls which timed out are dropped
+                if call is not None and call.response is None:
+                    call.response = Response(code, code_msg, content)
+                    call.event.set()
+        except Exception:
+            pass
+
+        with self._lock:
+            self._broken = True
+            calls = self._calls.values()
+        for call in calls:
+            call.event.set()
+
+    def _mux_send_request(self, req_id, req):
+        with self._send_lock:
+            self.send_request(req_id, req)
+
+    def _mux_send_update(self, req_id, code, code_msg, content=''):
+        with self._send_lock:
+            self.send_update(req_id, code, code_msg, content)
+
+    def _wait_response(self, call, deadline):
+        call.event.wait(max(deadline - time.time(), 0))
+        resp = call.response
+        if resp is None:
+            if self._broken:
+                raise NetworkError('Connection to daemon is lost')
+            raise NetworkError('Timed out waiting for daemon')
+        call.response = None
+        call.event.clear()
+        return resp
+
+    def call_service(self, service, fcall_str, peer_id=None, timeout=None):
+        '''Call a rpc service in multiplexed mode. Thread safe.'''
+        if timeout is None:
+            timeout = self._call_timeout
+        deadline = time.time() + timeout
+        key = (peer_id, service)
+        call = _PendingCall()
+
+        with self._lock:
+            if self._broken:
+                raise NetworkError('Connection to daemon is lost')
+            idle = self._idle_reqs.get(key)
+            started = bool(idle)
+            if started:
+                req_id = idle.pop()
+            else:
+                req_id = self.get_request_id()
+            self._calls[req_id] = call
+
+        done = False
+        try:
+            if not started:
+                req = service
+                if peer_id:
+                    req = 'remote %s %s' % (peer_id, service)
+                self._mux_send_request(req_id, req)
+                resp = self._wait_response(call, deadline)
+                if resp.code != '200':
+                    raise RuntimeError('Failed to start service %s: %s %s' %
+                                       (service, resp.code, resp.code_msg))
+
+            self._mux_send_update(req_id, SC_CLIENT_CALL, SS_CLIENT_CALL,
+                                  fcall_str)
+            buf = []
+            while True:
+                resp = self._wait_response(call, deadline)
+                if resp.code == SC_SERVER_RET:
+                    buf.append(resp.content)
+                    break
+                elif resp.code == SC_SERVER_MORE:
+                    buf.append(resp.content)
+                    self._mux_send_update(req_id, SC_CLIENT_MORE,
+                                          SS_CLIENT_MORE)
+                else:
+                    raise RuntimeError('Error received: %s %s' %
+                                       (resp.code, resp.code_msg))
+            done = True
+            return ''.join(buf)
+        finally:
+            with self._lock:
+                del self._calls[req_id]
+                if done:
+                    self._idle_reqs.setdefault(key, []).append(req_id)
+            if not done and not self._broken:
+                # the processor may still be busy, don't reuse it
+                try:
+                    self._mux_send_update(req_id, SC_PROC_DONE, SS_PROC_DONE)
+                except Exception:
+                    pass
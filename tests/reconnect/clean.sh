@@ -0,0 +1,13 @@
+#!/bin/bash
+
+CLEANFILE="peer-db PeerMgr ccnet.log ccnet.db misc logs"
+
+for file in $CLEANFILE; do
+  rm -rf conf2/$file
+done
+rm -f conf2/[0-9a-f]*.peer
+
+rm -rf conf2/GroupMgr
+rm -rf conf2/OrgMgr
+
+rm -rf clients
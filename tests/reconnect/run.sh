@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Reconnect storm on the loopback: N clients (10 by default, or the
+# first argument) connect to a relay, the relay is restarted, and the
+# clients come back with the tickets they got the first time instead of
+# the RSA challenge. Prints how long it took until all of them resumed,
+# and the ticket counters of the relay, so clients falling back to RSA
+# show up. Exits non-zero if not all clients resumed.
+
+. ../common-conf.sh
+
+testdir=${top_srcdir}/tests/reconnect
+
+n_clients=${1:-10}
+timeout=180
+
+conf2=${testdir}/conf2
+clients_dir=${testdir}/clients
+
+# metric CONF NAME: counter NAME of the daemon in CONF, 0 if unknown.
+metric () {
+  local value
+  value=$(${ccnet_tool} -c $1 metrics 2>/dev/null | awk -v n=$2 '$1 == n { print $2 }')
+  echo ${value:-0}
+}
+
+# wait_metric CONF NAME MIN: wait until counter NAME reaches MIN,
+# checking every 0.2 seconds.
+wait_metric () {
+  local i
+  for i in $(seq $((timeout * 5))); do
+    if [ $(metric $1 $2) -ge $3 ]; then
+      return 0
+    fi
+    sleep 0.2
+  done
+  return 1
+}
+
+print_tickets () {
+  echo "    issued $(metric ${conf2} ccnet_tickets_issued_total)," \
+       "resumed $(metric ${conf2} ccnet_tickets_resumed_total)," \
+       "rejected $(metric ${conf2} ccnet_tickets_rejected_total)"
+}
+
+fail () {
+  echo "--- $1"
+  print_tickets
+  kill -2 $relay ${clients} 2>/dev/null
+  exit 1
+}
+
+start_relay () {
+  ${ccnet_server} -c ${conf2} -D all -f ${conf2}/ccnet.log &
+  relay=$!
+}
+
+# Each client gets its own key, network port and client port.
+mkdir -p ${clients_dir}
+for i in $(seq ${n_clients}); do
+  conf=${clients_dir}/client$i
+  if [ ! -f ${conf}/ccnet.conf ]; then
+    ${ccnet_init} -c ${conf} -n client$i -P $((10100 + i)) > /dev/null ||
+      exit 1
+    sed -i "/^\[Client\]/,\$ s/^PORT = .*/PORT = $((10400 + i))/" ${conf}/ccnet.conf
+  fi
+done
+
+start_relay
+clients=
+for i in $(seq ${n_clients}); do
+  ${ccnet} -c ${clients_dir}/client$i -f ${clients_dir}/client$i/ccnet.log &
+  clients="${clients} $!"
+done
+
+sleep 5
+
+for i in $(seq ${n_clients}); do
+  ${ccnet_tool} -c ${clients_dir}/client$i add-relay --addr 127.0.0.1:10022
+done
+
+wait_metric ${conf2} ccnet_tickets_issued_total ${n_clients} ||
+  fail "the relay did not issue a ticket to every client"
+echo "+++ ${n_clients} clients got a ticket"
+
+kill -2 $relay
+wait $relay
+start=$(date +%s%N)
+start_relay
+
+# The counters start from 0 again. The first retries come within a
+# minute, see lib/reconnect-backoff.h.
+wait_metric ${conf2} ccnet_tickets_resumed_total ${n_clients} ||
+  fail "not every client resumed its session"
+elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+
+echo "+++ ${n_clients} clients resumed in ${elapsed} ms after the relay restart"
+print_tickets
+
+kill -2 $relay ${clients}
+wait
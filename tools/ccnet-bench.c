@@ -0,0 +1,1099 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*
+ * Load generator for a ccnet daemon on this host.
+ *
+ * Runs one workload with a number of concurrent clients and prints a
+ * single JSON line with the throughput and latency quantiles, so runs
+ * can be compared by scripts:
+ *
+ *   rpc        count_procs_alive calls through a client pool
+ *   echo       round trips to a service, "echo-demo" of
+ *              demo/ccnet-demo-server by default
+ *   mq         one publisher fanning messages out to subscribers
+ *   reconnect  clients connecting, making one rpc call and leaving
+ *   dbmix      user db reads mixed with cheap writes, through the
+ *              threaded rpc server
+ *   login      password checks of validate_emailuser; divide ops_per_sec
+ *              by the daemon's [PASSWORD_HASH] THREADS for logins/sec
+ *              per core
+ *   sign       RSA signatures of sign_message through the threaded rpc
+ *              server
+ *   sign-batch sign_messages calls of SIGN_BATCH messages each; multiply
+ *              ops_per_sec by SIGN_BATCH for signatures/sec
+ *   verify     verify_message of a signature by the daemon's own key
+ *
+ * Simulations run in process and need no daemon:
+ *
+ *   backoff    connect attempts per second a relay sees from clients
+ *              with the daemon's reconnect backoff, after it was down
+ *   htree-sync the hash tree walk of cluster peer sync between two
+ *              nodes whose entries differ in a few places
+ *   cevent     THREADS producer threads posting events to one event
+ *              loop through a CEventManager; ops_per_sec is events/sec
+ *   msgcodec   encoding and decoding of mq messages in the string and
+ *              the binary format
+ */
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <getopt.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <openssl/sha.h>
+
+#include <ccnet.h>
+#include <ccnet/cevent.h>
+#include <ccnet-object.h>
+
+#include "htree.h"
+#include "reconnect-backoff.h"
+
+#define BENCH_APP "ccnet-bench"
+#define MQ_DRAIN_TIMEOUT_SEC 10
+
+/* as in net/cluster/peer-sync.c */
+#define SYNC_TREE_NODES 100000
+/* "<node seq> <hash>\n" */
+#define SYNC_HASH_LINE  48
+
+#define SIGN_BATCH 16
+
+/* A workload has either a worker run by every thread, or a run
+ * function that does it all and prints its own report. */
+typedef struct {
+    const char *name;
+    void *(*worker) (void *vidx);
+    void (*run) ();
+} Workload;
+
+static char *config_dir;
+static char daemon_id[41];              /* sign workloads */
+static char *service = "echo-demo";
+static int n_threads = 4;
+static int n_ops = 1000;                /* per thread */
+static int write_pct = 10;              /* dbmix */
+static int down_secs = 60;              /* backoff */
+static int n_diverged = -1;             /* htree-sync, -1 for 0.1% */
+static int body_size = 256;             /* msgcodec */
+
+/* cevent, the counter is only touched by the event loop */
+static CEventManager *cevent_mgr;
+static uint32_t cevent_id;
+static int n_cevents;
+static const Workload *workload;
+
+static CcnetClientPool *pool;
+
+/* latency samples of all threads, in usec */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static GArray *samples;
+static int n_errors;
+
+/* mq */
+static int n_subscribed;
+static int n_delivered;
+
+static void report (gint64 elapsed);
+
+static gint64
+now_usec ()
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return (gint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+add_sample (gint64 usec)
+{
+    pthread_mutex_lock (&lock);
+    g_array_append_val (samples, usec);
+    pthread_mutex_unlock (&lock);
+}
+
+static void
+add_error ()
+{
+    pthread_mutex_lock (&lock);
+    n_errors++;
+    pthread_mutex_unlock (&lock);
+}
+
+static CcnetClient *
+connect_client ()
+{
+    CcnetClient *client = ccnet_client_new ();
+
+    if (ccnet_client_load_confdir (client, config_dir) < 0 ||
+        ccnet_client_connect_daemon (client, CCNET_CLIENT_SYNC) < 0) {
+        g_object_unref (client);
+        return NULL;
+    }
+    return client;
+}
+
+static void *
+rpc_worker (void *vidx)
+{
+    SearpcClient *rpc;
+    GError *error = NULL;
+    gint64 start;
+    int i;
+
+    rpc = ccnet_create_pooled_rpc_client (pool, NULL, "ccnet-rpcserver");
+    for (i = 0; i < n_ops; ++i) {
+        start = now_usec ();
+        searpc_client_call__int (rpc, "count_procs_alive", &error, 0);
+        if (error) {
+            add_error ();
+            g_clear_error (&error);
+            continue;
+        }
+        add_sample (now_usec () - start);
+    }
+    ccnet_rpc_client_free (rpc);
+
+    return NULL;
+}
+
+static void *
+echo_worker (void *vidx)
+{
+    CcnetClient *client;
+    const char *msg = BENCH_APP;
+    gint64 start;
+    int req_id;
+    int i;
+
+    if (!(client = connect_client ())) {
+        add_error ();
+        return NULL;
+    }
+
+    for (i = 0; i < n_ops; ++i) {
+        start = now_usec ();
+        req_id = ccnet_client_get_request_id (client);
+        ccnet_client_send_request (client, req_id, service);
+        if (ccnet_client_read_response (client) < 0) {
+            /* the connection is gone */
+            add_error ();
+            break;
+        }
+        if (memcmp (client->response.code, "300", 3) != 0) {
+            add_error ();
+            continue;
+        }
+        add_sample (now_usec () - start);
+
+        /* let the slave finish */
+        ccnet_client_send_update (client, req_id,
+                                  "300", NULL, msg, strlen(msg) + 1);
+    }
+
+    ccnet_client_disconnect_daemon (client);
+    g_object_unref (client);
+    return NULL;
+}
+
+static void *
+reconnect_worker (void *vidx)
+{
+    CcnetClient *client;
+    SearpcClient *rpc;
+    GError *error = NULL;
+    gint64 start;
+    int i;
+
+    client = ccnet_client_new ();
+    if (ccnet_client_load_confdir (client, config_dir) < 0) {
+        add_error ();
+        g_object_unref (client);
+        return NULL;
+    }
+
+    /* The rpc call makes sure the daemon has set the client up. */
+    for (i = 0; i < n_ops; ++i) {
+        start = now_usec ();
+        if (ccnet_client_connect_daemon (client, CCNET_CLIENT_SYNC) < 0) {
+            add_error ();
+            continue;
+        }
+        rpc = ccnet_create_rpc_client (client, NULL, "ccnet-rpcserver");
+        searpc_client_call__int (rpc, "count_procs_alive", &error, 0);
+        ccnet_rpc_client_free (rpc);
+        ccnet_client_disconnect_daemon (client);
+
+        if (error) {
+            add_error ();
+            g_clear_error (&error);
+            continue;
+        }
+        add_sample (now_usec () - start);
+    }
+
+    g_object_unref (client);
+    return NULL;
+}
+
+static void
+free_object_list (GList *list)
+{
+    while (list) {
+        g_object_unref (list->data);
+        list = g_list_delete_link (list, list);
+    }
+}
+
+/* Each client adds its own user up front, so that the password hash
+ * isn't timed. Reads alternate between fetching that user and a page
+ * of users, both from the db; writes flip the user's active flag,
+ * a single UPDATE. */
+static void *
+dbmix_worker (void *vidx)
+{
+    SearpcClient *rpc;
+    GError *error = NULL;
+    GObject *user;
+    GList *users;
+    char email[64];
+    gboolean write, active = TRUE;
+    unsigned int seed = (unsigned int)(long)vidx;
+    gint64 start;
+    int i, id = 0;
+
+    snprintf (email, sizeof(email), "bench-%d@ccnet-bench.invalid",
+              (int)(long)vidx);
+    rpc = ccnet_create_pooled_rpc_client (pool, NULL,
+                                          "ccnet-threaded-rpcserver");
+    /* left over by an interrupted run */
+    searpc_client_call__int (rpc, "remove_emailuser", NULL,
+                             1, "string", email);
+    searpc_client_call__int (rpc, "add_emailuser", &error,
+                             4, "string", email, "string", "bench",
+                             "int", 0, "int", 1);
+    user = error ? NULL :
+        searpc_client_call__object (rpc, "get_emailuser",
+                                    CCNET_TYPE_EMAIL_USER, &error,
+                                    1, "string", email);
+    if (!user) {
+        fprintf (stderr, "Failed to add user %s: %s\n", email,
+                 error ? error->message : "not found");
+        exit (1);
+    }
+    g_object_get (user, "id", &id, NULL);
+    g_object_unref (user);
+
+    for (i = 0; i < n_ops; ++i) {
+        write = rand_r (&seed) % 100 < write_pct;
+        start = now_usec ();
+        if (write) {
+            searpc_client_call__int (rpc, "update_emailuser", &error,
+                                     4, "int", id, "string", "!",
+                                     "int", 0, "int", !active);
+        } else if (i % 2 == 0) {
+            user = searpc_client_call__object (rpc, "get_emailuser",
+                                               CCNET_TYPE_EMAIL_USER, &error,
+                                               1, "string", email);
+            if (user)
+                g_object_unref (user);
+        } else {
+            users = searpc_client_call__objlist (rpc, "get_emailusers",
+                                                 CCNET_TYPE_EMAIL_USER, &error,
+                                                 3, "string", "DB",
+                                                 "int", 0, "int", 50);
+            free_object_list (users);
+        }
+        if (error) {
+            add_error ();
+            g_clear_error (&error);
+            continue;
+        }
+        add_sample (now_usec () - start);
+        if (write)
+            active = !active;
+    }
+
+    searpc_client_call__int (rpc, "remove_emailuser", NULL,
+                             1, "string", email);
+    ccnet_rpc_client_free (rpc);
+
+    return NULL;
+}
+
+/* Each client checks the password of its own user. */
+static void *
+login_worker (void *vidx)
+{
+    SearpcClient *rpc;
+    GError *error = NULL;
+    char email[64];
+    gint64 start;
+    int i, ret;
+
+    snprintf (email, sizeof(email), "bench-login-%d@ccnet-bench.invalid",
+              (int)(long)vidx);
+    rpc = ccnet_create_pooled_rpc_client (pool, NULL,
+                                          "ccnet-threaded-rpcserver");
+    /* left over by an interrupted run */
+    searpc_client_call__int (rpc, "remove_emailuser", NULL,
+                             1, "string", email);
+    searpc_client_call__int (rpc, "add_emailuser", &error,
+                             4, "string", email, "string", "bench",
+                             "int", 0, "int", 1);
+    if (error) {
+        fprintf (stderr, "Failed to add user %s: %s\n", email, error->message);
+        exit (1);
+    }
+
+    for (i = 0; i < n_ops; ++i) {
+        start = now_usec ();
+        ret = searpc_client_call__int (rpc, "validate_emailuser", &error,
+                                       2, "string", email, "string", "bench");
+        if (error || ret != 0) {
+            add_error ();
+            g_clear_error (&error);
+            continue;
+        }
+        add_sample (now_usec () - start);
+    }
+
+    searpc_client_call__int (rpc, "remove_emailuser", NULL,
+                             1, "string", email);
+    ccnet_rpc_client_free (rpc);
+
+    return NULL;
+}
+
+enum {
+    SIGN_ONE,
+    SIGN_BATCHED,
+    VERIFY_ONE,
+};
+
+static void
+sign_loop (int idx, int mode)
+{
+    SearpcClient *rpc;
+    GError *error = NULL;
+    GString *batch = g_string_new (NULL);
+    char message[64];
+    char *sig, *ret;
+    gint64 start;
+    int i, j, valid = -1;
+
+    rpc = ccnet_create_pooled_rpc_client (pool, NULL,
+                                          "ccnet-threaded-rpcserver");
+
+    snprintf (message, sizeof(message), "ccnet-bench %d", idx);
+    sig = searpc_client_call__string (rpc, "sign_message", &error,
+                                      1, "string", message);
+    if (!sig) {
+        fprintf (stderr, "Failed to sign: %s\n",
+                 error ? error->message : "no signature");
+        exit (1);
+    }
+    for (j = 0; j < SIGN_BATCH; ++j)
+        g_string_append_printf (batch, "%sccnet-bench %d %d",
+                                j ? "\n" : "", idx, j);
+
+    for (i = 0; i < n_ops; ++i) {
+        ret = NULL;
+        start = now_usec ();
+        switch (mode) {
+        case SIGN_ONE:
+            ret = searpc_client_call__string (rpc, "sign_message", &error,
+                                              1, "string", message);
+            break;
+        case SIGN_BATCHED:
+            ret = searpc_client_call__string (rpc, "sign_messages", &error,
+                                              1, "string", batch->str);
+            break;
+        case VERIFY_ONE:
+            valid = searpc_client_call__int (rpc, "verify_message", &error,
+                                             3, "string", message,
+                                             "string", sig,
+                                             "string", daemon_id);
+            break;
+        }
+        if (error || (mode == VERIFY_ONE ? valid != 0 : ret == NULL)) {
+            add_error ();
+            g_clear_error (&error);
+            g_free (ret);
+            continue;
+        }
+        add_sample (now_usec () - start);
+        g_free (ret);
+    }
+
+    g_free (sig);
+    g_string_free (batch, TRUE);
+    ccnet_rpc_client_free (rpc);
+}
+
+static void *
+sign_worker (void *vidx)
+{
+    sign_loop ((int)(long)vidx, SIGN_ONE);
+    return NULL;
+}
+
+static void *
+sign_batch_worker (void *vidx)
+{
+    sign_loop ((int)(long)vidx, SIGN_BATCHED);
+    return NULL;
+}
+
+static void *
+verify_worker (void *vidx)
+{
+    sign_loop ((int)(long)vidx, VERIFY_ONE);
+    return NULL;
+}
+
+static void *
+mq_subscriber (void *vidx)
+{
+    CcnetClient *client;
+    CcnetMessage *msg;
+    int i;
+
+    if (!(client = connect_client ()) ||
+        ccnet_client_prepare_recv_message (client, BENCH_APP) < 0) {
+        add_error ();
+        /* don't keep the publisher waiting */
+        pthread_mutex_lock (&lock);
+        n_subscribed++;
+        pthread_cond_broadcast (&cond);
+        pthread_mutex_unlock (&lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&lock);
+    n_subscribed++;
+    pthread_cond_broadcast (&cond);
+    pthread_mutex_unlock (&lock);
+
+    for (i = 0; i < n_ops; ++i) {
+        if (!(msg = ccnet_client_receive_message (client)))
+            break;
+        /* the body is the send time */
+        add_sample (now_usec () - g_ascii_strtoll (msg->body, NULL, 10));
+        ccnet_message_free (msg);
+
+        pthread_mutex_lock (&lock);
+        n_delivered++;
+        pthread_cond_broadcast (&cond);
+        pthread_mutex_unlock (&lock);
+    }
+
+    /* The client is left to the exit, a subscriber may still be
+     * blocked on a lost message. */
+    return NULL;
+}
+
+static void *
+mq_publisher (void *vidx)
+{
+    CcnetClient *client;
+    CcnetMessage *msg;
+    char body[32];
+    int i;
+
+    if (!(client = connect_client ())) {
+        add_error ();
+        return NULL;
+    }
+
+    pthread_mutex_lock (&lock);
+    while (n_subscribed < n_threads)
+        pthread_cond_wait (&cond, &lock);
+    pthread_mutex_unlock (&lock);
+
+    for (i = 0; i < n_ops; ++i) {
+        snprintf (body, sizeof(body), "%"G_GINT64_FORMAT, now_usec ());
+        msg = ccnet_message_new (client->base.id, client->base.id,
+                                 BENCH_APP, body, 0);
+        if (ccnet_client_send_message (client, msg) < 0)
+            add_error ();
+        ccnet_message_free (msg);
+    }
+
+    ccnet_client_disconnect_daemon (client);
+    g_object_unref (client);
+    return NULL;
+}
+
+static void *
+mq_worker (void *vidx)
+{
+    int idx = (int)(long)vidx;
+
+    /* thread 0 publishes, the others subscribe */
+    if (idx == 0)
+        return mq_publisher (vidx);
+    return mq_subscriber (vidx);
+}
+
+/*
+ * n_ops clients lose their relay at second 0, and it comes back after
+ * down_secs. Every client follows the reconnect schedule of the
+ * daemon's connection manager; an attempt after the relay is back
+ * succeeds. Prints the attempts per second until all are connected.
+ */
+static void
+run_backoff ()
+{
+    int *next = g_new (int, n_ops);     /* -1 once connected */
+    int *delay = g_new0 (int, n_ops);
+    GString *rates = g_string_new (NULL);
+    int left = n_ops, total = 0, peak = 0;
+    int t, i, n;
+
+    for (i = 0; i < n_ops; ++i)
+        next[i] = reconnect_first_delay (FALSE);
+
+    for (t = 0; left > 0; ++t) {
+        n = 0;
+        for (i = 0; i < n_ops; ++i) {
+            if (next[i] != t)
+                continue;
+            ++n;
+            if (t >= down_secs) {
+                next[i] = -1;
+                --left;
+                continue;
+            }
+            delay[i] = reconnect_next_delay (delay[i], FALSE);
+            next[i] = t + delay[i];
+        }
+        g_string_append_printf (rates, "%s%d", t ? ", " : "", n);
+        total += n;
+        peak = MAX (peak, n);
+    }
+
+    printf ("{\"workload\": \"backoff\", \"clients\": %d, "
+            "\"down_secs\": %d, \"attempts\": %d, \"peak_per_sec\": %d, "
+            "\"recovered_secs\": %d, \"attempts_per_sec\": [%s]}\n",
+            n_ops, down_secs, total, peak, t, rates->str);
+
+    g_string_free (rates, TRUE);
+    g_free (next);
+    g_free (delay);
+}
+
+/* Entry i as peer sync hashes it, with a fake peer id. Returns the
+ * length of the line, which is also what it costs to send. */
+static int
+sync_entry_hash (int i, gint64 mtime, unsigned char *hash)
+{
+    char line[128];
+    int len;
+
+    len = snprintf (line, sizeof(line), "%040x %"G_GINT64_FORMAT" - 0 -\n",
+                    i, mtime);
+    SHA1 ((unsigned char *)line, len, hash);
+    return len;
+}
+
+static gboolean
+same_node_hash (HTree *a, HTree *b, int seq)
+{
+    static const unsigned char zero[SHA_DIGEST_LENGTH];
+    unsigned char *ha = ht_get_node_hash (a, ht_get_node_by_seq (a, seq));
+    unsigned char *hb = ht_get_node_hash (b, ht_get_node_by_seq (b, seq));
+
+    return memcmp (ha ? ha : zero, hb ? hb : zero, SHA_DIGEST_LENGTH) == 0;
+}
+
+static int
+leaf_size (HTree *tree, int seq)
+{
+    HTData *data = ht_get_data (tree, ht_get_node_by_seq (tree, seq));
+
+    return data ? data->size : 0;
+}
+
+/*
+ * Two nodes hold n_ops entries, n_diverged of them changed on one side.
+ * Walk the trees the way peer sync exchanges them: every hop sends the
+ * children of the nodes whose hashes differ, or the entries of a leaf,
+ * and the merged leaves go back in one more hop. Prints the hops, what
+ * was sent and how long the walk took, next to a full dump.
+ */
+static void
+run_htree_sync ()
+{
+    int n_diff = n_diverged >= 0 ? MIN (n_diverged, n_ops) : n_ops / 1000;
+    int step = n_diff > 0 ? n_ops / n_diff : 0;
+    unsigned char *hashes = g_malloc ((gsize)n_ops * SHA_DIGEST_LENGTH);
+    unsigned char *changed = g_malloc ((gsize)(n_diff + 1) * SHA_DIGEST_LENGTH);
+    HTree *a = ht_new (SYNC_TREE_NODES, SHA_DIGEST_LENGTH);
+    HTree *b = ht_new (SYNC_TREE_NODES, SHA_DIGEST_LENGTH);
+    GArray *frontier = g_array_new (FALSE, FALSE, sizeof(int));
+    GArray *next = g_array_new (FALSE, FALSE, sizeof(int));
+    GArray *tmp;
+    gint64 start, build_usec, walk_usec;
+    gint64 n_hashes = 0, n_entries = 0, dump_bytes = 0, entry_len = 0;
+    int hops = 0, n_leaves = 0, k = 0;
+    int i, j, seq;
+    HTNode *node;
+
+    start = now_usec ();
+    for (i = 0; i < n_ops; ++i) {
+        unsigned char *h = hashes + (gsize)i * SHA_DIGEST_LENGTH;
+
+        entry_len = sync_entry_hash (i, 0, h);
+        dump_bytes += entry_len;
+        ht_add (a, h, NULL);
+        if (step > 0 && i % step == 0 && k < n_diff) {
+            h = changed + (gsize)k++ * SHA_DIGEST_LENGTH;
+            sync_entry_hash (i, 1, h);
+        }
+        ht_add (b, h, NULL);
+    }
+    build_usec = now_usec () - start;
+
+    start = now_usec ();
+    seq = 0;
+    g_array_append_val (frontier, seq);
+    n_hashes = 1;
+    while (frontier->len > 0) {
+        ++hops;
+        g_array_set_size (next, 0);
+        for (i = 0; i < (int)frontier->len; ++i) {
+            seq = g_array_index (frontier, int, i);
+            if (same_node_hash (a, b, seq))
+                continue;
+
+            node = ht_get_node_by_seq (a, seq);
+            if (HTNODE_IS_LEAF (node)) {
+                ++n_leaves;
+                n_entries += leaf_size (a, seq) + leaf_size (b, seq);
+                continue;
+            }
+            for (j = 0; j < 16; ++j) {
+                int child = ht_get_node_seq (a, ht_get_child (a, node, j));
+                g_array_append_val (next, child);
+            }
+            n_hashes += 16;
+        }
+        tmp = frontier;
+        frontier = next;
+        next = tmp;
+    }
+    /* the merged leaves go back */
+    if (n_leaves > 0)
+        ++hops;
+    walk_usec = now_usec () - start;
+
+    printf ("{\"workload\": \"htree-sync\", \"entries\": %d, "
+            "\"diverged\": %d, \"hops\": %d, \"hashes_sent\": %"
+            G_GINT64_FORMAT", \"leaves_differing\": %d, "
+            "\"entries_sent\": %"G_GINT64_FORMAT", "
+            "\"bytes_sent\": %"G_GINT64_FORMAT", "
+            "\"full_dump_bytes\": %"G_GINT64_FORMAT", "
+            "\"build_usec\": %"G_GINT64_FORMAT", "
+            "\"walk_usec\": %"G_GINT64_FORMAT"}\n",
+            n_ops, k, hops, n_hashes, n_leaves, n_entries,
+            n_hashes * SYNC_HASH_LINE + n_entries * entry_len,
+            dump_bytes, build_usec, walk_usec);
+
+    g_array_free (frontier, TRUE);
+    g_array_free (next, TRUE);
+    ht_clear (a);
+    ht_clear (b);
+    g_free (hashes);
+    g_free (changed);
+}
+
+/* The event data is the time it was posted. */
+static void
+cevent_cb (CEvent *event, void *handler_data)
+{
+    add_sample (now_usec () - *(gint64 *)event->data);
+    if (++n_cevents == n_threads * n_ops)
+        event_loopexit (NULL);
+}
+
+static void *
+cevent_producer (void *vidx)
+{
+    gint64 *sent = g_new (gint64, n_ops);
+    int i;
+
+    for (i = 0; i < n_ops; ++i) {
+        sent[i] = now_usec ();
+        cevent_manager_add_event (cevent_mgr, cevent_id, &sent[i]);
+    }
+
+    /* freed once all events are handled */
+    return sent;
+}
+
+static void
+run_cevent ()
+{
+    pthread_t *threads = g_new0 (pthread_t, n_threads);
+    gint64 start, elapsed;
+    void *sent;
+    int i, rc;
+
+    event_init ();
+    cevent_mgr = cevent_manager_new ();
+    if (cevent_manager_start (cevent_mgr) < 0)
+        exit (1);
+    cevent_id = cevent_manager_register (cevent_mgr, cevent_cb, NULL);
+    samples = g_array_sized_new (FALSE, FALSE, sizeof(gint64),
+                                 n_threads * n_ops);
+
+    start = now_usec ();
+    for (i = 0; i < n_threads; ++i) {
+        rc = pthread_create (&threads[i], NULL, cevent_producer,
+                             (void *)(long)i);
+        if (rc != 0) {
+            fprintf (stderr, "Failed to create thread: %s\n", strerror(rc));
+            exit (1);
+        }
+    }
+    event_dispatch ();
+    elapsed = now_usec () - start;
+
+    for (i = 0; i < n_threads; ++i) {
+        pthread_join (threads[i], &sent);
+        g_free (sent);
+    }
+    g_free (threads);
+
+    report (elapsed);
+}
+
+/* Nanoseconds per message of @n_ops rounds of encoding @msg and of
+ * decoding it again. The string parser works in place, so each decode
+ * gets a fresh copy of the packet, as from the packet buffer. */
+static void
+codec_rounds (CcnetMessage *msg, gboolean binary,
+              double *encode_nsec, double *decode_nsec, int *wire_len)
+{
+    GString *buf = g_string_sized_new (body_size + 256);
+    char *packet;
+    CcnetMessage *copy;
+    gint64 start;
+    int i;
+
+    start = now_usec ();
+    for (i = 0; i < n_ops; ++i) {
+        if (binary)
+            ccnet_message_to_binary_buf (msg, buf);
+        else
+            ccnet_message_to_string_buf (msg, buf);
+    }
+    *encode_nsec = (now_usec () - start) * 1000.0 / n_ops;
+
+    *wire_len = binary ? buf->len : buf->len + 1;
+    packet = g_malloc (*wire_len);
+
+    memcpy (packet, buf->str, *wire_len);
+    copy = binary ? ccnet_message_from_binary (packet, *wire_len) :
+        ccnet_message_from_string (packet, *wire_len);
+    if (!copy || strcmp (copy->body, msg->body) != 0 ||
+        strcmp (copy->id, msg->id) != 0) {
+        fprintf (stderr, "Bad %s decoding\n", binary ? "binary" : "string");
+        exit (1);
+    }
+    ccnet_message_free (copy);
+
+    start = now_usec ();
+    for (i = 0; i < n_ops; ++i) {
+        memcpy (packet, buf->str, *wire_len);
+        if (binary)
+            copy = ccnet_message_from_binary (packet, *wire_len);
+        else
+            copy = ccnet_message_from_string (packet, *wire_len);
+        ccnet_message_free (copy);
+    }
+    *decode_nsec = (now_usec () - start) * 1000.0 / n_ops;
+
+    g_free (packet);
+    g_string_free (buf, TRUE);
+}
+
+static void
+run_msgcodec ()
+{
+    char from[41], to[41];
+    char *body;
+    CcnetMessage *msg;
+    double str_enc, str_dec, bin_enc, bin_dec;
+    int str_len, bin_len;
+
+    g_type_init ();
+
+    memset (from, 'a', 40);
+    from[40] = '\0';
+    memset (to, 'b', 40);
+    to[40] = '\0';
+    body = g_malloc (body_size + 1);
+    memset (body, 'x', body_size);
+    body[body_size] = '\0';
+    msg = ccnet_message_new (from, to, BENCH_APP, body, 0);
+
+    codec_rounds (msg, FALSE, &str_enc, &str_dec, &str_len);
+    codec_rounds (msg, TRUE, &bin_enc, &bin_dec, &bin_len);
+
+    printf ("{\"workload\": \"msgcodec\", \"messages\": %d, "
+            "\"body_size\": %d, "
+            "\"string_bytes\": %d, \"string_encode_nsec\": %.1f, "
+            "\"string_decode_nsec\": %.1f, "
+            "\"binary_bytes\": %d, \"binary_encode_nsec\": %.1f, "
+            "\"binary_decode_nsec\": %.1f}\n",
+            n_ops, body_size, str_len, str_enc, str_dec,
+            bin_len, bin_enc, bin_dec);
+
+    ccnet_message_free (msg);
+    g_free (body);
+}
+
+static const Workload workloads[] = {
+    { "rpc",        rpc_worker },
+    { "echo",       echo_worker },
+    { "mq",         mq_worker },
+    { "reconnect",  reconnect_worker },
+    { "dbmix",      dbmix_worker },
+    { "login",      login_worker },
+    { "sign",       sign_worker },
+    { "sign-batch", sign_batch_worker },
+    { "verify",     verify_worker },
+    { "backoff",    NULL,           run_backoff },
+    { "htree-sync", NULL,           run_htree_sync },
+    { "cevent",     NULL,           run_cevent },
+    { "msgcodec",   NULL,           run_msgcodec },
+    { NULL },
+};
+
+/* Wait for the subscribers to get what was published. */
+static void
+wait_mq_drained ()
+{
+    struct timespec deadline;
+
+    deadline.tv_sec = time (NULL) + MQ_DRAIN_TIMEOUT_SEC;
+    deadline.tv_nsec = 0;
+
+    pthread_mutex_lock (&lock);
+    while (n_delivered < n_threads * n_ops &&
+           pthread_cond_timedwait (&cond, &lock, &deadline) == 0)
+        ;
+    pthread_mutex_unlock (&lock);
+}
+
+static int
+cmp_sample (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static gint64
+quantile (double q)
+{
+    guint i;
+
+    if (samples->len == 0)
+        return 0;
+    i = (guint)(q * samples->len);
+    if (i >= samples->len)
+        i = samples->len - 1;
+    return g_array_index (samples, gint64, i);
+}
+
+static void
+report (gint64 elapsed)
+{
+    double secs = elapsed / 1000000.0;
+    int lost = 0;
+
+    pthread_mutex_lock (&lock);
+    qsort (samples->data, samples->len, sizeof(gint64), cmp_sample);
+    if (workload->worker == mq_worker)
+        lost = n_threads * n_ops - n_delivered;
+
+    printf ("{\"workload\": \"%s\", \"threads\": %d, \"ops\": %u, "
+            "\"errors\": %d, \"lost\": %d, \"seconds\": %.3f, "
+            "\"ops_per_sec\": %.1f, "
+            "\"p50_usec\": %"G_GINT64_FORMAT", "
+            "\"p99_usec\": %"G_GINT64_FORMAT", "
+            "\"p999_usec\": %"G_GINT64_FORMAT", "
+            "\"max_usec\": %"G_GINT64_FORMAT"}\n",
+            workload->name, n_threads, samples->len, n_errors, lost, secs,
+            secs > 0 ? samples->len / secs : 0.0,
+            quantile (0.5), quantile (0.99), quantile (0.999),
+            quantile (1.0));
+    pthread_mutex_unlock (&lock);
+}
+
+static const char *short_opts = "hc:t:n:s:w:d:x:b:";
+static const struct option long_opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "config-dir", required_argument, NULL, 'c' },
+    { "threads", required_argument, NULL, 't' },
+    { "count", required_argument, NULL, 'n' },
+    { "service", required_argument, NULL, 's' },
+    { "write-percent", required_argument, NULL, 'w' },
+    { "down-secs", required_argument, NULL, 'd' },
+    { "diverged", required_argument, NULL, 'x' },
+    { "body-size", required_argument, NULL, 'b' },
+    { 0, 0, 0, 0 },
+};
+
+static void
+usage (int exit_status)
+{
+    fputs (
+"Usage: ccnet-bench [OPTION]... WORKLOAD\n"
+"Run WORKLOAD against the ccnet daemon and print the result as JSON.\n"
+"\n"
+"Workloads:\n"
+"  rpc        rpc calls through a client pool\n"
+"  echo       request round trips to a service\n"
+"  mq         message fan-out from one publisher to THREADS subscribers\n"
+"  reconnect  connect, make one rpc call and disconnect\n"
+"  dbmix      user db reads and writes, needs ccnet-server\n"
+"  login      password checks, needs ccnet-server\n"
+"  sign       RSA signatures, one per call\n"
+"  sign-batch RSA signatures, 16 per call\n"
+"  verify     RSA signature checks\n"
+"\n"
+"Simulations:\n"
+"  backoff    reconnect attempts per second after a relay outage\n"
+"  htree-sync hash tree walk of cluster peer sync, try -n 1000000\n"
+"  cevent     events from THREADS threads to one event loop, try -t 8\n"
+"  msgcodec   string and binary message encoding, try -n 100000\n"
+"\n"
+"  -c, --config-dir=DIR      ccnet configuration directory\n"
+"  -t, --threads=N           concurrent clients, default 4\n"
+"  -n, --count=N             operations per client, messages published\n"
+"                              for mq, clients for backoff, entries\n"
+"                              for htree-sync, or messages for msgcodec,\n"
+"                              default 1000\n"
+"  -s, --service=NAME        service for echo, default echo-demo\n"
+"  -w, --write-percent=N     share of writes for dbmix, default 10\n"
+"  -d, --down-secs=N         relay outage for backoff, default 60\n"
+"  -x, --diverged=N          entries that differ for htree-sync, default\n"
+"                              0.1% of them\n"
+"  -b, --body-size=N         message body bytes for msgcodec, default 256\n"
+           , stderr);
+    exit (exit_status);
+}
+
+int
+main (int argc, char **argv)
+{
+    pthread_t *threads;
+    gint64 start;
+    int n_workers;
+    int c, i, rc;
+
+    config_dir = DEFAULT_CONFIG_DIR;
+
+    while ((c = getopt_long (argc, argv,
+                             short_opts, long_opts, NULL)) != EOF) {
+        switch (c) {
+        case 'c':
+            config_dir = optarg;
+            break;
+        case 't':
+            n_threads = atoi (optarg);
+            break;
+        case 'n':
+            n_ops = atoi (optarg);
+            break;
+        case 's':
+            service = optarg;
+            break;
+        case 'w':
+            write_pct = atoi (optarg);
+            break;
+        case 'd':
+            down_secs = atoi (optarg);
+            break;
+        case 'x':
+            n_diverged = atoi (optarg);
+            break;
+        case 'b':
+            body_size = atoi (optarg);
+            break;
+        default:
+            usage (1);
+        }
+    }
+
+    if (optind != argc - 1 || n_threads <= 0 || n_ops <= 0 || body_size < 0)
+        usage (1);
+    for (workload = workloads; workload->name; ++workload)
+        if (strcmp (workload->name, argv[optind]) == 0)
+            break;
+    if (!workload->name)
+        usage (1);
+
+    if (workload->run) {
+        workload->run ();
+        return 0;
+    }
+
+    g_type_init ();
+
+    samples = g_array_new (FALSE, FALSE, sizeof(gint64));
+    if (workload->worker == rpc_worker || workload->worker == dbmix_worker ||
+        workload->worker == login_worker || workload->worker == sign_worker ||
+        workload->worker == sign_batch_worker ||
+        workload->worker == verify_worker)
+        pool = ccnet_client_pool_new (config_dir);
+
+    if (workload->worker == verify_worker) {
+        CcnetClient *client = ccnet_client_pool_get_client (pool);
+        if (!client) {
+            fprintf (stderr, "Failed to connect to the daemon\n");
+            exit (1);
+        }
+        g_strlcpy (daemon_id, client->base.id, sizeof(daemon_id));
+        ccnet_client_pool_return_client (pool, client);
+    }
+
+    /* the mq publisher is an extra thread */
+    n_workers = workload->worker == mq_worker ? n_threads + 1 : n_threads;
+    threads = g_new0 (pthread_t, n_workers);
+
+    start = now_usec ();
+    for (i = 0; i < n_workers; ++i) {
+        rc = pthread_create (&threads[i], NULL, workload->worker,
+                             (void *)(long)i);
+        if (rc != 0) {
+            fprintf (stderr, "Failed to create thread: %s\n", strerror(rc));
+            exit (1);
+        }
+    }
+
+    if (workload->worker == mq_worker) {
+        pthread_join (threads[0], NULL);
+        wait_mq_drained ();
+    } else {
+        for (i = 0; i < n_workers; ++i)
+            pthread_join (threads[i], NULL);
+    }
+
+    report (now_usec () - start);
+
+    return n_errors > 0 ? 1 : 0;
+}